@@ -3,18 +3,18 @@
 
 #include "block.h"
 
-Block::Block() : data(0), length(0), lastaccessed(-1), dirty(false)
+Block::Block() : data(0), length(0), lastaccessed(-1), dirty(false), pins(0), version(0)
 {}
 
 
-Block::Block(const SIZE_T s) : data(0), length(0), lastaccessed(-1), dirty(false)
+Block::Block(const SIZE_T s) : data(0), length(0), lastaccessed(-1), dirty(false), pins(0), version(0)
 {
   Resize(s);
 }
 
 
 
-Block::Block(const Block &rhs) : data(0), length(0), lastaccessed(rhs.lastaccessed), dirty(rhs.dirty)
+Block::Block(const Block &rhs) : data(0), length(0), lastaccessed(rhs.lastaccessed), dirty(rhs.dirty), pins(0), version(0)
 {
   if (Resize(rhs.length)!=ERROR_NOERROR) { 
     throw GenericException();
@@ -22,7 +22,7 @@ Block::Block(const Block &rhs) : data(0), length(0), lastaccessed(rhs.lastaccess
   memcpy(data,rhs.data,rhs.length);
 }
 
-Block::Block(const char * str) : data(0), length(0), lastaccessed(-1), dirty(false)
+Block::Block(const char * str) : data(0), length(0), lastaccessed(-1), dirty(false), pins(0), version(0)
 {
   if (Resize(strlen(str))!=ERROR_NOERROR) { 
     throw GenericException();
@@ -36,6 +36,8 @@ Block::~Block()
   length=0;
   lastaccessed=-1;
   dirty=false;
+  pins=0;
+  version=0;
 }
 
 Block & Block::operator=(const Block &rhs)
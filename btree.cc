@@ -1,7 +1,10 @@
 #include <assert.h>
 #include "btree.h"
+#include "btree_fixed.h"
+#include "btree_cursor.h"
 #include <stdio.h>
 #include <string.h>
+#include <algorithm>
 
 using namespace std;
 
@@ -31,17 +34,45 @@ KeyValuePair & KeyValuePair::operator=(const KeyValuePair &rhs)
 BTreeIndex::BTreeIndex(SIZE_T keysize, 
 		       SIZE_T valuesize,
 		       BufferCache *cache,
-		       bool unique) 
+		       bool unique,
+		       int format) 
 {
   superblock.info.keysize=keysize;
   superblock.info.valuesize=valuesize;
+  superblock.info.format=format & 0xff;
+  superblock.info.flags=format>>8;
+  if (!unique) { 
+    superblock.info.flags|=BTREE_FLAG_MULTI;
+  }
+  if (superblock.info.flags & BTREE_FLAG_MULTI) { 
+    // the leaves keep a posting list for each key
+    superblock.info.valuesize=BTREE_POSTING_HEADER+BTREE_POSTING_INLINE*valuesize;
+  }
   buffercache=cache;
-  // note: ignoring unique now
+  fixedlookup=0;
+  specialized=true;
+  concurrent=false;
+  buffered=false;
+  multi=false;
+  filterkeys=0;
+  cow=false;
+  changing=false;
+  committed=0;
+  generation=0;
 }
 
 BTreeIndex::BTreeIndex()
 {
-  // shouldn't have to do anything
+  fixedlookup=0;
+  specialized=true;
+  concurrent=false;
+  buffered=false;
+  multi=false;
+  filterkeys=0;
+  cow=false;
+  changing=false;
+  committed=0;
+  generation=0;
 }
 
 
@@ -53,6 +84,18 @@ BTreeIndex::BTreeIndex(const BTreeIndex &rhs)
   buffercache=rhs.buffercache;
   superblock_index=rhs.superblock_index;
   superblock=rhs.superblock;
+  fixedlookup=rhs.fixedlookup;
+  specialized=rhs.specialized;
+  concurrent=rhs.concurrent;
+  buffered=rhs.buffered;
+  multi=rhs.multi;
+  filter=rhs.filter;
+  filterkeys=rhs.filterkeys;
+  keycache.Reset(rhs.keycache.GetCapacity(),rhs.superblock.info.keysize);
+  cow=rhs.cow;
+  changing=false;
+  committed=rhs.committed;
+  generation=rhs.generation;
 }
 
 BTreeIndex::~BTreeIndex()
@@ -69,6 +112,8 @@ BTreeIndex & BTreeIndex::operator=(const BTreeIndex &rhs)
 
 ERROR_T BTreeIndex::AllocateNode(SIZE_T &n)
 {
+  MutexHolder hold(allocmutex);
+
   n=superblock.info.freelist;
 
   if (n==0) { 
@@ -83,21 +128,33 @@ ERROR_T BTreeIndex::AllocateNode(SIZE_T &n)
 
   superblock.info.freelist=node.info.freelist;
 
-  superblock.Serialize(buffercache,superblock_index);
+  WriteSuperblock();
 
   buffercache->NotifyAllocateBlock(n);
 
+  if (changing) { 
+    fresh.insert(n);
+  }
+
   return ERROR_NOERROR;
 }
 
 
 ERROR_T BTreeIndex::DeallocateNode(const SIZE_T &n)
 {
+  if (changing && fresh.erase(n)==0) { 
+    // committed, so a snapshot may still need it
+    replaced.push_back(n);
+    return ERROR_NOERROR;
+  }
+
+  MutexHolder hold(allocmutex);
   BTreeNode node;
 
   node.Unserialize(buffercache,n);
 
-  assert(node.info.nodetype!=BTREE_UNALLOCATED_BLOCK);
+  // (one a failed change allocated may never have been written)
+  assert(node.info.nodetype!=BTREE_UNALLOCATED_BLOCK || fresh.count(n));
 
   node.info.nodetype=BTREE_UNALLOCATED_BLOCK;
 
@@ -107,7 +164,7 @@ ERROR_T BTreeIndex::DeallocateNode(const SIZE_T &n)
 
   superblock.info.freelist=n;
 
-  superblock.Serialize(buffercache,superblock_index);
+  WriteSuperblock();
 
   buffercache->NotifyDeallocateBlock(n);
 
@@ -115,6 +172,25 @@ ERROR_T BTreeIndex::DeallocateNode(const SIZE_T &n)
 
 }
 
+
+//
+// What goes to disk names the last root committed, not the one a
+// copy-on-write change is building
+//
+ERROR_T BTreeIndex::WriteSuperblock()
+{
+  SIZE_T root=superblock.info.rootnode;
+  ERROR_T rc;
+
+  if (!cow) { 
+    return superblock.Serialize(buffercache,superblock_index);
+  }
+  superblock.info.rootnode=committed;
+  rc=superblock.Serialize(buffercache,superblock_index);
+  superblock.info.rootnode=root;
+  return rc;
+}
+
 ERROR_T BTreeIndex::Attach(const SIZE_T initblock, const bool create)
 {
   ERROR_T rc;
@@ -123,18 +199,72 @@ ERROR_T BTreeIndex::Attach(const SIZE_T initblock, const bool create)
   assert(superblock_index==0);
 
   if (create) {
-    // build a super block, root node, and a free space list
+    if (superblock.info.format==BTREE_FORMAT_SLOTTED &&
+	buffercache->GetBlockSize()>BTREE_SLOTTED_MAXBLOCKSIZE) { 
+      return ERROR_SIZE;
+    }
+    if ((superblock.info.flags & BTREE_FLAG_BLINK) && (superblock.info.flags & BTREE_FLAG_COW)) { 
+      // a B-link tree's links can't follow its nodes to new blocks
+      return ERROR_BADCONFIG;
+    }
+    if ((superblock.info.flags & BTREE_FLAG_BUFFERED) && superblock.info.flags!=BTREE_FLAG_BUFFERED) { 
+      // nor can a B-link tree's or a snapshot's readers, which take
+      // no latches, see changes as they move between buffers
+      return ERROR_BADCONFIG;
+    }
+    if (superblock.info.flags & BTREE_FLAG_BUFFERED) { 
+      // half a block must still take a few keys, and a message
+      BTreeNode probe(BTREE_ROOT_NODE,
+		      superblock.info.keysize,
+		      superblock.info.valuesize,
+		      buffercache->GetBlockSize(),
+		      superblock.info.GetFormatAndFlags());
+      BTreeMessage m(BTREE_MSG_PUT, KEY_T(superblock.info.keysize), VALUE_T(superblock.info.valuesize));
+      if (probe.info.GetNumSlotsAsInterior()<4 || probe.GetMessageSize(m)>probe.GetBufferSize()) { 
+	return ERROR_SIZE;
+      }
+    }
+    if ((superblock.info.flags & BTREE_FLAG_MULTI) && superblock.info.flags!=BTREE_FLAG_MULTI) { 
+      // overflow blocks are neither linked, copied, nor buffered
+      return ERROR_BADCONFIG;
+    }
+    if (superblock.info.flags & BTREE_FLAG_MULTI) { 
+      // a leaf must take a few whole posting lists, and an overflow
+      // block a couple of values
+      BTreeNode leaf(BTREE_LEAF_NODE,
+		     superblock.info.keysize,
+		     superblock.info.valuesize,
+		     buffercache->GetBlockSize(),
+		     superblock.info.GetFormatAndFlags());
+      BTreeNode overflow(BTREE_OVERFLOW_NODE,
+			 superblock.info.keysize,
+			 GetValueSize(),
+			 buffercache->GetBlockSize(),
+			 BTREE_FORMAT_FIXED);
+      if (GetValueSize()==0 || leaf.info.GetNumSlotsAsLeaf()<4 || overflow.GetNumSlots()<2) { 
+	return ERROR_SIZE;
+      }
+    }
+
+    SIZE_T filterblocks=BTreeFilter::BlocksFor(filterkeys,buffercache->GetBlockSize());
+    if (superblock_index+2+filterblocks>buffercache->GetNumBlocks()) { 
+      return ERROR_NOSPACE;
+    }
+
+    // build a super block, root node, key filter, and a free space list
     //
     // Superblock at superblock_index
     // root node at superblock_index+1
+    // filter blocks, if any, from superblock_index+2
     // free space list for rest
     BTreeNode newsuperblock(BTREE_SUPERBLOCK,
 			    superblock.info.keysize,
 			    superblock.info.valuesize,
-			    buffercache->GetBlockSize());
+			    buffercache->GetBlockSize(),
+			    superblock.info.GetFormatAndFlags());
     newsuperblock.info.rootnode=superblock_index+1;
-    newsuperblock.info.freelist=superblock_index+2;
-    newsuperblock.info.numkeys=0;
+    newsuperblock.info.freelist=superblock_index+2+filterblocks;
+    newsuperblock.info.SetFilterBlocks(filterblocks);
 
     buffercache->NotifyAllocateBlock(superblock_index);
 
@@ -147,9 +277,10 @@ ERROR_T BTreeIndex::Attach(const SIZE_T initblock, const bool create)
     BTreeNode newrootnode(BTREE_ROOT_NODE,
 			  superblock.info.keysize,
 			  superblock.info.valuesize,
-			  buffercache->GetBlockSize());
+			  buffercache->GetBlockSize(),
+			  NodeFormatFor(superblock.info.GetFormatAndFlags(),BTREE_ROOT_NODE));
     newrootnode.info.rootnode=superblock_index+1;
-    newrootnode.info.freelist=superblock_index+2;
+    newrootnode.info.freelist=superblock_index+2+filterblocks;
     newrootnode.info.numkeys=0;
 
     buffercache->NotifyAllocateBlock(superblock_index+1);
@@ -160,7 +291,13 @@ ERROR_T BTreeIndex::Attach(const SIZE_T initblock, const bool create)
       return rc;
     }
 
-    for (SIZE_T i=superblock_index+2; i<buffercache->GetNumBlocks();i++) { 
+    rc=BTreeFilter::Create(buffercache,superblock_index+2,filterblocks);
+
+    if (rc) { 
+      return rc;
+    }
+
+    for (SIZE_T i=superblock_index+2+filterblocks; i<buffercache->GetNumBlocks();i++) { 
       BTreeNode newfreenode(BTREE_UNALLOCATED_BLOCK,
 			    superblock.info.keysize,
 			    superblock.info.valuesize,
@@ -179,87 +316,327 @@ ERROR_T BTreeIndex::Attach(const SIZE_T initblock, const bool create)
 
   // OK, now, mounting the btree is simply a matter of reading the superblock 
 
-  return superblock.Unserialize(buffercache,initblock);
+  rc=superblock.Unserialize(buffercache,initblock);
+  if (rc) { 
+    return rc;
+  }
+
+  cow = (superblock.info.flags & BTREE_FLAG_COW)!=0;
+  buffered = (superblock.info.flags & BTREE_FLAG_BUFFERED)!=0;
+  multi = (superblock.info.flags & BTREE_FLAG_MULTI)!=0;
+  rc=filter.Attach(buffercache,superblock_index+2,superblock.info.GetFilterBlocks(),superblock.info.keysize);
+  if (rc) { 
+    return rc;
+  }
+  keycache.Reset(keycache.GetCapacity(),superblock.info.keysize);
+
+  // the specialised code doesn't look in buffers or posting lists
+  fixedlookup = superblock.info.format==BTREE_FORMAT_FIXED && !buffered && !multi ? 
+    GetFixedLookup(superblock.info.keysize,superblock.info.valuesize) : 0;
+  committed = superblock.info.rootnode;
+  generation = 0;
+
+  return ERROR_NOERROR;
 }
     
 
 ERROR_T BTreeIndex::Detach(SIZE_T &initblock)
 {
-  return superblock.Serialize(buffercache,superblock_index);
+  ERROR_T rc;
+
+  rc=Reclaim();
+  if (rc) { return rc; }
+  rc=filter.Flush();
+  if (rc) { return rc; }
+  return WriteSuperblock();
+}
+
+
+//
+// Copy-on-write
+//
+// A change shadows a node (ShadowNode) before it first writes it:
+// the node is copied to a newly allocated block, its parent is made
+// to point there, which shadows the parent in turn, and so on up to
+// the root.  Blocks the change allocates are its own to write as it
+// likes, so each node is copied once however often the change
+// writes it.  The blocks it copied from, and any committed ones it
+// frees, still belong to the snapshots, so they are retired rather
+// than freed.  A block retired by the commit of generation g can
+// only be reached from snapshots older than g, and goes back on the
+// free list once there are none.
+//
+// Only the writer ever frees blocks, so a snapshot is no more than a
+// count against its generation.
+//
+ERROR_T BTreeIndex::GetSnapshot(BTreeSnapshot &snap) const
+{
+  if (!cow) { 
+    snap.root=superblock.info.rootnode;
+    snap.generation=0;
+    return ERROR_NOERROR;
+  }
+  MutexHolder hold(snapmutex);
+  snap.root=committed;
+  snap.generation=generation;
+  snapshots[generation]++;
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeIndex::ReleaseSnapshot(const BTreeSnapshot &snap) const
+{
+  if (!cow) { 
+    return ERROR_NOERROR;
+  }
+  MutexHolder hold(snapmutex);
+  map<SIZE_T,SIZE_T>::iterator i=snapshots.find(snap.generation);
+  if (i==snapshots.end()) { 
+    return ERROR_INSANE;
+  }
+  if (--i->second==0) { 
+    snapshots.erase(i);
+  }
+  return ERROR_NOERROR;
+}
+
+
+// Holds a snapshot for as long as it is in scope
+struct SnapshotHolder : public BTreeSnapshot {
+  const BTreeIndex &index;
+
+  SnapshotHolder(const BTreeIndex &i) : index(i) { index.GetSnapshot(*this); }
+  ~SnapshotHolder() { index.ReleaseSnapshot(*this); }
+};
+
+
+// Holds m, if there is one, for as long as it is in scope
+class TurnHolder {
+ private:
+  Mutex *m;
+ public:
+  TurnHolder(Mutex *x) : m(x) { if (m) { m->Lock(); } }
+  ~TurnHolder() { if (m) { m->Unlock(); } }
+};
+
+
+void BTreeIndex::BeginChange()
+{
+  if (cow) { 
+    writemutex.Lock();
+    changing=true;
+  } else if (TurnMutex()) { 
+    TurnMutex()->Lock();
+  }
+}
+
+
+ERROR_T BTreeIndex::EndChange(const ERROR_T rc)
+{
+  ERROR_T rc2=ERROR_NOERROR;
+  SIZE_T i;
+
+  if (!cow) { 
+    if (TurnMutex()) { 
+      TurnMutex()->Unlock();
+    }
+    return rc;
+  }
+  changing=false;
+
+  // (a batch insert that ran into keys already there still commits
+  // the rest)
+  if ((rc!=ERROR_NOERROR && rc!=ERROR_CONFLICT) || fresh.empty()) { 
+    // nobody has seen what the change wrote, so it can all go
+    superblock.info.rootnode=committed;
+    for (set<SIZE_T>::iterator f=fresh.begin(); f!=fresh.end(); ++f) { 
+      DeallocateNode(*f);
+    }
+  } else {
+    {
+      MutexHolder hold(snapmutex);
+      committed=superblock.info.rootnode;
+      generation++;
+      for (i=0; i<replaced.size(); i++) { 
+	retired.push_back(make_pair(generation,replaced[i]));
+      }
+    }
+    rc2=WriteSuperblock();
+  }
+  fresh.clear();
+  replaced.clear();
+
+  if (!rc2) { 
+    rc2=Reclaim();
+  }
+  writemutex.Unlock();
+  return rc ? rc : rc2;
+}
+
+
+ERROR_T BTreeIndex::Reclaim()
+{
+  vector<SIZE_T> blocks;
+  ERROR_T rc;
+
+  {
+    MutexHolder hold(snapmutex);
+    SIZE_T oldest=snapshots.empty() ? generation : snapshots.begin()->first;
+    while (!retired.empty() && retired.front().first<=oldest) { 
+      blocks.push_back(retired.front().second);
+      retired.pop_front();
+    }
+  }
+  for (SIZE_T i=0; i<blocks.size(); i++) { 
+    rc=DeallocateNode(blocks[i]);
+    if (rc) { return rc; }
+  }
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeIndex::ShadowNode(SIZE_T &node)
+{
+  Block block;
+  SIZE_T n;
+  ERROR_T rc;
+
+  if (!changing || fresh.count(node)) { 
+    return ERROR_NOERROR;
+  }
+  rc=buffercache->ReadBlock(node,block);
+  if (rc) { return rc; }
+  rc=AllocateNode(n);
+  if (rc) { return rc; }
+  rc=buffercache->WriteBlock(n,block);
+  if (rc) { return rc; }
+  replaced.push_back(node);
+  node=n;
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeIndex::ShadowPath(BTreePath &path)
+{
+  ERROR_T rc;
+
+  if (!changing) { 
+    return ERROR_NOERROR;
+  }
+  for (SIZE_T level=0; level<path.GetDepth(); level++) { 
+    BTreePathEntry &e=path[level];
+    SIZE_T node=e.node;
+
+    rc=ShadowNode(node);
+    if (rc) { return rc; }
+    if (node==e.node) { 
+      continue;
+    }
+    rc=e.b.Pin(buffercache,node);
+    if (rc) { return rc; }
+    e.node=node;
+    if (level==0) { 
+      superblock.info.rootnode=node;
+    } else {
+      BTreePathEntry &parent=path[level-1];
+      rc=parent.b.SetPtr(parent.offset,node);
+      if (rc) { return rc; }
+      rc=parent.b.Serialize(buffercache,parent.node);
+      if (rc) { return rc; }
+    }
+  }
+  return ERROR_NOERROR;
 }
  
 
+BTreeLatchMode BTreeIndex::LeafLatching(const bool change) const
+{
+  if (superblock.info.flags & BTREE_FLAG_BLINK) { 
+    return change ? BTREE_LATCH_BLINK_LEAF : BTREE_LATCH_BLINK;
+  }
+  return change ? BTREE_LATCH_LEAF : BTREE_LATCH_READ;
+}
+
+
 ERROR_T BTreeIndex::LookupOrUpdateInternal(const SIZE_T &node,
 					   const BTreeOp op,
 					   const KEY_T &key,
 					   VALUE_T &value)
 {
-  BTreeNode b;
+  BTreePath path(buffercache);
+  bool found;
   ERROR_T rc;
-  SIZE_T offset;
-  KEY_T testkey;
-  SIZE_T ptr;
 
-  rc= b.Unserialize(buffercache,node);
+  if (buffered) { 
+    VALUE_T old;
+
+    if (op==BTREE_OP_LOOKUP) { 
+      return LookupBuffered(node, key, value);
+    }
+    // BTREE_OP_UPDATE
+    rc = LookupBuffered(node, key, old);
+    if (rc) { return rc; }
+    return SendMessages(vector<BTreeMessage>(1, BTreeMessage(BTREE_MSG_PUT, key, value)));
+  }
+
+  if (concurrent && !cow) { 
+    path.SetLatching(LeafLatching(op!=BTREE_OP_LOOKUP));
+  }
+  rc = path.Descend(node, &key, found);
 
   if (rc!=ERROR_NOERROR) { 
     return rc;
   }
+  if (!found) { 
+    return ERROR_NONEXISTENT;
+  }
 
-  switch (b.info.nodetype) { 
-  case BTREE_ROOT_NODE:
-  case BTREE_INTERIOR_NODE:
-    // Scan through key/ptr pairs
-    //and recurse if possible
-    for (offset=0;offset<b.info.numkeys;offset++) { 
-      rc=b.GetKey(offset,testkey);
-      if (rc) {  return rc; }
-      if (key<testkey || key==testkey) {
-	// OK, so we now have the first key that's larger
-	// so we ned to recurse on the ptr immediately previous to 
-	// this one, if it exists
-	rc=b.GetPtr(offset,ptr);
-	if (rc) { return rc; }
-	return LookupOrUpdateInternal(ptr,op,key,value);
-      }
-    }
-    // if we got here, we need to go to the next pointer, if it exists
-    if (b.info.numkeys>0) { 
-      rc=b.GetPtr(b.info.numkeys,ptr);
-      if (rc) { return rc; }
-      return LookupOrUpdateInternal(ptr,op,key,value);
-    } else {
-      // There are no keys at all on this node, so nowhere to go
-      return ERROR_NONEXISTENT;
+  BTreePathEntry &leaf = path.Leaf();
+  if (op==BTREE_OP_LOOKUP && multi) { 
+    VALUE_T list;
+    rc = leaf.b.GetVal(leaf.offset,list);
+    if (rc) { return rc; }
+    return FirstPosting(list,value);
+  } else if (op==BTREE_OP_LOOKUP) { 
+    return leaf.b.GetVal(leaf.offset,value);
+  } else { 
+    // BTREE_OP_UPDATE
+    rc = ShadowPath(path);
+    if (rc) { return rc; }
+    rc = leaf.b.SetVal(leaf.offset,value);
+    if (rc) { return rc; }
+    return leaf.b.Serialize(buffercache, leaf.node);
+  }
+}
+
+
+// The changes buffered in an interior node, if any
+static ERROR_T PrintMessages(ostream &os, const BTreeNode &b)
+{
+  vector<BTreeMessage> msgs;
+  ERROR_T rc;
+  unsigned i, j;
+
+  rc=b.GetMessages(msgs);
+  if (rc) { return rc; }
+  if (msgs.empty()) { 
+    return ERROR_NOERROR;
+  }
+  os << "Buffer: ";
+  for (i=0;i<msgs.size();i++) { 
+    os << (msgs[i].op==BTREE_MSG_PUT ? "+" : "-");
+    for (j=0;j<msgs[i].key.length;j++) { 
+      os << msgs[i].key.data[j];
     }
-    break;
-  case BTREE_LEAF_NODE:
-    // Scan through keys looking for matching
-    for (offset=0;offset<b.info.numkeys;offset++) { 
-      rc=b.GetKey(offset,testkey);
-      if (rc) {  return rc; }
-      if (testkey==key) { 
-	if (op==BTREE_OP_LOOKUP) { 
-	  return b.GetVal(offset,value);
-	} else { 
-	  // BTREE_OP_UPDATE
-	  rc = b.SetVal(offset,value);
-	  if (rc) { return rc; }
-	  rc = b.Serialize(buffercache, node);
-	  return rc;
-	  // return ERROR_UNIMPL;
-	}
+    if (msgs[i].op==BTREE_MSG_PUT) { 
+      os << "=";
+      for (j=0;j<msgs[i].value.length;j++) { 
+	os << msgs[i].value.data[j];
       }
     }
-    return ERROR_NONEXISTENT;
-    break;
-  default:
-    // We can't be looking at anything other than a root, internal, or leaf
-    return ERROR_INSANE;
-    break;
-  }  
-
-  return ERROR_INSANE;
+    os << " ";
+  }
+  return ERROR_NOERROR;
 }
 
 
@@ -296,11 +673,13 @@ static ERROR_T PrintNode(ostream &os, SIZE_T nodenum, BTreeNode &b, BTreeDisplay
 	if (offset==b.info.numkeys) break;
 	rc=b.GetKey(offset,key);
 	if (rc) {  return rc; }
-	for (i=0;i<b.info.keysize;i++) { 
+	for (i=0;i<key.length;i++) { 
 	  os << key.data[i];
 	}
 	os << " ";
       }
+      rc=PrintMessages(os,b);
+      if (rc) { return rc; }
     }
     break;
   case BTREE_LEAF_NODE:
@@ -322,7 +701,7 @@ static ERROR_T PrintNode(ostream &os, SIZE_T nodenum, BTreeNode &b, BTreeDisplay
       }
       rc=b.GetKey(offset,key);
       if (rc) {  return rc; }
-      for (i=0;i<b.info.keysize;i++) { 
+      for (i=0;i<key.length;i++) { 
 	os << key.data[i];
       }
       if (dt==BTREE_SORTED_KEYVAL) { 
@@ -332,7 +711,7 @@ static ERROR_T PrintNode(ostream &os, SIZE_T nodenum, BTreeNode &b, BTreeDisplay
       }
       rc=b.GetVal(offset,value);
       if (rc) {  return rc; }
-      for (i=0;i<b.info.valuesize;i++) { 
+      for (i=0;i<value.length;i++) { 
 	os << value.data[i];
       }
       if (dt==BTREE_SORTED_KEYVAL) { 
@@ -355,357 +734,2714 @@ static ERROR_T PrintNode(ostream &os, SIZE_T nodenum, BTreeNode &b, BTreeDisplay
   return ERROR_NOERROR;
 }
   
+//
+// A key in the key cache is answered from there.  Otherwise what
+// the tree has is offered to the cache, which only takes it if
+// nothing has changed meanwhile.
+//
 ERROR_T BTreeIndex::Lookup(const KEY_T &key, VALUE_T &value)
 {
-  return LookupOrUpdateInternal(superblock.info.rootnode, BTREE_OP_LOOKUP, key, value);
+  SIZE_T stamp=0;
+  ERROR_T rc;
+
+  if (keycache.Find(key, value, stamp)) { 
+    return ERROR_NOERROR;
+  }
+  rc = LookupTree(key, value);
+  if (rc==ERROR_NOERROR) { 
+    keycache.Admit(key, value, stamp);
+  }
+  return rc;
 }
 
-ERROR_T BTreeIndex::Insert(const KEY_T &key, const VALUE_T &value)
+
+ERROR_T BTreeIndex::LookupTree(const KEY_T &key, VALUE_T &value)
 {
-  // WRITE ME
-  // 1) Initilize x as root
-  // 2) While x is not leaf
-  // 	a) Find the child of x to traverse next. Let this by y.
-  // 	b) If y is not full, change x to point to y
-  // 	c) If y is full, split it and change x to point to one of the two parts of y. If k < mid key of y, set x as first part of y. Else, set x as second part of y. When we split y, we move mid key from y to its parent x.
-  // 3) Repeat loop 2) until x is a leaf. Insert k to x.
-  
-  VALUE_T val;
-  ERROR_T rc;
-  if(Lookup(key, val) == ERROR_NONEXISTENT){
-      BTreeNode root;
-      root.Unserialize(buffercache, superblock.info.rootnode);
-      if (root.info.numkeys == 0) {
-	//cout << "Root initialization" << endl;
-	BTreeNode leaf(BTREE_LEAF_NODE,
-			superblock.info.keysize,
-			superblock.info.valuesize,
-			buffercache->GetBlockSize());
-        
-
-	SIZE_T lhs;
-	SIZE_T rhs;
-	//initialize two leaves for root
-	rc = AllocateNode(lhs);
-	if (rc) { return rc; }
+  TurnHolder turn(TurnMutex());
 
-	rc = AllocateNode(rhs);
-	if (rc) { return rc; }
+  if (cow) { 
+    SnapshotHolder snap(*this);
+    return Lookup(snap, key, value);
+  }
+  if (!filter.MayHold(key)) { 
+    return ERROR_NONEXISTENT;
+  }
+  if (specialized && fixedlookup && !concurrent && key.length>=superblock.info.keysize) { 
+    return filter.Settle(fixedlookup(buffercache, superblock.info.rootnode, BTREE_OP_LOOKUP, key, value));
+  }
+  return filter.Settle(LookupOrUpdateInternal(superblock.info.rootnode, BTREE_OP_LOOKUP, key, value));
+}
 
-	leaf.Serialize(buffercache, lhs);
-	leaf.Serialize(buffercache, rhs);
-	root.info.numkeys++;
-	
-	//set pointers for left and right leaves
-	rc=root.SetKey(0, key);
-	if (rc) { return rc; }
-	rc=root.SetPtr(0, lhs);
-	if (rc) { return rc; }
-	rc=root.SetPtr(1, rhs);
-	if (rc) { return rc; }
-	rc=root.Serialize(buffercache, superblock.info.rootnode);
-        if (rc) { return rc; }
-      }    
-      //cout << "Beginning insert process...Call Insert Helper" << endl;
-      //this is the error we want, can now start insert
 
-      //start from root
-      rc = InsertHelper(superblock_index+1, key, value);
-      if (rc) { return rc; }
+// The nodes of a copy-on-write snapshot don't change, so the
+// specialised lookups need no latches there.  The filter only ever
+// gains keys, so it holds those of any snapshot.
+ERROR_T BTreeIndex::Lookup(const BTreeSnapshot &snap, const KEY_T &key, VALUE_T &value)
+{
+  if (!filter.MayHold(key)) { 
+    return ERROR_NONEXISTENT;
+  }
+  if (buffered) { 
+    TurnHolder turn(TurnMutex());
+    return filter.Settle(LookupOrUpdateInternal(snap.root, BTREE_OP_LOOKUP, key, value));
   }
-  //key already exists
-  else { return ERROR_CONFLICT; }
+  if (specialized && fixedlookup && (!concurrent || cow) && key.length>=superblock.info.keysize) { 
+    return filter.Settle(fixedlookup(buffercache, snap.root, BTREE_OP_LOOKUP, key, value));
+  }
+  return filter.Settle(LookupOrUpdateInternal(snap.root, BTREE_OP_LOOKUP, key, value));
 }
 
- 
-ERROR_T BTreeIndex::InsertHelper(const SIZE_T &node, const KEY_T &key, const VALUE_T &value)
+
+// Interiors, check that the node's bytes are less than 2/3 used
+// Leafs, check that the node's bytes are less than 2/3 used
+// and either way, that a full size key still fits
+static bool IsFull(const BTreeNode &b, const SIZE_T used)
 {
-  //cout << "Enter Insert Helper" << endl;
-  //cout << "-----------------------" << endl;
-  BTreeNode b;
-  ERROR_T rc;
-  SIZE_T offset;
-  KEY_T testkey;
-  SIZE_T ptr;
+  return (3 * used >= 2 * b.info.GetNumDataBytes() ||
+	  used + b.GetRecordSize(b.info.keysize, b.info.valuesize) > b.info.GetNumDataBytes());
+}
 
-  SIZE_T newnode;
-  KEY_T splitkey;
-  
-  rc = b.Unserialize(buffercache,node);
 
-  if (rc!=ERROR_NOERROR) { 
-    return rc;
-  }
+// A node that an insert below can't fill up, so it stops any split
+static bool SafeForInsert(const BTreeNode &b)
+{
+  return !IsFull(b, b.GetNumUsedBytes() + b.GetRecordSize(b.info.keysize, b.info.valuesize));
+}
 
-  switch (b.info.nodetype) { 
-  case BTREE_ROOT_NODE:
-  case BTREE_INTERIOR_NODE:
-    // Scan through key/ptr pairs
-    // and recurse if possible
-    for (offset=0;offset<b.info.numkeys;offset++) { 
-      rc=b.GetKey(offset,testkey);
-      if (rc) {  return rc; }
-	// conditional below shouldn't have key == testKey
-	// because that would be in the next leaf node (not desirable)
-      if (key<testkey) {
-	// OK, so we now have the first key that's larger
-	// so we need to recurse on the ptr immediately previous to 
-	// this one, if it exists
 
-	rc=b.GetPtr(offset,ptr);
-	if (rc) { return rc; }
-         
-        //call recursively
-        //cout << "Recursive call 1" << endl;
-	rc = InsertHelper(ptr,key,value);
-        if (rc) { return rc; }
+//
+// Inserts go down the tree once, keeping the path.  The leaf finds
+// out whether the key is already there, and a node that the insert
+// fills up is split on the way back up (SplitUp), while it is still
+// pinned, so each node on the path is read once.
+//
+// Concurrent inserts first go down with only the leaf latched
+// exclusively, which is all it takes unless the leaf would fill up.
+// If it would, they go down again latching exclusively, and keep
+// the latches from the last node that is sure not to split.
+//
+ERROR_T BTreeIndex::Insert(const KEY_T &key, const VALUE_T &value)
+{
+  ERROR_T rc;
 
-        //check to see if this node is full
-        if(NodeFull(ptr)){
-          //cout << "Node is full 1" << endl;
-          //if it is full, split it
-	  rc = SplitNode(ptr, splitkey, newnode);
-          if (rc) { return rc; }
-          //cout << "Insert key ptr pair into newly split node" << endl;
-	  return InsertKeyVal(node, splitkey, VALUE_T(), newnode);
-        }
-        else { return rc; }
-      }
-    }
-    // if we got here, we need to go to the next pointer, if it exists
-    if (b.info.numkeys>0) { 
-      //same process as before
-      //cout << "b.info.numkeys > 0" << endl;      
+  BeginChange();
+  rc = EndChange(multi ? InsertPosting(key, value, false) : InsertInternal(key, value, false));
+  keycache.Forget(key);
+  return rc;
+}
 
-      rc=b.GetPtr(b.info.numkeys,ptr);
 
-      if (rc) { return rc; }
+ERROR_T BTreeIndex::Upsert(const KEY_T &key, const VALUE_T &value)
+{
+  ERROR_T rc;
 
-      //cout << "Recursive call 2" << endl;
-      rc = InsertHelper(ptr,key,value);
-      if (rc) { return rc; }
+  BeginChange();
+  rc = EndChange(multi ? InsertPosting(key, value, true) : InsertInternal(key, value, true));
+  keycache.Forget(key);
+  return rc;
+}
 
 
-      if(NodeFull(ptr)){ 
-       // cout << "Node is full 2" << endl;
-        rc = SplitNode(ptr, splitkey, newnode);
-        if (rc) { return rc; }
-        return InsertKeyVal(node, splitkey, VALUE_T(), newnode);
-      }
-      else { return rc; }
-    } else {
-       // cout << "b.info.numkeys is <= 0" << endl;
-        return ERROR_NONEXISTENT;
-    }
-    break;
-  case BTREE_LEAF_NODE:
-   // cout << "BTREE_LEAF_NODE" << endl;
-   // cout << "Insert key val pair into leaf node" << endl;
-    //simply insert into leaf (we will split later if necessary)
-    return InsertKeyVal(node, key, value, 0);
-    break;
+ERROR_T BTreeIndex::InsertInternal(const KEY_T &key, const VALUE_T &value, const bool upsert)
+{
+  BTreePath path(buffercache);
+  bool found, had;
+  ERROR_T rc;
+
+  // the key goes in the filter before it goes in the tree, so no
+  // lookup can find it in the tree but not in the filter
+  had = filter.Add(key);
+
+  if (buffered) { 
+    VALUE_T old;
+
+    // a key new to the filter can't conflict
+    if (!upsert) { 
+      filter.Count(had);
+    }
+    if (!upsert && had) { 
+      rc = filter.Settle(LookupBuffered(superblock.info.rootnode, key, old));
+      if (rc==ERROR_NOERROR) { 
+	return ERROR_CONFLICT;
+      }
+      if (rc!=ERROR_NONEXISTENT) { return rc; }
+    }
+    return SendMessages(vector<BTreeMessage>(1, BTreeMessage(BTREE_MSG_PUT, key, value)));
+  }
+
+  if (concurrent && !cow) { 
+    path.SetLatching(LeafLatching(true));
+    rc = path.Descend(superblock.info.rootnode, &key, found);
+    if (rc && rc!=ERROR_NONEXISTENT) { return rc; }
+    if (rc==ERROR_NOERROR) { 
+      BTreePathEntry &leaf = path.Leaf();
+      if (found && !upsert) { 
+	return ERROR_CONFLICT;
+      }
+      if (!IsFull(leaf.b, leaf.b.GetNumUsedBytes() + leaf.b.GetRecordSize(key.length, value.length))) { 
+	if (found) { 
+	  rc = leaf.b.SetVal(leaf.offset, value);
+	} else {
+	  rc = leaf.b.InsertKeyVal(leaf.offset, key, value);
+	}
+	if (rc) { return rc; }
+	return leaf.b.Serialize(buffercache, leaf.node);
+      }
+    }
+    path.Clear();
+    path.SetLatching(BTREE_LATCH_WRITE, SafeForInsert);
+  }
+
+  rc = path.Descend(superblock.info.rootnode, &key, found);
+  if (rc==ERROR_NONEXISTENT) { 
+    // the tree is empty, and the path holds just its root
+    rc = ShadowPath(path);
+    if (rc) { return rc; }
+    rc = InitRoot(path[0].b, key);
+    if (rc) { return rc; }
+    path.Clear();
+    rc = path.Descend(superblock.info.rootnode, &key, found);
+  }
+  if (rc) { return rc; }
+
+  BTreePathEntry &leaf = path.Leaf();
+  if (found && !upsert) { 
+    return ERROR_CONFLICT;
+  }
+  rc = ShadowPath(path);
+  if (rc) { return rc; }
+  if (found) { 
+    rc = leaf.b.SetVal(leaf.offset, value);
+  } else {
+    rc = leaf.b.InsertKeyVal(leaf.offset, key, value);
+  }
+  if (rc) { return rc; }
+
+  return SplitUp(path);
+}
+
+
+
+//
+// An empty tree has a root with no keys.  Before the first insert
+// it gets two empty leaves, separated by key.
+//
+ERROR_T BTreeIndex::InitRoot(BTreeNode &root, const KEY_T &key)
+{
+  ERROR_T rc;
+
+  if (root.info.numkeys > 0) { 
+    return ERROR_NOERROR;
+  }
+
+  BTreeNode leaf(BTREE_LEAF_NODE,
+		 superblock.info.keysize,
+		 superblock.info.valuesize,
+		 buffercache->GetBlockSize(),
+		 NodeFormatFor(superblock.info.GetFormatAndFlags(),BTREE_LEAF_NODE));
+  SIZE_T lhs;
+  SIZE_T rhs;
+
+  //initialize two leaves for root
+  rc = AllocateNode(lhs);
+  if (rc) { return rc; }
+
+  rc = AllocateNode(rhs);
+  if (rc) { return rc; }
+
+  rc = leaf.SetFences(&key, 0);
+  if (rc) { return rc; }
+  rc = leaf.Serialize(buffercache, rhs);
+  if (rc) { return rc; }
+  //the left leaf links to the right one
+  rc = leaf.SetRightLink(rhs);
+  if (rc) { return rc; }
+  rc = leaf.SetFences(0, &key);
+  if (rc) { return rc; }
+  rc = leaf.Serialize(buffercache, lhs);
+  if (rc) { return rc; }
+  //set pointers for left and right leaves
+  rc = root.SetPtr(0, lhs);
+  if (rc) { return rc; }
+  rc = root.InsertKeyPtr(0, key, rhs);
+  if (rc) { return rc; }
+  return root.Serialize(buffercache, superblock.info.rootnode);
+}
+
+ 
+//
+// Writes back the nodes of path, from the leaf up, after the leaf
+// has changed.  A node that is now full is split, and its new right
+// half goes into its parent, which is then checked in turn.
+//
+ERROR_T BTreeIndex::SplitUp(BTreePath &path)
+{
+  KEY_T splitkey;
+  KEY_T lokey, hikey;
+  const KEY_T *lo, *hi;
+  SIZE_T newnode;
+  ERROR_T rc;
+
+  for (SIZE_T level=path.GetDepth(); level-->0; ) { 
+    BTreePathEntry &e = path[level];
+
+    if (!IsFull(e.b, e.b.GetNumUsedBytes())) { 
+      return e.b.Serialize(buffercache, e.node);
+    }
+    if (e.b.info.nodetype==BTREE_ROOT_NODE) { 
+      return SplitRoot(e.b);
+    }
+    if (level==path.GetTop()) { 
+      // the path let go of its parent, taking it to be safe
+      return ERROR_INSANE;
+    }
+
+    rc = path.GetFences(level, lokey, hikey, lo, hi);
+    if (rc) { return rc; }
+    rc = SplitNode(e.b, e.node, splitkey, newnode, lo, hi);
+    if (rc) { return rc; }
+
+    //the new right half goes in after the node
+    BTreePathEntry &parent = path[level-1];
+    rc = parent.b.InsertKeyPtr(parent.offset, splitkey, newnode);
+    if (rc) { return rc; }
+  }
+  return ERROR_INSANE;
+}
+
+
+//
+// Shortens midkey, the last key on the left of a leaf split, to the
+// shortest separator s with midkey <= s < first, where first is the
+// first key on the right.  Everything <= s goes left.  s is the
+// shortest prefix of first that is greater than midkey; a prefix
+// shorter than the whole key sorts before first, so if it would take
+// the whole key, midkey is used at full length.  Keys shorter than
+// keysize compare as if padded with zeros.
+//
+static BYTE_T KeyByte(const KEY_T &k, const SIZE_T i)
+{
+  return i<k.length ? k.data[i] : 0;
+}
+
+static void TruncateSeparator(KEY_T &midkey, const KEY_T &first, const SIZE_T keysize)
+{
+  SIZE_T n=0;
+
+  while (n<keysize && KeyByte(midkey,n)==KeyByte(first,n)) { 
+    n++;
+  }
+  if (n+1<keysize) { 
+    // first is the larger at byte n, so it has a byte there
+    midkey.Resize(n+1,false);
+    memcpy(midkey.data,first.data,n+1);
+  } else if (midkey.length<keysize) { 
+    KEY_T full(keysize);
+    memset(full.data,0,keysize);
+    memcpy(full.data,midkey.data,midkey.length);
+    midkey=full;
+  }
+}
+
+//splits given node into two nodes
+//lo and hi are the keys that bound it in its parent
+ERROR_T BTreeIndex::SplitNode (const SIZE_T node, KEY_T &midkey, SIZE_T &newnode,
+			       const KEY_T *lo, const KEY_T *hi) {
+  BTreeNode lhs;
+
+  ERROR_T rc;
+
+  rc=lhs.Unserialize(buffercache, node);
+  if (rc) { return rc; }
+
+  return SplitNode(lhs, node, midkey, newnode, lo, hi);
+}
+
+
+//splits lhs, which is node as it is in memory, and writes out both halves
+ERROR_T BTreeIndex::SplitNode (BTreeNode &lhs, const SIZE_T node, KEY_T &midkey, SIZE_T &newnode,
+			       const KEY_T *lo, const KEY_T *hi) {
+  ERROR_T rc;
+
+  // the left node will represent the first half of the current node
+  // the right node is a fresh node of the same type
+  BTreeNode rhs(lhs.info.nodetype==BTREE_ROOT_NODE ? BTREE_INTERIOR_NODE : lhs.info.nodetype,
+		lhs.info.keysize,
+		lhs.info.valuesize,
+		lhs.info.blocksize,
+		lhs.info.GetFormatAndFlags());
+
+  //allocate space for new node
+  rc = AllocateNode(newnode);
+  if (rc) { return rc; }
+
+  rc = lhs.Split(rhs, midkey);
+  if (rc) { return rc; }
+
+  //leaves, and the nodes of a B-link tree, are linked left to
+  //right, the new node goes after this one
+  SIZE_T next;
+  rc = lhs.GetRightLink(next);
+  if (rc) { return rc; }
+  rc = rhs.SetRightLink(next);
+  if (rc) { return rc; }
+  rc = lhs.SetRightLink(newnode);
+  if (rc) { return rc; }
+
+  //interior nodes that hold variable length keys get the
+  //shortest separator instead of the whole key
+  if (lhs.info.nodetype==BTREE_LEAF_NODE && rhs.info.numkeys>0 &&
+      NodeFormatFor(superblock.info.format,BTREE_INTERIOR_NODE)==BTREE_FORMAT_SLOTTED) { 
+    KEY_T first;
+    rc = rhs.GetKey(0, first);
+    if (rc) { return rc; }
+    TruncateSeparator(midkey, first, lhs.info.keysize);
+  }
+
+  //each half now has a narrower range of keys
+  rc = lhs.SetFences(lo, &midkey);
+  if (rc) { return rc; }
+  rc = rhs.SetFences(&midkey, hi);
+  if (rc) { return rc; }
+
+  //write back to disk
+  rc = lhs.Serialize(buffercache, node);
+  if (rc) { return rc; }
+
+  rc = rhs.Serialize(buffercache, newnode);
+  if (rc) { return rc; }
+
+  return ERROR_NOERROR;
+
+}
+
+
+//
+// The root stays at superblock.info.rootnode, so to split it we
+// move its contents to a new interior node, split that, and
+// rewrite the root with just the two halves
+//
+ERROR_T BTreeIndex::SplitRoot()
+{
+  BTreeNode root;
+  ERROR_T rc;
+
+  rc = root.Unserialize(buffercache, superblock.info.rootnode);
+  if (rc) { return rc; }
+
+  return SplitRoot(root);
+}
+
+
+//splits the root as it is in memory
+ERROR_T BTreeIndex::SplitRoot(BTreeNode &root)
+{
+  SIZE_T lhs, rhs;
+  KEY_T midkey;
+  ERROR_T rc;
+
+  rc = AllocateNode(lhs);
+  if (rc) { return rc; }
+
+  root.info.nodetype = BTREE_INTERIOR_NODE;
+  rc = SplitNode(root, lhs, midkey, rhs, 0, 0);
+  if (rc) { return rc; }
+
+  BTreeNode newroot(BTREE_ROOT_NODE,
+		    root.info.keysize,
+		    root.info.valuesize,
+		    root.info.blocksize,
+		    root.info.GetFormatAndFlags());
+  newroot.info.rootnode = root.info.rootnode;
+  newroot.info.freelist = root.info.freelist;
+
+  rc = newroot.SetPtr(0, lhs);
+  if (rc) { return rc; }
+  rc = newroot.InsertKeyPtr(0, midkey, rhs);
+  if (rc) { return rc; }
+
+  return newroot.Serialize(buffercache, superblock.info.rootnode);
+}
+
+
+//
+// Bulk loading
+//
+// The leaves are filled in key order straight from the source and
+// written out as they fill, so they take consecutive free blocks and
+// a scan along the leaf chain reads the disk sequentially.  Each
+// level above is then built from the blocks and separators of the
+// level below it, until one fits in the root.
+//
+
+// true if one more record of keylen/vallen bytes leaves b, with used
+// bytes in use, short of full (see IsFull) and within fill of that
+static bool BulkFits(const BTreeNode &b, const SIZE_T used,
+		     const SIZE_T keylen, const SIZE_T vallen, const double fill)
+{
+  SIZE_T after=used+b.GetRecordSize(keylen,vallen);
+
+  return !IsFull(b,after) && 3*after <= fill*2*b.info.GetNumDataBytes();
+}
+
+// Empties b so it can be filled again
+static void ClearNode(BTreeNode &b)
+{
+  memset(b.data,0,b.info.GetNumDataBytes());
+  b.info.numkeys=0;
+}
+
+
+ERROR_T BTreeIndex::BulkLoad(KeyValueSource &source, const double fill)
+{
+  ERROR_T rc;
+
+  BeginChange();
+  rc = EndChange(BulkLoadInternal(source, fill));
+  keycache.ForgetAll();
+  return rc;
+}
+
+
+ERROR_T BTreeIndex::BulkLoadInternal(KeyValueSource &source, const double fill)
+{
+  if (multi) { 
+    return ERROR_UNIMPL;
+  }
+
+  BTreeNode root;
+  BTreeNode leaf(BTREE_LEAF_NODE,
+		 superblock.info.keysize,
+		 superblock.info.valuesize,
+		 buffercache->GetBlockSize(),
+		 NodeFormatFor(superblock.info.GetFormatAndFlags(),BTREE_LEAF_NODE));
+  vector<SIZE_T> children;  // the leaves in key order
+  vector<KEY_T> seps;       // seps[i] separates children[i] and children[i+1]
+  KEY_T key, sep;
+  VALUE_T value;
+  SIZE_T used=0, block=0, next;
+  int cmp;
+  ERROR_T rc;
+
+  if (fill<=0 || fill>1) { 
+    return ERROR_BADCONFIG;
+  }
+
+  rc = root.Unserialize(buffercache, superblock.info.rootnode);
+  if (rc) { return rc; }
+  if (root.info.numkeys>0) { 
+    return ERROR_CONFLICT;
+  }
+
+  while ((rc=source.GetNext(key, value))==ERROR_NOERROR) { 
+    if (leaf.info.numkeys>0) { 
+      cmp = leaf.CompareKey(leaf.info.numkeys-1, key);
+      if (cmp==0) { return ERROR_CONFLICT; }
+      if (cmp>0) { return ERROR_INSANE; }
+    }
+    filter.Add(key);
+
+    if (children.empty()) { 
+      rc = AllocateNode(block);
+      if (rc) { return rc; }
+      children.push_back(block);
+      used = leaf.GetNumUsedBytes();
+    } else if (!BulkFits(leaf, used, key.length, value.length, fill)) { 
+      // write the leaf out, the next one starts with this key
+      rc = AllocateNode(next);
+      if (rc) { return rc; }
+      rc = leaf.GetKey(leaf.info.numkeys-1, sep);
+      if (rc) { return rc; }
+      if (NodeFormatFor(superblock.info.format,BTREE_INTERIOR_NODE)==BTREE_FORMAT_SLOTTED) { 
+	TruncateSeparator(sep, key, superblock.info.keysize);
+      }
+      rc = leaf.SetRightLink(next);
+      if (rc) { return rc; }
+      rc = leaf.SetFences(seps.empty() ? 0 : &seps.back(), &sep);
+      if (rc) { return rc; }
+      rc = leaf.Serialize(buffercache, block);
+      if (rc) { return rc; }
+
+      seps.push_back(sep);
+      children.push_back(next);
+      block = next;
+      ClearNode(leaf);
+      used = leaf.GetNumUsedBytes();
+    }
+
+    rc = leaf.InsertKeyVal(leaf.info.numkeys, key, value);
+    if (rc) { return rc; }
+    used += leaf.GetRecordSize(key.length, value.length);
+  }
+  if (rc!=ERROR_NONEXISTENT) { 
+    return rc;
+  }
+  if (children.empty()) { 
+    return ERROR_NOERROR;
+  }
+
+  if (children.size()==1) { 
+    // the root needs a key, so as in Insert the only leaf gets an
+    // empty one after it
+    rc = leaf.GetKey(leaf.info.numkeys-1, sep);
+    if (rc) { return rc; }
+    rc = AllocateNode(next);
+    if (rc) { return rc; }
+    rc = leaf.SetRightLink(next);
+    if (rc) { return rc; }
+    rc = leaf.SetFences(0, &sep);
+    if (rc) { return rc; }
+    rc = leaf.Serialize(buffercache, block);
+    if (rc) { return rc; }
+    ClearNode(leaf);
+    rc = leaf.SetFences(&sep, 0);
+    if (rc) { return rc; }
+    rc = leaf.Serialize(buffercache, next);
+    if (rc) { return rc; }
+    seps.push_back(sep);
+    children.push_back(next);
+  } else {
+    // the last leaf ends the chain
+    rc = leaf.SetFences(&seps.back(), 0);
+    if (rc) { return rc; }
+    rc = leaf.Serialize(buffercache, block);
+    if (rc) { return rc; }
+  }
+
+  // the last level is written over the root
+  rc = ShadowNode(superblock.info.rootnode);
+  if (rc) { return rc; }
+  while (children.size()>1) { 
+    rc = BulkLoadLevel(children, seps, fill);
+    if (rc) { return rc; }
+  }
+  return ERROR_NOERROR;
+}
+
+
+//
+// Builds the level above children, and replaces children and seps
+// with its nodes and the separators between them.  If it all fits in
+// one node, that node is written to the root.
+//
+ERROR_T BTreeIndex::BulkLoadLevel(vector<SIZE_T> &children, vector<KEY_T> &seps,
+				  const double fill)
+{
+  BTreeNode node(BTREE_INTERIOR_NODE,
+		 superblock.info.keysize,
+		 superblock.info.valuesize,
+		 buffercache->GetBlockSize(),
+		 NodeFormatFor(superblock.info.GetFormatAndFlags(),BTREE_INTERIOR_NODE));
+  vector<SIZE_T> upchildren;
+  vector<KEY_T> upseps;
+  SIZE_T n=children.size();
+  SIZE_T i, j, used, block, next=0;
+  ERROR_T rc;
+
+  for (i=0; i<n; i=j+1) { 
+    ClearNode(node);
+    used = node.GetNumUsedBytes();
+    rc = node.SetPtr(0, children[i]);
+    if (rc) { return rc; }
+
+    // children[i..j] go in this node
+    for (j=i; j+1<n; j++) { 
+      if (node.info.numkeys>0 && !BulkFits(node, used, seps[j].length, 0, fill)) { 
+	break;
+      }
+      rc = node.InsertKeyPtr(node.info.numkeys, seps[j], children[j+1]);
+      if (rc) { return rc; }
+      used += node.GetRecordSize(seps[j].length);
+    }
+
+    // an interior node needs a key, so don't leave a lone child for
+    // the next one: give it one of ours, or take it in past fill
+    if (j+2==n && node.info.numkeys>1) { 
+      node.info.numkeys--;
+      j--;
+    } else if (j+2==n) { 
+      if (!BulkFits(node, used, seps[j].length, 0, 1.0)) { 
+	return ERROR_SIZE;
+      }
+      rc = node.InsertKeyPtr(node.info.numkeys, seps[j], children[j+1]);
+      if (rc) { return rc; }
+      j++;
+    }
+
+    if (i==0 && j+1==n) { 
+      node.info.nodetype = BTREE_ROOT_NODE;
+      node.info.rootnode = superblock.info.rootnode;
+      rc = node.Serialize(buffercache, superblock.info.rootnode);
+      if (rc) { return rc; }
+      children.assign(1, superblock.info.rootnode);
+      seps.clear();
+      return ERROR_NOERROR;
+    }
+
+    rc = node.SetFences(i>0 ? &seps[i-1] : 0, j+1<n ? &seps[j] : 0);
+    if (rc) { return rc; }
+    // the block of the node after this one is taken now, for the
+    // right link of a B-link tree
+    if (next==0) { 
+      rc = AllocateNode(block);
+      if (rc) { return rc; }
+    } else {
+      block = next;
+      next = 0;
+    }
+    if (j+1<n) { 
+      rc = AllocateNode(next);
+      if (rc) { return rc; }
+    }
+    rc = node.SetRightLink(next);
+    if (rc) { return rc; }
+    rc = node.Serialize(buffercache, block);
+    if (rc) { return rc; }
+
+    // seps[j] moves up to separate this node from the next
+    upchildren.push_back(block);
+    if (j+1<n) { 
+      upseps.push_back(seps[j]);
+    }
+  }
+
+  children.swap(upchildren);
+  seps.swap(upseps);
+  return ERROR_NOERROR;
+}
+
+
+//
+// Batched inserts
+//
+// The batch is sorted and goes down the tree in one pass: each node
+// on the way is read once, hands each child the run of keys that
+// belongs under it, and takes in whatever new nodes its children
+// split off.  A node that ends up full is split just once, into as
+// many even pieces as it takes for none of them to be full, so a
+// leaf that gets a hundred keys is rewritten once rather than split
+// over and over.
+//
+
+// Compares keys as the tree does: bytewise up to keysize, short keys
+// padded with zeros
+static int CompareBatchKeys(const KEY_T &a, const KEY_T &b, const SIZE_T keysize)
+{
+  for (SIZE_T i=0; i<keysize; i++) { 
+    if (KeyByte(a,i)!=KeyByte(b,i)) { 
+      return KeyByte(a,i)<KeyByte(b,i) ? -1 : 1;
+    }
+  }
+  return 0;
+}
+
+static const KEY_T &KeyOf(const KeyValuePair &p) { return p.key; }
+static const KEY_T &KeyOf(const KEY_T &k) { return k; }
+static const KEY_T &KeyOf(const BTreeMessage &m) { return m.key; }
+
+// Orders indices into a vector of keys or pairs by key
+template <class T>
+struct BatchOrder {
+  const vector<T> &items;
+  SIZE_T keysize;
+
+  BatchOrder(const vector<T> &i, const SIZE_T k) : items(i), keysize(k) {}
+
+  bool operator()(const SIZE_T a, const SIZE_T b) const {
+    return CompareBatchKeys(KeyOf(items[a]),KeyOf(items[b]),keysize)<0;
+  }
+};
+
+// Of the sorted keys order[begin..end), finds those that go under
+// the same child of interior node b as the first: they are
+// order[begin..k) for the k returned, and the child is ptr offset
+template <class T>
+static SIZE_T ChildRun(const BTreeNode &b, const vector<T> &items, const vector<SIZE_T> &order,
+		       const SIZE_T begin, const SIZE_T end, SIZE_T &offset)
+{
+  SIZE_T k;
+
+  // the keys up to and including the separator at offset all
+  // belong under the ptr immediately previous to it
+  b.SearchKey(KeyOf(items[order[begin]]), offset);
+  for (k=begin+1; k<end; k++) { 
+    if (offset<b.info.numkeys && b.CompareKey(offset, KeyOf(items[order[k]]))<0) { 
+      break;
+    }
+  }
+  return k;
+}
+
+
+ERROR_T BTreeIndex::InsertBatch(const vector<KeyValuePair> &pairs, vector<ERROR_T> &results)
+{
+  ERROR_T rc;
+
+  BeginChange();
+  rc = EndChange(InsertBatchInternal(pairs, results));
+  for (SIZE_T i=0; i<pairs.size(); i++) { 
+    keycache.Forget(pairs[i].key);
+  }
+  return rc;
+}
+
+
+ERROR_T BTreeIndex::InsertBatchInternal(const vector<KeyValuePair> &pairs, vector<ERROR_T> &results)
+{
+  vector<SIZE_T> order;
+  vector<KEY_T> upkeys;
+  vector<SIZE_T> upnodes;
+  BTreeNode root;
+  SIZE_T i;
+  ERROR_T rc;
+
+  results.assign(pairs.size(), ERROR_NOERROR);
+  if (pairs.empty()) { 
+    return ERROR_NOERROR;
+  }
+
+  if (multi) { 
+    // a repeated key is just another value for its list
+    rc = ERROR_NOERROR;
+    for (i=0; i<pairs.size(); i++) { 
+      results[i] = InsertPosting(pairs[i].key, pairs[i].value, false);
+      if (results[i]==ERROR_CONFLICT) { 
+	rc = ERROR_CONFLICT;
+      } else if (results[i]) { 
+	return results[i];
+      }
+    }
+    return rc;
+  }
+
+  // a key that repeats within the batch goes in the first time only
+  for (i=0; i<pairs.size(); i++) { 
+    order.push_back(i);
+  }
+  stable_sort(order.begin(), order.end(), BatchOrder<KeyValuePair>(pairs, superblock.info.keysize));
+  SIZE_T n=1;
+  for (i=1; i<order.size(); i++) { 
+    if (CompareBatchKeys(pairs[order[i]].key, pairs[order[n-1]].key, superblock.info.keysize)==0) { 
+      results[order[i]] = ERROR_CONFLICT;
+    } else {
+      order[n++] = order[i];
+    }
+  }
+  order.resize(n);
+
+  // the keys go in the filter first, as in InsertInternal
+  vector<bool> had(order.size());
+  for (i=0; i<order.size(); i++) { 
+    had[i] = filter.Add(pairs[order[i]].key);
+  }
+
+  if (buffered) { 
+    // the keys not already there go into the root's buffer together.
+    // Only those the filter had before can be.
+    vector<KEY_T> keys;
+    vector<VALUE_T> values;
+    vector<ERROR_T> there;
+    vector<BTreeMessage> msgs;
+
+    for (i=0; i<order.size(); i++) { 
+      filter.Count(had[i]);
+      if (had[i]) { 
+	keys.push_back(pairs[order[i]].key);
+      }
+    }
+    if (!keys.empty()) { 
+      rc = MultiLookupInternal(superblock.info.rootnode, keys, values, there);
+      if (rc && rc!=ERROR_NONEXISTENT) { return rc; }
+    }
+    SIZE_T j=0;
+    for (i=0; i<order.size(); i++) { 
+      if (had[i] && filter.Settle(there[j++])==ERROR_NOERROR) { 
+	results[order[i]] = ERROR_CONFLICT;
+      } else {
+	msgs.push_back(BTreeMessage(BTREE_MSG_PUT, pairs[order[i]].key, pairs[order[i]].value));
+      }
+    }
+    rc = SendMessages(msgs);
+    if (rc) { return rc; }
+    return msgs.size()<order.size() || n<pairs.size() ? ERROR_CONFLICT : ERROR_NOERROR;
+  }
+
+  rc = root.Unserialize(buffercache, superblock.info.rootnode);
+  if (rc) { return rc; }
+  if (root.info.numkeys==0) { 
+    rc = ShadowNode(superblock.info.rootnode);
+    if (rc) { return rc; }
+  }
+  rc = InitRoot(root, pairs[order[0]].key);
+  if (rc) { return rc; }
+
+  rc = InsertBatchHelper(superblock.info.rootnode, pairs, order, 0, order.size(),
+			 0, 0, results, upkeys, upnodes);
+  if (rc) { return rc; }
+  rc = GrowRoot(upkeys, upnodes);
+  if (rc) { return rc; }
+
+  for (i=0; i<results.size(); i++) { 
+    if (results[i]) { 
+      return ERROR_CONFLICT;
+    }
+  }
+  return ERROR_NOERROR;
+}
+
+
+//
+// As in SplitRoot the root stays put: what is left of it moves to a
+// new interior node, and the root is rewritten over that and the
+// pieces split off beside it, which may take more than one level
+//
+ERROR_T BTreeIndex::GrowRoot(vector<KEY_T> &upkeys, vector<SIZE_T> &upnodes)
+{
+  vector<KEY_T> keys;
+  vector<VALUE_T> novals;
+  vector<SIZE_T> ptrs;
+  BTreeNode root;
+  SIZE_T lhs;
+  ERROR_T rc;
+
+  while (!upkeys.empty()) { 
+    rc = root.Unserialize(buffercache, superblock.info.rootnode);
+    if (rc) { return rc; }
+    rc = AllocateNode(lhs);
+    if (rc) { return rc; }
+    root.info.nodetype = BTREE_INTERIOR_NODE;
+    rc = root.Serialize(buffercache, lhs);
+    if (rc) { return rc; }
+    root.info.nodetype = BTREE_ROOT_NODE;
+    rc = root.SetRightLink(0);
+    if (rc) { return rc; }
+
+    keys.swap(upkeys);
+    ptrs.assign(1, lhs);
+    ptrs.insert(ptrs.end(), upnodes.begin(), upnodes.end());
+    upkeys.clear();
+    upnodes.clear();
+    rc = WriteBatchNodes(superblock.info.rootnode, root, keys, novals, ptrs, 0, 0, upkeys, upnodes);
+    if (rc) { return rc; }
+  }
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeIndex::InsertBatchHelper(SIZE_T &node,
+				      const vector<KeyValuePair> &pairs,
+				      const vector<SIZE_T> &order,
+				      const SIZE_T begin, const SIZE_T end,
+				      const KEY_T *lo, const KEY_T *hi,
+				      vector<ERROR_T> &results,
+				      vector<KEY_T> &upkeys, vector<SIZE_T> &upnodes)
+{
+  BTreeNode b;
+  vector<KEY_T> keys;
+  vector<VALUE_T> vals;
+  vector<SIZE_T> ptrs;
+  KEY_T key, lokey, hikey;
+  VALUE_T value;
+  SIZE_T i, j, k, offset, ptr, child;
+  ERROR_T rc;
+
+  rc = b.Unserialize(buffercache, node);
+  if (rc) { return rc; }
+
+  switch (b.info.nodetype) { 
+  case BTREE_ROOT_NODE:
+  case BTREE_INTERIOR_NODE: {
+    vector<KEY_T> addkeys;     // split off by the children, in key order
+    vector<SIZE_T> addnodes;
+    vector<SIZE_T> addafter;   // the child each one goes to the right of
+    bool moved=false;          // a child was shadowed (see ShadowNode)
+
+    if (b.info.numkeys==0) { 
+      return ERROR_NONEXISTENT;
+    }
+
+    for (j=begin; j<end; j=k) { 
+      k = ChildRun(b, pairs, order, j, end, offset);
+      rc = b.GetPtr(offset, ptr);
+      if (rc) { return rc; }
+
+      const KEY_T *clo=lo, *chi=hi;
+      if (offset>0) { 
+	rc = b.GetKey(offset-1, lokey);
+	if (rc) { return rc; }
+	clo = &lokey;
+      }
+      if (offset<b.info.numkeys) { 
+	rc = b.GetKey(offset, hikey);
+	if (rc) { return rc; }
+	chi = &hikey;
+      }
+
+      child = ptr;
+      rc = InsertBatchHelper(ptr, pairs, order, j, k, clo, chi, results, addkeys, addnodes);
+      if (rc) { return rc; }
+      addafter.resize(addkeys.size(), offset);
+      if (ptr!=child) { 
+	rc = b.SetPtr(offset, ptr);
+	if (rc) { return rc; }
+	moved = true;
+      }
+    }
+
+    if (addkeys.empty() && !moved) { 
+      return ERROR_NOERROR;
+    }
+    rc = ShadowNode(node);
+    if (rc) { return rc; }
+
+    SIZE_T add=0;
+    for (k=0; k<addkeys.size(); k++) { 
+      add += b.GetRecordSize(addkeys[k].length);
+    }
+    if (!IsFull(b, b.GetNumUsedBytes()+add)) { 
+      for (k=0; k<addkeys.size(); k++) { 
+	b.SearchKey(addkeys[k], offset);
+	rc = b.InsertKeyPtr(offset, addkeys[k], addnodes[k]);
+	if (rc) { return rc; }
+      }
+      return b.Serialize(buffercache, node);
+    }
+
+    // ptr0 key0 ptr1 ... with the new nodes spliced in after the
+    // children they split from
+    rc = b.GetPtr(0, ptr);
+    if (rc) { return rc; }
+    ptrs.push_back(ptr);
+    for (i=0, k=0; i<=b.info.numkeys; i++) { 
+      for (; k<addkeys.size() && addafter[k]==i; k++) { 
+	keys.push_back(addkeys[k]);
+	ptrs.push_back(addnodes[k]);
+      }
+      if (i<b.info.numkeys) { 
+	rc = b.GetKey(i, key);
+	if (rc) { return rc; }
+	rc = b.GetPtr(i+1, ptr);
+	if (rc) { return rc; }
+	keys.push_back(key);
+	ptrs.push_back(ptr);
+      }
+    }
+    return WriteBatchNodes(node, b, keys, vals, ptrs, lo, hi, upkeys, upnodes);
+  }
+  case BTREE_LEAF_NODE: {
+    SIZE_T add=0;
+
+    for (j=begin; j<end; j++) { 
+      if (b.SearchKey(pairs[order[j]].key, offset)) { 
+	results[order[j]] = ERROR_CONFLICT;
+      } else {
+	add += b.GetRecordSize(pairs[order[j]].key.length, pairs[order[j]].value.length);
+      }
+    }
+    if (add==0) { 
+      return ERROR_NOERROR;
+    }
+    rc = ShadowNode(node);
+    if (rc) { return rc; }
+
+    if (!IsFull(b, b.GetNumUsedBytes()+add)) { 
+      // no split, so the pairs can go straight in
+      for (j=begin; j<end; j++) { 
+	if (results[order[j]]) { 
+	  continue;
+	}
+	b.SearchKey(pairs[order[j]].key, offset);
+	rc = b.InsertKeyVal(offset, pairs[order[j]].key, pairs[order[j]].value);
+	if (rc) { return rc; }
+      }
+      return b.Serialize(buffercache, node);
+    }
+
+    // merge the node's pairs with the batch's
+    for (i=0, j=begin; i<b.info.numkeys || j<end; ) { 
+      if (j<end && results[order[j]]) { 
+	j++;
+      } else if (j>=end || (i<b.info.numkeys && b.CompareKey(i, pairs[order[j]].key)<0)) { 
+	if ((rc=b.GetKey(i, key)) || (rc=b.GetVal(i, value))) { 
+	  return rc;
+	}
+	keys.push_back(key);
+	vals.push_back(value);
+	i++;
+      } else {
+	keys.push_back(pairs[order[j]].key);
+	vals.push_back(pairs[order[j]].value);
+	j++;
+      }
+    }
+
+    // the leaf chain carries on from the last piece
+    rc = b.GetPtr(0, ptr);
+    if (rc) { return rc; }
+    ptrs.push_back(ptr);
+    return WriteBatchNodes(node, b, keys, vals, ptrs, lo, hi, upkeys, upnodes);
+  }
+  default:
+    return ERROR_INSANE;
+  }
+}
+
+
+//
+// Empties b and gives it the fences lo and hi, as each node
+// WriteBatchNodes fills starts out: every key between them shares
+// their common prefix, so a prefix compressed node can leave it out
+// from the start
+//
+static ERROR_T StartBatchNode(BTreeNode &b, const KEY_T *lo, const KEY_T *hi)
+{
+  ClearNode(b);
+  return b.SetFences(lo, hi);
+}
+
+
+//
+// Where WriteBatchNodes cuts keys into pieces, given b, a node
+// started by StartBatchNode.  cuts gets the index of the key each
+// piece after the first begins with, which an interior node passes
+// up rather than keeping.  Every piece is sized as b is, before
+// anything is in it, so each record fits where it is put.
+//
+static void PlanBatchNodes(const BTreeNode &b,
+			   const vector<KEY_T> &keys, const vector<VALUE_T> &vals,
+			   vector<SIZE_T> &cuts)
+{
+  bool isleaf = b.info.nodetype==BTREE_LEAF_NODE;
+  SIZE_T n=keys.size();
+  SIZE_T base=b.GetNumUsedBytes();
+  SIZE_T i, total, pieces, piece, used, sofar, count;
+
+  total = 0;
+  for (i=0; i<n; i++) { 
+    total += b.GetRecordSize(keys[i].length, isleaf ? vals[i].length : 0);
+  }
+
+  // as few pieces as will do, found by filling them up one by one
+  pieces = 1;
+  if (IsFull(b, base+total)) { 
+    used = base;
+    for (i=0; i<n; i++) { 
+      if (used>base && !BulkFits(b, used, keys[i].length, isleaf ? vals[i].length : 0, 1.0)) { 
+	pieces++;
+	used = base;
+	if (!isleaf) { 
+	  continue;
+	}
+      }
+      used += b.GetRecordSize(keys[i].length, isleaf ? vals[i].length : 0);
+    }
+    if (pieces<2) { 
+      pieces = 2;
+    }
+  }
+
+  cuts.clear();
+  used = base;
+  piece = 0;
+  sofar = 0;
+  count = 0;
+  for (i=0; i<n; i++) { 
+    SIZE_T rec = b.GetRecordSize(keys[i].length, isleaf ? vals[i].length : 0);
+
+    // start a new piece once this one has its share, or has no room;
+    // an interior node needs a key, so don't leave the next one none
+    if (count>0 && (isleaf || i+1<n) &&
+	((piece+1<pieces && pieces*(2*sofar+rec) > 2*(piece+1)*total) ||
+	 !BulkFits(b, used, keys[i].length, isleaf ? vals[i].length : 0, 1.0))) { 
+      cuts.push_back(i);
+      used = base;
+      piece++;
+      count = 0;
+      if (!isleaf) { 
+	sofar += rec;
+	continue;
+      }
+    }
+    sofar += rec;
+    used += rec;
+    count++;
+  }
+}
+
+
+//
+// Writes the contents of node, now keys and either vals (a leaf,
+// ptrs holding just the next leaf) or ptrs (interior), back out.  If
+// they make node full, they are spread evenly over node and as many
+// new nodes after it as it takes, and each new node and the key that
+// separates it from the one before are added to upnodes and upkeys
+// for the parent.  b is node as read, lo and hi its fences.  The
+// first new node goes in block spare, if it isn't 0.
+//
+ERROR_T BTreeIndex::WriteBatchNodes(const SIZE_T node, BTreeNode &b,
+				    const vector<KEY_T> &keys, const vector<VALUE_T> &vals,
+				    const vector<SIZE_T> &ptrs,
+				    const KEY_T *lo, const KEY_T *hi,
+				    vector<KEY_T> &upkeys, vector<SIZE_T> &upnodes,
+				    const SIZE_T spare)
+{
+  bool isleaf = b.info.nodetype==BTREE_LEAF_NODE;
+  BTreeNode more(isleaf ? BTREE_LEAF_NODE : BTREE_INTERIOR_NODE,
+		 b.info.keysize,
+		 b.info.valuesize,
+		 b.info.blocksize,
+		 b.info.GetFormatAndFlags());
+  BTreeNode *cur=&b;
+  SIZE_T n=keys.size();
+  SIZE_T firstup=upkeys.size();
+  SIZE_T block=node, next, link;
+  SIZE_T i, piece;
+  vector<SIZE_T> cuts;
+  ERROR_T rc;
+
+  // where the last piece links to, for interior B-link nodes (leaves
+  // get theirs from ptrs[0])
+  rc = b.GetRightLink(link);
+  if (rc) { return rc; }
+  rc = StartBatchNode(b, lo, hi);
+  if (rc) { return rc; }
+  // cutting off a piece compresses it with its own fences, which
+  // changes its record size, so the pieces are all worked out first
+  PlanBatchNodes(b, keys, vals, cuts);
+
+  rc = cur->SetPtr(0, ptrs[0]);
+  if (rc) { return rc; }
+  piece = 0;
+
+  for (i=0; i<n; i++) { 
+    if (piece<cuts.size() && i==cuts[piece]) { 
+      // a leaf passes up a separator, an interior node passes up this key
+      KEY_T sep(isleaf ? keys[i-1] : keys[i]);
+
+      if (isleaf &&
+	  NodeFormatFor(superblock.info.format,BTREE_INTERIOR_NODE)==BTREE_FORMAT_SLOTTED) { 
+	TruncateSeparator(sep, keys[i], superblock.info.keysize);
+      }
+      if (spare && upkeys.size()==firstup) { 
+	next = spare;
+      } else {
+	rc = AllocateNode(next);
+	if (rc) { return rc; }
+      }
+      rc = cur->SetRightLink(next);
+      if (rc) { return rc; }
+      upkeys.push_back(sep);
+      upnodes.push_back(next);
+      rc = cur->SetFences(piece>0 ? &upkeys[firstup+piece-1] : lo, &upkeys.back());
+      if (rc) { return rc; }
+      rc = cur->Serialize(buffercache, block);
+      if (rc) { return rc; }
+
+      cur = &more;
+      rc = StartBatchNode(more, lo, hi);
+      if (rc) { return rc; }
+      block = next;
+      piece++;
+      rc = more.SetPtr(0, isleaf ? ptrs[0] : ptrs[i+1]);
+      if (rc) { return rc; }
+      if (!isleaf) { 
+	continue;
+      }
+    }
+
+    if (isleaf) { 
+      rc = cur->InsertKeyVal(cur->info.numkeys, keys[i], vals[i]);
+    } else {
+      rc = cur->InsertKeyPtr(cur->info.numkeys, keys[i], ptrs[i+1]);
+    }
+    if (rc) { return rc; }
+  }
+
+  rc = cur->SetFences(piece>0 ? &upkeys[firstup+piece-1] : lo, hi);
+  if (rc) { return rc; }
+  if (!isleaf) { 
+    rc = cur->SetRightLink(link);
+    if (rc) { return rc; }
+  }
+  return cur->Serialize(buffercache, block);
+}
+
+
+//
+// Batched lookups
+//
+// The keys are sorted and looked up a level at a time, so each node
+// on their paths is read once, however many of them pass through
+// it.  The nodes of each level are fetched a half cache at a time
+// with PrefetchBlocks, which reads runs of adjacent blocks (the
+// leaves of a bulk loaded tree, say) with a single disk request.
+//
+struct LookupRange {
+  SIZE_T node;
+  SIZE_T begin, end;   // the sorted keys that lead to node
+
+  LookupRange(const SIZE_T n, const SIZE_T b, const SIZE_T e) : node(n), begin(b), end(e) {}
+};
+
+
+ERROR_T BTreeIndex::MultiLookup(const vector<KEY_T> &keys, vector<VALUE_T> &values,
+				vector<ERROR_T> &results)
+{
+  TurnHolder turn(TurnMutex());
+  SnapshotHolder snap(*this);
+  VALUE_T list;
+  ERROR_T rc;
+
+  if (filter.IsOn()) { 
+    // only the keys the filter may have go down the tree
+    vector<KEY_T> maybe;
+    vector<SIZE_T> where;    // of each of them in keys
+    vector<VALUE_T> found;
+    vector<ERROR_T> there;
+
+    for (SIZE_T i=0; i<keys.size(); i++) { 
+      if (filter.MayHold(keys[i])) { 
+	maybe.push_back(keys[i]);
+	where.push_back(i);
+      }
+    }
+    rc = MultiLookupInternal(snap.root, maybe, found, there);
+    if (rc && rc!=ERROR_NONEXISTENT) { return rc; }
+    bool missing = rc==ERROR_NONEXISTENT || maybe.size()<keys.size();
+    values.resize(keys.size());
+    results.assign(keys.size(), ERROR_NONEXISTENT);
+    for (SIZE_T j=0; j<maybe.size(); j++) { 
+      results[where[j]] = filter.Settle(there[j]);
+      if (there[j]==ERROR_NOERROR) { 
+	rc = values[where[j]].Resize(found[j].length,false);
+	if (rc) { return rc; }
+	memcpy(values[where[j]].data,found[j].data,found[j].length);
+      }
+    }
+    rc = missing ? ERROR_NONEXISTENT : ERROR_NOERROR;
+  } else {
+    rc = MultiLookupInternal(snap.root, keys, values, results);
+  }
+  if (!multi || (rc && rc!=ERROR_NONEXISTENT)) { 
+    return rc;
+  }
+  // what was found is each key's posting list
+  for (SIZE_T i=0; i<keys.size(); i++) { 
+    if (results[i]) { 
+      continue;
+    }
+    ERROR_T rc2 = list.Resize(values[i].length,false);
+    if (rc2) { return rc2; }
+    memcpy(list.data,values[i].data,list.length);
+    rc2 = FirstPosting(list,values[i]);
+    if (rc2) { return rc2; }
+  }
+  return rc;
+}
+
+
+//
+// In a buffered tree a key is settled by the first change to it on
+// the way down, and goes no further
+//
+ERROR_T BTreeIndex::MultiLookupInternal(const SIZE_T root, const vector<KEY_T> &keys,
+					vector<VALUE_T> &values, vector<ERROR_T> &results)
+{
+  vector<SIZE_T> order, blocks;
+  vector<LookupRange> level, below;
+  vector<bool> settled(keys.size(), false);   // by place in order
+  SIZE_T window = buffercache->GetCacheSize()/2;
+  BTreeNode b;
+  BTreeMessage m;
+  SIZE_T i, j, k, f, offset, ptr;
+  ERROR_T rc;
+
+  values.resize(keys.size());
+  results.assign(keys.size(), ERROR_NONEXISTENT);
+  if (keys.empty()) { 
+    return ERROR_NOERROR;
+  }
+  if (window<1) { 
+    window = 1;
+  }
+
+  for (i=0; i<keys.size(); i++) { 
+    order.push_back(i);
+  }
+  sort(order.begin(), order.end(), BatchOrder<KEY_T>(keys, superblock.info.keysize));
+
+  level.push_back(LookupRange(root, 0, keys.size()));
+  while (!level.empty()) { 
+    below.clear();
+    for (f=0; f<level.size(); f++) { 
+      if (f%window==0 && level.size()>1) { 
+	blocks.clear();
+	for (i=f; i<level.size() && i<f+window; i++) { 
+	  blocks.push_back(level[i].node);
+	}
+	// only a hint, a cache that can't take them all is fine
+	buffercache->PrefetchBlocks(blocks);
+      }
+
+      rc = b.Unserialize(buffercache, level[f].node);
+      if (rc) { return rc; }
+
+      switch (b.info.nodetype) { 
+      case BTREE_ROOT_NODE:
+      case BTREE_INTERIOR_NODE:
+	if (b.info.numkeys==0) { 
+	  // an empty tree
+	  break;
+	}
+	for (j=level[f].begin; j<level[f].end && b.GetBufferSize()>0; j++) { 
+	  if (settled[j]) { 
+	    continue;
+	  }
+	  rc = b.FindMessage(keys[order[j]], m);
+	  if (rc==ERROR_NONEXISTENT) { 
+	    continue;
+	  }
+	  if (rc) { return rc; }
+	  if (m.op==BTREE_MSG_PUT) { 
+	    values[order[j]] = m.value;
+	    results[order[j]] = ERROR_NOERROR;
+	  }
+	  settled[j] = true;
+	}
+	for (j=level[f].begin; j<level[f].end; j=k) { 
+	  k = ChildRun(b, keys, order, j, level[f].end, offset);
+	  for (i=j; i<k && settled[i]; i++) { 
+	  }
+	  if (i==k) { 
+	    // nothing left to find down there
+	    continue;
+	  }
+	  rc = b.GetPtr(offset, ptr);
+	  if (rc) { return rc; }
+	  below.push_back(LookupRange(ptr, j, k));
+	}
+	break;
+      case BTREE_LEAF_NODE:
+	for (j=level[f].begin; j<level[f].end; j++) { 
+	  if (!settled[j] && b.SearchKey(keys[order[j]], offset)) { 
+	    rc = b.GetVal(offset, values[order[j]]);
+	    if (rc) { return rc; }
+	    results[order[j]] = ERROR_NOERROR;
+	  }
+	}
+	break;
+      default:
+	return ERROR_INSANE;
+      }
+    }
+    level.swap(below);
+  }
+
+  for (i=0; i<results.size(); i++) { 
+    if (results[i]) { 
+      return ERROR_NONEXISTENT;
+    }
+  }
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeIndex::Update(const KEY_T &key, const VALUE_T &value)
+{
+  VALUE_T v = value;
+  ERROR_T rc;
+
+  if (multi) { 
+    // there's no one value to update
+    return ERROR_UNIMPL;
+  }
+  if (!filter.MayHold(key)) { 
+    return ERROR_NONEXISTENT;
+  }
+  if (specialized && fixedlookup && !concurrent && !cow && key.length>=superblock.info.keysize) { 
+    rc = filter.Settle(fixedlookup(buffercache, superblock.info.rootnode, BTREE_OP_UPDATE, key, v));
+  } else {
+    BeginChange();
+    rc = filter.Settle(EndChange(LookupOrUpdateInternal(superblock.info.rootnode, BTREE_OP_UPDATE, key, v)));
+  }
+  keycache.Forget(key);
+  return rc;
+}
+
+  
+//
+// Deletes
+//
+// A node that is left less than a quarter used, well under the third
+// each half of a split starts with, is rebalanced with a sibling.
+// The two are merged if they fit in one node and their contents are
+// spread evenly over both otherwise, so a node that has just split
+// doesn't merge straight back.  The right one of the pair always
+// goes into the left, so only the left leaf's chain link changes,
+// and a right node that is no longer needed is freed.  When the
+// root is left with a single child, the child moves up into the
+// root block and the tree gets shorter.
+//
+static bool IsUnderfull(const BTreeNode &b, const SIZE_T used)
+{
+  return 4 * used < b.info.GetNumDataBytes();
+}
+
+
+// A node that a delete below can't leave underfull, nor full once
+// rebalancing its children changes a separator, so it stops any
+// rebalance
+static bool SafeForDelete(const BTreeNode &b)
+{
+  SIZE_T used = b.GetNumUsedBytes();
+  SIZE_T record = b.GetRecordSize(b.info.keysize, b.info.valuesize);
+
+  return used >= record && !IsUnderfull(b, used - record) && !IsFull(b, used + record);
+}
+
+
+//
+// Concurrent deletes, like inserts, first try with only the leaf
+// latched exclusively, and go down again latching exclusively if
+// the leaf would be left underfull.
+//
+ERROR_T BTreeIndex::Delete(const KEY_T &key)
+{
+  ERROR_T rc;
+
+  if (!filter.MayHold(key)) { 
+    return ERROR_NONEXISTENT;
+  }
+  BeginChange();
+  rc = filter.Settle(EndChange(multi ? DeletePosting(key, 0) : DeleteInternal(key)));
+  keycache.Forget(key);
+  return rc;
+}
+
+
+ERROR_T BTreeIndex::Delete(const KEY_T &key, const VALUE_T &value)
+{
+  if (!multi) { 
+    return ERROR_UNIMPL;
+  }
+  ERROR_T rc;
+
+  if (!filter.MayHold(key)) { 
+    return ERROR_NONEXISTENT;
+  }
+  BeginChange();
+  rc = EndChange(DeletePosting(key, &value));
+  keycache.Forget(key);
+  return rc;
+}
+
+
+ERROR_T BTreeIndex::DeleteInternal(const KEY_T &key)
+{
+  BTreePath path(buffercache);
+  BTreeNode root;
+  SIZE_T ptr;
+  bool found;
+  ERROR_T rc;
+
+  if (buffered) { 
+    VALUE_T old;
+
+    rc = LookupBuffered(superblock.info.rootnode, key, old);
+    if (rc) { return rc; }
+    return SendMessages(vector<BTreeMessage>(1, BTreeMessage(BTREE_MSG_DELETE, key, old)));
+  }
+
+  if (concurrent && !cow) { 
+    path.SetLatching(LeafLatching(true));
+    rc = path.Descend(superblock.info.rootnode, &key, found);
+    if (rc) { return rc; }
+    if (!found) { 
+      return ERROR_NONEXISTENT;
+    }
+    BTreePathEntry &leaf = path.Leaf();
+    SIZE_T used = leaf.b.GetNumUsedBytes();
+    SIZE_T record = leaf.b.GetRecordSize(leaf.b.info.keysize, leaf.b.info.valuesize);
+    if (used >= record && !IsUnderfull(leaf.b, used - record)) { 
+      rc = leaf.b.DeleteKeyVal(leaf.offset);
+      if (rc) { return rc; }
+      return leaf.b.Serialize(buffercache, leaf.node);
+    }
+    path.Clear();
+    path.SetLatching(BTREE_LATCH_WRITE, SafeForDelete);
+  }
+
+  rc = path.Descend(superblock.info.rootnode, &key, found);
+  if (rc) { return rc; }
+  if (!found) { 
+    return ERROR_NONEXISTENT;
+  }
+  rc = ShadowPath(path);
+  if (rc) { return rc; }
+
+  BTreePathEntry &leaf = path.Leaf();
+  rc = leaf.b.DeleteKeyVal(leaf.offset);
+  if (rc) { return rc; }
+  rc = RebalanceUp(path);
+  if (rc) { return rc; }
+  if (path.GetTop()>0) { 
+    // the root was let go, so nothing reached it
+    return ERROR_NOERROR;
+  }
+  // keep only the root, which may now have a single child
+  while (path.GetDepth()>1) { 
+    path.Pop();
+  }
+
+  rc = root.Unserialize(buffercache, superblock.info.rootnode);
+  if (rc) { return rc; }
+
+  // a root with no keys left has a single child
+  while (root.info.numkeys==0) { 
+    rc = root.GetPtr(0, ptr);
+    if (rc) { return rc; }
+    rc = path.Push(ptr);
+    if (rc) { return rc; }
+    BTreeNode &child = path.Leaf().b;
+
+    if (child.info.nodetype==BTREE_LEAF_NODE) { 
+      // the last two leaves only merge once both are empty, and
+      // the tree is then empty again
+      rc = root.SetPtr(0, 0);
+      if (rc) { return rc; }
+      rc = root.Serialize(buffercache, superblock.info.rootnode);
+      if (rc) { return rc; }
+      return DeallocateNode(ptr);
+    }
+
+    child.info.nodetype = BTREE_ROOT_NODE;
+    child.info.rootnode = root.info.rootnode;
+    child.info.freelist = root.info.freelist;
+    rc = child.SetFences(0, 0);
+    if (rc) { return rc; }
+    rc = child.Serialize(buffercache, superblock.info.rootnode);
+    if (rc) { return rc; }
+    rc = DeallocateNode(ptr);
+    if (rc) { return rc; }
+    path.Pop();
+
+    rc = root.Unserialize(buffercache, superblock.info.rootnode);
+    if (rc) { return rc; }
+  }
+  return ERROR_NOERROR;
+}
+
+
+//
+// Writes back the nodes of path, from the leaf up, after a key has
+// gone from the leaf.  A node left underfull is rebalanced with a
+// sibling, which changes their parent, and one that rebalancing
+// below has left full is split; either way the parent is checked
+// next.
+//
+ERROR_T BTreeIndex::RebalanceUp(BTreePath &path)
+{
+  KEY_T splitkey;
+  KEY_T lokey, hikey;
+  const KEY_T *lo, *hi;
+  SIZE_T newnode;
+  SIZE_T used;
+  SIZE_T sibling;
+  ERROR_T rc;
+
+  for (SIZE_T level=path.GetDepth(); level-->0; ) { 
+    BTreePathEntry &e = path[level];
+
+    used = e.b.GetNumUsedBytes();
+    if (IsFull(e.b, used)) { 
+      if (e.b.info.nodetype==BTREE_ROOT_NODE) { 
+	return SplitRoot(e.b);
+      }
+      if (level==path.GetTop()) { 
+	return ERROR_INSANE;
+      }
+      rc = path.GetFences(level, lokey, hikey, lo, hi);
+      if (rc) { return rc; }
+      rc = SplitNode(e.b, e.node, splitkey, newnode, lo, hi);
+      if (rc) { return rc; }
+      BTreePathEntry &parent = path[level-1];
+      rc = parent.b.InsertKeyPtr(parent.offset, splitkey, newnode);
+      if (rc) { return rc; }
+      continue;
+    }
+
+    rc = e.b.Serialize(buffercache, e.node);
+    if (rc || level==0 || !IsUnderfull(e.b, used)) { 
+      return rc;
+    }
+    if (level==path.GetTop()) { 
+      return ERROR_INSANE;
+    }
+
+    // the node and the sibling to its left, or to its right if it
+    // is the first
+    BTreePathEntry &parent = path[level-1];
+    SIZE_T left = parent.offset>0 ? parent.offset-1 : 0;
+    rc = path.GetFences(level-1, lokey, hikey, lo, hi);
+    if (rc) { return rc; }
+    if (path.GetLatching()==BTREE_LATCH_NONE || parent.b.info.numkeys==0) { 
+      rc = Rebalance(parent.b, left, lo, hi);
+    } else {
+      // nobody gets to the sibling without going through parent
+      // first, but some may have done that already
+      rc = parent.b.GetPtr(parent.offset>0 ? left : 1, sibling);
+      if (rc) { return rc; }
+      buffercache->LatchBlock(sibling, true);
+      rc = Rebalance(parent.b, left, lo, hi);
+      buffercache->UnlatchBlock(sibling);
+    }
+    if (rc) { return rc; }
+  }
+  return ERROR_NOERROR;
+}
+
+
+//
+// Rebalances the children of parent either side of its key left,
+// merging them into the left one or evening them out.  lo and hi are
+// parent's fences.  parent is updated but not written.
+//
+// The pair is written back to the blocks it had, so parent ends up
+// with no more keys than before.  If it wouldn't fit in two nodes
+// (prefix compressed, it may take more room between the pair's
+// fences than between each node's own) it is left as it is.  That
+// is settled before anything is written.
+//
+ERROR_T BTreeIndex::Rebalance(BTreeNode &parent, const SIZE_T left,
+			      const KEY_T *lo, const KEY_T *hi)
+{
+  BTreeNode l, r;
+  vector<KEY_T> keys, upkeys;
+  vector<VALUE_T> vals;
+  vector<SIZE_T> ptrs, upnodes;
+  KEY_T key, sep, lokey, hikey;
+  VALUE_T value;
+  SIZE_T lnode, rnode, ptr, i;
+  vector<SIZE_T> cuts;
+  bool isleaf;
+  ERROR_T rc;
+
+  if ((rc=parent.GetPtr(left, lnode)) ||
+      (rc=parent.GetPtr(left+1, rnode)) ||
+      (rc=parent.GetKey(left, sep))) { 
+    return rc;
+  }
+  rc = l.Unserialize(buffercache, lnode);
+  if (rc) { return rc; }
+  rc = r.Unserialize(buffercache, rnode);
+  if (rc) { return rc; }
+  isleaf = l.info.nodetype==BTREE_LEAF_NODE;
+
+  // the root keeps its last two leaves until both are empty, a root
+  // with no keys is an empty tree
+  if (parent.info.nodetype==BTREE_ROOT_NODE && parent.info.numkeys==1 &&
+      isleaf && l.info.numkeys+r.info.numkeys>0) { 
+    return ERROR_NOERROR;
+  }
+
+  // everything in the pair in order, with the separator brought
+  // down between two interior nodes
+  for (i=0; i<l.info.numkeys; i++) { 
+    rc = l.GetKey(i, key);
+    if (rc) { return rc; }
+    keys.push_back(key);
+    if (isleaf) { 
+      rc = l.GetVal(i, value);
+      if (rc) { return rc; }
+      vals.push_back(value);
+    }
+  }
+  if (isleaf) { 
+    rc = r.GetPtr(0, ptr);
+    if (rc) { return rc; }
+    ptrs.push_back(ptr);
+  } else {
+    for (i=0; i<=l.info.numkeys; i++) { 
+      rc = l.GetPtr(i, ptr);
+      if (rc) { return rc; }
+      ptrs.push_back(ptr);
+    }
+    keys.push_back(sep);
+  }
+  for (i=0; i<r.info.numkeys; i++) { 
+    rc = r.GetKey(i, key);
+    if (rc) { return rc; }
+    keys.push_back(key);
+    if (isleaf) { 
+      rc = r.GetVal(i, value);
+      if (rc) { return rc; }
+      vals.push_back(value);
+    } else {
+      rc = r.GetPtr(i, ptr);
+      if (rc) { return rc; }
+      ptrs.push_back(ptr);
+    }
+  }
+  if (!isleaf) { 
+    rc = r.GetPtr(r.info.numkeys, ptr);
+    if (rc) { return rc; }
+    ptrs.push_back(ptr);
+  }
+
+  // the pair's fences
+  if (left>0) { 
+    rc = parent.GetKey(left-1, lokey);
+    if (rc) { return rc; }
+    lo = &lokey;
+  }
+  if (left+1<parent.info.numkeys) { 
+    rc = parent.GetKey(left+1, hikey);
+    if (rc) { return rc; }
+    hi = &hikey;
+  }
+
+  // only two nodes' worth will do
+  BTreeNode plan(l);
+  rc = StartBatchNode(plan, lo, hi);
+  if (rc) { return rc; }
+  PlanBatchNodes(plan, keys, vals, cuts);
+  if (cuts.size()>1) { 
+    return ERROR_NOERROR;
+  }
+
+  // a copy-on-write change writes the pair to blocks of its own
+  if ((rc=ShadowNode(lnode)) || (rc=ShadowNode(rnode)) ||
+      (rc=parent.SetPtr(left, lnode)) || (rc=parent.SetPtr(left+1, rnode))) { 
+    return rc;
+  }
+
+  // the pair links on to where the right one did
+  rc = r.GetRightLink(ptr);
+  if (rc) { return rc; }
+  rc = l.SetRightLink(ptr);
+  if (rc) { return rc; }
+
+  // the right node is reused if the two don't fit in one
+  rc = WriteBatchNodes(lnode, l, keys, vals, ptrs, lo, hi, upkeys, upnodes, rnode);
+  if (rc) { return rc; }
+  if (upnodes.empty()) { 
+    rc = DeallocateNode(rnode);
+    if (rc) { return rc; }
+  }
+
+  rc = parent.DeleteKeyPtr(left);
+  if (rc) { return rc; }
+  for (i=0; i<upkeys.size(); i++) { 
+    rc = parent.InsertKeyPtr(left+i, upkeys[i], upnodes[i]);
+    if (rc) { return rc; }
+  }
+  return ERROR_NOERROR;
+}
+
+//
+// Buffered trees
+//
+// A change goes into the root's buffer as a message, and stays there
+// until the buffer is full.  The messages for the child with the
+// most bytes of them then move down a level together (FlushHelper),
+// into the child's own buffer or, at the bottom, into the leaf,
+// which is rewritten once for the lot.  A node's messages are newer
+// than any below it, so a lookup goes by the first one it meets on
+// the way down.  Leaves left thin are rebalanced as their parent
+// flushes into them, but interior nodes are never merged, which
+// would mean merging their buffers too.
+//
+// A tree without buffers takes the same path for ApplyBatch: no
+// message fits in a node, so each goes straight down to its leaf.
+//
+ERROR_T BTreeIndex::ApplyBatch(const vector<BTreeMessage> &msgs)
+{
+  ERROR_T rc;
+
+  BeginChange();
+  rc = EndChange(ApplyBatchInternal(msgs));
+  for (SIZE_T i=0; i<msgs.size(); i++) { 
+    keycache.Forget(msgs[i].key);
+  }
+  return rc;
+}
+
+
+// The batch code doesn't shadow nodes, so a copy-on-write change
+// takes the messages one at a time
+ERROR_T BTreeIndex::ApplyBatchInternal(const vector<BTreeMessage> &msgs)
+{
+  SIZE_T i;
+  ERROR_T rc;
+
+  if (multi) { 
+    // a put would have to say whether it replaces the key's values
+    return ERROR_UNIMPL;
+  }
+  for (i=1; i<msgs.size(); i++) { 
+    if (CompareBatchKeys(msgs[i-1].key, msgs[i].key, superblock.info.keysize)>=0) { 
+      return ERROR_INSANE;
+    }
+  }
+  if (!cow) { 
+    for (i=0; i<msgs.size(); i++) { 
+      if (msgs[i].op==BTREE_MSG_PUT) { 
+	filter.Add(msgs[i].key);
+      }
+    }
+    return SendMessages(msgs);
+  }
+  for (i=0; i<msgs.size(); i++) { 
+    if (msgs[i].op==BTREE_MSG_PUT) { 
+      rc = InsertInternal(msgs[i].key, msgs[i].value, true);
+    } else {
+      rc = DeleteInternal(msgs[i].key);
+    }
+    if (rc && rc!=ERROR_NONEXISTENT) { 
+      return rc;
+    }
+  }
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeIndex::LookupBuffered(const SIZE_T node, const KEY_T &key, VALUE_T &value) const
+{
+  BTreeNode b;
+  BTreeMessage m;
+  SIZE_T ptr=node, offset;
+  ERROR_T rc;
+
+  for (;;) { 
+    rc = b.Pin(buffercache, ptr);
+    if (rc) { return rc; }
+
+    switch (b.info.nodetype) { 
+    case BTREE_ROOT_NODE:
+    case BTREE_INTERIOR_NODE:
+      if (b.info.numkeys==0) { 
+	// an empty tree
+	return ERROR_NONEXISTENT;
+      }
+      rc = b.FindMessage(key, m);
+      if (rc==ERROR_NOERROR) { 
+	if (m.op!=BTREE_MSG_PUT) { 
+	  return ERROR_NONEXISTENT;
+	}
+	value = m.value;
+	return ERROR_NOERROR;
+      }
+      if (rc!=ERROR_NONEXISTENT) { return rc; }
+      b.SearchKey(key, offset);
+      rc = b.GetPtr(offset, ptr);
+      if (rc) { return rc; }
+      break;
+    case BTREE_LEAF_NODE:
+      if (!b.SearchKey(key, offset)) { 
+	return ERROR_NONEXISTENT;
+      }
+      return b.GetVal(offset, value);
+    default:
+      return ERROR_INSANE;
+    }
+  }
+}
+
+
+ERROR_T BTreeIndex::SendMessages(const vector<BTreeMessage> &msgs)
+{
+  vector<KEY_T> upkeys;
+  vector<SIZE_T> upnodes;
+  BTreeNode root;
+  SIZE_T ptr;
+  bool thin;
+  ERROR_T rc;
+
+  if (msgs.empty()) { 
+    return ERROR_NOERROR;
+  }
+  rc = root.Unserialize(buffercache, superblock.info.rootnode);
+  if (rc) { return rc; }
+  rc = InitRoot(root, msgs[0].key);
+  if (rc) { return rc; }
+
+  rc = FlushHelper(superblock.info.rootnode, msgs, 0, 0, upkeys, upnodes, thin);
+  if (rc) { return rc; }
+  rc = GrowRoot(upkeys, upnodes);
+  if (rc) { return rc; }
+
+  // the last two leaves only merge once both are empty, and the
+  // tree is then empty again
+  rc = root.Unserialize(buffercache, superblock.info.rootnode);
+  if (rc || root.info.numkeys>0) { 
+    return rc;
+  }
+  rc = root.GetPtr(0, ptr);
+  if (rc) { return rc; }
+  rc = root.SetPtr(0, 0);
+  if (rc) { return rc; }
+  rc = root.Serialize(buffercache, superblock.info.rootnode);
+  if (rc) { return rc; }
+  return DeallocateNode(ptr);
+}
+
+
+//
+// Adds msgs, which are newer than any message node has, to node,
+// whose fences are lo and hi.  An interior node keeps them in its
+// buffer alongside its own if they fit, and flushes the child with
+// the most bytes of them until they do.  A leaf takes them in.
+// Either way node is written, or split, as in InsertBatchHelper, and
+// thin is set if it is a leaf left underfull.
+//
+ERROR_T BTreeIndex::FlushHelper(const SIZE_T node,
+				const vector<BTreeMessage> &msgs,
+				const KEY_T *lo, const KEY_T *hi,
+				vector<KEY_T> &upkeys, vector<SIZE_T> &upnodes,
+				bool &thin)
+{
+  BTreeNode b;
+  vector<KEY_T> keys;
+  vector<VALUE_T> vals;
+  vector<SIZE_T> ptrs;
+  KEY_T key, lokey, hikey;
+  VALUE_T value;
+  SIZE_T i, j, k, offset, ptr;
+  int c;
+  ERROR_T rc;
+
+  thin = false;
+  rc = b.Unserialize(buffercache, node);
+  if (rc) { return rc; }
+
+  switch (b.info.nodetype) { 
+  case BTREE_ROOT_NODE:
+  case BTREE_INTERIOR_NODE: {
+    vector<BTreeMessage> mine, all, kept;
+    vector<SIZE_T> order;
+    vector<KEY_T> addkeys;     // split off by the children
+    vector<SIZE_T> addnodes;
+    vector<SIZE_T> addafter;   // the child each one goes to the right of
+    vector<SIZE_T> thinleaves;
+    SIZE_T add=0, held=0;
+
+    if (b.info.numkeys==0) { 
+      return ERROR_NONEXISTENT;
+    }
+
+    // the node's messages and the new ones, in key order, a new one
+    // replacing the node's for the same key
+    rc = b.GetMessages(mine);
+    if (rc) { return rc; }
+    for (i=0, j=0; i<mine.size() || j<msgs.size(); ) { 
+      c = i>=mine.size() ? 1 : j>=msgs.size() ? -1 :
+	CompareBatchKeys(mine[i].key, msgs[j].key, superblock.info.keysize);
+      if (c<0) { 
+	all.push_back(mine[i++]);
+      } else {
+	all.push_back(msgs[j++]);
+	if (c==0) { 
+	  i++;
+	}
+      }
+    }
+
+    // order holds the messages still to keep, held their bytes
+    for (i=0; i<all.size(); i++) { 
+      order.push_back(i);
+      held += b.GetMessageSize(all[i]);
+    }
+
+    // once the children have split enough to split this node, it
+    // flushes everything, so that the pieces start out empty
+    while (held>b.GetBufferSize() || (!order.empty() && IsFull(b, b.GetNumUsedBytes()+add))) { 
+      SIZE_T best=0, bestend=0, bestoffset=0, bytes, most=0;
+      bool childthin;
+
+      for (j=0; j<order.size(); j=k) { 
+	k = ChildRun(b, all, order, j, order.size(), offset);
+	for (bytes=0, i=j; i<k; i++) { 
+	  bytes += b.GetMessageSize(all[order[i]]);
+	}
+	if (bytes>most) { 
+	  most = bytes;
+	  best = j;
+	  bestend = k;
+	  bestoffset = offset;
+	}
+	if (b.GetBufferSize()==0) { 
+	  // a node without a buffer keeps nothing, so any will do
+	  break;
+	}
+      }
+
+      const KEY_T *clo=lo, *chi=hi;
+      if (bestoffset>0) { 
+	rc = b.GetKey(bestoffset-1, lokey);
+	if (rc) { return rc; }
+	clo = &lokey;
+      }
+      if (bestoffset<b.info.numkeys) { 
+	rc = b.GetKey(bestoffset, hikey);
+	if (rc) { return rc; }
+	chi = &hikey;
+      }
+      rc = b.GetPtr(bestoffset, ptr);
+      if (rc) { return rc; }
+
+      vector<BTreeMessage> run;
+      for (i=best; i<bestend; i++) { 
+	run.push_back(all[order[i]]);
+      }
+      rc = FlushHelper(ptr, run, clo, chi, addkeys, addnodes, childthin);
+      if (rc) { return rc; }
+      addafter.resize(addkeys.size(), bestoffset);
+      if (childthin) { 
+	thinleaves.push_back(ptr);
+      }
+      order.erase(order.begin()+best, order.begin()+bestend);
+      held -= most;
+
+      for (add=0, k=0; k<addkeys.size(); k++) { 
+	add += b.GetRecordSize(addkeys[k].length);
+      }
+    }
+
+    for (i=0; i<order.size(); i++) { 
+      kept.push_back(all[order[i]]);
+    }
+    rc = b.SetMessages(kept);
+    if (rc) { return rc; }
+
+    if (IsFull(b, b.GetNumUsedBytes()+add)) { 
+      // ptr0 key0 ptr1 ... with the new nodes spliced in after the
+      // children they split from
+      rc = b.GetPtr(0, ptr);
+      if (rc) { return rc; }
+      ptrs.push_back(ptr);
+      for (i=0; i<=b.info.numkeys; i++) { 
+	for (k=0; k<addkeys.size(); k++) { 
+	  if (addafter[k]==i) { 
+	    keys.push_back(addkeys[k]);
+	    ptrs.push_back(addnodes[k]);
+	  }
+	}
+	if (i<b.info.numkeys) { 
+	  rc = b.GetKey(i, key);
+	  if (rc) { return rc; }
+	  rc = b.GetPtr(i+1, ptr);
+	  if (rc) { return rc; }
+	  keys.push_back(key);
+	  ptrs.push_back(ptr);
+	}
+      }
+      return WriteBatchNodes(node, b, keys, vals, ptrs, lo, hi, upkeys, upnodes);
+    }
+
+    for (k=0; k<addkeys.size(); k++) { 
+      b.SearchKey(addkeys[k], offset);
+      rc = b.InsertKeyPtr(offset, addkeys[k], addnodes[k]);
+      if (rc) { return rc; }
+    }
+
+    // an interior node keeps a key, and the root keeps its buffer
+    // empty should it lose its last, and a separator that changes
+    // must still fit
+    for (k=0; k<thinleaves.size(); k++) { 
+      if (b.info.numkeys<2 && (b.info.nodetype!=BTREE_ROOT_NODE || !kept.empty())) { 
+	break;
+      }
+      if (IsFull(b, b.GetNumUsedBytes()+b.GetRecordSize(b.info.keysize, b.info.valuesize))) { 
+	break;
+      }
+      for (offset=0; offset<=b.info.numkeys; offset++) { 
+	rc = b.GetPtr(offset, ptr);
+	if (rc) { return rc; }
+	if (ptr==thinleaves[k]) { 
+	  break;
+	}
+      }
+      if (offset>b.info.numkeys) { 
+	// merged into its sibling already
+	continue;
+      }
+      rc = Rebalance(b, offset>0 ? offset-1 : 0, lo, hi);
+      if (rc) { return rc; }
+    }
+    return b.Serialize(buffercache, node);
+  }
+  case BTREE_LEAF_NODE: {
+    bool changed=false;
+    SIZE_T firstup=upkeys.size();
+
+    // the leaf's pairs with the messages applied
+    for (i=0, j=0; i<b.info.numkeys || j<msgs.size(); ) { 
+      c = j>=msgs.size() ? -1 : i>=b.info.numkeys ? 1 : b.CompareKey(i, msgs[j].key);
+      if (c<0) { 
+	if ((rc=b.GetKey(i, key)) || (rc=b.GetVal(i, value))) { 
+	  return rc;
+	}
+	keys.push_back(key);
+	vals.push_back(value);
+	i++;
+	continue;
+      }
+      if (msgs[j].op==BTREE_MSG_PUT) { 
+	keys.push_back(msgs[j].key);
+	vals.push_back(msgs[j].value);
+	changed = true;
+      } else if (c==0) { 
+	changed = true;
+      }
+      if (c==0) { 
+	i++;
+      }
+      j++;
+    }
+    if (!changed) { 
+      return ERROR_NOERROR;
+    }
+
+    // the leaf chain carries on from the last piece
+    rc = b.GetPtr(0, ptr);
+    if (rc) { return rc; }
+    ptrs.push_back(ptr);
+    rc = WriteBatchNodes(node, b, keys, vals, ptrs, lo, hi, upkeys, upnodes);
+    if (rc) { return rc; }
+    thin = upkeys.size()==firstup && IsUnderfull(b, b.GetNumUsedBytes());
+    return ERROR_NOERROR;
+  }
   default:
-   // cout << "We can't be looking at anything other than a root, internal, or leaf" << endl;
     return ERROR_INSANE;
-    break;
-  }  
+  }
+}
+
+
+//
+// Takes the messages still buffered on path that belong in its leaf
+// into an unpinned copy of the leaf, which grows to hold them, for a
+// cursor to walk.  The copy is not to be written.
+//
+ERROR_T BTreeIndex::ApplyPending(BTreePath &path) const
+{
+  vector<BTreeMessage> pending, msgs;
+  vector<SIZE_T> order, keep;
+  KEY_T key;
+  VALUE_T value;
+  SIZE_T level, below, i, j, ptr, offset, extra;
+  int c;
+  ERROR_T rc;
+
+  // a message belongs in the leaf if it would be flushed along the
+  // path all the way down
+  for (level=0; level+1<path.GetDepth(); level++) { 
+    rc = path[level].b.GetMessages(msgs);
+    if (rc) { return rc; }
+    for (i=0; i<msgs.size(); i++) { 
+      for (below=level; below+1<path.GetDepth(); below++) { 
+	path[below].b.SearchKey(msgs[i].key, offset);
+	if (offset!=path[below].offset) { 
+	  break;
+	}
+      }
+      if (below+1==path.GetDepth()) { 
+	pending.push_back(msgs[i]);
+      }
+    }
+  }
+  if (pending.empty()) { 
+    return ERROR_NOERROR;
+  }
+
+  // the first for each key, from nearest the root, is the newest
+  for (i=0; i<pending.size(); i++) { 
+    order.push_back(i);
+  }
+  stable_sort(order.begin(), order.end(), BatchOrder<BTreeMessage>(pending, superblock.info.keysize));
+
+  BTreePathEntry &leaf = path.Leaf();
+  // room for the new pairs, and for keys that lose a common prefix
+  extra = (leaf.b.info.numkeys+order.size())*leaf.b.GetPrefixLength();
+  for (i=0; i<order.size(); i++) { 
+    const BTreeMessage &m = pending[order[i]];
+    if (!keep.empty() &&
+	CompareBatchKeys(m.key, pending[keep.back()].key, superblock.info.keysize)==0) { 
+      continue;
+    }
+    keep.push_back(order[i]);
+    if (m.op==BTREE_MSG_PUT) { 
+      extra += leaf.b.GetRecordSize(m.key.length, m.value.length);
+    }
+  }
 
-  return ERROR_INSANE;
+  BTreeNode copy(BTREE_LEAF_NODE,
+		 leaf.b.info.keysize,
+		 leaf.b.info.valuesize,
+		 leaf.b.info.blocksize+extra,
+		 leaf.b.info.GetFormatAndFlags());
+  if (copy.info.format==BTREE_FORMAT_SLOTTED &&
+      (SIZE_T)copy.info.blocksize>BTREE_SLOTTED_MAXBLOCKSIZE) { 
+    return ERROR_SIZE;
+  }
+  rc = leaf.b.GetPtr(0, ptr);
+  if (rc) { return rc; }
+  rc = copy.SetPtr(0, ptr);
+  if (rc) { return rc; }
+
+  for (i=0, j=0; i<leaf.b.info.numkeys || j<keep.size(); ) { 
+    const BTreeMessage *m = j<keep.size() ? &pending[keep[j]] : 0;
+
+    c = !m ? -1 : i>=leaf.b.info.numkeys ? 1 : leaf.b.CompareKey(i, m->key);
+    if (c<0) { 
+      if ((rc=leaf.b.GetKey(i, key)) || (rc=leaf.b.GetVal(i, value)) ||
+	  (rc=copy.InsertKeyVal(copy.info.numkeys, key, value))) { 
+	return rc;
+      }
+      i++;
+      continue;
+    }
+    if (m->op==BTREE_MSG_PUT) { 
+      rc = copy.InsertKeyVal(copy.info.numkeys, m->key, m->value);
+      if (rc) { return rc; }
+    }
+    if (c==0) { 
+      i++;
+    }
+    j++;
+  }
+
+  leaf.b.Unpin();
+  leaf.b = copy;
+  return ERROR_NOERROR;
 }
 
 
 
-bool BTreeIndex::NodeFull(const SIZE_T node){
-  
-  // Unserialize node pointer
-  BTreeNode b;
-  b.Unserialize(buffercache, node);
-  SIZE_T full;  
-
-  // Switch based on node type
-  // Consider root as interior node
-  // Interiors, check that total slots are less than 2/3 full
-  // Leafs, check that total slots are less than 2/3 full
-  switch(b.info.nodetype){
-    case BTREE_ROOT_NODE:
-    case BTREE_INTERIOR_NODE:
-	full = (2 / 3) * b.info.GetNumSlotsAsInterior();
-	return (full <= b.info.numkeys);
-    case BTREE_LEAF_NODE:
-	full = (2 / 3) * b.info.GetNumSlotsAsLeaf();
-	return (full <= b.info.numkeys);
+//
+// Posting lists
+//
+// A non-unique tree keeps each key's values as a posting list (see
+// btree_ds.h) in the key's place in its leaf.  While the list is
+// short a change to it writes only the leaf.  Once it has outgrown
+// the leaf, it is a chain of overflow blocks, and a change reads the
+// chain up to the block the value belongs in and writes that block,
+// splitting it first if it is full.  A block left empty is freed,
+// one that would fit in the block before it is merged into it, and
+// the list moves back into the leaf once it is down to half of what
+// the leaf can hold, so a value coming and going doesn't keep
+// moving it.
+//
+static SIZE_T PostingCount(const VALUE_T &list)
+{
+  SIZE_T n;
 
-  }
-  return false;
+  memcpy(&n,list.data,sizeof(SIZE_T));
+  return n;
+}
+
+
+static SIZE_T PostingFirst(const VALUE_T &list)
+{
+  SIZE_T n;
 
+  memcpy(&n,list.data+sizeof(SIZE_T),sizeof(SIZE_T));
+  return n;
 }
 
-//splits given node into two nodes
-ERROR_T BTreeIndex::SplitNode (const SIZE_T node, KEY_T &midkey, SIZE_T &newnode) {
-  BTreeNode lhs;
-  //just copy for now
-  BTreeNode rhs = lhs;
 
+// Makes list one of count values, with bytes of them at vals and
+// the chain, if any, at first
+static ERROR_T SetPosting(VALUE_T &list, const SIZE_T count, const SIZE_T first,
+			  const BYTE_T *vals, const SIZE_T bytes)
+{
+  Block made(BTREE_POSTING_HEADER+bytes);
   ERROR_T rc;
- 
-  //represents number of keys in both left and right nodes
-  SIZE_T numLHS;
-  SIZE_T numRHS;
 
-  // the left node will represent the first half of the current node
-  rc=lhs.Unserialize(buffercache, node);
-  if (rc) { return rc; }
-  //allocate space for new node
-  rc = AllocateNode(newnode);
+  // (vals may be in list)
+  memcpy(made.data,&count,sizeof(SIZE_T));
+  memcpy(made.data+sizeof(SIZE_T),&first,sizeof(SIZE_T));
+  memcpy(made.data+BTREE_POSTING_HEADER,vals,bytes);
+  rc=list.Resize(made.length,false);
   if (rc) { return rc; }
+  memcpy(list.data,made.data,made.length);
+  return ERROR_NOERROR;
+}
+
+
+static ERROR_T PadValue(const VALUE_T &value, const SIZE_T valuesize, VALUE_T &v)
+{
+  SIZE_T len = value.length<valuesize ? value.length : valuesize;
+  ERROR_T rc=v.Resize(valuesize,false);
 
-  // write this new space for rhs onto the disk
-  rc = rhs.Serialize(buffercache, newnode);
   if (rc) { return rc; }
+  memcpy(v.data,value.data,len);
+  memset(v.data+len,0,valuesize-len);
+  return ERROR_NOERROR;
+}
 
-  char *lhsStart;
-  char *rhsStart;
- 
-  //if we are splitting a leaf node
-  if(lhs.info.nodetype == BTREE_LEAF_NODE){
-    // number of keys in the left and right nodes
-    numLHS = (lhs.info.numkeys+2)/2; //we want to add one more to include ptr that will point to rhs (+2/2 works for both even and odd numbers)
 
-    numRHS = (lhs.info.numkeys - numLHS);
- 
-    //gives numLeft-1th pointer
-    rc=lhs.GetKey(numLHS-1, midkey);
-    if (rc) { return rc; }
+static BYTE_T *OverflowValues(const BTreeNode &b)
+{
+  return (BYTE_T *)b.ResolvePtr(0)+sizeof(SIZE_T);
+}
+
 
-    //gives ith pointer to ith key value pair (leaf)
-    lhsStart = lhs.ResolveKeyVal(numLHS);
-    rhsStart = rhs.ResolveKeyVal(0);
+// Where v goes among the n values at vals, which are in order, and
+// whether it is there already
+static SIZE_T FindPosting(const BYTE_T *vals, const SIZE_T n, const VALUE_T &v, bool &found)
+{
+  SIZE_T lo=0, hi=n, mid;
 
-    memcpy(rhsStart, lhsStart, numRHS*(lhs.info.keysize+lhs.info.valuesize));
+  while (lo<hi) { 
+    mid=(lo+hi)/2;
+    if (memcmp(vals+mid*v.length,v.data,v.length)<0) { 
+      lo=mid+1;
+    } else {
+      hi=mid;
+    }
   }
+  found = lo<n && memcmp(vals+lo*v.length,v.data,v.length)==0;
+  return lo;
+}
+
+
+static void InsertOverflowValue(BTreeNode &b, const SIZE_T i, const VALUE_T &v)
+{
+  BYTE_T *p=OverflowValues(b);
+
+  memmove(p+(i+1)*v.length,p+i*v.length,(b.info.numkeys-i)*v.length);
+  memcpy(p+i*v.length,v.data,v.length);
+  b.info.numkeys++;
+}
+
+
+static void RemoveOverflowValue(BTreeNode &b, const SIZE_T i)
+{
+  BYTE_T *p=OverflowValues(b);
+  SIZE_T vs=b.info.valuesize;
+
+  memmove(p+i*vs,p+(i+1)*vs,(b.info.numkeys-i-1)*vs);
+  b.info.numkeys--;
+}
 
-  //we're splitting an interior node
-  else{
 
-    numLHS = lhs.info.numkeys / 2;
-    numRHS = lhs.info.numkeys - numLHS - 1;
+// Reads the chain from first to the block v belongs in, the first
+// whose last value is not below it, or else the last one.  prev is
+// the block before it, or 0.
+static ERROR_T FindOverflowNode(BufferCache *cache, const SIZE_T first, const VALUE_T &v,
+				BTreeNode &b, SIZE_T &node, SIZE_T &prev, SIZE_T &next)
+{
+  ERROR_T rc;
 
-    rc=lhs.GetKey(numLHS, midkey);
+  prev=0;
+  for (node=first; ; prev=node, node=next) { 
+    rc=b.Unserialize(cache,node);
+    if (rc) { return rc; }
+    if (b.info.nodetype!=BTREE_OVERFLOW_NODE || b.info.numkeys==0) { 
+      return ERROR_INSANE;
+    }
+    rc=b.GetPtr(0,next);
     if (rc) { return rc; }
+    if (next==0 || 
+	memcmp(v.data,OverflowValues(b)+(b.info.numkeys-1)*v.length,v.length)<=0) { 
+      return ERROR_NOERROR;
+    }
+  }
+}
+
 
-    lhsStart = lhs.ResolvePtr(numLHS);
-    rhsStart = rhs.ResolvePtr(0);
+ERROR_T BTreeIndex::InsertPosting(const KEY_T &key, const VALUE_T &value, const bool upsert)
+{
+  BTreePath path(buffercache);
+  VALUE_T v, list;
+  bool found=false;
+  ERROR_T rc;
+
+  rc=PadValue(value,GetValueSize(),v);
+  if (rc) { return rc; }
+  rc=path.Descend(superblock.info.rootnode,&key,found);
+  if (rc && rc!=ERROR_NONEXISTENT) { 
+    return rc;
+  }
+  if (!found) { 
+    path.Clear();
+    rc=SetPosting(list,1,0,v.data,v.length);
+    if (rc) { return rc; }
+    return InsertInternal(key,list,false);
+  }
 
-    memcpy(rhsStart, lhsStart, numRHS*(lhs.info.keysize+lhs.info.valuesize));
+  rc=path.Leaf().b.GetVal(path.Leaf().offset,list);
+  if (rc) { return rc; }
+  rc=AddToPosting(list,v);
+  if (rc==ERROR_CONFLICT && upsert) { 
+    return ERROR_NOERROR;
   }
+  if (rc) { return rc; }
+  return WritePosting(path,key,list);
+}
 
-  //these nodes have new key counts
-  lhs.info.numkeys = numLHS;
-  rhs.info.numkeys = numRHS;
 
-  //write back to disk
-  rc = lhs.Serialize(buffercache, node);
+ERROR_T BTreeIndex::DeletePosting(const KEY_T &key, const VALUE_T *value)
+{
+  BTreePath path(buffercache);
+  VALUE_T v, list;
+  bool found=false;
+  ERROR_T rc;
+
+  rc=path.Descend(superblock.info.rootnode,&key,found);
+  if (rc && rc!=ERROR_NONEXISTENT) { 
+    return rc;
+  }
+  if (!found) { 
+    return ERROR_NONEXISTENT;
+  }
+  rc=path.Leaf().b.GetVal(path.Leaf().offset,list);
   if (rc) { return rc; }
 
-  rc = rhs.Serialize(buffercache, newnode);
+  if (!value) { 
+    path.Clear();
+    rc=DeleteInternal(key);
+    if (rc) { return rc; }
+    return FreePosting(list);
+  }
+
+  rc=PadValue(*value,GetValueSize(),v);
+  if (rc) { return rc; }
+  rc=RemoveFromPosting(list,v);
   if (rc) { return rc; }
+  if (PostingCount(list)==0) { 
+    path.Clear();
+    return DeleteInternal(key);
+  }
+  return WritePosting(path,key,list);
+}
 
-  return ERROR_NOERROR;
 
+ERROR_T BTreeIndex::WritePosting(BTreePath &path, const KEY_T &key, const VALUE_T &list)
+{
+  BTreePathEntry &leaf=path.Leaf();
+  ERROR_T rc;
+
+  rc=leaf.b.SetVal(leaf.offset,list);
+  if (rc==ERROR_NOSPACE) { 
+    // a slotted leaf that other lists have grown into has no room
+    // for this one to grow in place, so it goes in again
+    path.Clear();
+    rc=DeleteInternal(key);
+    if (rc) { return rc; }
+    return InsertInternal(key,list,false);
+  }
+  if (rc) { return rc; }
+  return leaf.b.Serialize(buffercache,leaf.node);
 }
 
 
-ERROR_T BTreeIndex::InsertKeyVal(const SIZE_T node, const KEY_T &key, const VALUE_T &value, SIZE_T newnode) {
+// v is padded to valuesize
+ERROR_T BTreeIndex::AddToPosting(VALUE_T &list, const VALUE_T &v)
+{
+  SIZE_T vs=v.length;
+  SIZE_T count=PostingCount(list);
+  SIZE_T first=PostingFirst(list);
+  SIZE_T node, prev, next, i;
   BTreeNode b;
-  KEY_T testKey;
+  bool found;
   ERROR_T rc;
 
-  SIZE_T slotsLeft;
-  SIZE_T slotSize;
+  if (first==0) { 
+    const BYTE_T *vals=list.data+BTREE_POSTING_HEADER;
+    i=FindPosting(vals,count,v,found);
+    if (found) { 
+      return ERROR_CONFLICT;
+    }
+    Block grown((count+1)*vs);
+    memcpy(grown.data,vals,i*vs);
+    memcpy(grown.data+i*vs,v.data,vs);
+    memcpy(grown.data+(i+1)*vs,vals+i*vs,(count-i)*vs);
+    if (count<BTREE_POSTING_INLINE) { 
+      return SetPosting(list,count+1,0,grown.data,grown.length);
+    }
 
-  rc=b.Unserialize(buffercache, node);
-  if (rc) { return rc; }
-  SIZE_T numkeys = b.info.numkeys;
+    // too many for the leaf, so they all go to an overflow block
+    BTreeNode o(BTREE_OVERFLOW_NODE,
+		superblock.info.keysize,
+		vs,
+		buffercache->GetBlockSize(),
+		BTREE_FORMAT_FIXED);
+    rc=AllocateNode(node);
+    if (rc) { return rc; }
+    o.info.numkeys=count+1;
+    memcpy(OverflowValues(o),grown.data,grown.length);
+    rc=o.Serialize(buffercache,node);
+    if (rc) { return rc; }
+    return SetPosting(list,count+1,node,0,0);
+  }
 
-  switch (b.info.nodetype) {
-    case BTREE_ROOT_NODE:
-    case BTREE_INTERIOR_NODE:
-      //size of key ptr pair
-      slotSize = b.info.keysize + sizeof(SIZE_T);
-      break;
-    case BTREE_LEAF_NODE:
-      //size of key value pair
-      slotSize = b.info.keysize + b.info.valuesize;
-      break;
-    default:
-      return ERROR_INSANE;
+  rc=FindOverflowNode(buffercache,first,v,b,node,prev,next);
+  if (rc) { return rc; }
+  i=FindPosting(OverflowValues(b),b.info.numkeys,v,found);
+  if (found) { 
+    return ERROR_CONFLICT;
+  }
+  if (b.info.numkeys==b.GetNumSlots()) { 
+    // the top half of a full block goes to a new one after it
+    BTreeNode r(BTREE_OVERFLOW_NODE,
+		superblock.info.keysize,
+		vs,
+		buffercache->GetBlockSize(),
+		BTREE_FORMAT_FIXED);
+    SIZE_T half=b.info.numkeys/2;
+    SIZE_T rnode;
+
+    rc=AllocateNode(rnode);
+    if (rc) { return rc; }
+    r.info.numkeys=b.info.numkeys-half;
+    memcpy(OverflowValues(r),OverflowValues(b)+half*vs,r.info.numkeys*vs);
+    r.SetPtr(0,next);
+    b.info.numkeys=half;
+    b.SetPtr(0,rnode);
+    if (i>half) { 
+      InsertOverflowValue(r,i-half,v);
+    } else {
+      InsertOverflowValue(b,i,v);
+    }
+    rc=r.Serialize(buffercache,rnode);
+    if (rc) { return rc; }
+  } else {
+    InsertOverflowValue(b,i,v);
   }
+  rc=b.Serialize(buffercache,node);
+  if (rc) { return rc; }
+  return SetPosting(list,count+1,first,0,0);
+}
 
-  //we're adding a new key
-  b.info.numkeys++;
 
-  if (numkeys > 0) {
-    slotsLeft = numkeys;
-    for (SIZE_T i=0; i < numkeys; i++) {
-      rc = b.GetKey(i, testKey);
-      if (rc) { return rc; }
+// v is padded to valuesize
+ERROR_T BTreeIndex::RemoveFromPosting(VALUE_T &list, const VALUE_T &v)
+{
+  SIZE_T vs=v.length;
+  SIZE_T count=PostingCount(list);
+  SIZE_T first=PostingFirst(list);
+  SIZE_T node, prev, next, i, n;
+  BTreeNode b;
+  bool found;
+  ERROR_T rc;
 
-      if (key < testKey) {
-        //we're going to move existing data over one
-        void *src = b.ResolveKey(i);
-	void *dest = b.ResolveKey(i+1);
-        //memmove(destination, source, num_bytes)
-        //dest = pointer to dest array where content is copies
-        //src = pointer to src of data to be copied
-	memmove(dest, src, slotsLeft * slotSize);
-      }
+  if (first==0) { 
+    const BYTE_T *vals=list.data+BTREE_POSTING_HEADER;
+    i=FindPosting(vals,count,v,found);
+    if (!found) { 
+      return ERROR_NONEXISTENT;
+    }
+    Block kept((count-1)*vs);
+    memcpy(kept.data,vals,i*vs);
+    memcpy(kept.data+i*vs,vals+(i+1)*vs,(count-1-i)*vs);
+    return SetPosting(list,count-1,0,kept.data,kept.length);
+  }
 
-      //we want it to point to last key
-      if (i == (numkeys - 1)) { i = numkeys; }
+  rc=FindOverflowNode(buffercache,first,v,b,node,prev,next);
+  if (rc) { return rc; }
+  i=FindPosting(OverflowValues(b),b.info.numkeys,v,found);
+  if (!found) { 
+    return ERROR_NONEXISTENT;
+  }
+  RemoveOverflowValue(b,i);
 
-      //set key no matter what type of node
-      rc = b.SetKey(i,key);
+  if (b.info.numkeys==0) { 
+    // out of the chain
+    if (prev==0) { 
+      first=next;
+    } else {
+      BTreeNode p;
+      rc=p.Unserialize(buffercache,prev);
       if (rc) { return rc; }
-      if (b.info.nodetype == BTREE_LEAF_NODE) {
-        //if it's a leaf node, it needs a key val pair
-        rc = b.SetVal(i, value);
-        if (rc) { return rc; }
-      } else {
-        //otherwise it's a key ptr pair
-        rc = b.SetPtr(i+1, newnode);
-        if(rc) { return rc; }
+      p.SetPtr(0,next);
+      rc=p.Serialize(buffercache,prev);
+      if (rc) { return rc; }
+    }
+    rc=DeallocateNode(node);
+    if (rc) { return rc; }
+  } else {
+    if (next!=0) { 
+      BTreeNode nb;
+      rc=nb.Unserialize(buffercache,next);
+      if (rc) { return rc; }
+      if (b.info.numkeys+nb.info.numkeys<=b.GetNumSlots()) { 
+	memcpy(OverflowValues(b)+b.info.numkeys*vs,OverflowValues(nb),nb.info.numkeys*vs);
+	b.info.numkeys+=nb.info.numkeys;
+	rc=DeallocateNode(next);
+	if (rc) { return rc; }
+	// what came after it now comes after b
+	rc=nb.GetPtr(0,next);
+	if (rc) { return rc; }
+	b.SetPtr(0,next);
       }
-      break;
     }
-    slotsLeft--;
+    rc=b.Serialize(buffercache,node);
+    if (rc) { return rc; }
+  }
+
+  count--;
+  if (count>BTREE_POSTING_INLINE/2) { 
+    return SetPosting(list,count,first,0,0);
   }
-  //there was nothing on the node, that's easy 
-  else {
-    rc = b.SetKey(0, key);
+
+  // back into the leaf
+  Block vals(count*vs);
+  for (n=0, node=first; node!=0; node=next) { 
+    rc=b.Unserialize(buffercache,node);
     if (rc) { return rc; }
- 
-    rc = b.SetVal(0, value);
+    if (n+b.info.numkeys>count) { 
+      return ERROR_INSANE;
+    }
+    memcpy(vals.data+n*vs,OverflowValues(b),b.info.numkeys*vs);
+    n+=b.info.numkeys;
+    rc=b.GetPtr(0,next);
+    if (rc) { return rc; }
+    rc=DeallocateNode(node);
     if (rc) { return rc; }
   }
-  //write back onto disk
-  return b.Serialize(buffercache, node);
-
+  return SetPosting(list,count,0,vals.data,vals.length);
 }
 
 
-ERROR_T BTreeIndex::Update(const KEY_T &key, const VALUE_T &value)
+ERROR_T BTreeIndex::FreePosting(const VALUE_T &list)
 {
-  VALUE_T v = value;
-  return LookupOrUpdateInternal(superblock.info.rootnode, BTREE_OP_UPDATE, key, v);
+  SIZE_T node, next;
+  BTreeNode b;
+  ERROR_T rc;
+
+  for (node=PostingFirst(list); node!=0; node=next) { 
+    rc=b.Unserialize(buffercache,node);
+    if (rc) { return rc; }
+    rc=b.GetPtr(0,next);
+    if (rc) { return rc; }
+    rc=DeallocateNode(node);
+    if (rc) { return rc; }
+  }
+  return ERROR_NOERROR;
 }
 
-  
-ERROR_T BTreeIndex::Delete(const KEY_T &key)
+
+ERROR_T BTreeIndex::FirstPosting(const VALUE_T &list, VALUE_T &value) const
 {
-  // This is optional extra credit 
-  //
-  // 
-  return ERROR_UNIMPL;
+  SIZE_T vs=GetValueSize();
+  SIZE_T first=PostingFirst(list);
+  const BYTE_T *p=list.data+BTREE_POSTING_HEADER;
+  BTreeNode b;
+  ERROR_T rc;
+
+  if (PostingCount(list)==0) { 
+    return ERROR_INSANE;
+  }
+  if (first!=0) { 
+    rc=b.Unserialize(buffercache,first);
+    if (rc) { return rc; }
+    p=OverflowValues(b);
+  }
+  rc=value.Resize(vs,false);
+  if (rc) { return rc; }
+  memcpy(value.data,p,vs);
+  return ERROR_NOERROR;
 }
 
   
@@ -719,68 +3455,143 @@ ERROR_T BTreeIndex::DisplayInternal(const SIZE_T &node,
 				    ostream &o,
 				    BTreeDisplayType display_type) const
 {
-  KEY_T testkey;
+  BTreePath path(buffercache);
   SIZE_T ptr;
-  BTreeNode b;
   ERROR_T rc;
-  SIZE_T offset;
-
-  rc= b.Unserialize(buffercache,node);
 
-  if (rc!=ERROR_NOERROR) { 
-    return rc;
-  }
+  // Each node is printed as it goes on the path, and the offset of
+  // an interior node is the next of its children to visit
+  for (ptr=node; ; ) { 
+    rc = path.Push(ptr);
+    if (rc) { return rc; }
+    BTreePathEntry &e = path.Leaf();
 
-  rc = PrintNode(o,node,b,display_type);
+    rc = PrintNode(o,e.node,e.b,display_type);
   
-  if (rc) { return rc; }
+    if (rc) { return rc; }
 
-  if (display_type==BTREE_DEPTH_DOT) { 
-    o << ";";
-  }
+    if (display_type==BTREE_DEPTH_DOT) { 
+      o << ";";
+    }
 
-  if (display_type!=BTREE_SORTED_KEYVAL) {
-    o << endl;
-  }
+    if (display_type!=BTREE_SORTED_KEYVAL) {
+      o << endl;
+    }
 
-  switch (b.info.nodetype) { 
-  case BTREE_ROOT_NODE:
-  case BTREE_INTERIOR_NODE:
-    if (b.info.numkeys>0) { 
-      for (offset=0;offset<=b.info.numkeys;offset++) { 
-	rc=b.GetPtr(offset,ptr);
-	if (rc) { return rc; }
-	if (display_type==BTREE_DEPTH_DOT) { 
-	  o << node << " -> "<<ptr<<";\n";
-	}
-	rc=DisplayInternal(ptr,o,display_type);
-	if (rc) { return rc; }
+    switch (e.b.info.nodetype) { 
+    case BTREE_ROOT_NODE:
+    case BTREE_INTERIOR_NODE:
+    case BTREE_LEAF_NODE:
+      break;
+    default:
+      if (display_type==BTREE_DEPTH_DOT) { 
+      } else {
+	o << "Unsupported Node Type " << e.b.info.nodetype ;
       }
+      return ERROR_INSANE;
     }
-    return ERROR_NOERROR;
-    break;
-  case BTREE_LEAF_NODE:
-    return ERROR_NOERROR;
-    break;
-  default:
+
+    // back up to the nearest node with children left to visit
+    while (path.GetDepth()>0 &&
+	   (path.Leaf().b.info.nodetype==BTREE_LEAF_NODE ||
+	    path.Leaf().b.info.numkeys==0 ||
+	    path.Leaf().offset>path.Leaf().b.info.numkeys)) { 
+      path.Pop();
+    }
+    if (path.GetDepth()==0) { 
+      return ERROR_NOERROR;
+    }
+
+    BTreePathEntry &p = path.Leaf();
+    rc=p.b.GetPtr(p.offset++,ptr);
+    if (rc) { return rc; }
     if (display_type==BTREE_DEPTH_DOT) { 
-    } else {
-      o << "Unsupported Node Type " << b.info.nodetype ;
+      o << p.node << " -> "<<ptr<<";\n";
     }
-    return ERROR_INSANE;
   }
+}
+
 
+//
+// The leftmost leaf, where the leaf chain starts
+//
+ERROR_T BTreeIndex::FirstLeaf(SIZE_T &leaf) const
+{
+  BTreePath path(buffercache);
+  bool found;
+  ERROR_T rc;
+
+  rc=path.Descend(superblock.info.rootnode,0,found);
+  if (rc) { return rc; }
+
+  leaf=path.Leaf().node;
   return ERROR_NOERROR;
 }
 
 
 ERROR_T BTreeIndex::Display(ostream &o, BTreeDisplayType display_type) const
 {
+  SnapshotHolder snap(*this);
   ERROR_T rc;
+  if (display_type==BTREE_SORTED_KEYVAL && (buffered || multi)) { 
+    // the leaves don't have the changes still buffered above them,
+    // nor a long posting list's values
+    BTreeCursor cursor(this);
+    BTreePostingCursor values(this);
+    KEY_T key;
+    VALUE_T value;
+    unsigned i;
+
+    for (rc=cursor.Seek(); rc==ERROR_NOERROR; rc=cursor.Next()) { 
+      if ((rc=cursor.GetKey(key))) { 
+	return rc;
+      }
+      // each of a key's values is a pair of its own
+      for (rc = multi ? values.Seek(key) : cursor.GetVal(value);
+	   rc==ERROR_NOERROR;
+	   rc = multi ? values.Next() : ERROR_NONEXISTENT) { 
+	if (multi && (rc=values.GetVal(value))) { 
+	  return rc;
+	}
+	o << "(";
+	for (i=0;i<key.length;i++) { 
+	  o << key.data[i];
+	}
+	o << ",";
+	for (i=0;i<value.length;i++) { 
+	  o << value.data[i];
+	}
+	o << ")\n";
+      }
+      if (rc!=ERROR_NONEXISTENT) { 
+	return rc;
+      }
+    }
+    return rc==ERROR_NONEXISTENT ? ERROR_NOERROR : rc;
+  }
+  // a copy-on-write tree's leaves aren't linked, but a depth first
+  // walk comes to them in key order all the same
+  if (display_type==BTREE_SORTED_KEYVAL && !cow) { 
+    // walk the leaf chain instead of the whole tree
+    BTreeNode b;
+    SIZE_T leaf;
+    rc=FirstLeaf(leaf);
+    if (rc==ERROR_NONEXISTENT) { 
+      return ERROR_NOERROR;
+    }
+    while (rc==ERROR_NOERROR && leaf!=0) { 
+      rc=b.Unserialize(buffercache,leaf);
+      if (rc) { return rc; }
+      rc=PrintNode(o,leaf,b,display_type);
+      if (rc) { return rc; }
+      rc=b.GetPtr(0,leaf);
+    }
+    return rc;
+  }
   if (display_type==BTREE_DEPTH_DOT) { 
     o << "digraph tree { \n";
   }
-  rc=DisplayInternal(superblock.info.rootnode,o,display_type);
+  rc=DisplayInternal(snap.root,o,display_type);
   if (display_type==BTREE_DEPTH_DOT) { 
     o << "}\n";
   }
@@ -3,6 +3,10 @@
 
 #include <iostream>
 #include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <set>
 
 #include "global.h"
 #include "block.h"
@@ -10,6 +14,9 @@
 #include "buffercache.h"
 
 #include "btree_ds.h"
+#include "btree_path.h"
+#include "btree_filter.h"
+#include "btree_keycache.h"
 
 using namespace std;
 
@@ -39,26 +46,184 @@ struct KeyValuePair {
 
 enum BTreeOp {BTREE_OP_INSERT, BTREE_OP_DELETE, BTREE_OP_UPDATE,BTREE_OP_LOOKUP};
 
+// Lookup or update specialised for one key and value size (see btree_fixed.h)
+typedef ERROR_T (*FixedLookupFn)(BufferCache *cache,
+				 const SIZE_T root,
+				 const BTreeOp op,
+				 const KEY_T &key,
+				 VALUE_T &value);
+
+// A stream of key/value pairs in increasing key order, for BulkLoad
+class KeyValueSource {
+ public:
+  virtual ~KeyValueSource() {}
+  // return zero on success
+  // return ERROR_NONEXISTENT after the last pair
+  virtual ERROR_T GetNext(KEY_T &key, VALUE_T &value) = 0;
+};
+
 enum BTreeDisplayType {BTREE_DEPTH, BTREE_DEPTH_DOT, BTREE_SORTED_KEYVAL};
 
+// A root of the index as it was last committed (see
+// BTreeIndex::GetSnapshot)
+struct BTreeSnapshot {
+  SIZE_T root;
+  SIZE_T generation;   // the commit it came from
+};
+
 class BTreeIndex {
  private:
   BufferCache *buffercache;
   SIZE_T       superblock_index;
   BTreeNode    superblock;
+  FixedLookupFn fixedlookup;   // 0 if there's no specialised code for this tree
+  bool         specialized;    // use it
+  bool         concurrent;     // latch nodes (see SetConcurrent)
+  bool         buffered;       // BTREE_FLAG_BUFFERED is set
+  bool         multi;          // BTREE_FLAG_MULTI is set
+  Mutex        allocmutex;     // for the free list in the superblock
+  BTreeFilter  filter;         // of the keys, if the index has one
+  SIZE_T       filterkeys;     // what to size a new index's filter for
+  BTreeKeyCache keycache;      // of what Lookup found for hot keys
+
+  // Copy-on-write trees (see GetSnapshot)
+  bool         cow;            // BTREE_FLAG_COW is set
+  Mutex        writemutex;     // changes take turns
+  bool         changing;       // a change is under way
+  set<SIZE_T>  fresh;          // blocks it has allocated
+  vector<SIZE_T> replaced;     // blocks it has copied or freed
+  mutable Mutex snapmutex;     // for the rest
+  SIZE_T       committed;      // the root as of the last commit
+  SIZE_T       generation;     // commits so far
+  mutable map<SIZE_T,SIZE_T> snapshots;    // generation -> snapshots of it held
+  deque<pair<SIZE_T,SIZE_T> > retired;     // (generation, block) left behind
+					   // by the commit of generation
 
+  friend class BTreeCursor;
+  friend class BTreePostingCursor;
+
+  // What a buffered or non-unique tree's operations take turns on
+  // when it is shared between threads, 0 if they needn't
+  Mutex       *TurnMutex() { return (buffered || multi) && concurrent ? &writemutex : 0; }
  protected:
 
   ERROR_T      AllocateNode(SIZE_T &node);
 
   ERROR_T      DeallocateNode(const SIZE_T &node);
 
+  ERROR_T      WriteSuperblock();
+
+  // Changes to a copy-on-write tree go between these, which do
+  // nothing for other trees.  EndChange commits whatever the change
+  // wrote unless it failed, and returns rc.
+  void         BeginChange();
+  ERROR_T      EndChange(const ERROR_T rc);
+
+  // Frees the retired blocks no snapshot still held can reach
+  ERROR_T      Reclaim();
+
+  // During a copy-on-write change, moves node to a block of the
+  // change's own, unless it is in one already, so that it can be
+  // written.  Whatever points at node must then be changed too.
+  ERROR_T      ShadowNode(SIZE_T &node);
+
+  // The same for every node on path, from the root down
+  ERROR_T      ShadowPath(BTreePath &path);
+
+  // Lookup, without the key cache
+  ERROR_T      LookupTree(const KEY_T &key, VALUE_T &value);
+
   ERROR_T      LookupOrUpdateInternal(const SIZE_T &Node,
 				      const BTreeOp op, 
 				      const KEY_T &key,
 				      VALUE_T &val);
   
 
+  ERROR_T      FirstLeaf(SIZE_T &leaf) const;
+
+  // How a concurrent operation first goes down, with at most the
+  // leaf latched (exclusively, if it will change it)
+  BTreeLatchMode LeafLatching(const bool change) const;
+
+  ERROR_T      InsertInternal(const KEY_T &key, const VALUE_T &value, const bool upsert);
+
+  ERROR_T      InsertBatchInternal(const vector<KeyValuePair> &pairs, vector<ERROR_T> &results);
+
+  ERROR_T      ApplyBatchInternal(const vector<BTreeMessage> &msgs);
+
+  ERROR_T      DeleteInternal(const KEY_T &key);
+
+  ERROR_T      BulkLoadInternal(KeyValueSource &source, const double fill);
+
+  ERROR_T      SplitUp(BTreePath &path);
+
+  ERROR_T      InitRoot(BTreeNode &root, const KEY_T &key);
+
+  ERROR_T      InsertBatchHelper(SIZE_T &node,
+				 const vector<KeyValuePair> &pairs,
+				 const vector<SIZE_T> &order,
+				 const SIZE_T begin, const SIZE_T end,
+				 const KEY_T *lo, const KEY_T *hi,
+				 vector<ERROR_T> &results,
+				 vector<KEY_T> &upkeys,
+				 vector<SIZE_T> &upnodes);
+
+  ERROR_T      WriteBatchNodes(const SIZE_T node, BTreeNode &b,
+			       const vector<KEY_T> &keys,
+			       const vector<VALUE_T> &vals,
+			       const vector<SIZE_T> &ptrs,
+			       const KEY_T *lo, const KEY_T *hi,
+			       vector<KEY_T> &upkeys,
+			       vector<SIZE_T> &upnodes,
+			       const SIZE_T spare=0);
+
+  ERROR_T      RebalanceUp(BTreePath &path);
+
+  ERROR_T      Rebalance(BTreeNode &parent, const SIZE_T left,
+			 const KEY_T *lo, const KEY_T *hi);
+
+  // Adds a level above the root for as long as it has split, upkeys
+  // and upnodes being what it split into
+  ERROR_T      GrowRoot(vector<KEY_T> &upkeys, vector<SIZE_T> &upnodes);
+
+  ERROR_T      MultiLookupInternal(const SIZE_T root,
+				   const vector<KEY_T> &keys,
+				   vector<VALUE_T> &values,
+				   vector<ERROR_T> &results);
+
+  // Buffered trees
+  ERROR_T      LookupBuffered(const SIZE_T node, const KEY_T &key, VALUE_T &value) const;
+
+  // msgs, in key order, go into the root's buffer, or straight down
+  // to the leaves in a tree without buffers
+  ERROR_T      SendMessages(const vector<BTreeMessage> &msgs);
+
+  ERROR_T      FlushHelper(const SIZE_T node,
+			   const vector<BTreeMessage> &msgs,
+			   const KEY_T *lo, const KEY_T *hi,
+			   vector<KEY_T> &upkeys,
+			   vector<SIZE_T> &upnodes,
+			   bool &thin);
+
+  // Replaces the leaf of path with a copy that has the changes still
+  // buffered above it, for a cursor
+  ERROR_T      ApplyPending(BTreePath &path) const;
+
+  // Non-unique trees.  A posting list (see btree_ds.h) is changed in
+  // the leaf path ends at, which holds it at the path's offset
+  ERROR_T      InsertPosting(const KEY_T &key, const VALUE_T &value, const bool upsert);
+  // all of key's values if value is 0
+  ERROR_T      DeletePosting(const KEY_T &key, const VALUE_T *value);
+  ERROR_T      WritePosting(BTreePath &path, const KEY_T &key, const VALUE_T &list);
+  ERROR_T      AddToPosting(VALUE_T &list, const VALUE_T &value);
+  ERROR_T      RemoveFromPosting(VALUE_T &list, const VALUE_T &value);
+  ERROR_T      FreePosting(const VALUE_T &list);
+  ERROR_T      FirstPosting(const VALUE_T &list, VALUE_T &value) const;
+
+  ERROR_T      BulkLoadLevel(vector<SIZE_T> &children,
+			     vector<KEY_T> &seps,
+			     const double fill);
+
   ERROR_T      DisplayInternal(const SIZE_T &node,
 			       ostream &o, 
 			       const BTreeDisplayType display_type=BTREE_DEPTH) const;
@@ -76,7 +241,9 @@ public:
   BTreeIndex(SIZE_T keysize, 
 	     SIZE_T valuesize,
 	     BufferCache *cache,
-	     bool unique=true);   // true if a  key maps to a single value
+	     bool unique=true,    // true if a  key maps to a single value
+	     int format=BTREE_FORMAT_FIXED);  // node format (see btree_ds.h)
+  // (a format with BTREE_FORMAT_MULTI is the same as unique=false)
 
 
   BTreeIndex();
@@ -99,39 +266,212 @@ public:
   // We expect you to tell us the number of your superblock, which
   // we will return to you on the next attach
   ERROR_T Detach(SIZE_T &initblock);
+
+  // Lookups and updates on fixed format trees of some common key and
+  // value sizes run specialised code (the default).  This turns it
+  // off or back on, for comparison.
+  void UseSpecialized(const bool use) { specialized=use; }
+
+  // An index created after this keeps a Bloom filter of its keys
+  // (see btree_filter.h) sized for keys keys, in blocks reserved
+  // after the root and counted in the superblock.  Attach reads it
+  // into memory and Detach writes it back, so it lasts from one to
+  // the next.  Lookup, Update and Delete of a key the filter has
+  // never seen return ERROR_NONEXISTENT without reading the tree,
+  // MultiLookup only takes the other keys down, and a buffered
+  // tree's Insert skips its conflict check.  Every key inserted is
+  // added, by whatever call puts it there, and stays in the filter
+  // after it is deleted, so the filter holds the keys of any
+  // snapshot too.  0 (the default) means no filter.  Takes effect at
+  // Attach(initblock,true), which returns ERROR_NOSPACE if the
+  // filter doesn't fit.
+  void SetFilterKeys(const SIZE_T keys) { filterkeys=keys; }
+
+  // The filter, for its counts of probes, descents skipped and false
+  // positives since Attach
+  const BTreeFilter &GetFilter() const { return filter; }
+
+  // Keeps up to entries keys, and the values Lookup found for them,
+  // in memory above the tree (see btree_keycache.h), so that a
+  // lookup of a hot key reads no blocks at all.  Keys earn their
+  // place by how often they are looked up (TinyLFU), and anything
+  // that changes a key drops it from the cache.  The cache starts
+  // empty at each Attach.  Only Lookup uses it, not MultiLookup,
+  // cursors or lookups of a snapshot.  0 (the default) means none.
+  void SetKeyCache(const SIZE_T entries) { keycache.Reset(entries,superblock.info.keysize); }
+
+  // The key cache, for its counts of lookups, hits, and keys admitted
+  // and turned away since Attach
+  const BTreeKeyCache &GetKeyCache() const { return keycache; }
+
+  // As given to the constructor, or read by Attach
+  SIZE_T GetKeySize() const { return superblock.info.keysize; }
+  SIZE_T GetValueSize() const { 
+    return (superblock.info.flags & BTREE_FLAG_MULTI) ? 
+      (superblock.info.valuesize-BTREE_POSTING_HEADER)/BTREE_POSTING_INLINE : superblock.info.valuesize;
+  }
+  int    GetFormat() const { return superblock.info.GetFormatAndFlags(); }
+  bool   IsUnique() const { return !(superblock.info.flags & BTREE_FLAG_MULTI); }
+
+  // Lets Lookup, Update, Insert, Upsert and Delete run from any
+  // number of threads at once.  Each takes per node latches on the
+  // way down, shared ones and only the leaf's exclusive at first, and
+  // lets go of a parent as soon as its child is latched.  An insert
+  // or delete that would split or rebalance the leaf starts again
+  // with exclusive latches, letting go of the nodes above each one
+  // that can take the change without passing it up.  The specialised
+  // lookups are not used meanwhile.  Everything else still needs the
+  // index to itself.
+  //
+  // In a B-link tree (a format with BTREE_FORMAT_BLINK) the first go
+  // down takes no latches at all, reading each node as it stands
+  // and moving right along the links past any split it missed, so
+  // lookups never latch anything and the others only their leaf.
+  //
+  // A copy-on-write tree (see GetSnapshot) latches nothing whether
+  // or not this is set.  In a buffered tree the operations above,
+  // and MultiLookup, take turns instead.
+  void SetConcurrent(const bool c) { concurrent=c; }
+
+  // A buffered tree (a format with BTREE_FORMAT_BUFFERED) is a
+  // B-epsilon tree: each interior node gives half its block to a
+  // buffer of changes on their way down, so it has half the children
+  // it would otherwise.  Insert, Upsert, Update, Delete and
+  // InsertBatch leave their change in the root's buffer.  Once a
+  // buffer is full, the changes for the child with the most of them
+  // move down into its buffer, or into the leaf, all in one write.
+  // A leaf is written once for many changes rather than once each,
+  // and the nodes near the root, where most of the writing happens,
+  // stay in the cache.  Lookups, cursors and Display take the
+  // newest change on the way down over the leaf.  Insert, Update and
+  // Delete still look for the key to give their result, but only
+  // read the leaf if no buffer has a change for it; Upsert writes
+  // without looking.  The specialised lookups are not used.
+
+  // In a non-unique tree (unique=false, or a format with
+  // BTREE_FORMAT_MULTI) a key has a list of values, kept in order
+  // and padded to valuesize, up to BTREE_POSTING_INLINE of them in
+  // the leaf and the rest in overflow blocks of their own, so a key
+  // with many values takes one entry in the tree.  Insert adds a
+  // value to the key's list, and only conflicts if the value is
+  // already there; Upsert does the same, but doesn't mind.  Lookup,
+  // MultiLookup and the cursors give a key's first value, and
+  // BTreePostingCursor (btree_cursor.h) all of them.  Delete of a
+  // key takes all its values, and of a key and value just that one.
+  // Update, ApplyBatch and BulkLoad return ERROR_UNIMPL, and
+  // InsertBatch inserts its pairs one at a time.  It can't have any
+  // other flag.
+
+  // A copy-on-write tree (a format with BTREE_FORMAT_COW) never
+  // writes over a node once it has been committed.  A change writes
+  // each node it touches, and every node above it, to a new block,
+  // and commits by putting the new root in the superblock, so it
+  // either happens as a whole or not at all.  Changes take turns,
+  // but Lookup, MultiLookup, Display and cursors read from a
+  // snapshot, from any number of threads, without waiting for them
+  // or holding them up.
+  //
+  // GetSnapshot gives the last root committed.  It and everything
+  // under it stay as they are until the matching ReleaseSnapshot:
+  // the blocks that later changes leave behind are freed, by the
+  // next change or Detach, only once no snapshot reaches them.  In
+  // any other tree a snapshot is just the root, and keeps nothing.
+  // A change needs free blocks for its copies, so in a copy-on-write
+  // tree even Update and Delete can return ERROR_NOSPACE.
+  ERROR_T GetSnapshot(BTreeSnapshot &snap) const;
+  ERROR_T ReleaseSnapshot(const BTreeSnapshot &snap) const;
   
   // return zero on success
   // return ERROR_NOSPACE if you run out of disk space
   // return ERROR_SIZE if the key or value are the wrong size for this index
   // return ERROR_CONFLICT if the key already exists and it's a unique index
   ERROR_T Insert(const KEY_T &key, const VALUE_T &value);
+
+  // Inserts the pair, or updates the value if the key is already
+  // there, in a single pass down the tree
+  // return zero on success
+  // return ERROR_NOSPACE if you run out of disk space
+  // return ERROR_SIZE if the key or value are the wrong size for this index
+  ERROR_T Upsert(const KEY_T &key, const VALUE_T &value);
   
-  // Helper function for Insert
-  ERROR_T InsertHelper(const SIZE_T &node, const KEY_T &key, const VALUE_T &value);
-  
-  //checks whether a given node is full
-  bool NodeFull(const SIZE_T ptr);
-  
-  //inserts key value pair
-  ERROR_T InsertKeyVal(const SIZE_T node, const KEY_T &key, const VALUE_T &value, SIZE_T newnode);
-  
+  // Inserts all of pairs in one pass down the tree, which reads and
+  // writes each node it touches once, far fewer than inserting them
+  // one at a time.  results[i] is set to what Insert would have
+  // returned for pairs[i] (a key that repeats within the batch goes
+  // in the first time).
+  // return zero on success
+  // return ERROR_CONFLICT if any of the keys were already there
+  // return ERROR_NOSPACE if you run out of disk space part way
+  ERROR_T InsertBatch(const vector<KeyValuePair> &pairs, vector<ERROR_T> &results);
+
+  // Applies msgs, puts and deletes in key order with at most one for
+  // any key, in one pass down the tree like InsertBatch.  A delete of
+  // a key that isn't there does nothing.  Leaves left underfull are
+  // rebalanced, but interior nodes are not merged.  A copy-on-write
+  // tree applies them one at a time, but still in a single change.
+  // return zero on success
+  // return ERROR_INSANE if msgs are out of order
+  // return ERROR_NOSPACE if you run out of disk space part way
+  ERROR_T ApplyBatch(const vector<BTreeMessage> &msgs);
+
   //splits node
-  ERROR_T SplitNode(const SIZE_T node, KEY_T &midkey, SIZE_T &newnode);  
+  ERROR_T SplitNode(const SIZE_T node, KEY_T &midkey, SIZE_T &newnode,
+		    const KEY_T *lo, const KEY_T *hi);
+
+  //splits node, already read into lhs
+  ERROR_T SplitNode(BTreeNode &lhs, const SIZE_T node, KEY_T &midkey, SIZE_T &newnode,
+		    const KEY_T *lo, const KEY_T *hi);
+
+  //splits the root, which stays in the same block
+  ERROR_T SplitRoot();
+  ERROR_T SplitRoot(BTreeNode &root);
+
+  // Builds an empty index bottom up from pairs in increasing key
+  // order, far faster than inserting them one at a time.  Nodes are
+  // filled to fill (0,1] of what Insert lets them hold before they
+  // split, and the leaves go to consecutive free blocks.
+  // return zero on success
+  // return ERROR_CONFLICT if the index is not empty or a key repeats
+  // return ERROR_INSANE if the keys are out of order
+  // return ERROR_NOSPACE if you run out of disk space
+  ERROR_T BulkLoad(KeyValueSource &source, const double fill=1.0);
 
   // return zero on success
   // return ERROR_NONEXISTENT  if the key doesn't exist
   // return ERROR_SIZE if the key or value are the wrong size for this index
   ERROR_T Update(const KEY_T &key, const VALUE_T &value);
   
+  // Nodes left underfull borrow from or merge with a sibling, freed
+  // nodes go back to the free list, and the root gets shorter when it
+  // is down to one child.
   // return zero on success
   // return ERROR_NONEXISTENT  if the key doesn't exist
   // return ERROR_SIZE if the key or value are the wrong size for this index
   ERROR_T Delete(const KEY_T &key);
+
+  // Takes value from key's list in a non-unique tree, and the key
+  // with it once it has no values left
+  // return zero on success
+  // return ERROR_NONEXISTENT  if the key doesn't have the value
+  // return ERROR_UNIMPL if the index is unique
+  ERROR_T Delete(const KEY_T &key, const VALUE_T &value);
   
   // return zero on success
   // return ERROR_NONEXISTENT  if the key doesn't exist
   ERROR_T Lookup(const KEY_T &key, VALUE_T &value);
 
+  // Lookup as of snap
+  ERROR_T Lookup(const BTreeSnapshot &snap, const KEY_T &key, VALUE_T &value);
+
+  // Looks up all of keys together, reading each node on their paths
+  // once, and prefetching the nodes of each level before it gets to
+  // them.  values[i] and results[i] are what Lookup would have given
+  // for keys[i].
+  // return zero on success
+  // return ERROR_NONEXISTENT if any of the keys don't exist
+  ERROR_T MultiLookup(const vector<KEY_T> &keys, vector<VALUE_T> &values,
+		      vector<ERROR_T> &results);
+
   // Here you should figure out if your index makes sense
   // Is it a tree?  Is it in order?  Is it balanced?  Does each node have
   // a valid use ratio?
@@ -142,11 +482,12 @@ public:
   // the tree, printing each node
   // BTREE_DEPTH_DOT means to do the same way, but print
   // the tree in a Graphviz/dot-compatible way (nodes and edges)
-  // BTREE_SORTED_KEYVAL means to do a depth first traversal,
-  // like the previous two, but to only print the
-  // key/value pairs in the leaves, one "(key, value)" tuple
+  // BTREE_SORTED_KEYVAL means to walk the leaves from left to
+  // right along their sibling links, and to only print the
+  // key/value pairs in them, one "(key, value)" tuple
   // per line.  This will be the keys and values in the tree
-  // sorted in order of keys.
+  // sorted in order of keys.  A buffered tree is walked with a
+  // cursor, so that the changes still buffered are in it.
   ERROR_T Display(ostream &o, BTreeDisplayType display_type=BTREE_DEPTH) const;
   
   ostream & Print(ostream &os) const;
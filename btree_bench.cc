@@ -0,0 +1,248 @@
+#include <iostream>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <set>
+#include <strstream>
+#include <pthread.h>
+#include "btree.h"
+
+
+using namespace std;
+
+void usage()
+{
+  cerr << "usage: btree_bench filestem cachesize format[-generic][-filter][,format...] [threads [cachekeys]] < specfile\n";
+}
+
+
+static double Now()
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC,&t);
+  return t.tv_sec*1e9+t.tv_nsec;
+}
+
+
+struct OpStats {
+  SIZE_T count, fails;
+  double ns;
+
+  OpStats() : count(0), fails(0), ns(0) {}
+};
+
+
+// One thread's share of the spec: lines first, first+step, ...
+struct BenchWorker {
+  BTreeIndex              *btree;
+  const vector<string>    *lines;
+  SIZE_T                   first, step;
+  map<string,OpStats>      stats;
+  pthread_t                thread;
+};
+
+
+static void *RunOps(void *arg)
+{
+  BenchWorker *w=(BenchWorker *)arg;
+  const vector<string> &lines=*w->lines;
+  ERROR_T rc;
+
+  for (SIZE_T i=w->first;i<lines.size();i+=w->step) {
+    string action, key, value;
+    VALUE_T v;
+    istrstream is(lines[i].c_str(),lines[i].size());
+    is >> action >> key >> value;
+
+    double start=Now();
+    if (action=="INSERT") {
+      rc=w->btree->Insert(KEY_T(key.c_str()),VALUE_T(value.c_str()));
+    } else if (action=="UPDATE") {
+      rc=w->btree->Update(KEY_T(key.c_str()),VALUE_T(value.c_str()));
+    } else if (action=="UPSERT") {
+      rc=w->btree->Upsert(KEY_T(key.c_str()),VALUE_T(value.c_str()));
+    } else if (action=="LOOKUP") {
+      rc=w->btree->Lookup(KEY_T(key.c_str()),v);
+    } else {
+      rc=w->btree->Delete(KEY_T(key.c_str()));
+    }
+    OpStats &s=w->stats[action];
+    s.ns+=Now()-start;
+    s.count++;
+    if (rc) {
+      s.fails++;
+    }
+  }
+  return 0;
+}
+
+
+//
+// Runs a sim spec file against a fresh index in each of the given
+// node formats and reports the wall clock time per operation along
+// with the cache and disk statistics.  The INIT line gives the key
+// and value sizes; any format on it is ignored.  A format ending in
+// -generic runs without the specialised code (see btree_fixed.h).
+// One ending in -filter (after any -generic) gets a Bloom filter
+// sized for the keys the spec inserts (see btree_filter.h), and its
+// counts are reported with the statistics, so that running "fixed"
+// beside "fixed-filter" shows the disk reads it saves.
+//
+// With threads, the operations are dealt out to that many threads
+// running against one concurrent index (see
+// BTreeIndex::SetConcurrent), so the order they happen in, and which
+// of them fail, varies from run to run.  ns/op is then the time each
+// operation took, and the total throughput is reported as well.
+//
+// With cachekeys, the index keeps a key cache of that many entries
+// (see BTreeIndex::SetKeyCache), whose hit rate is reported.
+//
+int main(int argc, char *argv[])
+{
+  if (argc<4 || argc>6) {
+    usage();
+    return -1;
+  }
+
+  char *filestem=argv[1];
+  SIZE_T cachesize=atoi(argv[2]);
+  SIZE_T threads = argc>4 ? atoi(argv[4]) : 1;
+  SIZE_T cachekeys = argc>5 ? atoi(argv[5]) : 0;
+  vector<string> lines;
+  char line[1024];
+  SIZE_T keysize=0, valuesize=0;
+  set<string> inserted;   // what a filter is sized for
+  ERROR_T rc;
+
+  while (fgets(line,sizeof(line),stdin)) {
+    string action, key, value;
+    istrstream is(line,strlen(line));
+    is >> action >> key >> value;
+    if (action=="INIT") {
+      keysize=atoi(key.c_str());
+      valuesize=atoi(value.c_str());
+    } else if (action=="INSERT" || action=="UPDATE" || action=="UPSERT" ||
+	       action=="LOOKUP" || action=="DELETE") {
+      lines.push_back(line);
+      if (action=="INSERT" || action=="UPSERT") {
+	inserted.insert(key);
+      }
+    }
+  }
+
+  if (keysize==0 || valuesize==0) {
+    cerr << "No INIT line in the spec file\n";
+    return -1;
+  }
+
+  if (threads<1) {
+    usage();
+    return -1;
+  }
+
+  cout << "format op count fails ns/op\n";
+
+  for (char *tok=strtok(argv[3],","); tok; tok=strtok(0,",")) {
+    string name=tok;
+    bool specialized=true, filter=false;
+    if (name.size()>7 && name.substr(name.size()-7)=="-filter") {
+      name=name.substr(0,name.size()-7);
+      filter=true;
+    }
+    if (name.size()>8 && name.substr(name.size()-8)=="-generic") {
+      name=name.substr(0,name.size()-8);
+      specialized=false;
+    }
+    int format=NodeFormatFromName(name.c_str());
+    if (format<0) {
+      cerr << "Unknown node format "<<tok<<endl;
+      continue;
+    }
+
+    DiskSystem disk(filestem);
+    BufferCache cache(&disk,cachesize);
+    map<string,OpStats> stats;
+
+    if ((rc=cache.Attach())!=ERROR_NOERROR) {
+      cerr << "Can't attach cache due to error "<<rc<<endl;
+      return -1;
+    }
+
+    BTreeIndex btree(keysize,valuesize,&cache,true,format);
+    btree.UseSpecialized(specialized);
+    btree.SetFilterKeys(filter ? inserted.size() : 0);
+
+    if ((rc=btree.Attach(0,true))!=ERROR_NOERROR) {
+      cerr << "Can't attach btree due to error "<<rc<<endl;
+      return -1;
+    }
+
+    btree.SetConcurrent(threads>1);
+    btree.SetKeyCache(cachekeys);
+
+    vector<BenchWorker> workers(threads);
+    double start=Now();
+    for (SIZE_T t=0;t<threads;t++) {
+      workers[t].btree=&btree;
+      workers[t].lines=&lines;
+      workers[t].first=t;
+      workers[t].step=threads;
+      if (threads==1) {
+	RunOps(&workers[t]);
+      } else if (pthread_create(&workers[t].thread,0,RunOps,&workers[t])) {
+	cerr << "Can't start thread "<<t<<endl;
+	return -1;
+      }
+    }
+    for (SIZE_T t=0;threads>1 && t<threads;t++) {
+      pthread_join(workers[t].thread,0);
+    }
+    double elapsed=Now()-start;
+
+    for (SIZE_T t=0;t<threads;t++) {
+      for (map<string,OpStats>::const_iterator w=workers[t].stats.begin(); w!=workers[t].stats.end(); ++w) {
+	OpStats &s=stats[(*w).first];
+	s.count+=(*w).second.count;
+	s.fails+=(*w).second.fails;
+	s.ns+=(*w).second.ns;
+      }
+    }
+
+    for (map<string,OpStats>::const_iterator s=stats.begin(); s!=stats.end(); ++s) {
+      cout << tok << " " << (*s).first << " " << (*s).second.count << " "
+	   << (*s).second.fails << " " << (*s).second.ns/(*s).second.count << endl;
+    }
+    if (threads>1) {
+      cout << tok << " all " << lines.size() << " threads=" << threads << " "
+	   << lines.size()/(elapsed/1e9) << " ops/s\n";
+    }
+
+    const BTreeFilter &f=btree.GetFilter();
+    if (f.IsOn()) {
+      cerr << tok << ": filterblocks="<<f.GetNumBlocks()<<" probes="<<f.GetNumProbes()
+	   << " skipped="<<f.GetNumSkipped()<<" falsepositives="<<f.GetNumFalsePositives()
+	   << " falsepositiverate="<<f.GetFalsePositiveRate()<<endl;
+    }
+
+    const BTreeKeyCache &k=btree.GetKeyCache();
+    if (k.IsOn()) {
+      cerr << tok << ": keycache lookups="<<k.GetNumLookups()<<" hits="<<k.GetNumHits()
+	   << " hitrate="<<k.GetHitRate()<<" admitted="<<k.GetNumAdmitted()
+	   << " rejected="<<k.GetNumRejected()<<endl;
+    }
+
+    SIZE_T superblocknum;
+    btree.Detach(superblocknum);
+    cache.Detach();
+
+    cerr << tok << ": numreads="<<cache.GetNumReads()<<" numwrites="<<cache.GetNumWrites()
+	 << " numdiskreads="<<cache.GetNumDiskReads()<<" numdiskwrites="<<cache.GetNumDiskWrites()
+	 << " total time="<<cache.GetCurrentTime()<<endl;
+  }
+
+  return 0;
+}
@@ -0,0 +1,162 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <string>
+#include <strstream>
+#include "btree.h"
+#include "extsort.h"
+
+void usage()
+{
+  cerr << "usage: btree_bulkload filestem cachesize [fill [sortkb [fanin [tmpprefix]]]] < pairs\n";
+  cerr << "       pairs is one \"key value\" per line, in key order unless sortkb is\n";
+  cerr << "       given, in which case they are sorted first using that much memory\n";
+}
+
+
+static double Now()
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC,&t);
+  return t.tv_sec+t.tv_nsec/1e9;
+}
+
+
+//
+// Reads "key value" lines from a file
+//
+class LineSource : public KeyValueSource {
+ private:
+  FILE   *file;
+  SIZE_T  count;
+ public:
+  LineSource(FILE *f) : file(f), count(0) {}
+
+  ERROR_T GetNext(KEY_T &key, VALUE_T &value) {
+    char line[1024];
+    string k, v;
+
+    while (fgets(line,sizeof(line),file)) {
+      istrstream is(line,strlen(line));
+      is >> k >> v;
+      if (k.empty() || k[0]=='#') {
+	continue;
+      }
+      key.Resize(k.size(),false);
+      memcpy(key.data,k.data(),k.size());
+      value.Resize(v.size(),false);
+      memcpy(value.data,v.data(),v.size());
+      count++;
+      return ERROR_NOERROR;
+    }
+    return ERROR_NONEXISTENT;
+  }
+
+  SIZE_T GetCount() const { return count; }
+};
+
+
+int main(int argc, char **argv)
+{
+  char *filestem;
+  SIZE_T cachesize;
+  SIZE_T superblocknum;
+  double fill=1.0;
+  SIZE_T sortkb=0, fanin=16;
+  string tmpprefix;
+
+  if (argc<3 || argc>7) {
+    usage();
+    return -1;
+  }
+
+  filestem=argv[1];
+  cachesize=atoi(argv[2]);
+  tmpprefix=string(filestem)+".sort";
+  if (argc>3) {
+    fill=atof(argv[3]);
+  }
+  if (argc>4) {
+    sortkb=atoi(argv[4]);
+  }
+  if (argc>5) {
+    fanin=atoi(argv[5]);
+  }
+  if (argc>6) {
+    tmpprefix=argv[6];
+  }
+
+  DiskSystem disk(filestem);
+  BufferCache cache(&disk,cachesize);
+  BTreeIndex btree(0,0,&cache);
+  LineSource input(stdin);
+  ExternalSorter sorter(tmpprefix,sortkb*1024,fanin);
+  KeyValueSource *source=&input;
+
+  ERROR_T rc;
+
+
+  if ((rc=cache.Attach())!=ERROR_NOERROR) {
+    cerr << "Can't attach buffer cache due to error"<<rc<<endl;
+    return -1;
+  }
+
+  if ((rc=btree.Attach(0))!=ERROR_NOERROR) {
+    cerr << "Can't attach to index  due to error "<<rc<<endl;
+    return -1;
+  } else {
+    cerr << "Index attached!"<<endl;
+    double start=Now();
+    if (sortkb>0) {
+      // run generation and all but the last merge pass happen here,
+      // the last pass feeds the build
+      KEY_T key;
+      VALUE_T value;
+      while ((rc=input.GetNext(key,value))==ERROR_NOERROR &&
+	     (rc=sorter.Add(key,value))==ERROR_NOERROR) {
+      }
+      if (rc==ERROR_NONEXISTENT) {
+	rc=sorter.Finish();
+      }
+      if (rc) {
+	cerr <<"Sort failed: error "<<rc<<endl;
+	return -1;
+      }
+      cerr <<"Sorted "<<sorter.GetNumPairs()<<" pairs into "<<sorter.GetNumRuns()<<" runs in "
+	   <<Now()-start<<" s, "<<sorter.GetNumPasses()<<" merge passes\n";
+      source=&sorter;
+      start=Now();
+    }
+    ERROR_T loadrc=btree.BulkLoad(*source,fill);
+    if ((rc=loadrc)!=ERROR_NOERROR) {
+      cerr <<"Bulk load failed after "<<input.GetCount()<<" pairs: error "<<rc<<endl;
+    } else {
+      cerr <<"Bulk loaded "<<input.GetCount()<<" pairs in "<<Now()-start<<" s"
+	   <<(sortkb>0 && sorter.GetNumPasses()>0 ? " (with the last merge pass)" : "")<<"\n";
+    }
+    if ((rc=btree.Detach(superblocknum))!=ERROR_NOERROR) {
+      cerr <<"Can't detach from index due to error "<<rc<<endl;
+      return -1;
+    }
+    if ((rc=cache.Detach())!=ERROR_NOERROR) {
+      cerr <<"Can't detach from cache due to error "<<rc<<endl;
+      return -1;
+    }
+    cerr << "Performance statistics:\n";
+
+    cerr << "numallocs       = "<<cache.GetNumAllocs()<<endl;
+    cerr << "numdeallocs     = "<<cache.GetNumDeallocs()<<endl;
+    cerr << "numreads        = "<<cache.GetNumReads()<<endl;
+    cerr << "numdiskreads    = "<<cache.GetNumDiskReads()<<endl;
+    cerr << "numwrites       = "<<cache.GetNumWrites()<<endl;
+    cerr << "numdiskwrites   = "<<cache.GetNumDiskWrites()<<endl;
+    cerr << endl;
+
+    cerr << "total time      = "<<cache.GetCurrentTime()<<endl;
+
+    // the index is detached cleanly either way, but a failed load
+    // must still fail
+    return loadrc ? -1 : 0;
+  }
+}
@@ -0,0 +1,375 @@
+#include <string.h>
+#include "btree_cursor.h"
+
+
+BTreeCursor::BTreeCursor(const BTreeIndex *i, const bool p, const BTreeSnapshot *s) :
+  index(i), prefetch(p), given(s!=0), held(false), path(i->buffercache),
+  valid(false), haslo(false), hashi(false)
+{
+  if (s) { 
+    snap=*s;
+  }
+}
+
+
+BTreeCursor::~BTreeCursor()
+{
+  // nothing may stay pinned once the snapshot's blocks can be freed
+  path.Clear();
+  if (held) { 
+    index->ReleaseSnapshot(snap);
+  }
+}
+
+
+//
+// Each Seek starts again from the last root committed, unless the
+// cursor was given a snapshot
+//
+ERROR_T BTreeCursor::TakeSnapshot()
+{
+  ERROR_T rc;
+
+  if (given) { 
+    return ERROR_NOERROR;
+  }
+  path.Clear();
+  if (held) { 
+    held=false;
+    rc=index->ReleaseSnapshot(snap);
+    if (rc) { return rc; }
+  }
+  rc=index->GetSnapshot(snap);
+  if (rc) { return rc; }
+  held=true;
+  return ERROR_NOERROR;
+}
+
+
+static ERROR_T CopyBound(KEY_T &dst, const KEY_T &src)
+{
+  ERROR_T rc=dst.Resize(src.length,false);
+
+  if (rc) { return rc; }
+  memcpy(dst.data,src.data,src.length);
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeCursor::SetBounds(const KEY_T *l, const KEY_T *h)
+{
+  ERROR_T rc;
+
+  valid=false;
+  path.Clear();
+  haslo = l!=0;
+  hashi = h!=0;
+  if (l) {
+    rc=CopyBound(lo,*l);
+    if (rc) { return rc; }
+  }
+  if (h) {
+    rc=CopyBound(hi,*h);
+    if (rc) { return rc; }
+  }
+  return ERROR_NOERROR;
+}
+
+
+//
+// Called when the path has just reached a new leaf, going backward
+// if last.  A buffered tree's leaf is swapped for one with the
+// changes still buffered above it, and the offset found again: at
+// key, setting found, or else at the start, or the end if last.
+//
+ERROR_T BTreeCursor::LoadLeaf(const KEY_T *key, const bool last, bool &found)
+{
+  SIZE_T next;
+  ERROR_T rc;
+
+  if (path.Leaf().b.info.nodetype!=BTREE_LEAF_NODE) {
+    return ERROR_INSANE;
+  }
+
+  if (index->buffered) {
+    rc=index->ApplyPending(path);
+    if (rc) { return rc; }
+    BTreePathEntry &leaf=path.Leaf();
+    if (key) {
+      found=leaf.b.SearchKey(*key,leaf.offset);
+    } else {
+      leaf.offset = last ? leaf.b.info.numkeys : 0;
+    }
+  }
+
+  if (prefetch && !last) {
+    rc=path.Leaf().b.GetRightLink(next);
+    if (rc) { return rc; }
+    if (next!=0) {
+      // only a hint, a cache that can't prefetch it is fine
+      index->buffercache->PrefetchBlock(next);
+    }
+  }
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeCursor::CheckBounds()
+{
+  const BTreePathEntry &leaf=path.Leaf();
+
+  if ((haslo && leaf.b.CompareKey(leaf.offset,lo)<0) ||
+      (hashi && leaf.b.CompareKey(leaf.offset,hi)>0)) {
+    valid=false;
+    return ERROR_NONEXISTENT;
+  }
+  valid=true;
+  return ERROR_NOERROR;
+}
+
+
+//
+// Moves from offset in the current leaf to the first pair at or
+// after it, going on to following leaves past the end of the leaf
+//
+ERROR_T BTreeCursor::SkipForward()
+{
+  bool found;
+  ERROR_T rc;
+
+  while (path.Leaf().offset>=path.Leaf().b.info.numkeys) {
+    rc=path.NextLeaf();
+    if (rc==ERROR_NONEXISTENT) {
+      valid=false;
+    }
+    if (rc) { return rc; }
+    rc=LoadLeaf(0,false,found);
+    if (rc) { return rc; }
+  }
+  return CheckBounds();
+}
+
+
+//
+// Moves from offset in the current leaf to the pair before it, going
+// back to earlier leaves past the start of the leaf
+//
+ERROR_T BTreeCursor::SkipBackward()
+{
+  bool found;
+  ERROR_T rc;
+
+  while (path.Leaf().offset==0) {
+    rc=path.PrevLeaf();
+    if (rc==ERROR_NONEXISTENT) {
+      valid=false;
+    }
+    if (rc) { return rc; }
+    rc=LoadLeaf(0,true,found);
+    if (rc) { return rc; }
+  }
+  path.Leaf().offset--;
+  return CheckBounds();
+}
+
+
+ERROR_T BTreeCursor::Seek(const KEY_T *l, const KEY_T *h)
+{
+  bool found;
+  ERROR_T rc;
+
+  rc=SetBounds(l,h);
+  if (rc) { return rc; }
+  rc=TakeSnapshot();
+  if (rc) { return rc; }
+
+  // to the first key >= lo, which may be in a following leaf
+  rc=path.Descend(snap.root,l,found);
+  if (rc) { return rc; }
+  rc=LoadLeaf(l,false,found);
+  if (rc) { return rc; }
+  return SkipForward();
+}
+
+
+ERROR_T BTreeCursor::SeekLast(const KEY_T *l, const KEY_T *h)
+{
+  bool found=false;
+  ERROR_T rc;
+
+  rc=SetBounds(l,h);
+  if (rc) { return rc; }
+  rc=TakeSnapshot();
+  if (rc) { return rc; }
+
+  if (h) {
+    rc=path.Descend(snap.root,h,found);
+  } else {
+    rc=path.DescendLast(snap.root);
+  }
+  if (rc) { return rc; }
+  rc=LoadLeaf(h,true,found);
+  if (rc) { return rc; }
+
+  if (found) {
+    return CheckBounds();
+  }
+  // the last key < hi comes before where hi would go
+  return SkipBackward();
+}
+
+
+ERROR_T BTreeCursor::Next()
+{
+  if (!valid) {
+    return ERROR_NONEXISTENT;
+  }
+  path.Leaf().offset++;
+  return SkipForward();
+}
+
+
+ERROR_T BTreeCursor::Prev()
+{
+  if (!valid) {
+    return ERROR_NONEXISTENT;
+  }
+  return SkipBackward();
+}
+
+
+ERROR_T BTreeCursor::GetKey(KEY_T &key) const
+{
+  if (!valid) {
+    return ERROR_NONEXISTENT;
+  }
+  return path.Leaf().b.GetKey(path.Leaf().offset,key);
+}
+
+
+ERROR_T BTreeCursor::GetVal(VALUE_T &value) const
+{
+  if (!valid) {
+    return ERROR_NONEXISTENT;
+  }
+  if (index->multi) {
+    VALUE_T list;
+    ERROR_T rc=path.Leaf().b.GetVal(path.Leaf().offset,list);
+    if (rc) { return rc; }
+    return index->FirstPosting(list,value);
+  }
+  return path.Leaf().b.GetVal(path.Leaf().offset,value);
+}
+
+
+BTreePostingCursor::BTreePostingCursor(const BTreeIndex *i) :
+  index(i), count(0), offset(0), valid(false)
+{
+}
+
+
+static SIZE_T PostingField(const VALUE_T &list, const SIZE_T n)
+{
+  SIZE_T x;
+
+  memcpy(&x,list.data+n*sizeof(SIZE_T),sizeof(SIZE_T));
+  return x;
+}
+
+
+ERROR_T BTreePostingCursor::LoadBlock(const SIZE_T node)
+{
+  SIZE_T next;
+  ERROR_T rc;
+
+  rc=block.Unserialize(index->buffercache,node);
+  if (rc) { return rc; }
+  if (block.info.nodetype!=BTREE_OVERFLOW_NODE || block.info.numkeys==0) {
+    return ERROR_INSANE;
+  }
+  rc=block.GetPtr(0,next);
+  if (rc) { return rc; }
+  if (next!=0) {
+    // only a hint, a cache that can't prefetch it is fine
+    index->buffercache->PrefetchBlock(next);
+  }
+  offset=0;
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreePostingCursor::Seek(const KEY_T &key)
+{
+  BTreePath path(index->buffercache);
+  bool found=false;
+  SIZE_T first;
+  ERROR_T rc;
+
+  valid=false;
+  count=0;
+  if (!index->multi) {
+    return ERROR_UNIMPL;
+  }
+  rc=path.Descend(index->superblock.info.rootnode,&key,found);
+  if (rc) { return rc; }
+  if (!found) {
+    return ERROR_NONEXISTENT;
+  }
+  rc=path.Leaf().b.GetVal(path.Leaf().offset,list);
+  if (rc) { return rc; }
+
+  count=PostingField(list,0);
+  first=PostingField(list,1);
+  offset=0;
+  if (first!=0) {
+    rc=LoadBlock(first);
+    if (rc) { return rc; }
+  }
+  valid = count>0;
+  return valid ? ERROR_NOERROR : ERROR_NONEXISTENT;
+}
+
+
+ERROR_T BTreePostingCursor::Next()
+{
+  SIZE_T next;
+  ERROR_T rc;
+
+  if (!valid) {
+    return ERROR_NONEXISTENT;
+  }
+  offset++;
+  if (PostingField(list,1)==0) {
+    valid = offset<count;
+  } else if (offset>=block.info.numkeys) {
+    rc=block.GetPtr(0,next);
+    if (rc) { return rc; }
+    valid = next!=0;
+    if (valid) {
+      rc=LoadBlock(next);
+      if (rc) { return rc; }
+    }
+  }
+  return valid ? ERROR_NOERROR : ERROR_NONEXISTENT;
+}
+
+
+ERROR_T BTreePostingCursor::GetVal(VALUE_T &value) const
+{
+  SIZE_T vs=index->GetValueSize();
+  const BYTE_T *p;
+  ERROR_T rc;
+
+  if (!valid) {
+    return ERROR_NONEXISTENT;
+  }
+  if (PostingField(list,1)==0) {
+    p=list.data+BTREE_POSTING_HEADER;
+  } else {
+    p=(const BYTE_T *)block.ResolvePtr(0)+sizeof(SIZE_T);
+  }
+  rc=value.Resize(vs,false);
+  if (rc) { return rc; }
+  memcpy(value.data,p+offset*vs,vs);
+  return ERROR_NOERROR;
+}
@@ -0,0 +1,113 @@
+#ifndef _btree_cursor
+#define _btree_cursor
+
+#include "btree.h"
+
+//
+// Ordered iteration over a BTreeIndex
+//
+// A cursor sits on one key/value pair of a leaf.  It keeps the path
+// from the root to that leaf pinned in the cache (see btree_path.h),
+// so stepping within a leaf touches no blocks, and moving to the
+// next or previous leaf goes back up only as far as the nearest
+// node with a ptr that way, usually just the leaf's parent.
+//
+// The cursor is bounded by [lo,hi], either end of which may be open.
+// It is not valid once it steps past either bound or off the end of
+// the tree.  Nothing may modify the index while a cursor is in use,
+// unless it is a copy-on-write index: the cursor then walks a
+// snapshot (see BTreeIndex::GetSnapshot), its own from each Seek on
+// or one it is given, and changes go on beside it.  In a buffered
+// index each leaf the cursor reaches is a copy with the changes
+// still buffered above it taken in.  In a non-unique index GetVal
+// gives the key's first value; a BTreePostingCursor gives the rest.
+//
+class BTreeCursor {
+ private:
+  const BTreeIndex *index;
+  bool         prefetch;   // ask the cache for the next leaf early
+  BTreeSnapshot snap;      // the root it walks
+  bool         given;      // snap belongs to whoever gave it
+  bool         held;       // snap is the cursor's own, to release
+  BTreePath    path;       // down to the current leaf, whose offset is the current pair
+  bool         valid;
+  bool         haslo, hashi;
+  KEY_T        lo, hi;
+
+  ERROR_T      SetBounds(const KEY_T *lo, const KEY_T *hi);
+  ERROR_T      LoadLeaf(const KEY_T *key, const bool last, bool &found);
+  ERROR_T      SkipForward();
+  ERROR_T      SkipBackward();
+  ERROR_T      CheckBounds();
+  ERROR_T      TakeSnapshot();
+
+ public:
+  // With prefetch, each leaf read also asks the buffer cache to
+  // prefetch the leaf after it.  With snap, the cursor walks that
+  // snapshot, which must be held until the cursor is done with.
+  BTreeCursor(const BTreeIndex *index, const bool prefetch=false,
+	      const BTreeSnapshot *snap=0);
+  ~BTreeCursor();
+
+  // Positions the cursor on the first key >= lo (the first key of the
+  // tree if lo is 0).  Returns ERROR_NONEXISTENT if there is no key in
+  // [lo,hi]
+  ERROR_T Seek(const KEY_T *lo=0, const KEY_T *hi=0);
+  // Positions the cursor on the last key <= hi, for walking backward
+  ERROR_T SeekLast(const KEY_T *lo=0, const KEY_T *hi=0);
+
+  // Move to the following or preceding key.  Return ERROR_NONEXISTENT,
+  // and leave the cursor invalid, when that would leave [lo,hi]
+  ERROR_T Next();
+  ERROR_T Prev();
+
+  bool    Valid() const { return valid; }
+
+  // The pair under the cursor.  ERROR_NONEXISTENT if it is not valid
+  ERROR_T GetKey(KEY_T &key) const;
+  ERROR_T GetVal(VALUE_T &value) const;
+};
+
+
+//
+// The values of one key of a non-unique BTreeIndex, in order
+//
+// The cursor keeps a copy of the key's posting list (see btree_ds.h)
+// and, once the list has gone to overflow blocks, the block it is
+// in, asking the cache for the next block as it gets to each one.
+// As with BTreeCursor, nothing may modify the index meanwhile.
+//
+class BTreePostingCursor {
+ private:
+  const BTreeIndex *index;
+  VALUE_T      list;       // the key's posting list, as in its leaf
+  SIZE_T       count;      // values in it
+  BTreeNode    block;      // the overflow block the cursor is in, if any
+  SIZE_T       offset;     // of the current value, in the list or block
+  bool         valid;
+
+  ERROR_T      LoadBlock(const SIZE_T node);
+
+ public:
+  BTreePostingCursor(const BTreeIndex *index);
+
+  // Positions the cursor on the first value of key
+  // return ERROR_NONEXISTENT if the key isn't there
+  // return ERROR_UNIMPL if the index is unique
+  ERROR_T Seek(const KEY_T &key);
+
+  // Moves to the next value.  Returns ERROR_NONEXISTENT, and leaves
+  // the cursor invalid, after the last one
+  ERROR_T Next();
+
+  bool    Valid() const { return valid; }
+
+  // How many values the key has
+  SIZE_T  GetNumValues() const { return count; }
+
+  // The value under the cursor, padded to the index's valuesize.
+  // ERROR_NONEXISTENT if it is not valid
+  ERROR_T GetVal(VALUE_T &value) const;
+};
+
+#endif
@@ -7,12 +7,56 @@
 #include "buffercache.h"
 
 #include "btree.h"
+#include "keysearch.h"
 
 using namespace std;
 
+#define MIN(x,y) ((x)<(y) ? (x) : (y))
+
+// The right link, the two fence lengths and the two fences
+static SIZE_T BlinkTrailerBytes(const NodeMetadata &info)
+{
+  return (info.flags & BTREE_FLAG_BLINK) ? 3*sizeof(SIZE_T)+2*info.keysize : 0;
+}
+
+// The message buffer at the end of an interior node of a buffered tree
+static SIZE_T BufferBytes(const NodeMetadata &info)
+{
+  if (!(info.flags & BTREE_FLAG_BUFFERED) ||
+      (info.nodetype!=BTREE_ROOT_NODE && info.nodetype!=BTREE_INTERIOR_NODE)) { 
+    return 0;
+  }
+  return info.GetNumBodyBytes()/2;
+}
+
+
+int NodeMetadata::GetFormatAndFlags() const
+{
+  return format | (flags<<8);
+}
+
+
+SIZE_T NodeMetadata::GetFilterBlocks() const
+{
+  return numkeys;
+}
+
+
+void NodeMetadata::SetFilterBlocks(const SIZE_T n)
+{
+  numkeys=n;
+}
+
+
+SIZE_T NodeMetadata::GetNumBodyBytes() const
+{
+  return blocksize-sizeof(*this);
+}
+
+
 SIZE_T NodeMetadata::GetNumDataBytes() const
 {
-  SIZE_T n=blocksize-sizeof(*this);
+  SIZE_T n=GetNumBodyBytes()-BlinkTrailerBytes(*this)-BufferBytes(*this);
   return n;
 }
 
@@ -34,20 +78,110 @@ ostream & NodeMetadata::Print(ostream &os) const
 				   nodetype==BTREE_SUPERBLOCK ? "SUPERBLOCK" :
 				   nodetype==BTREE_ROOT_NODE ? "ROOT_NODE" :
 				   nodetype==BTREE_INTERIOR_NODE ? "INTERIOR_NODE" :
-				   nodetype==BTREE_LEAF_NODE ? "LEAF_NODE" : "UNKNOWN_TYPE")
+				   nodetype==BTREE_LEAF_NODE ? "LEAF_NODE" :
+				   nodetype==BTREE_OVERFLOW_NODE ? "OVERFLOW_NODE" :
+				   nodetype==BTREE_FILTER_NODE ? "FILTER_NODE" : "UNKNOWN_TYPE")
+     << ", format="<<NodeFormatName(GetFormatAndFlags())
      << ", keysize="<<keysize<<", valuesize="<<valuesize<<", blocksize="<<blocksize
-     << ", rootnode="<<rootnode<<", freelist="<<freelist<<", numkeys="<<numkeys<<")";
+     << ", rootnode="<<rootnode<<", freelist="<<freelist;
+  if (nodetype==BTREE_SUPERBLOCK) {
+    os << ", filterblocks="<<GetFilterBlocks()<<")";
+  } else {
+    os << ", numkeys="<<numkeys<<")";
+  }
   return os;
 }
 
+// The flags a tree may have, one at most
+static const int formatflags[] = {0, BTREE_FLAG_BLINK, BTREE_FLAG_COW, BTREE_FLAG_BUFFERED,
+				  BTREE_FLAG_MULTI};
+#define NUM_FORMAT_FLAGS (sizeof(formatflags)/sizeof(formatflags[0]))
+
+const char *NodeFormatName(const int format)
+{
+  // by format, then by flags as in formatflags
+  static const char *names[][NUM_FORMAT_FLAGS] = {
+    {"fixed", "fixed+blink", "fixed+cow", "fixed+buffered", "fixed+multi"},
+    {"prefix", "prefix+blink", "prefix+cow", "prefix+buffered", "prefix+multi"},
+    {"slotted", "slotted+blink", "slotted+cow", "slotted+buffered", "slotted+multi"},
+    {"soa", "soa+blink", "soa+cow", "soa+buffered", "soa+multi"}
+  };
+  int f = format & 0xff;
+  int flags = format>>8;
+
+  if (f<BTREE_FORMAT_FIXED || f>BTREE_FORMAT_SOA) { 
+    return "unknown";
+  }
+  for (SIZE_T i=0; i<NUM_FORMAT_FLAGS; i++) { 
+    if (flags==formatflags[i]) { 
+      return names[f][i];
+    }
+  }
+  return "unknown";
+}
+
+
+int NodeFormatFromName(const char *name)
+{
+  for (int f=BTREE_FORMAT_FIXED; f<=BTREE_FORMAT_SOA; f++) { 
+    for (SIZE_T i=0; i<NUM_FORMAT_FLAGS; i++) { 
+      if (!strcmp(name,NodeFormatName(f|(formatflags[i]<<8)))) { 
+	return f|(formatflags[i]<<8);
+      }
+    }
+  }
+  return -1;
+}
+
+
+int NodeFormatFor(const int treeformat, const int nodetype)
+{
+  // every format covers both leaves and interior nodes, and the
+  // flags go to every node
+  return treeformat;
+}
+
+
+//
+// FNV-1a over the key, less any zeros it ends with, then mixed
+// (the splitmix64 finalizer) so that every bit of the hash depends
+// on every byte
+//
+unsigned long long KeyHash(const KEY_T &key, const SIZE_T keysize)
+{
+  SIZE_T len = MIN(key.length,keysize);
+  unsigned long long h=14695981039346656037ULL;
+
+  while (len>0 && key.data[len-1]==0) { 
+    len--;
+  }
+  for (SIZE_T i=0; i<len; i++) { 
+    h ^= key.data[i];
+    h *= 1099511628211ULL;
+  }
+  h ^= h>>30;
+  h *= 0xbf58476d1ce4e5b9ULL;
+  h ^= h>>27;
+  h *= 0x94d049bb133111ebULL;
+  h ^= h>>31;
+  return h;
+}
+
+
 BTreeNode::BTreeNode() 
 {
   info.nodetype=BTREE_UNALLOCATED_BLOCK;
+  info.format=BTREE_FORMAT_FIXED;
+  info.flags=0;
   data=0;
+  pincache=0;
+  pinframe=0;
+  pinblock=0;
 }
 
 BTreeNode::~BTreeNode()
 {
+  Unpin();
   if (data) { 
     delete [] data;
   }
@@ -56,9 +190,12 @@ BTreeNode::~BTreeNode()
 }
 
 
-BTreeNode::BTreeNode(int node_type, SIZE_T key_size, SIZE_T value_size, SIZE_T block_size)
+BTreeNode::BTreeNode(int node_type, SIZE_T key_size, SIZE_T value_size, SIZE_T block_size,
+		     int node_format)
 {
   info.nodetype=node_type;
+  info.format=node_format & 0xff;
+  info.flags=node_format>>8;
   info.keysize=key_size;
   info.valuesize=value_size;
   info.blocksize=block_size;
@@ -66,15 +203,21 @@ BTreeNode::BTreeNode(int node_type, SIZE_T key_size, SIZE_T value_size, SIZE_T b
   info.freelist=0;
   info.numkeys=0;				       
   data=0;
+  pincache=0;
+  pinframe=0;
+  pinblock=0;
   if (info.nodetype!=BTREE_UNALLOCATED_BLOCK && info.nodetype!=BTREE_SUPERBLOCK) {
-    data = new char [info.GetNumDataBytes()];
-    memset(data,0,info.GetNumDataBytes());
+    data = new char [info.GetNumBodyBytes()];
+    memset(data,0,info.GetNumBodyBytes());
+    SetFences(0,0);
   }
 }
 
 BTreeNode::BTreeNode(const BTreeNode &rhs) 
 {
   info.nodetype=rhs.info.nodetype;
+  info.format=rhs.info.format;
+  info.flags=rhs.info.flags;
   info.keysize=rhs.info.keysize;
   info.valuesize=rhs.info.valuesize;
   info.blocksize=rhs.info.blocksize;
@@ -82,9 +225,12 @@ BTreeNode::BTreeNode(const BTreeNode &rhs)
   info.freelist=rhs.info.freelist;
   info.numkeys=rhs.info.numkeys;				       
   data=0;
+  pincache=0;
+  pinframe=0;
+  pinblock=0;
   if (rhs.data) { 
-   data=new char [info.GetNumDataBytes()];
-    memcpy(data,rhs.data,info.GetNumDataBytes());
+    data=new char [info.GetNumBodyBytes()];
+    memcpy(data,rhs.data,info.GetNumBodyBytes());
   }
 }
 
@@ -99,17 +245,43 @@ ERROR_T BTreeNode::Serialize(BufferCache *b, const SIZE_T blocknum) const
 {
   assert((unsigned)info.blocksize==b->GetBlockSize());
 
-  Block block(sizeof(info)+info.GetNumDataBytes());
+  if (pinframe && pincache==b && pinblock==blocknum) { 
+    // the data is already there
+    memcpy(pinframe->data,&info,sizeof(info));
+    return b->DirtyBlock(blocknum,pinframe);
+  }
+
+  Block block(sizeof(info)+info.GetNumBodyBytes());
 
   memcpy(block.data,&info,sizeof(info));
   if (info.nodetype!=BTREE_UNALLOCATED_BLOCK && info.nodetype!=BTREE_SUPERBLOCK) { 
-    memcpy(block.data+sizeof(info),data,info.GetNumDataBytes());
+    memcpy(block.data+sizeof(info),data,info.GetNumBodyBytes());
   }
 
   return b->WriteBlock(blocknum,block);
 }
 
 
+// Makes node a copy of block
+static void CopyFromBlock(BTreeNode &node, BufferCache *b, const Block &block)
+{
+  memcpy(&node.info,block.data,sizeof(node.info));
+  
+  node.Unpin();
+  if (node.data) { 
+    delete [] node.data;
+    node.data=0;
+  }
+
+  assert(b->GetBlockSize()==(unsigned)node.info.blocksize);
+
+  if (node.info.nodetype!=BTREE_UNALLOCATED_BLOCK && node.info.nodetype!=BTREE_SUPERBLOCK) {
+    node.data = new char [node.info.GetNumBodyBytes()];
+    memcpy(node.data,block.data+sizeof(node.info),node.info.GetNumBodyBytes());
+  }
+}
+
+
 ERROR_T  BTreeNode::Unserialize(BufferCache *b, const SIZE_T blocknum)
 {
   Block block;
@@ -122,35 +294,328 @@ ERROR_T  BTreeNode::Unserialize(BufferCache *b, const SIZE_T blocknum)
     return rc;
   }
 
-  memcpy(&info,block.data,sizeof(info));
-  
+  CopyFromBlock(*this,b,block);
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T  BTreeNode::UnserializeUnlatched(BufferCache *b, const SIZE_T blocknum)
+{
+  Block block(b->GetBlockSize());
+
+  ERROR_T rc;
+
+  rc=b->ReadBlockUnlatched(blocknum,block);
+
+  if (rc!=ERROR_NOERROR) {
+    return rc;
+  }
+
+  CopyFromBlock(*this,b,block);
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeNode::Pin(BufferCache *b, const SIZE_T blocknum)
+{
+  Block *block;
+
+  ERROR_T rc;
+
+  rc=b->PinBlock(blocknum,block);
+
+  if (rc!=ERROR_NOERROR) {
+    return rc;
+  }
+
+  Unpin();
   if (data) { 
     delete [] data;
     data=0;
   }
 
+  memcpy(&info,block->data,sizeof(info));
+
   assert(b->GetBlockSize()==(unsigned)info.blocksize);
 
   if (info.nodetype!=BTREE_UNALLOCATED_BLOCK && info.nodetype!=BTREE_SUPERBLOCK) {
-    data = new char [info.GetNumDataBytes()];
-    memcpy(data,block.data+sizeof(info),info.GetNumDataBytes());
+    data = (char *) block->data+sizeof(info);
   }
-  
+  pincache=b;
+  pinframe=block;
+  pinblock=blocknum;
+
   return ERROR_NOERROR;
 }
 
 
-char * BTreeNode::ResolveKey(const SIZE_T offset) const
+void BTreeNode::Unpin()
+{
+  if (pinframe) { 
+    pincache->UnpinBlock(pinframe);
+    data=0;
+  }
+  pincache=0;
+  pinframe=0;
+  pinblock=0;
+}
+
+
+void BTreeNode::Reload()
+{
+  if (pinframe) { 
+    memcpy(&info,pinframe->data,sizeof(info));
+  }
+}
+
+
+//
+// Prefix compressed nodes have a header in front of the usual
+// layout, in which every key is keysize-prefixlen bytes wide.
+// Slotted nodes have a header giving the start of their heap.
+//
+static SIZE_T HeaderBytes(const NodeMetadata &info, const char *data)
+{
+  SIZE_T prefixlen;
+
+  switch (info.format) { 
+  case BTREE_FORMAT_PREFIX:
+    memcpy(&prefixlen,data,sizeof(SIZE_T));
+    return sizeof(SIZE_T)+prefixlen;
+  case BTREE_FORMAT_SLOTTED:
+    return sizeof(SIZE_T);
+  default:
+    return 0;
+  }
+}
+
+
+//
+// Slot of a slotted node.  The key is at data+offset.  In a leaf
+// the value follows the key in the heap, and its length is kept in
+// the SIZE_T after the slot, where an interior node keeps a ptr.
+//
+struct SlottedKey {
+  unsigned short offset;
+  unsigned short length;
+};
+
+
+static SlottedKey GetSlot(const BTreeNode &b, const SIZE_T offset)
+{
+  SlottedKey s;
+  memcpy(&s,b.ResolveSlot(offset),sizeof(s));
+  return s;
+}
+
+
+static void SetSlot(BTreeNode &b, const SIZE_T offset, const SIZE_T keyoffset, const SIZE_T length)
+{
+  SlottedKey s;
+  s.offset=keyoffset;
+  s.length=length;
+  memcpy(b.ResolveSlot(offset),&s,sizeof(s));
+}
+
+
+// Length of the ith value of a slotted leaf (0 for interior nodes)
+static SIZE_T GetValLength(const BTreeNode &b, const SIZE_T offset)
+{
+  SIZE_T len=0;
+  if (b.info.nodetype==BTREE_LEAF_NODE) { 
+    memcpy(&len,b.ResolveSlot(offset)+sizeof(SlottedKey),sizeof(SIZE_T));
+  }
+  return len;
+}
+
+
+static void SetValLength(BTreeNode &b, const SIZE_T offset, const SIZE_T len)
+{
+  if (b.info.nodetype==BTREE_LEAF_NODE) { 
+    memcpy(b.ResolveSlot(offset)+sizeof(SlottedKey),&len,sizeof(SIZE_T));
+  }
+}
+
+
+// The heap is empty (starts at the end of the data) in a fresh node
+static SIZE_T GetHeapTop(const BTreeNode &b)
+{
+  SIZE_T top;
+  memcpy(&top,b.data,sizeof(SIZE_T));
+  return top==0 ? b.info.GetNumDataBytes() : top;
+}
+
+
+static void SetHeapTop(BTreeNode &b, const SIZE_T top)
+{
+  memcpy(b.data,&top,sizeof(SIZE_T));
+}
+
+
+// Bytes between the end of the slots and the heap
+static SIZE_T GetHeapGap(const BTreeNode &b)
+{
+  SIZE_T end=HeaderBytes(b.info,b.data)+sizeof(SIZE_T)+b.info.numkeys*b.GetSlotSize();
+  return GetHeapTop(b)-end;
+}
+
+
+// Rewrites the heap with the records packed against the end of the
+// block, leaving every free byte between the slots and the heap
+static void CompactHeap(BTreeNode &b)
+{
+  SIZE_T top=b.info.GetNumDataBytes();
+  char heap[top];
+
+  for (SIZE_T i=0;i<b.info.numkeys;i++) { 
+    SlottedKey s=GetSlot(b,i);
+    SIZE_T len=s.length+GetValLength(b,i);
+    top-=len;
+    memcpy(heap+top,b.data+s.offset,len);
+    SetSlot(b,i,top,s.length);
+  }
+  memcpy(b.data+top,heap+top,b.info.GetNumDataBytes()-top);
+  SetHeapTop(b,top);
+}
+
+
+// Writes the ith record (the key, and for a leaf its value) of a
+// slotted node.  It stays where it is if it is no longer than before,
+// otherwise it goes on top of the heap, and the old bytes become
+// garbage that the next compaction reclaims.
+static ERROR_T SetRecord(BTreeNode &b, const SIZE_T offset,
+			 const char *key, const SIZE_T keylen,
+			 const char *val, const SIZE_T vallen)
+{
+  SlottedKey s=GetSlot(b,offset);
+  SIZE_T oldlen=s.length+GetValLength(b,offset);
+  SIZE_T len=keylen+vallen;
+  char record[len];
+
+  // key or val may point into the heap that is about to move
+  memcpy(record,key,keylen);
+  memcpy(record+keylen,val,vallen);
+
+  if (len>oldlen) { 
+    if (b.GetNumUsedBytes()-oldlen+len>b.info.GetNumDataBytes()) { 
+      return ERROR_NOSPACE;
+    }
+    if (GetHeapGap(b)<len) { 
+      SetSlot(b,offset,0,0);
+      SetValLength(b,offset,0);
+      CompactHeap(b);
+    }
+    s.offset=GetHeapTop(b)-len;
+    SetHeapTop(b,s.offset);
+  }
+  memcpy(b.data+s.offset,record,len);
+  SetSlot(b,offset,s.offset,keylen);
+  SetValLength(b,offset,vallen);
+  return ERROR_NOERROR;
+}
+
+
+SIZE_T BTreeNode::GetPrefixLength() const
+{
+  SIZE_T prefixlen=0;
+
+  if (info.format==BTREE_FORMAT_PREFIX && data) { 
+    memcpy(&prefixlen,data,sizeof(SIZE_T));
+  }
+  return prefixlen;
+}
+
+
+SIZE_T BTreeNode::GetKeyWidth() const
+{
+  if (info.format==BTREE_FORMAT_SLOTTED) { 
+    return sizeof(SlottedKey);
+  }
+  return info.keysize-GetPrefixLength();
+}
+
+
+SIZE_T BTreeNode::GetSlotSize() const
+{
+  switch (info.nodetype) { 
+  case BTREE_INTERIOR_NODE:
+  case BTREE_ROOT_NODE:
+    return GetKeyWidth()+sizeof(SIZE_T);
+  case BTREE_LEAF_NODE:
+    if (info.format==BTREE_FORMAT_SLOTTED) { 
+      return GetKeyWidth()+sizeof(SIZE_T);
+    }
+    return GetKeyWidth()+info.valuesize;
+  default:
+    return 0;
+  }
+}
+
+
+SIZE_T BTreeNode::GetNumSlots() const
+{
+  if (info.nodetype==BTREE_OVERFLOW_NODE) { 
+    return (info.GetNumDataBytes()-sizeof(SIZE_T))/info.valuesize;  // floor intended
+  }
+  switch (info.format) { 
+  case BTREE_FORMAT_FIXED:
+  case BTREE_FORMAT_SOA:
+    return info.nodetype==BTREE_LEAF_NODE ? info.GetNumSlotsAsLeaf() : info.GetNumSlotsAsInterior();
+  case BTREE_FORMAT_PREFIX:
+    return (info.GetNumDataBytes()-HeaderBytes(info,data)-sizeof(SIZE_T))/GetSlotSize();  // floor intended
+  case BTREE_FORMAT_SLOTTED:
+    return (info.GetNumDataBytes()-HeaderBytes(info,data)-sizeof(SIZE_T))/
+      (GetSlotSize()+info.keysize+(info.nodetype==BTREE_LEAF_NODE ? info.valuesize : 0));  // floor intended
+  default:
+    return 0;
+  }
+}
+
+
+SIZE_T BTreeNode::GetNumUsedBytes() const
+{
+  SIZE_T n=HeaderBytes(info,data)+sizeof(SIZE_T)+info.numkeys*GetSlotSize();
+
+  if (info.format==BTREE_FORMAT_SLOTTED) { 
+    for (SIZE_T i=0;i<info.numkeys;i++) { 
+      n+=GetSlot(*this,i).length+GetValLength(*this,i);
+    }
+  }
+  return n;
+}
+
+
+SIZE_T BTreeNode::GetRecordSize(const SIZE_T keylength, const SIZE_T valuelength) const
+{
+  SIZE_T need=GetSlotSize();
+
+  if (info.format==BTREE_FORMAT_SLOTTED) { 
+    need+=MIN(keylength,info.keysize);
+    if (info.nodetype==BTREE_LEAF_NODE) { 
+      need+=MIN(valuelength,info.valuesize);
+    }
+  }
+  return need;
+}
+
+
+bool BTreeNode::HasRoomFor(const SIZE_T keylength, const SIZE_T valuelength) const
+{
+  return GetNumUsedBytes()+GetRecordSize(keylength,valuelength)<=info.GetNumDataBytes();
+}
+
+
+char * BTreeNode::ResolveSlot(const SIZE_T offset) const
 {
   switch (info.nodetype) { 
   case BTREE_INTERIOR_NODE:
   case BTREE_ROOT_NODE:
-    assert(offset<info.numkeys);
-    return data+sizeof(SIZE_T)+offset*(sizeof(SIZE_T)+info.keysize);
-    break;
   case BTREE_LEAF_NODE:
     assert(offset<info.numkeys);
-    return data+sizeof(SIZE_T)+offset*(info.keysize+info.valuesize);
+    if (info.format==BTREE_FORMAT_SOA) { 
+      return data+sizeof(SIZE_T)+offset*info.keysize;
+    }
+    return data+HeaderBytes(info,data)+sizeof(SIZE_T)+offset*GetSlotSize();
     break;
   default:
     return 0;
@@ -158,15 +623,34 @@ char * BTreeNode::ResolveKey(const SIZE_T offset) const
 }
 
 
+char * BTreeNode::ResolveKey(const SIZE_T offset) const
+{
+  char *p=ResolveSlot(offset);
+
+  if (p && info.format==BTREE_FORMAT_SLOTTED) { 
+    return data+GetSlot(*this,offset).offset;
+  }
+  return p;
+}
+
+
 char * BTreeNode::ResolvePtr(const SIZE_T offset) const
 {
   switch (info.nodetype) { 
   case BTREE_INTERIOR_NODE:
   case BTREE_ROOT_NODE:
     assert(offset<=info.numkeys);
-    return data+offset*(sizeof(SIZE_T)+info.keysize);
+    if (info.format==BTREE_FORMAT_SOA && offset>0) { 
+      return data+sizeof(SIZE_T)+GetNumSlots()*info.keysize+(offset-1)*sizeof(SIZE_T);
+    }
+    return data+HeaderBytes(info,data)+offset*GetSlotSize();
     break;
   case BTREE_LEAF_NODE:
+    assert(offset==0);
+    return data+HeaderBytes(info,data);
+    break;
+  case BTREE_OVERFLOW_NODE:
+    // the next block in the chain
     assert(offset==0);
     return data;
     break;
@@ -182,7 +666,13 @@ char * BTreeNode::ResolveVal(const SIZE_T offset) const
   switch (info.nodetype) { 
   case BTREE_LEAF_NODE:
     assert(offset<info.numkeys);
-    return data+sizeof(SIZE_T)+offset*(info.keysize+info.valuesize)+info.keysize;
+    if (info.format==BTREE_FORMAT_SOA) { 
+      return data+sizeof(SIZE_T)+GetNumSlots()*info.keysize+offset*info.valuesize;
+    }
+    if (info.format==BTREE_FORMAT_SLOTTED) { 
+      return ResolveKey(offset)+GetSlot(*this,offset).length;
+    }
+    return ResolveKey(offset)+GetKeyWidth();
     break;
   default:
     return 0;
@@ -199,13 +689,22 @@ char * BTreeNode::ResolveKeyVal(const SIZE_T offset) const
 ERROR_T BTreeNode::GetKey(const SIZE_T offset, KEY_T &k) const
 {
   char *p=ResolveKey(offset);
+  SIZE_T prefixlen=GetPrefixLength();
 
   if (p==0) { 
     return ERROR_NOMEM;
   }
+
+  if (info.format==BTREE_FORMAT_SLOTTED) { 
+    SIZE_T len=GetSlot(*this,offset).length;
+    k.Resize(len,false);
+    memcpy(k.data,p,len);
+    return ERROR_NOERROR;
+  }
   
   k.Resize(info.keysize,false);
-  memcpy(k.data,p,info.keysize);
+  memcpy(k.data,data+sizeof(SIZE_T),prefixlen);
+  memcpy(k.data+prefixlen,p,info.keysize-prefixlen);
   return ERROR_NOERROR;
 }
 
@@ -228,6 +727,13 @@ ERROR_T BTreeNode::GetVal(const SIZE_T offset, VALUE_T &v) const
   if (p==0) { 
     return ERROR_NOMEM;
   }
+
+  if (info.format==BTREE_FORMAT_SLOTTED) { 
+    SIZE_T len=GetValLength(*this,offset);
+    v.Resize(len,false);
+    memcpy(v.data,p,len);
+    return ERROR_NOERROR;
+  }
   
   v.Resize(info.valuesize,false);
   memcpy(v.data,p,info.valuesize);
@@ -247,15 +753,42 @@ ERROR_T BTreeNode::GetKeyVal(const SIZE_T offset, KeyValuePair &p) const
 }
 
 
+// Copies bytes [from,from+len) of k, padding short keys with zeros
+static void CopyKeyBytes(char *p, const KEY_T &k, const SIZE_T from, const SIZE_T len)
+{
+  SIZE_T have = k.length>from ? MIN(len,k.length-from) : 0;
+
+  memcpy(p,k.data+from,have);
+  memset(p+have,0,len-have);
+}
+
+
 ERROR_T BTreeNode::SetKey(const SIZE_T offset, const KEY_T &k)
 {
   char *p=ResolveKey(offset);
+  SIZE_T prefixlen=GetPrefixLength();
 
   if (p==0) { 
     return ERROR_NOMEM;
   }
 
-  memcpy(p,k.data,info.keysize);
+  if (info.format==BTREE_FORMAT_SLOTTED) { 
+    // keys are stored at their own length
+    SlottedKey s=GetSlot(*this,offset);
+    return SetRecord(*this,offset,(const char *)k.data,MIN(k.length,info.keysize),
+		     data+s.offset+s.length,GetValLength(*this,offset));
+  }
+
+  if (prefixlen>0) { 
+    // the key has to be within the node's fences
+    char prefix[prefixlen];
+    CopyKeyBytes(prefix,k,0,prefixlen);
+    if (memcmp(prefix,data+sizeof(SIZE_T),prefixlen)) { 
+      return ERROR_INSANE;
+    }
+  }
+
+  CopyKeyBytes(p,k,prefixlen,info.keysize-prefixlen);
 
   return ERROR_NOERROR;
 }
@@ -283,8 +816,18 @@ ERROR_T BTreeNode::SetVal(const SIZE_T offset, const VALUE_T &v)
   if (p==0) { 
     return ERROR_NOMEM;
   }
+
+  if (info.format==BTREE_FORMAT_SLOTTED) { 
+    // values are stored at their own length
+    SlottedKey s=GetSlot(*this,offset);
+    return SetRecord(*this,offset,data+s.offset,s.length,
+		     (const char *)v.data,MIN(v.length,info.valuesize));
+  }
   
-  memcpy(p,v.data,info.valuesize);
+  memcpy(p,v.data,MIN(info.valuesize,v.length));
+  if (v.length<info.valuesize) { 
+    memset(p+v.length,0,info.valuesize-v.length);
+  }
   
   return ERROR_NOERROR;
 }
@@ -304,6 +847,719 @@ ERROR_T BTreeNode::SetKeyVal(const SIZE_T offset, const KeyValuePair &p)
 
 
 
+// Compares the len bytes at p with bytes [from,from+len) of k
+// A short key compares as if it were padded with zeros
+static int CompareKeyBytes(const BYTE_T *p, const KEY_T &k, const SIZE_T from, const SIZE_T len)
+{
+  SIZE_T n = k.length>from ? MIN(len,k.length-from) : 0;
+  int c=memcmp(p,k.data+from,n);
+
+  if (c!=0) { 
+    return c;
+  }
+  for (SIZE_T i=n;i<len;i++) { 
+    if (p[i]) { 
+      return 1;
+    }
+  }
+  return 0;
+}
+
+
+int BTreeNode::CompareKey(const SIZE_T offset, const KEY_T &k) const
+{
+  SIZE_T prefixlen=GetPrefixLength();
+  int c;
+
+  if (info.format==BTREE_FORMAT_SLOTTED) { 
+    SlottedKey s=GetSlot(*this,offset);
+    c=CompareKeyBytes((const BYTE_T *)data+s.offset,k,0,s.length);
+    if (c!=0) { 
+      return c;
+    }
+    if (info.nodetype==BTREE_LEAF_NODE) { 
+      // a short key is as if it were padded with zeros
+      for (SIZE_T i=s.length;i<k.length && i<info.keysize;i++) { 
+	if (k.data[i]) { 
+	  return -1;
+	}
+      }
+      return 0;
+    }
+    // a separator that is a proper prefix of a key sorts before it
+    return s.length<info.keysize ? -1 : 0;
+  }
+
+  if (prefixlen>0) { 
+    c=CompareKeyBytes((const BYTE_T *)data+sizeof(SIZE_T),k,0,prefixlen);
+    if (c!=0) { 
+      return c;
+    }
+  }
+  return CompareKeyBytes((const BYTE_T *)ResolveKey(offset),k,prefixlen,info.keysize-prefixlen);
+}
+
+
+bool BTreeNode::SearchKey(const KEY_T &k, SIZE_T &offset) const
+{
+  SIZE_T lo=0;
+  SIZE_T hi=info.numkeys;
+  SIZE_T prefixlen=GetPrefixLength();
+  SIZE_T width=info.keysize-prefixlen;
+  KeySearchFn kernel=GetKeySearch(width);
+
+  if (info.format==BTREE_FORMAT_SLOTTED) { 
+    // keys of any length, each compared through its slot
+    while (lo<hi) { 
+      SIZE_T mid=lo+(hi-lo)/2;
+      if (CompareKey(mid,k)<0) { 
+	lo=mid+1;
+      } else {
+	hi=mid;
+      }
+    }
+    offset=lo;
+    return offset<info.numkeys && CompareKey(offset,k)==0;
+  }
+
+  if (prefixlen>0) { 
+    // Compare against the node's prefix once, then only the suffixes
+    int c=CompareKeyBytes((const BYTE_T *)data+sizeof(SIZE_T),k,0,prefixlen);
+    if (c!=0) { 
+      // the key is outside the node's fences
+      offset = c>0 ? 0 : info.numkeys;
+      return false;
+    }
+  }
+
+  if (kernel && info.numkeys>0 && k.length>=info.keysize) { 
+    // small fixed size keys (or suffixes) have a vectorized search
+    SIZE_T stride = info.format==BTREE_FORMAT_SOA ? info.keysize : GetSlotSize();
+    offset=kernel((const BYTE_T *)ResolveKey(0),stride,info.numkeys,k.data+prefixlen);
+  } else {
+    while (lo<hi) { 
+      SIZE_T mid=lo+(hi-lo)/2;
+      if (CompareKeyBytes((const BYTE_T *)ResolveKey(mid),k,prefixlen,width)<0) { 
+	lo=mid+1;
+      } else {
+	hi=mid;
+      }
+    }
+    offset=lo;
+  }
+
+  return offset<info.numkeys && CompareKeyBytes((const BYTE_T *)ResolveKey(offset),k,prefixlen,width)==0;
+}
+
+
+// After numkeys has grown by one, moves the keys from offset on
+// (and the ptrs or values that go with them) over one place
+static void OpenGap(BTreeNode &b, const SIZE_T offset)
+{
+  SIZE_T n=b.info.numkeys-1-offset;
+  char *p;
+
+  if (b.info.format==BTREE_FORMAT_SLOTTED) { 
+    p=b.ResolveSlot(offset);
+    memmove(p+b.GetSlotSize(),p,n*b.GetSlotSize());
+    // the slot still points at the record that moved over
+    SetSlot(b,offset,0,0);
+    SetValLength(b,offset,0);
+    return;
+  }
+  if (n==0) { 
+    return;
+  }
+  if (b.info.format==BTREE_FORMAT_SOA) { 
+    SIZE_T size = b.info.nodetype==BTREE_LEAF_NODE ? b.info.valuesize : sizeof(SIZE_T);
+    p=b.ResolveKey(offset);
+    memmove(p+b.info.keysize,p,n*b.info.keysize);
+    p = b.info.nodetype==BTREE_LEAF_NODE ? b.ResolveVal(offset) : b.ResolvePtr(offset+1);
+    memmove(p+size,p,n*size);
+  } else {
+    p=b.ResolveSlot(offset);
+    memmove(p+b.GetSlotSize(),p,n*b.GetSlotSize());
+  }
+}
+
+
+ERROR_T BTreeNode::InsertKeyVal(const SIZE_T offset, const KEY_T &k, const VALUE_T &v)
+{
+  ERROR_T rc;
+
+  if (info.nodetype!=BTREE_LEAF_NODE) { 
+    return ERROR_INSANE;
+  }
+  if (!HasRoomFor(k.length,v.length)) { 
+    return ERROR_NOSPACE;
+  }
+  if (info.format==BTREE_FORMAT_SLOTTED && GetHeapGap(*this)<GetSlotSize()) { 
+    // the slots are about to grow into the heap's garbage
+    CompactHeap(*this);
+  }
+
+  info.numkeys++;
+
+  // move the later pairs over one
+  OpenGap(*this,offset);
+
+  if (info.format==BTREE_FORMAT_SLOTTED) { 
+    return SetRecord(*this,offset,(const char *)k.data,MIN(k.length,info.keysize),
+		     (const char *)v.data,MIN(v.length,info.valuesize));
+  }
+
+  rc=SetKey(offset,k);
+  if (rc) { return rc; }
+  return SetVal(offset,v);
+}
+
+
+ERROR_T BTreeNode::InsertKeyPtr(const SIZE_T offset, const KEY_T &k, const SIZE_T &ptr)
+{
+  ERROR_T rc;
+
+  if (info.nodetype!=BTREE_INTERIOR_NODE && info.nodetype!=BTREE_ROOT_NODE) { 
+    return ERROR_INSANE;
+  }
+  if (!HasRoomFor(k.length)) { 
+    return ERROR_NOSPACE;
+  }
+  if (info.format==BTREE_FORMAT_SLOTTED && GetHeapGap(*this)<GetSlotSize()) { 
+    // the slots are about to grow into the heap's garbage
+    CompactHeap(*this);
+  }
+
+  info.numkeys++;
+
+  // move the later key/ptr pairs over one
+  OpenGap(*this,offset);
+
+  rc=SetKey(offset,k);
+  if (rc) { return rc; }
+  return SetPtr(offset+1,ptr);
+}
+
+
+// Before numkeys shrinks by one, moves the keys after offset (and
+// the ptrs or values that go with them) back over it
+static void CloseGap(BTreeNode &b, const SIZE_T offset)
+{
+  SIZE_T n=b.info.numkeys-1-offset;
+  char *p;
+
+  if (n==0) { 
+    return;
+  }
+  if (b.info.format==BTREE_FORMAT_SOA) { 
+    SIZE_T size = b.info.nodetype==BTREE_LEAF_NODE ? b.info.valuesize : sizeof(SIZE_T);
+    p=b.ResolveKey(offset);
+    memmove(p,p+b.info.keysize,n*b.info.keysize);
+    p = b.info.nodetype==BTREE_LEAF_NODE ? b.ResolveVal(offset) : b.ResolvePtr(offset+1);
+    memmove(p,p+size,n*size);
+  } else {
+    // a slotted node's record is left in the heap as garbage
+    p=b.ResolveSlot(offset);
+    memmove(p,p+b.GetSlotSize(),n*b.GetSlotSize());
+  }
+}
+
+
+ERROR_T BTreeNode::DeleteKeyVal(const SIZE_T offset)
+{
+  if (info.nodetype!=BTREE_LEAF_NODE) { 
+    return ERROR_INSANE;
+  }
+  if (offset>=info.numkeys) { 
+    return ERROR_NONEXISTENT;
+  }
+
+  CloseGap(*this,offset);
+  info.numkeys--;
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeNode::DeleteKeyPtr(const SIZE_T offset)
+{
+  if (info.nodetype!=BTREE_INTERIOR_NODE && info.nodetype!=BTREE_ROOT_NODE) { 
+    return ERROR_INSANE;
+  }
+  if (offset>=info.numkeys) { 
+    return ERROR_NONEXISTENT;
+  }
+
+  CloseGap(*this,offset);
+  info.numkeys--;
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeNode::Split(BTreeNode &rhs, KEY_T &midkey)
+{
+  SIZE_T numLHS, numRHS;
+  ERROR_T rc;
+
+  if (rhs.info.format!=info.format || rhs.info.numkeys!=0) { 
+    return ERROR_INSANE;
+  }
+
+  if (info.format==BTREE_FORMAT_SLOTTED && info.nodetype==BTREE_LEAF_NODE) { 
+    // the records live in the heap, so move them over one at a time
+    KEY_T key;
+    VALUE_T val;
+
+    numLHS = (info.numkeys+1)/2;
+    numRHS = info.numkeys-numLHS;
+
+    rc=GetKey(numLHS-1,midkey);
+    if (rc) { return rc; }
+
+    for (SIZE_T i=0;i<numRHS;i++) { 
+      rc=GetKey(numLHS+i,key);
+      if (rc) { return rc; }
+      rc=GetVal(numLHS+i,val);
+      if (rc) { return rc; }
+      rc=rhs.InsertKeyVal(i,key,val);
+      if (rc) { return rc; }
+    }
+
+    info.numkeys=numLHS;
+    CompactHeap(*this);
+    return ERROR_NOERROR;
+  }
+
+  if (info.format==BTREE_FORMAT_SLOTTED) { 
+    // the keys live in the heap, so move them over one at a time
+    KEY_T key;
+    SIZE_T ptr;
+
+    numLHS = info.numkeys/2;
+    numRHS = info.numkeys-numLHS-1;
+
+    rc=GetKey(numLHS,midkey);
+    if (rc) { return rc; }
+    rc=GetPtr(numLHS+1,ptr);
+    if (rc) { return rc; }
+    rc=rhs.SetPtr(0,ptr);
+    if (rc) { return rc; }
+
+    for (SIZE_T i=0;i<numRHS;i++) { 
+      rc=GetKey(numLHS+1+i,key);
+      if (rc) { return rc; }
+      rc=GetPtr(numLHS+2+i,ptr);
+      if (rc) { return rc; }
+      rc=rhs.InsertKeyPtr(i,key,ptr);
+      if (rc) { return rc; }
+    }
+
+    info.numkeys=numLHS;
+    CompactHeap(*this);
+    return ERROR_NOERROR;
+  }
+
+  // rhs starts out with our prefix, so slots can be copied as is
+  memcpy(rhs.data,data,HeaderBytes(info,data));
+
+  if (info.nodetype==BTREE_LEAF_NODE) { 
+    // the last key on the left is the separator
+    numLHS = (info.numkeys+1)/2;
+    numRHS = info.numkeys-numLHS;
+
+    rc=GetKey(numLHS-1,midkey);
+    if (rc) { return rc; }
+
+    rhs.info.numkeys=numRHS;
+    if (numRHS>0 && info.format==BTREE_FORMAT_SOA) { 
+      memcpy(rhs.ResolveKey(0),ResolveKey(numLHS),numRHS*info.keysize);
+      memcpy(rhs.ResolveVal(0),ResolveVal(numLHS),numRHS*info.valuesize);
+    } else if (numRHS>0) { 
+      memcpy(rhs.ResolveKey(0),ResolveKey(numLHS),numRHS*GetSlotSize());
+    }
+  } else {
+    // the middle key moves up, the keys and ptrs after it move right
+    numLHS = info.numkeys/2;
+    numRHS = info.numkeys-numLHS-1;
+
+    rc=GetKey(numLHS,midkey);
+    if (rc) { return rc; }
+
+    rhs.info.numkeys=numRHS;
+    if (info.format==BTREE_FORMAT_SOA) { 
+      memcpy(rhs.ResolvePtr(0),ResolvePtr(numLHS+1),sizeof(SIZE_T));
+      if (numRHS>0) { 
+	memcpy(rhs.ResolveKey(0),ResolveKey(numLHS+1),numRHS*info.keysize);
+	memcpy(rhs.ResolvePtr(1),ResolvePtr(numLHS+2),numRHS*sizeof(SIZE_T));
+      }
+    } else {
+      memcpy(rhs.ResolvePtr(0),ResolvePtr(numLHS+1),numRHS*GetSlotSize()+sizeof(SIZE_T));
+    }
+  }
+
+  info.numkeys=numLHS;
+
+  return ERROR_NOERROR;
+}
+
+
+//
+// The B-link trailer follows the data: the right link, the lengths
+// of the two fences, then the fences themselves
+//
+static char *BlinkTrailer(const BTreeNode &b)
+{
+  return b.data+b.info.GetNumDataBytes();
+}
+
+
+// which is 0 for lo, 1 for hi
+static void SetBlinkFence(BTreeNode &b, const SIZE_T which, const KEY_T *k)
+{
+  char *t=BlinkTrailer(b);
+  SIZE_T len = k ? MIN(k->length,b.info.keysize) : BTREE_NOFENCE;
+
+  memcpy(t+(1+which)*sizeof(SIZE_T),&len,sizeof(SIZE_T));
+  if (k) { 
+    memcpy(t+3*sizeof(SIZE_T)+which*b.info.keysize,k->data,len);
+  }
+}
+
+
+// Compares a fence with k, the way an interior node compares its
+// separators (see CompareKey), into c.  Returns false, leaving c
+// alone, if there is no such fence.
+static bool CompareBlinkFence(const BTreeNode &b, const SIZE_T which, const KEY_T &k, int &c)
+{
+  const char *t=BlinkTrailer(b);
+  const BYTE_T *f=(const BYTE_T *)t+3*sizeof(SIZE_T)+which*b.info.keysize;
+  SIZE_T len;
+
+  memcpy(&len,t+(1+which)*sizeof(SIZE_T),sizeof(SIZE_T));
+  if (len==BTREE_NOFENCE) { 
+    return false;
+  }
+  c=CompareKeyBytes(f,k,0,len);
+  if (c!=0 || len>=b.info.keysize) { 
+    return true;
+  }
+  if (b.info.format==BTREE_FORMAT_SLOTTED) { 
+    // a separator that is a proper prefix of a key sorts before it
+    c=-1;
+    return true;
+  }
+  // otherwise it is as if it were padded with zeros
+  for (SIZE_T i=len;i<k.length && i<b.info.keysize;i++) { 
+    if (k.data[i]) { 
+      c=-1;
+      return true;
+    }
+  }
+  return true;
+}
+
+
+ERROR_T BTreeNode::SetFences(const KEY_T *lo, const KEY_T *hi)
+{
+  SIZE_T oldlen;
+  SIZE_T newlen=0;
+
+  if (info.flags & BTREE_FLAG_BLINK) { 
+    SetBlinkFence(*this,0,lo);
+    SetBlinkFence(*this,1,hi);
+  }
+
+  oldlen=GetPrefixLength();
+  if (info.format!=BTREE_FORMAT_PREFIX) { 
+    return ERROR_NOERROR;
+  }
+
+  // every key between lo and hi shares their common prefix
+  if (lo && hi) { 
+    SIZE_T n=MIN(info.keysize,MIN(lo->length,hi->length));
+    while (newlen<n && lo->data[newlen]==hi->data[newlen]) { 
+      newlen++;
+    }
+  }
+
+  if (newlen==oldlen) { 
+    return ERROR_NOERROR;
+  }
+
+  // Decode everything and write it back with the new prefix
+  BTreeNode old(*this);
+  SIZE_T oldwidth=info.keysize-oldlen;
+  SIZE_T newwidth=info.keysize-newlen;
+  SIZE_T payload=GetSlotSize()-oldwidth;
+  SIZE_T n=info.numkeys;
+  char key[info.keysize];
+
+  if (sizeof(SIZE_T)+newlen+sizeof(SIZE_T)+n*(newwidth+payload) > info.GetNumDataBytes()) { 
+    return ERROR_NOSPACE;
+  }
+
+  memcpy(data,&newlen,sizeof(SIZE_T));
+  if (newlen>0) { 
+    CopyKeyBytes(data+sizeof(SIZE_T),*hi,0,newlen);
+  }
+
+  // the leading ptr
+  memcpy(ResolvePtr(0),old.ResolvePtr(0),sizeof(SIZE_T));
+
+  for (SIZE_T i=0;i<n;i++) { 
+    const char *src=old.ResolveKey(i);
+    memcpy(key,old.data+sizeof(SIZE_T),oldlen);
+    memcpy(key+oldlen,src,oldwidth);
+    assert(!memcmp(key,data+sizeof(SIZE_T),newlen));
+    char *dst=ResolveKey(i);
+    memcpy(dst,key+newlen,newwidth);
+    memcpy(dst+newwidth,src+oldwidth,payload);
+  }
+
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeNode::GetRightLink(SIZE_T &p) const
+{
+  if (info.nodetype==BTREE_LEAF_NODE && !(info.flags & BTREE_FLAG_COW)) { 
+    return GetPtr(0,p);
+  }
+  p=0;
+  if (info.flags & BTREE_FLAG_BLINK) { 
+    memcpy(&p,BlinkTrailer(*this),sizeof(SIZE_T));
+  }
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeNode::SetRightLink(const SIZE_T p)
+{
+  if (info.nodetype==BTREE_LEAF_NODE && !(info.flags & BTREE_FLAG_COW)) { 
+    return SetPtr(0,p);
+  }
+  if (info.flags & BTREE_FLAG_BLINK) { 
+    memcpy(BlinkTrailer(*this),&p,sizeof(SIZE_T));
+  }
+  return ERROR_NOERROR;
+}
+
+
+int BTreeNode::CompareFences(const KEY_T &k) const
+{
+  int c;
+
+  if (!(info.flags & BTREE_FLAG_BLINK)) { 
+    return 0;
+  }
+  if (CompareBlinkFence(*this,0,k,c) && c>=0) { 
+    return -1;
+  }
+  if (CompareBlinkFence(*this,1,k,c) && c<0) { 
+    return 1;
+  }
+  return 0;
+}
+
+
+//
+// The message buffer follows the data and any B-link trailer: the
+// bytes of messages in use, then the messages themselves
+//
+#define MSG_HEADER_BYTES 5   // OP KEYLEN VALLEN
+
+static char *MessageBuffer(const BTreeNode &b)
+{
+  return b.data+b.info.GetNumBodyBytes()-BufferBytes(b.info);
+}
+
+
+static SIZE_T GetBufferUsed(const BTreeNode &b)
+{
+  SIZE_T used;
+
+  memcpy(&used,MessageBuffer(b),sizeof(SIZE_T));
+  return used;
+}
+
+
+// Stored lengths of a message's key and value
+static void MessageLengths(const BTreeNode &b, const BTreeMessage &m,
+			   SIZE_T &keylen, SIZE_T &vallen)
+{
+  if (b.info.format==BTREE_FORMAT_SLOTTED) { 
+    keylen=MIN(m.key.length,b.info.keysize);
+    vallen=MIN(m.value.length,b.info.valuesize);
+  } else {
+    keylen=b.info.keysize;
+    vallen=b.info.valuesize;
+  }
+  if (m.op!=BTREE_MSG_PUT) { 
+    vallen=0;
+  }
+}
+
+
+// Decodes the message at p, of at most left bytes
+static bool ReadMessageHeader(const char *p, const SIZE_T left, BYTE_T &op,
+			      SIZE_T &keylen, SIZE_T &vallen)
+{
+  unsigned short kl, vl;
+
+  if (left<MSG_HEADER_BYTES) { 
+    return false;
+  }
+  op=p[0];
+  memcpy(&kl,p+1,2);
+  memcpy(&vl,p+3,2);
+  keylen=kl;
+  vallen=vl;
+  return (op==BTREE_MSG_PUT || op==BTREE_MSG_DELETE) &&
+    MSG_HEADER_BYTES+keylen+vallen<=left;
+}
+
+
+SIZE_T BTreeNode::GetBufferSize() const
+{
+  SIZE_T n=BufferBytes(info);
+
+  return n>sizeof(SIZE_T) ? n-sizeof(SIZE_T) : 0;
+}
+
+
+SIZE_T BTreeNode::GetMessageSize(const BTreeMessage &m) const
+{
+  SIZE_T keylen, vallen;
+
+  MessageLengths(*this,m,keylen,vallen);
+  return MSG_HEADER_BYTES+keylen+vallen;
+}
+
+
+ERROR_T BTreeNode::GetMessages(vector<BTreeMessage> &msgs) const
+{
+  msgs.clear();
+  if (GetBufferSize()==0) { 
+    return ERROR_NOERROR;
+  }
+
+  SIZE_T used=GetBufferUsed(*this);
+  const char *p=MessageBuffer(*this)+sizeof(SIZE_T);
+  SIZE_T keylen, vallen;
+  BYTE_T op;
+
+  if (used>GetBufferSize()) { 
+    return ERROR_INSANE;
+  }
+  while (used>0) { 
+    if (!ReadMessageHeader(p,used,op,keylen,vallen)) { 
+      return ERROR_INSANE;
+    }
+    msgs.push_back(BTreeMessage());
+    BTreeMessage &m=msgs.back();
+    m.op=op;
+    if (m.key.Resize(keylen,false) || m.value.Resize(vallen,false)) { 
+      return ERROR_NOMEM;
+    }
+    memcpy(m.key.data,p+MSG_HEADER_BYTES,keylen);
+    memcpy(m.value.data,p+MSG_HEADER_BYTES+keylen,vallen);
+    p+=MSG_HEADER_BYTES+keylen+vallen;
+    used-=MSG_HEADER_BYTES+keylen+vallen;
+  }
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeNode::SetMessages(const vector<BTreeMessage> &msgs)
+{
+  SIZE_T used=0;
+  SIZE_T keylen, vallen;
+
+  for (SIZE_T i=0; i<msgs.size(); i++) { 
+    used+=GetMessageSize(msgs[i]);
+  }
+  if (used>GetBufferSize()) { 
+    return ERROR_NOSPACE;
+  }
+  if (BufferBytes(info)==0) { 
+    // no buffer, and nothing to put in it
+    return ERROR_NOERROR;
+  }
+
+  char *p=MessageBuffer(*this);
+  memcpy(p,&used,sizeof(SIZE_T));
+  p+=sizeof(SIZE_T);
+  for (SIZE_T i=0; i<msgs.size(); i++) { 
+    const BTreeMessage &m=msgs[i];
+    unsigned short kl, vl;
+
+    MessageLengths(*this,m,keylen,vallen);
+    kl=keylen;
+    vl=vallen;
+    p[0]=m.op;
+    memcpy(p+1,&kl,2);
+    memcpy(p+3,&vl,2);
+    CopyKeyBytes(p+MSG_HEADER_BYTES,m.key,0,keylen);
+    CopyKeyBytes(p+MSG_HEADER_BYTES+keylen,m.value,0,vallen);
+    p+=MSG_HEADER_BYTES+keylen+vallen;
+  }
+  return ERROR_NOERROR;
+}
+
+
+// Compares len bytes at p with k, both as if padded with zeros to keysize
+static int CompareMessageKey(const char *p, const SIZE_T len, const KEY_T &k,
+			     const SIZE_T keysize)
+{
+  for (SIZE_T i=0; i<keysize; i++) { 
+    BYTE_T a = i<len ? p[i] : 0;
+    BYTE_T b = i<k.length ? k.data[i] : 0;
+    if (a!=b) { 
+      return a<b ? -1 : 1;
+    }
+  }
+  return 0;
+}
+
+
+ERROR_T BTreeNode::FindMessage(const KEY_T &k, BTreeMessage &m) const
+{
+  if (GetBufferSize()==0) { 
+    return ERROR_NONEXISTENT;
+  }
+
+  SIZE_T used=GetBufferUsed(*this);
+  const char *p=MessageBuffer(*this)+sizeof(SIZE_T);
+  SIZE_T keylen, vallen;
+  BYTE_T op;
+  int c;
+
+  if (used>GetBufferSize()) { 
+    return ERROR_INSANE;
+  }
+  while (used>0) { 
+    if (!ReadMessageHeader(p,used,op,keylen,vallen)) { 
+      return ERROR_INSANE;
+    }
+    c=CompareMessageKey(p+MSG_HEADER_BYTES,keylen,k,info.keysize);
+    if (c==0) { 
+      m.op=op;
+      if (m.key.Resize(keylen,false) || m.value.Resize(vallen,false)) { 
+	return ERROR_NOMEM;
+      }
+      memcpy(m.key.data,p+MSG_HEADER_BYTES,keylen);
+      memcpy(m.value.data,p+MSG_HEADER_BYTES+keylen,vallen);
+      return ERROR_NOERROR;
+    }
+    if (c>0) { 
+      // in key order, so it isn't further on
+      break;
+    }
+    p+=MSG_HEADER_BYTES+keylen+vallen;
+    used-=MSG_HEADER_BYTES+keylen+vallen;
+  }
+  return ERROR_NONEXISTENT;
+}
+
+
 ostream & BTreeNode::Print(ostream &os) const 
 {
   os << "BTreeNode(info="<<info;
@@ -2,6 +2,7 @@
 #define _btree_ds
 
 #include <iostream>
+#include <vector>
 #include "global.h"
 #include "block.h"
 
@@ -13,6 +14,33 @@ using namespace std;
 #define BTREE_ROOT_NODE 2
 #define BTREE_INTERIOR_NODE 3
 #define BTREE_LEAF_NODE 4
+#define BTREE_OVERFLOW_NODE 5  // part of a long posting list
+#define BTREE_FILTER_NODE 6    // part of the key filter (see btree_filter.h)
+
+// Node formats (how the keys of a node are laid out in its block)
+#define BTREE_FORMAT_FIXED 0   // every key stored at full keysize
+#define BTREE_FORMAT_PREFIX 1  // one common prefix per node plus key suffixes
+#define BTREE_FORMAT_SLOTTED 2 // keys and values of any length, found through a slot directory
+#define BTREE_FORMAT_SOA 3     // all the keys together, then all the ptrs or values
+
+// Node flags, kept beside the format.  Where a format is passed as
+// an int (to BTreeNode, BTreeIndex and NodeFormatFor) its second byte
+// holds the flags, so BTREE_FORMAT_BLINK can be or'ed into a format.
+#define BTREE_FLAG_BLINK 1     // right link and fence keys in every node
+#define BTREE_FORMAT_BLINK (BTREE_FLAG_BLINK<<8)
+#define BTREE_FLAG_COW 2       // nodes are copied on write, and leaves not linked
+#define BTREE_FORMAT_COW (BTREE_FLAG_COW<<8)
+#define BTREE_FLAG_BUFFERED 4  // interior nodes buffer changes on their way down
+#define BTREE_FORMAT_BUFFERED (BTREE_FLAG_BUFFERED<<8)
+#define BTREE_FLAG_MULTI 8     // keys are not unique: a leaf value is a posting list
+#define BTREE_FORMAT_MULTI (BTREE_FLAG_MULTI<<8)
+
+// A posting list keeps up to this many values in the leaf
+#define BTREE_POSTING_INLINE 4
+#define BTREE_POSTING_HEADER (2*sizeof(SIZE_T))
+
+// Slotted nodes address their heap with 16 bit offsets
+#define BTREE_SLOTTED_MAXBLOCKSIZE 65536
 
 
 typedef Block Buffer;
@@ -25,14 +53,28 @@ class BufferCache;
 struct KeyValuePair;
 
 struct NodeMetadata {
-  int nodetype;
+  // nodetype, format and flags share what used to be a single int
+  // nodetype, so on a (little endian) disk written before formats
+  // existed every node reads back as BTREE_FORMAT_FIXED, no flags
+  short nodetype;
+  unsigned char format; //for superblock: the format of new nodes
+  unsigned char flags;  //for superblock: the flags of new nodes
   SIZE_T keysize; 
   SIZE_T valuesize;
   SIZE_T blocksize;
   SIZE_T rootnode; //meaningful only for superblock
   SIZE_T freelist; //meaningful only for superblock or a free block
-  SIZE_T numkeys;
-
+  SIZE_T numkeys;  //for superblock: not a key count, but how many
+                   //blocks the key filter has (see GetFilterBlocks)
+
+  // format | flags<<8
+  int    GetFormatAndFlags() const;
+  // For superblock: the key filter's blocks, which follow the first
+  // root node, 0 for none.  They are kept in numkeys.
+  SIZE_T GetFilterBlocks() const;
+  void   SetFilterBlocks(const SIZE_T n);
+  // bytes after the header: the data, then the B-link trailer if any
+  SIZE_T GetNumBodyBytes() const;
   SIZE_T GetNumDataBytes() const;
   SIZE_T GetNumSlotsAsInterior() const;
   SIZE_T GetNumSlotsAsLeaf() const;
@@ -44,6 +86,20 @@ struct NodeMetadata {
 
 inline ostream & operator<< (ostream &os, const NodeMetadata &node) { return node.Print(os); }
 
+const char *NodeFormatName(const int format);
+// returns -1 for an unknown name; a name ending in "+blink" gives
+// the format with BTREE_FORMAT_BLINK, one ending in "+cow" the
+// format with BTREE_FORMAT_COW, one ending in "+buffered" the
+// format with BTREE_FORMAT_BUFFERED, and one ending in "+multi" the
+// format with BTREE_FORMAT_MULTI
+int NodeFormatFromName(const char *name);
+// The format (and flags) a node of this type gets in a tree of the
+// given format
+int NodeFormatFor(const int treeformat, const int nodetype);
+// A 64 bit hash of key as the tree compares it, as if padded with
+// zeros to keysize, so keys that compare equal hash the same
+unsigned long long KeyHash(const KEY_T &key, const SIZE_T keysize);
+
 
 
 //
@@ -55,7 +111,99 @@ inline ostream & operator<< (ostream &os, const NodeMetadata &node) { return nod
 //
 // PTR* KEY VALUE KEY VALUE KEY VALUE
 //
-// *Here this pointer is not used
+// *Here this pointer is the next leaf to the right (0 for the last
+//  leaf), so the leaves form a chain in key order.  Whatever splits
+//  or removes a leaf has to keep the chain linked.
+//
+// Prefix compressed nodes (BTREE_FORMAT_PREFIX) start with
+//
+// PREFIXLEN PREFIX
+//
+// followed by the layouts above with every key replaced by its
+// last keysize-PREFIXLEN bytes.  The prefix is the common prefix of
+// the node's fence keys (the separators around it in its parent),
+// so every key that can ever land in the node shares it.
+//
+// Slotted nodes (BTREE_FORMAT_SLOTTED) start with
+//
+// HEAPTOP
+//
+// followed by the layouts above with every key replaced by a 4 byte
+// slot (OFFSET LENGTH) locating it in a heap that grows down from the
+// end of the block, and in leaves every value replaced by its
+// length, the value itself following the key in the heap.  Keys and
+// values take only the bytes they have, up to keysize and valuesize.
+// A leaf key compares as if padded with zeros to keysize; a separator
+// that is a proper prefix of a key sorts before it.
+//
+// Structure of arrays nodes (BTREE_FORMAT_SOA) hold as many keys as
+// fixed nodes, but keep them apart from the ptrs and values:
+//
+// Interior: PTR KEY KEY ... KEY PTR PTR ... PTR
+// Leaf:     PTR* KEY KEY ... KEY VALUE VALUE ... VALUE
+//
+// where each array has room for GetNumSlots() entries, so a key
+// search only touches keys.
+//
+// Nodes of a B-link tree (BTREE_FLAG_BLINK) end, in any format, with
+//
+// RIGHTLINK LOLEN HILEN LOKEY HIKEY
+//
+// after their GetNumDataBytes() bytes of data.  RIGHTLINK is the next
+// node to the right on the same level (0 for the last; a leaf keeps
+// using its first ptr), and LOKEY and HIKEY, of keysize bytes, are
+// the node's fences as given to SetFences, a length of
+// BTREE_NOFENCE meaning unbounded.  A thread that reads a node while
+// another splits it can tell from HIKEY that the key it is after has
+// moved right, and from LOKEY that it has come to the wrong node.
+//
+// The interior nodes of a buffered tree (BTREE_FLAG_BUFFERED) give
+// the back half of their body to a buffer of messages:
+//
+// USED MESSAGE MESSAGE ... MESSAGE
+//
+// USED being the bytes of messages, each of which is
+//
+// OP KEYLEN VALLEN KEY VALUE
+//
+// with a one byte OP and two byte lengths.  The messages are in key
+// order, one at most for any key.  Keys and values are kept as a
+// leaf of the same format would keep them: at their own length in a
+// slotted tree, padded with zeros to keysize and valuesize otherwise.
+//
+// In a non-unique tree (BTREE_FLAG_MULTI) the value of each key in
+// its leaf is a posting list of the key's values:
+//
+// COUNT FIRST VALUE VALUE ... VALUE
+//
+// The values are in increasing order, each padded with zeros to the
+// tree's valuesize.  Up to BTREE_POSTING_INLINE of them are kept
+// right there, FIRST being 0.  A longer list is kept in a chain of
+// overflow blocks starting at FIRST, and the leaf has only COUNT and
+// FIRST.  The superblock's valuesize is that of the whole list,
+// BTREE_POSTING_HEADER+BTREE_POSTING_INLINE*valuesize, which is what
+// the leaves make room for.  An overflow block (BTREE_OVERFLOW_NODE,
+// fixed format, no flags, numkeys values) is
+//
+// NEXT VALUE VALUE ... VALUE
+//
+// NEXT being the block that follows in the chain, or 0, and its
+// values all coming before those of NEXT.
+#define BTREE_NOFENCE ((SIZE_T)-1)
+
+
+// A change on its way down a buffered tree
+#define BTREE_MSG_PUT 1        // the key now has value, whether or not it had one
+#define BTREE_MSG_DELETE 2     // the key is gone
+
+struct BTreeMessage {
+  BYTE_T  op;
+  KEY_T   key;
+  VALUE_T value;   // BTREE_MSG_PUT only
+
+  BTreeMessage() : op(BTREE_MSG_PUT) {}
+  BTreeMessage(const BYTE_T o, const KEY_T &k, const VALUE_T &v) : op(o), key(k), value(v) {}
+};
 
 
 struct BTreeNode {
@@ -66,6 +214,11 @@ struct BTreeNode {
   // interior => array of keys
   // leaf => array of key/value pairs
 
+  // A pinned node's data is the cached block itself (see Pin)
+  BufferCache  *pincache;
+  Block        *pinframe;
+  SIZE_T        pinblock;
+
 
   BTreeNode();
   //
@@ -74,14 +227,34 @@ struct BTreeNode {
   //         because we will serialize it directly to disk
   //
   ~BTreeNode();
-  BTreeNode(int node_type, SIZE_T key_size, SIZE_T value_size, SIZE_T block_size);
+  BTreeNode(int node_type, SIZE_T key_size, SIZE_T value_size, SIZE_T block_size,
+	    int node_format=BTREE_FORMAT_FIXED);
   BTreeNode(const BTreeNode &rhs);
   BTreeNode & operator=(const BTreeNode &rhs);
   
   ERROR_T Serialize(BufferCache *b, const SIZE_T block) const;
   ERROR_T Unserialize(BufferCache *b, const SIZE_T block);
+  // Like Unserialize, but without a latch on the block: waits until
+  // nobody is changing it (see BufferCache::ReadBlockUnlatched)
+  ERROR_T UnserializeUnlatched(BufferCache *b, const SIZE_T block);
+
+  // Like Unserialize, but the node works on the block in the cache
+  // rather than a copy, so reading it copies and allocates nothing.
+  // The cache keeps the block until Unpin (or the next Pin or
+  // Unserialize, or the destructor).  Changes go straight into the
+  // cached block, and Serialize to the same block then only writes
+  // the header and marks the block dirty.  A copy of a pinned node
+  // is an ordinary one.
+  ERROR_T Pin(BufferCache *b, const SIZE_T block);
+  void    Unpin();
+  // Rereads a pinned node's header from the cached block, after
+  // someone else may have changed it
+  void    Reload();
 
   char *ResolveKey(const SIZE_T offset) const; // Gives a pointer to the ith key  (interior or leaf)
+                                               // (for a prefix compressed node, its suffix)
+  char *ResolveSlot(const SIZE_T offset) const; // Gives a pointer to where the ith key sits in the
+                                                // layout (for a slotted node, its slot)
   char *ResolvePtr(const SIZE_T offset) const; // Gives a pointer to the ith pointer (interior)
   char *ResolveVal(const SIZE_T offset) const; // Gives a pointer to the ith value (leaf)
   char *ResolveKeyVal(const SIZE_T offset) const ; // Gives a pointer to the ith keyvalue pair (leaf)
@@ -97,6 +270,67 @@ struct BTreeNode {
   ERROR_T SetVal(const SIZE_T offset, const VALUE_T &v); // Writes the ith value (leaf)
   ERROR_T SetKeyVal(const SIZE_T offset, const KeyValuePair &p); // Writes the ith key value pair (leaf)
 
+  // Compares the ith key, in place, with k (<0, 0, >0 like memcmp)
+  int CompareKey(const SIZE_T offset, const KEY_T &k) const;
+  // Binary search for k without copying any keys.
+  // offset is set to the first key >= k (numkeys if there is none)
+  // Returns true if that key is equal to k
+  bool SearchKey(const KEY_T &k, SIZE_T &offset) const;
+
+  // Layout, for any node format
+  SIZE_T GetPrefixLength() const;  // bytes of the common prefix (0 unless prefix compressed)
+  SIZE_T GetKeyWidth() const;      // bytes stored per key (per slot for slotted nodes)
+  SIZE_T GetSlotSize() const;      // bytes per key/ptr or key/value pair
+  SIZE_T GetNumSlots() const;      // keys that fit in this node (at full keysize),
+				   // or values in an overflow block
+  SIZE_T GetNumUsedBytes() const;  // data bytes in use, headers included
+  // bytes one more key of keylength bytes (and its ptr, or value of
+  // valuelength bytes) takes
+  SIZE_T GetRecordSize(const SIZE_T keylength, const SIZE_T valuelength=0) const;
+  // true if one more key of keylength bytes (and its ptr, or value of
+  // valuelength bytes) fits
+  bool   HasRoomFor(const SIZE_T keylength, const SIZE_T valuelength=0) const;
+
+  // Structural changes, for any node format
+  // Both return ERROR_NOSPACE if the node has no room for the key
+  ERROR_T InsertKeyVal(const SIZE_T offset, const KEY_T &k, const VALUE_T &v); // leaf
+  ERROR_T InsertKeyPtr(const SIZE_T offset, const KEY_T &k, const SIZE_T &p);  // interior, p becomes the (offset+1)th pointer
+  // Both return ERROR_NONEXISTENT if there is no key at offset
+  ERROR_T DeleteKeyVal(const SIZE_T offset);  // leaf
+  ERROR_T DeleteKeyPtr(const SIZE_T offset);  // interior, the (offset+1)th pointer goes with the key
+  // Moves the upper half of this node into rhs, an empty node of the
+  // same type and format.  midkey is the key that now separates them
+  ERROR_T Split(BTreeNode &rhs, KEY_T &midkey);
+  // Tells the node which keys bound it in its parent: every key in it is
+  // > lo and <= hi (0 means unbounded).  Prefix compressed nodes
+  // recompress to the common prefix of the two.
+  ERROR_T SetFences(const KEY_T *lo, const KEY_T *hi);
+
+  // B-link nodes.  Leaves link through their first ptr whether or
+  // not they are B-link nodes; other nodes keep no link unless they
+  // are, and SetRightLink does nothing.  Nor do the leaves of a
+  // copy-on-write tree (BTREE_FLAG_COW), where a link would hold on
+  // to the old copy of the leaf it names.
+  ERROR_T GetRightLink(SIZE_T &p) const;
+  ERROR_T SetRightLink(const SIZE_T p);
+  // Where k falls against the fences kept by a B-link node: <0 if
+  // k <= lo, so it belongs further left, >0 if k > hi, so further
+  // right, 0 if it belongs here.  Always 0 for other nodes.
+  int     CompareFences(const KEY_T &k) const;
+
+  // Message buffers, kept by the interior nodes of a buffered tree.
+  // Other nodes have a buffer of no bytes.
+  SIZE_T  GetBufferSize() const;   // bytes the messages can take
+  SIZE_T  GetMessageSize(const BTreeMessage &m) const;  // bytes m takes
+  // The messages, in key order
+  ERROR_T GetMessages(vector<BTreeMessage> &msgs) const;
+  // Replaces the messages with msgs, which must be in key order
+  // return ERROR_NOSPACE if they don't fit
+  ERROR_T SetMessages(const vector<BTreeMessage> &msgs);
+  // The message for k, without copying any others
+  // return ERROR_NONEXISTENT if there is none
+  ERROR_T FindMessage(const KEY_T &k, BTreeMessage &m) const;
+
   ostream &Print(ostream &rhs) const;
 };
 
@@ -0,0 +1,174 @@
+#include <string.h>
+#include "btree_filter.h"
+
+
+BTreeFilter::BTreeFilter() :
+  cache(0), first(0), numblocks(0), keysize(0), blockbytes(0),
+  probes(0), skipped(0), falsepositives(0)
+{
+}
+
+
+SIZE_T BTreeFilter::BlocksFor(const SIZE_T keys, const SIZE_T blocksize)
+{
+  SIZE_T nbits=(blocksize-sizeof(NodeMetadata))*8;
+
+  return (keys*BTREE_FILTER_BITS+nbits-1)/nbits;
+}
+
+
+ERROR_T BTreeFilter::Create(BufferCache *cache, const SIZE_T first, const SIZE_T numblocks)
+{
+  ERROR_T rc;
+
+  for (SIZE_T i=first; i<first+numblocks; i++) {
+    BTreeNode b(BTREE_FILTER_NODE, 0, 0, cache->GetBlockSize(), BTREE_FORMAT_FIXED);
+
+    cache->NotifyAllocateBlock(i);
+    rc=b.Serialize(cache,i);
+    if (rc) { return rc; }
+  }
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeFilter::Attach(BufferCache *c, const SIZE_T f, const SIZE_T n, const SIZE_T k)
+{
+  BTreeNode b;
+  ERROR_T rc;
+
+  cache=c;
+  first=f;
+  numblocks=0;
+  keysize=k;
+  blockbytes=c->GetBlockSize()-sizeof(NodeMetadata);
+  probes=skipped=falsepositives=0;
+
+  bits.assign(n*blockbytes,0);
+  dirty.assign(n,0);
+  for (SIZE_T i=0; i<n; i++) {
+    rc=b.Unserialize(cache,first+i);
+    if (rc) { return rc; }
+    if (b.info.nodetype!=BTREE_FILTER_NODE) {
+      return ERROR_INSANE;
+    }
+    memcpy(&bits[i*blockbytes],b.data,blockbytes);
+  }
+  numblocks=n;
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeFilter::Flush()
+{
+  ERROR_T rc;
+
+  for (SIZE_T i=0; i<numblocks; i++) {
+    if (!dirty[i]) {
+      continue;
+    }
+    BTreeNode b(BTREE_FILTER_NODE, 0, 0, cache->GetBlockSize(), BTREE_FORMAT_FIXED);
+    memcpy(b.data,&bits[i*blockbytes],blockbytes);
+    rc=b.Serialize(cache,first+i);
+    if (rc) { return rc; }
+    dirty[i]=0;
+  }
+  return ERROR_NOERROR;
+}
+
+
+//
+// The block comes from the key's hash and the bits, by double
+// hashing, from that mixed again
+//
+static unsigned long long Mix(unsigned long long h)
+{
+  h ^= h>>30;
+  h *= 0xbf58476d1ce4e5b9ULL;
+  h ^= h>>27;
+  h *= 0x94d049bb133111ebULL;
+  h ^= h>>31;
+  return h;
+}
+
+
+void BTreeFilter::Locate(const KEY_T &key, SIZE_T &block, SIZE_T pos[BTREE_FILTER_HASHES]) const
+{
+  unsigned long long h=KeyHash(key,keysize);
+
+  block=h%numblocks;
+
+  h=Mix(h);
+  unsigned long long a=h>>32, b=(h&0xffffffffULL)|1;
+  for (SIZE_T i=0; i<BTREE_FILTER_HASHES; i++) {
+    pos[i]=block*blockbytes*8+(a+i*b)%(blockbytes*8);
+  }
+}
+
+
+bool BTreeFilter::MayHold(const KEY_T &key)
+{
+  SIZE_T block, pos[BTREE_FILTER_HASHES];
+  bool maybe=true;
+
+  if (!numblocks) {
+    return true;
+  }
+  Locate(key,block,pos);
+  for (SIZE_T i=0; i<BTREE_FILTER_HASHES && maybe; i++) {
+    maybe = (__atomic_load_n(&bits[pos[i]/8],__ATOMIC_RELAXED)>>(pos[i]%8))&1;
+  }
+  Count(maybe);
+  return maybe;
+}
+
+
+bool BTreeFilter::Add(const KEY_T &key)
+{
+  SIZE_T block, pos[BTREE_FILTER_HASHES];
+  bool had=true;
+
+  if (!numblocks) {
+    return true;
+  }
+  Locate(key,block,pos);
+  for (SIZE_T i=0; i<BTREE_FILTER_HASHES; i++) {
+    BYTE_T mask=1<<(pos[i]%8);
+    if (!(__atomic_fetch_or(&bits[pos[i]/8],mask,__ATOMIC_RELAXED)&mask)) {
+      had=false;
+    }
+  }
+  if (!had) {
+    __atomic_store_n(&dirty[block],1,__ATOMIC_RELAXED);
+  }
+  return had;
+}
+
+
+void BTreeFilter::Count(const bool maybe)
+{
+  if (!numblocks) {
+    return;
+  }
+  __atomic_add_fetch(&probes,1,__ATOMIC_RELAXED);
+  if (!maybe) {
+    __atomic_add_fetch(&skipped,1,__ATOMIC_RELAXED);
+  }
+}
+
+
+ERROR_T BTreeFilter::Settle(const ERROR_T rc)
+{
+  if (numblocks && rc==ERROR_NONEXISTENT) {
+    __atomic_add_fetch(&falsepositives,1,__ATOMIC_RELAXED);
+  }
+  return rc;
+}
+
+
+double BTreeFilter::GetFalsePositiveRate() const
+{
+  SIZE_T absent=skipped+falsepositives;
+
+  return absent ? (double)falsepositives/absent : 0;
+}
@@ -0,0 +1,89 @@
+#ifndef _btree_filter
+#define _btree_filter
+
+#include <vector>
+#include "global.h"
+#include "btree_ds.h"
+#include "buffercache.h"
+
+// Bits given to each key the filter is sized for, and how many of
+// them a key sets.  Ten bits and six hashes make about one in a
+// hundred absent keys look present, once the filter is full.
+#define BTREE_FILTER_BITS 10
+#define BTREE_FILTER_HASHES 6
+
+//
+// A Bloom filter of an index's keys, kept in blocks of its own (see
+// BTreeIndex::SetFilterKeys)
+//
+// Each filter block is a BTREE_FILTER_NODE whose body is all bits.
+// Attach reads the blocks into memory, where the filter is asked and
+// changed without going through the buffer cache, and Flush writes
+// the ones that have changed back.  A key whose bits aren't all set
+// was never added, so MayHold can say for certain that it is absent,
+// and the descent it would have taken, with every block it reads,
+// is saved.  A key whose bits are all set is only probably there.
+// A key's bits all fall in the part of the filter one block holds.
+//
+// Bits are never cleared, so a deleted key still looks present
+// until the filter is made again.  Keys are hashed as the tree
+// compares them, as if padded with zeros to keysize.  Bits are set
+// and read atomically, so any number of threads can share a filter.
+//
+class BTreeFilter {
+ private:
+  BufferCache   *cache;
+  SIZE_T         first;       // the first filter block
+  SIZE_T         numblocks;   // 0 if there is no filter
+  SIZE_T         keysize;
+  SIZE_T         blockbytes;  // bytes of bits in each block
+  vector<BYTE_T> bits;        // of every block, one after another
+  vector<BYTE_T> dirty;       // by block, changed since the last Flush
+  SIZE_T         probes;      // keys asked about
+  SIZE_T         skipped;     // of them, certainly absent
+  SIZE_T         falsepositives;  // probably there, but weren't
+
+  void           Locate(const KEY_T &key, SIZE_T &block, SIZE_T pos[BTREE_FILTER_HASHES]) const;
+
+ public:
+  BTreeFilter();
+
+  // How many blocks of blocksize hold a filter for keys keys
+  static SIZE_T BlocksFor(const SIZE_T keys, const SIZE_T blocksize);
+
+  // Writes numblocks empty filter blocks from first on
+  static ERROR_T Create(BufferCache *cache, const SIZE_T first, const SIZE_T numblocks);
+
+  // Reads in the filter from first on, none if numblocks is 0
+  ERROR_T        Attach(BufferCache *cache, const SIZE_T first, const SIZE_T numblocks,
+			const SIZE_T keysize);
+
+  // Writes back the blocks changed since Attach or the last Flush
+  ERROR_T        Flush();
+
+  bool           IsOn() const { return numblocks>0; }
+  SIZE_T         GetNumBlocks() const { return numblocks; }
+
+  // false if key is certainly absent, true if it may be there, or
+  // there's no filter.  Counts the probe.
+  bool           MayHold(const KEY_T &key);
+
+  // Sets key's bits; returns whether they all were already
+  bool           Add(const KEY_T &key);
+
+  // Counts an answer of MayHold's that the caller got another way
+  void           Count(const bool maybe);
+
+  // rc is what an operation on a key MayHold let through came to:
+  // counts a false positive if the key wasn't there, and returns rc
+  ERROR_T        Settle(const ERROR_T rc);
+
+  SIZE_T         GetNumProbes() const { return probes; }
+  SIZE_T         GetNumSkipped() const { return skipped; }
+  SIZE_T         GetNumFalsePositives() const { return falsepositives; }
+  // Of the keys asked about that weren't there, the share that
+  // looked present
+  double         GetFalsePositiveRate() const;
+};
+
+#endif
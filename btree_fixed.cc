@@ -0,0 +1,28 @@
+#include "btree_fixed.h"
+
+
+//
+// The sizes we build specialised code for
+//
+struct FixedLookupEntry {
+  SIZE_T        keysize;
+  SIZE_T        valuesize;
+  FixedLookupFn fn;
+};
+
+static const FixedLookupEntry fixedlookups[] = {
+  {8,  8,  FixedBTree<8,8>::LookupOrUpdate},
+  {16, 16, FixedBTree<16,16>::LookupOrUpdate},
+  {16, 64, FixedBTree<16,64>::LookupOrUpdate},
+};
+
+
+FixedLookupFn GetFixedLookup(const SIZE_T keysize, const SIZE_T valuesize)
+{
+  for (unsigned i=0;i<sizeof(fixedlookups)/sizeof(fixedlookups[0]);i++) {
+    if (fixedlookups[i].keysize==keysize && fixedlookups[i].valuesize==valuesize) {
+      return fixedlookups[i].fn;
+    }
+  }
+  return 0;
+}
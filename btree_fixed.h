@@ -0,0 +1,148 @@
+#ifndef _btree_fixed
+#define _btree_fixed
+
+#include <string.h>
+#include <stdint.h>
+
+#include "btree.h"
+
+//
+// Lookup and update specialised at compile time for BTREE_FORMAT_FIXED
+// trees with a given key and value size
+//
+// They read the same on-disk nodes as BTreeNode, but work on the
+// block the buffer cache hands back instead of unserializing it, and
+// with the sizes known the slot offsets are constants and the key
+// compares can be unrolled.  BTreeIndex picks one of these when it is
+// attached (see GetFixedLookup) and falls back to the general code
+// for everything else.
+//
+
+
+// memcmp order on KEYSIZE bytes
+template <SIZE_T KEYSIZE>
+struct KeyMemcmp {
+  static inline int Compare(const BYTE_T *a, const BYTE_T *b) {
+    return memcmp(a,b,KEYSIZE);
+  }
+};
+
+
+// memcmp order is the order of the keys as big endian integers
+static inline uint64_t LoadKeyWord(const BYTE_T *p)
+{
+  uint64_t x;
+  memcpy(&x,p,8);
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  x=__builtin_bswap64(x);
+#endif
+  return x;
+}
+
+template <>
+struct KeyMemcmp<8> {
+  static inline int Compare(const BYTE_T *a, const BYTE_T *b) {
+    uint64_t x=LoadKeyWord(a), y=LoadKeyWord(b);
+    return (x>y)-(x<y);
+  }
+};
+
+template <>
+struct KeyMemcmp<16> {
+  static inline int Compare(const BYTE_T *a, const BYTE_T *b) {
+    uint64_t x=LoadKeyWord(a), y=LoadKeyWord(b);
+    if (x==y) {
+      x=LoadKeyWord(a+8);
+      y=LoadKeyWord(b+8);
+    }
+    return (x>y)-(x<y);
+  }
+};
+
+
+template <SIZE_T KEYSIZE, SIZE_T VALUESIZE, class COMPARE=KeyMemcmp<KEYSIZE> >
+struct FixedBTree {
+  // bytes per key/ptr and key/value pair, as in BTreeNode::GetSlotSize
+  static const SIZE_T INTERIOR_SLOT = KEYSIZE+sizeof(SIZE_T);
+  static const SIZE_T LEAF_SLOT = KEYSIZE+VALUESIZE;
+
+  // First of n keys, STRIDE bytes apart, that is >= key
+  template <SIZE_T STRIDE>
+  static inline SIZE_T Search(const BYTE_T *keys, const SIZE_T n, const BYTE_T *key) {
+    SIZE_T lo=0, hi=n;
+    while (lo<hi) {
+      SIZE_T mid=lo+(hi-lo)/2;
+      if (COMPARE::Compare(keys+mid*STRIDE,key)<0) {
+	lo=mid+1;
+      } else {
+	hi=mid;
+      }
+    }
+    return lo;
+  }
+
+  // Same contract as BTreeIndex::LookupOrUpdateInternal, for keys of at
+  // least KEYSIZE bytes
+  static ERROR_T LookupOrUpdate(BufferCache *cache,
+				const SIZE_T root,
+				const BTreeOp op,
+				const KEY_T &key,
+				VALUE_T &value) {
+    SIZE_T node=root;
+    NodeMetadata info;
+    SIZE_T offset;
+    ERROR_T rc;
+
+    for (;;) {
+      Block block;
+
+      rc=cache->ReadBlock(node,block);
+      if (rc) { return rc; }
+
+      memcpy(&info,block.data,sizeof(info));
+      if (info.format!=BTREE_FORMAT_FIXED) {
+	return ERROR_INSANE;
+      }
+
+      // the leading ptr, then the slots
+      BYTE_T *slots=block.data+sizeof(info)+sizeof(SIZE_T);
+
+      switch (info.nodetype) {
+      case BTREE_ROOT_NODE:
+      case BTREE_INTERIOR_NODE:
+	if (info.numkeys==0) {
+	  return ERROR_NONEXISTENT;
+	}
+	offset=Search<INTERIOR_SLOT>(slots,info.numkeys,key.data);
+	memcpy(&node,slots-sizeof(SIZE_T)+offset*INTERIOR_SLOT,sizeof(SIZE_T));
+	break;
+      case BTREE_LEAF_NODE:
+	offset=Search<LEAF_SLOT>(slots,info.numkeys,key.data);
+	if (offset>=info.numkeys || COMPARE::Compare(slots+offset*LEAF_SLOT,key.data)!=0) {
+	  return ERROR_NONEXISTENT;
+	}
+	if (op==BTREE_OP_LOOKUP) {
+	  value.Resize(VALUESIZE,false);
+	  memcpy(value.data,slots+offset*LEAF_SLOT+KEYSIZE,VALUESIZE);
+	  return ERROR_NOERROR;
+	} else {
+	  // BTREE_OP_UPDATE, short values are padded with zeros
+	  BYTE_T *v=slots+offset*LEAF_SLOT+KEYSIZE;
+	  SIZE_T n = value.length<VALUESIZE ? value.length : VALUESIZE;
+	  memcpy(v,value.data,n);
+	  memset(v+n,0,VALUESIZE-n);
+	  return cache->WriteBlock(node,block);
+	}
+	break;
+      default:
+	return ERROR_INSANE;
+      }
+    }
+  }
+};
+
+
+// The specialised LookupOrUpdate for these sizes, or 0 if there is none
+FixedLookupFn GetFixedLookup(const SIZE_T keysize, const SIZE_T valuesize);
+
+#endif
@@ -4,7 +4,9 @@
 
 void usage() 
 {
-  cerr << "usage: btree_init filestem cachesize keysize valuesize\n";
+  cerr << "usage: btree_init filestem cachesize keysize valuesize [format [filterkeys]]\n";
+  cerr << "  format is fixed, prefix, slotted or soa, optionally followed by\n";
+  cerr << "  one of +blink, +cow, +buffered or +multi (say prefix+blink)\n";
 }
 
 
@@ -13,8 +15,9 @@ int main(int argc, char **argv)
   char *filestem;
   SIZE_T cachesize, keysize, valuesize;
   SIZE_T superblocknum;
+  int format=BTREE_FORMAT_FIXED;
 
-  if (argc!=5) { 
+  if (argc<5 || argc>7) { 
     usage();
     return -1;
   }
@@ -23,10 +26,17 @@ int main(int argc, char **argv)
   cachesize=atoi(argv[2]);
   keysize=atoi(argv[3]);
   valuesize=atoi(argv[4]);
+  if (argc>=6 && (format=NodeFormatFromName(argv[5]))<0) { 
+    usage();
+    return -1;
+  }
 
   DiskSystem disk(filestem);
   BufferCache cache(&disk,cachesize);
-  BTreeIndex btree(keysize,valuesize,&cache);
+  BTreeIndex btree(keysize,valuesize,&cache,true,format);
+  if (argc==7) { 
+    btree.SetFilterKeys(atoi(argv[6]));
+  }
   
   ERROR_T rc;
 
@@ -0,0 +1,172 @@
+#include <string.h>
+#include "btree_keycache.h"
+
+
+BTreeKeyCache::BTreeKeyCache() :
+  capacity(0), keysize(0), width(0), samples(0), stamp(0),
+  lookups(0), hits(0), admitted(0), rejected(0)
+{
+}
+
+
+void BTreeKeyCache::Reset(const SIZE_T c, const SIZE_T k)
+{
+  MutexHolder hold(lock);
+
+  capacity=c;
+  keysize=k;
+  table.clear();
+  order.clear();
+  // a power of two, for masking
+  for (width=16; width<4*capacity; width*=2) {
+  }
+  sketch.assign(capacity ? BTREE_KEYCACHE_ROWS*width : 0, 0);
+  samples=0;
+  stamp++;
+  lookups=hits=admitted=rejected=0;
+}
+
+
+//
+// As KeyHash sees it: cut to keysize, less any zeros it ends with
+//
+string BTreeKeyCache::Normalize(const KEY_T &key) const
+{
+  SIZE_T len = key.length<keysize ? key.length : keysize;
+
+  while (len>0 && key.data[len-1]==0) {
+    len--;
+  }
+  return string((const char *)key.data,len);
+}
+
+
+//
+// Counters stop at 15, and are all halved once the sketch has
+// counted BTREE_KEYCACHE_SAMPLES keys per entry, so a key that was
+// hot a while ago soon counts for little
+//
+void BTreeKeyCache::CountKey(const unsigned long long h)
+{
+  unsigned long long a=h, b=(h>>32)|1;
+
+  for (SIZE_T r=0; r<BTREE_KEYCACHE_ROWS; r++) {
+    BYTE_T &c=sketch[r*width+((a+r*b)&(width-1))];
+    if (c<15) {
+      c++;
+    }
+  }
+  if (++samples>=BTREE_KEYCACHE_SAMPLES*capacity) {
+    for (SIZE_T i=0; i<sketch.size(); i++) {
+      sketch[i]>>=1;
+    }
+    samples/=2;
+  }
+}
+
+
+SIZE_T BTreeKeyCache::Frequency(const unsigned long long h) const
+{
+  unsigned long long a=h, b=(h>>32)|1;
+  SIZE_T f=15;
+
+  for (SIZE_T r=0; r<BTREE_KEYCACHE_ROWS; r++) {
+    BYTE_T c=sketch[r*width+((a+r*b)&(width-1))];
+    if (c<f) {
+      f=c;
+    }
+  }
+  return f;
+}
+
+
+bool BTreeKeyCache::Find(const KEY_T &key, VALUE_T &value, SIZE_T &s)
+{
+  if (!capacity) {
+    return false;
+  }
+
+  MutexHolder hold(lock);
+  string k=Normalize(key);
+
+  lookups++;
+  CountKey(KeyHash(key,keysize));
+  Table::iterator i=table.find(k);
+  if (i==table.end()) {
+    s=stamp;
+    return false;
+  }
+  if (value.Resize(i->second.value.size(),false)) {
+    s=stamp;
+    return false;
+  }
+  memcpy(value.data,i->second.value.data(),value.length);
+  order.splice(order.begin(),order,i->second.where);
+  hits++;
+  return true;
+}
+
+
+void BTreeKeyCache::Admit(const KEY_T &key, const VALUE_T &value, const SIZE_T s)
+{
+  if (!capacity) {
+    return;
+  }
+
+  MutexHolder hold(lock);
+  string k=Normalize(key);
+  unsigned long long h=KeyHash(key,keysize);
+
+  if (s!=stamp) {
+    // something changed since the lookup began, maybe this key
+    rejected++;
+    return;
+  }
+  Table::iterator i=table.find(k);
+  if (i!=table.end()) {
+    // another lookup got here first
+    return;
+  }
+  if (table.size()>=capacity) {
+    Table::iterator victim=table.find(order.back());
+    if (Frequency(h)<=Frequency(victim->second.hash)) {
+      rejected++;
+      return;
+    }
+    order.pop_back();
+    table.erase(victim);
+  }
+  order.push_front(k);
+  Entry &e=table[k];
+  e.value.assign((const char *)value.data,value.length);
+  e.hash=h;
+  e.where=order.begin();
+  admitted++;
+}
+
+
+void BTreeKeyCache::Forget(const KEY_T &key)
+{
+  if (!capacity) {
+    return;
+  }
+
+  MutexHolder hold(lock);
+  Table::iterator i=table.find(Normalize(key));
+
+  stamp++;
+  if (i!=table.end()) {
+    order.erase(i->second.where);
+    table.erase(i);
+  }
+}
+
+
+void BTreeKeyCache::ForgetAll()
+{
+  MutexHolder hold(lock);
+
+  table.clear();
+  order.clear();
+  stamp++;
+}
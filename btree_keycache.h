@@ -0,0 +1,90 @@
+#ifndef _btree_keycache
+#define _btree_keycache
+
+#include <string>
+#include <list>
+#include <map>
+#include <vector>
+#include "global.h"
+#include "btree_ds.h"
+#include "latch.h"
+
+using namespace std;
+
+// The admission sketch has this many rows, of about four counters
+// per entry each, and halves its counters once it has counted this
+// many keys per entry
+#define BTREE_KEYCACHE_ROWS 4
+#define BTREE_KEYCACHE_SAMPLES 10
+
+//
+// A bounded cache of keys and the values Lookup found for them,
+// above the tree (see BTreeIndex::SetKeyCache)
+//
+// A hit copies the value out of memory without touching a block.
+// Entries are kept in least recently used order, and admitted by
+// TinyLFU: every key asked about is counted in a small count-min
+// sketch whose counters are halved every so often, so that they
+// follow what is hot now, and a key that missed only displaces the
+// least recently used entry if the sketch has seen it more often.
+// Keys seen once, as in a scan, don't wash the hot ones out.
+//
+// Whatever changes a key in the index Forgets it afterwards.  Each
+// Forget moves the cache to its next stamp, and a lookup only
+// admits what it found if the stamp is still the one Find gave it
+// before the lookup began, so a value read just before a change
+// can't be admitted after it.  Any number of threads can share it.
+//
+class BTreeKeyCache {
+ private:
+  typedef list<string> Order;   // most recently used first
+  struct Entry {
+    string             value;
+    unsigned long long hash;   // of the key
+    Order::iterator    where;
+  };
+  typedef map<string,Entry> Table;
+
+  SIZE_T         capacity;      // entries, 0 for no cache
+  SIZE_T         keysize;
+  Table          table;
+  Order          order;
+  vector<BYTE_T> sketch;        // BTREE_KEYCACHE_ROWS rows of width counters
+  SIZE_T         width;
+  SIZE_T         samples;       // counted since the last halving
+  SIZE_T         stamp;         // Forgets so far
+  SIZE_T         lookups, hits, admitted, rejected;
+  Mutex          lock;
+
+  string         Normalize(const KEY_T &key) const;
+  void           CountKey(const unsigned long long h);
+  SIZE_T         Frequency(const unsigned long long h) const;
+
+ public:
+  BTreeKeyCache();
+
+  // Empties the cache and makes it hold up to capacity entries of
+  // keys of keysize
+  void    Reset(const SIZE_T capacity, const SIZE_T keysize);
+
+  bool    IsOn() const { return capacity>0; }
+  SIZE_T  GetCapacity() const { return capacity; }
+
+  // true, with value, on a hit; on a miss s is what to give Admit
+  bool    Find(const KEY_T &key, VALUE_T &value, SIZE_T &s);
+
+  // Offers what a lookup that missed with s found for key
+  void    Admit(const KEY_T &key, const VALUE_T &value, const SIZE_T s);
+
+  // Drops key, after a change to it in the index
+  void    Forget(const KEY_T &key);
+  void    ForgetAll();
+
+  SIZE_T  GetNumLookups() const { return lookups; }
+  SIZE_T  GetNumHits() const { return hits; }
+  SIZE_T  GetNumAdmitted() const { return admitted; }
+  SIZE_T  GetNumRejected() const { return rejected; }
+  double  GetHitRate() const { return lookups ? (double)hits/lookups : 0; }
+};
+
+#endif
@@ -1,9 +1,12 @@
 #include <stdlib.h>
+#include <string>
 #include "btree.h"
+#include "btree_cursor.h"
 
 void usage() 
 {
-  cerr << "usage: btree_lookup filestem cachesize key\n";
+  cerr << "usage: btree_lookup filestem cachesize key [key ...]\n";
+  cerr << "       more than one key are looked up together (- reads them from stdin)\n";
 }
 
 
@@ -12,16 +15,25 @@ int main(int argc, char **argv)
   char *filestem;
   SIZE_T cachesize;
   SIZE_T superblocknum;
-  char *key;
+  vector<KEY_T> keys;
 
-  if (argc!=4) { 
+  if (argc<4) { 
     usage();
     return -1;
   }
 
   filestem=argv[1];
   cachesize=atoi(argv[2]);
-  key=argv[3];
+  if (argc==4 && string(argv[3])=="-") { 
+    string k;
+    while (cin >> k) { 
+      keys.push_back(KEY_T(k.c_str()));
+    }
+  } else {
+    for (int i=3;i<argc;i++) { 
+      keys.push_back(KEY_T(argv[i]));
+    }
+  }
 
   DiskSystem disk(filestem);
   BufferCache cache(&disk,cachesize);
@@ -40,12 +52,49 @@ int main(int argc, char **argv)
     return -1;
   } else {
     cerr << "Index attached!"<<endl;
-    VALUE_T val;
-    if ((rc=btree.Lookup(KEY_T(key),val))!=ERROR_NOERROR) { 
-      cerr <<"Lookup failed: error "<<rc<<endl;
+    if (keys.size()==1 && !btree.IsUnique()) { 
+      // every value of the key, one per line
+      BTreePostingCursor values(&btree);
+      VALUE_T val;
+      for (rc=values.Seek(keys[0]); rc==ERROR_NOERROR; rc=values.Next()) { 
+	if ((rc=values.GetVal(val))!=ERROR_NOERROR) { 
+	  break;
+	}
+	cout << val << "\n";
+      }
+      if (rc!=ERROR_NONEXISTENT || values.GetNumValues()==0) { 
+	cerr <<"Lookup failed: error "<<rc<<endl;
+      } else {
+	cerr <<"Lookup found "<<values.GetNumValues()<<" values\n";
+      }
+    } else if (keys.size()==1) { 
+      VALUE_T val;
+      if ((rc=btree.Lookup(keys[0],val))!=ERROR_NOERROR) { 
+	cerr <<"Lookup failed: error "<<rc<<endl;
+      } else {
+	cerr <<"Lookup succeeded\n";
+	cout << val;
+      }
     } else {
-      cerr <<"Lookup succeeded\n";
-      cout << val;
+      vector<VALUE_T> vals;
+      vector<ERROR_T> results;
+      SIZE_T found=0;
+      if ((rc=btree.MultiLookup(keys,vals,results))!=ERROR_NOERROR && rc!=ERROR_NONEXISTENT) { 
+	cerr <<"Lookup failed: error "<<rc<<endl;
+      } else {
+	for (SIZE_T i=0;i<keys.size();i++) { 
+	  cout.write((const char *)keys[i].data,keys[i].length);
+	  if (results[i]) { 
+	    cout << " FAIL\n";
+	  } else {
+	    cout << " ";
+	    cout.write((const char *)vals[i].data,vals[i].length);
+	    cout << "\n";
+	    found++;
+	  }
+	}
+	cerr <<"Found "<<found<<" of "<<keys.size()<<" keys\n";
+      }
     }
     if ((rc=btree.Detach(superblocknum))!=ERROR_NOERROR) { 
       cerr <<"Can't detach from index due to error "<<rc<<endl;
@@ -0,0 +1,266 @@
+#include <string.h>
+#include "btree_memtable.h"
+
+
+bool BTreeMemtable::KeyOrder::operator()(const KEY_T &a, const KEY_T &b) const
+{
+  for (SIZE_T i=0; i<keysize; i++) {
+    BYTE_T x = i<a.length ? a.data[i] : 0;
+    BYTE_T y = i<b.length ? b.data[i] : 0;
+    if (x!=y) {
+      return x<y;
+    }
+  }
+  return false;
+}
+
+
+BTreeMemtable::BTreeMemtable(BTreeIndex *i, const SIZE_T m, const SIZE_T d) :
+  index(i), table(KeyOrder(i->GetKeySize())), maxbytes(m), drainto(d), bytes(0), hasnext(false),
+  drainerror(ERROR_NOERROR)
+{
+}
+
+
+void BTreeMemtable::SetLimits(const SIZE_T m, const SIZE_T d)
+{
+  MutexHolder hold(turn);
+
+  maxbytes=m;
+  drainto=d;
+}
+
+
+//
+// A slotted tree gives values back at their own length, up to
+// valuesize, and the others pad them with zeros to valuesize
+//
+ERROR_T BTreeMemtable::Shape(const VALUE_T &value, VALUE_T &shaped) const
+{
+  SIZE_T valuesize=index->GetValueSize();
+  SIZE_T len = value.length<valuesize ? value.length : valuesize;
+  ERROR_T rc;
+
+  if ((index->GetFormat()&0xff)==BTREE_FORMAT_SLOTTED) {
+    rc=shaped.Resize(len,false);
+  } else {
+    rc=shaped.Resize(valuesize,false);
+  }
+  if (rc) { return rc; }
+  memcpy(shaped.data,value.data,len);
+  memset(shaped.data+len,0,shaped.length-len);
+  return ERROR_NOERROR;
+}
+
+
+//
+// Holds op for key, over whatever was held for it, then drains if
+// the table has grown to maxbytes.  Once op is held it has been
+// done, so a drain that fails is only noted in drainerror.
+//
+ERROR_T BTreeMemtable::Put(const KEY_T &key, const BYTE_T op, const VALUE_T &value)
+{
+  VALUE_T shaped;
+  ERROR_T rc;
+
+  drainerror=ERROR_NOERROR;
+  if (!index->IsUnique()) {
+    // a drain couldn't apply it
+    return ERROR_UNIMPL;
+  }
+  if (op==BTREE_MSG_PUT) {
+    rc=Shape(value,shaped);
+    if (rc) { return rc; }
+  }
+
+  Table::iterator i=table.find(key);
+  if (i==table.end()) {
+    table.insert(make_pair(key,Entry(op,shaped)));
+    bytes += key.length+shaped.length;
+  } else {
+    // Block assignment would leak, so the value is copied in place
+    bytes -= i->second.value.length;
+    rc=i->second.value.Resize(shaped.length,false);
+    if (rc) { return rc; }
+    memcpy(i->second.value.data,shaped.data,shaped.length);
+    i->second.op=op;
+    bytes += shaped.length;
+  }
+
+  if (bytes>=maxbytes) {
+    drainerror=DrainInternal(drainto);
+  }
+  return ERROR_NOERROR;
+}
+
+
+//
+// Takes entries from next on, wrapping around to the start of the
+// table, until no more than target bytes are left, and applies them
+// to the index in key order.  They stay in the table if that fails.
+//
+ERROR_T BTreeMemtable::DrainInternal(const SIZE_T target)
+{
+  Table::iterator start, stop;
+  vector<BTreeMessage> msgs;
+  SIZE_T left=bytes;
+  bool wrapped=false;
+  ERROR_T rc;
+
+  if (table.empty()) {
+    return ERROR_NOERROR;
+  }
+  start = hasnext ? table.lower_bound(next) : table.begin();
+  if (start==table.end()) {
+    start=table.begin();
+  }
+
+  stop=start;
+  do {
+    left -= stop->first.length+stop->second.value.length;
+    ++stop;
+    if (stop==table.end()) {
+      stop=table.begin();
+      wrapped=true;
+    }
+  } while (left>target && stop!=start);
+
+  // the part taken after wrapping around comes first in key order
+  msgs.reserve(table.size());
+  if (wrapped) {
+    for (Table::iterator i=table.begin(); i!=stop; ++i) {
+      msgs.push_back(BTreeMessage(i->second.op,i->first,i->second.value));
+    }
+  }
+  for (Table::iterator i=start; i!=(wrapped ? table.end() : stop); ++i) {
+    msgs.push_back(BTreeMessage(i->second.op,i->first,i->second.value));
+  }
+
+  rc=index->ApplyBatch(msgs);
+  if (rc) { return rc; }
+
+  if (stop==start) {
+    table.clear();
+    hasnext=false;
+  } else {
+    rc=next.Resize(stop->first.length,false);
+    if (rc) { return rc; }
+    memcpy(next.data,stop->first.data,stop->first.length);
+    hasnext=true;
+    if (wrapped) {
+      table.erase(table.begin(),stop);
+      table.erase(start,table.end());
+    } else {
+      table.erase(start,stop);
+    }
+  }
+  bytes=left;
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeMemtable::Drain()
+{
+  MutexHolder hold(turn);
+
+  return DrainInternal(0);
+}
+
+
+//
+// Whether key is there, as far as the table knows, or else as far as
+// the index does
+//
+ERROR_T BTreeMemtable::Find(const KEY_T &key, bool &there)
+{
+  VALUE_T value;
+  ERROR_T rc;
+
+  if (!index->IsUnique()) {
+    // nothing will be held for key (see Put)
+    return ERROR_UNIMPL;
+  }
+  Table::const_iterator i=table.find(key);
+  if (i!=table.end()) {
+    there = i->second.op==BTREE_MSG_PUT;
+    return ERROR_NOERROR;
+  }
+  rc=index->Lookup(key,value);
+  if (rc && rc!=ERROR_NONEXISTENT) {
+    return rc;
+  }
+  there = rc==ERROR_NOERROR;
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreeMemtable::Insert(const KEY_T &key, const VALUE_T &value)
+{
+  MutexHolder hold(turn);
+  bool there;
+  ERROR_T rc;
+
+  rc=Find(key,there);
+  if (rc) { return rc; }
+  if (there) {
+    return ERROR_CONFLICT;
+  }
+  return Put(key,BTREE_MSG_PUT,value);
+}
+
+
+ERROR_T BTreeMemtable::Update(const KEY_T &key, const VALUE_T &value)
+{
+  MutexHolder hold(turn);
+  bool there;
+  ERROR_T rc;
+
+  rc=Find(key,there);
+  if (rc) { return rc; }
+  if (!there) {
+    return ERROR_NONEXISTENT;
+  }
+  return Put(key,BTREE_MSG_PUT,value);
+}
+
+
+ERROR_T BTreeMemtable::Upsert(const KEY_T &key, const VALUE_T &value)
+{
+  MutexHolder hold(turn);
+
+  return Put(key,BTREE_MSG_PUT,value);
+}
+
+
+ERROR_T BTreeMemtable::Delete(const KEY_T &key)
+{
+  MutexHolder hold(turn);
+  bool there;
+  ERROR_T rc;
+
+  rc=Find(key,there);
+  if (rc) { return rc; }
+  if (!there) {
+    return ERROR_NONEXISTENT;
+  }
+  // the tombstone keeps the index's copy from showing through
+  return Put(key,BTREE_MSG_DELETE,VALUE_T());
+}
+
+
+ERROR_T BTreeMemtable::Lookup(const KEY_T &key, VALUE_T &value)
+{
+  MutexHolder hold(turn);
+
+  Table::const_iterator i=table.find(key);
+  if (i==table.end()) {
+    return index->Lookup(key,value);
+  }
+  if (i->second.op==BTREE_MSG_DELETE) {
+    return ERROR_NONEXISTENT;
+  }
+  ERROR_T rc=value.Resize(i->second.value.length,false);
+  if (rc) { return rc; }
+  memcpy(value.data,i->second.value.data,i->second.value.length);
+  return ERROR_NOERROR;
+}
@@ -0,0 +1,91 @@
+#ifndef _btree_memtable
+#define _btree_memtable
+
+#include <map>
+#include "btree.h"
+#include "latch.h"
+
+//
+// An in-memory write buffer in front of a BTreeIndex
+//
+// Inserts, updates, upserts and deletes are kept in a sorted table in
+// memory, a delete as a tombstone, and lookups look there before the
+// index.  Once the table holds maxbytes of keys and values, entries
+// are drained into the index as one sorted batch (see
+// BTreeIndex::ApplyBatch) until it is down to drainto bytes.  Each
+// drain starts in key order where the last one stopped, wrapping
+// around, so every part of the key space takes its turn.
+//
+// Insert, Update and Delete still say whether the key was there, so
+// a key missing from the table costs a lookup in the index.  Upsert
+// doesn't need one.
+//
+// The index must be unique (see BTreeIndex::ApplyBatch): in front
+// of a non-unique one, Insert, Update, Upsert and Delete hold
+// nothing and return ERROR_UNIMPL.  Every change must go through the
+// memtable while it is in use.
+// Cursors, Display and MultiLookup on the index only see what has
+// been drained, so Drain first.  The destructor does not drain.
+//
+class BTreeMemtable {
+ private:
+  // Keys in the order the tree keeps them, as if padded with zeros
+  // to keysize
+  struct KeyOrder {
+    SIZE_T keysize;
+    KeyOrder(const SIZE_T k) : keysize(k) {}
+    bool operator()(const KEY_T &a, const KEY_T &b) const;
+  };
+
+  struct Entry {
+    BYTE_T  op;      // BTREE_MSG_PUT or BTREE_MSG_DELETE
+    VALUE_T value;   // as the index would give it back
+
+    Entry(const BYTE_T o, const VALUE_T &v) : op(o), value(v) {}
+  };
+
+  typedef map<KEY_T,Entry,KeyOrder> Table;
+
+  BTreeIndex *index;
+  Table       table;
+  SIZE_T      maxbytes;
+  SIZE_T      drainto;
+  SIZE_T      bytes;      // keys and values held
+  KEY_T       next;       // where the next drain starts
+  bool        hasnext;
+  ERROR_T     drainerror; // of the drain the last change set off
+  Mutex       turn;       // one operation at a time
+
+  ERROR_T     Shape(const VALUE_T &value, VALUE_T &shaped) const;
+  ERROR_T     Put(const KEY_T &key, const BYTE_T op, const VALUE_T &value);
+  ERROR_T     Find(const KEY_T &key, bool &there);
+  ERROR_T     DrainInternal(const SIZE_T target);
+
+ public:
+  // Drains down to drainto once maxbytes are held.  A drainto of
+  // zero drains the whole table each time
+  BTreeMemtable(BTreeIndex *index, const SIZE_T maxbytes, const SIZE_T drainto=0);
+
+  void    SetLimits(const SIZE_T maxbytes, const SIZE_T drainto=0);
+
+  // As the same calls on BTreeIndex.  A change is held once they
+  // return ERROR_NOERROR, even if the drain it set off failed: what
+  // that drain took stays in the table, to be drained again later,
+  // and GetDrainError says what went wrong.
+  ERROR_T Insert(const KEY_T &key, const VALUE_T &value);
+  ERROR_T Update(const KEY_T &key, const VALUE_T &value);
+  ERROR_T Upsert(const KEY_T &key, const VALUE_T &value);
+  ERROR_T Delete(const KEY_T &key);
+  ERROR_T Lookup(const KEY_T &key, VALUE_T &value);
+
+  // Applies everything held to the index
+  ERROR_T Drain();
+
+  // What the drain the last change set off failed with, if it did
+  ERROR_T GetDrainError() const { return drainerror; }
+
+  SIZE_T  GetNumBytes() const { return bytes; }
+  SIZE_T  GetNumEntries() const { return table.size(); }
+};
+
+#endif
@@ -0,0 +1,400 @@
+#include <new>
+#include <string.h>
+#include "btree_path.h"
+
+
+BTreePath::BTreePath(BufferCache *c) : 
+  cache(c), depth(0), top(0), mode(BTREE_LATCH_NONE), safe(0),
+  hastoplo(false), hastophi(false)
+{
+}
+
+
+BTreePath::~BTreePath()
+{
+  Clear();
+}
+
+
+void BTreePath::SetLatching(const BTreeLatchMode m, BTreeSafeFn s)
+{
+  mode=m;
+  safe=s;
+}
+
+
+ERROR_T BTreePath::Push(const SIZE_T node)
+{
+  if (mode==BTREE_LATCH_BLINK || mode==BTREE_LATCH_BLINK_LEAF) { 
+    return PushCopy(node);
+  }
+  return Push(node, mode==BTREE_LATCH_WRITE);
+}
+
+
+// The latch comes first, so the node is pinned and its header read
+// with nobody changing it
+ERROR_T BTreePath::Push(const SIZE_T node, const bool exclusive)
+{
+  ERROR_T rc;
+
+  if (depth>=BTREE_MAX_DEPTH) { 
+    return ERROR_INSANE;
+  }
+  if (mode!=BTREE_LATCH_NONE) { 
+    rc=cache->LatchBlock(node,exclusive);
+    if (rc) { return rc; }
+  }
+  BTreePathEntry *e=new (&Levels()[depth]) BTreePathEntry;
+  rc=e->b.Pin(cache,node);
+  if (rc) { 
+    e->~BTreePathEntry();
+    if (mode!=BTREE_LATCH_NONE) { 
+      cache->UnlatchBlock(node);
+    }
+    return rc;
+  }
+  e->node=node;
+  e->offset=0;
+  e->latched=mode!=BTREE_LATCH_NONE;
+  depth++;
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreePath::PushCopy(const SIZE_T node)
+{
+  ERROR_T rc;
+
+  if (depth>=BTREE_MAX_DEPTH) { 
+    return ERROR_INSANE;
+  }
+  BTreePathEntry *e=new (&Levels()[depth]) BTreePathEntry;
+  rc=e->b.UnserializeUnlatched(cache,node);
+  if (rc) { 
+    e->~BTreePathEntry();
+    return rc;
+  }
+  e->node=node;
+  e->offset=0;
+  e->latched=false;
+  depth++;
+  return ERROR_NOERROR;
+}
+
+
+void BTreePath::Pop()
+{
+  if (depth>top) { 
+    depth--;
+    SIZE_T node=Levels()[depth].node;
+    bool latched=Levels()[depth].latched;
+    // unpins the node
+    Levels()[depth].~BTreePathEntry();
+    if (latched) { 
+      cache->UnlatchBlock(node);
+    }
+  }
+}
+
+
+void BTreePath::Clear()
+{
+  while (depth>top) { 
+    Pop();
+  }
+  depth=0;
+  top=0;
+  hastoplo=false;
+  hastophi=false;
+}
+
+
+static ERROR_T CopyKey(KEY_T &dst, const KEY_T &src)
+{
+  ERROR_T rc=dst.Resize(src.length,false);
+
+  if (rc) { return rc; }
+  memcpy(dst.data,src.data,src.length);
+  return ERROR_NOERROR;
+}
+
+
+//
+// Lets go of the levels above level, which becomes the top.  In
+// BTREE_LATCH_WRITE mode their fences are kept for GetFences.
+//
+ERROR_T BTreePath::Release(const SIZE_T level)
+{
+  ERROR_T rc;
+
+  if (level<=top) { 
+    return ERROR_NOERROR;
+  }
+  if (mode==BTREE_LATCH_WRITE) { 
+    KEY_T lokey, hikey;
+    const KEY_T *lo, *hi;
+    rc=GetFences(level,lokey,hikey,lo,hi);
+    if (rc) { return rc; }
+    if (lo && (rc=CopyKey(toplo,*lo))) { return rc; }
+    if (hi && (rc=CopyKey(tophi,*hi))) { return rc; }
+    hastoplo = lo!=0;
+    hastophi = hi!=0;
+  }
+  for (; top<level; top++) { 
+    SIZE_T node=Levels()[top].node;
+    bool latched=Levels()[top].latched;
+    Levels()[top].~BTreePathEntry();
+    if (latched) { 
+      cache->UnlatchBlock(node);
+    }
+  }
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BTreePath::Descend(const SIZE_T node, const KEY_T *key, bool &found)
+{
+  SIZE_T ptr=node;
+  ERROR_T rc;
+
+  if (mode==BTREE_LATCH_BLINK || mode==BTREE_LATCH_BLINK_LEAF) { 
+    if (!key) { 
+      return ERROR_INSANE;
+    }
+    return DescendBlink(node,*key,found);
+  }
+
+  found=false;
+  for (;;) { 
+    rc=Push(ptr);
+    if (rc) { return rc; }
+    if (mode==BTREE_LATCH_LEAF && Leaf().b.info.nodetype==BTREE_LEAF_NODE) { 
+      // trade the shared latch for an exclusive one; the parent's
+      // keeps the leaf from being split or merged meanwhile, but
+      // not from being changed
+      cache->UnlatchBlock(ptr);
+      rc=cache->LatchBlock(ptr,true);
+      if (rc) { return rc; }
+      Leaf().b.Reload();
+    }
+    if (mode==BTREE_LATCH_READ || mode==BTREE_LATCH_LEAF ||
+	(mode==BTREE_LATCH_WRITE && safe && safe(Leaf().b))) { 
+      rc=Release(depth-1);
+      if (rc) { return rc; }
+    }
+    BTreePathEntry &e=Leaf();
+
+    switch (e.b.info.nodetype) { 
+    case BTREE_ROOT_NODE:
+    case BTREE_INTERIOR_NODE:
+      if (e.b.info.numkeys==0) { 
+	// There are no keys at all on this node, so nowhere to go
+	return ERROR_NONEXISTENT;
+      }
+      // Find the first key that's larger or equal and go down
+      // the ptr immediately previous to it (or the last ptr if
+      // there is no such key)
+      if (key) { 
+	e.b.SearchKey(*key,e.offset);
+      }
+      rc=e.b.GetPtr(e.offset,ptr);
+      if (rc) { return rc; }
+      break;
+    case BTREE_LEAF_NODE:
+      if (key) { 
+	found=e.b.SearchKey(*key,e.offset);
+      }
+      return ERROR_NOERROR;
+      break;
+    default:
+      return ERROR_INSANE;
+    }
+  }
+}
+
+
+//
+// Each node is checked against key once it is read.  One that key has
+// moved right of since its parent was read, by a split or a
+// rebalance, is left for its right link.  One that can't hold key at
+// all (key has moved left of it, or it has been freed or reused)
+// sends the search back to the root.  A leaf to be latched is
+// checked again once it is, and the latch let go before moving on,
+// so no thread ever waits for one latch while holding another.
+//
+ERROR_T BTreePath::DescendBlink(const SIZE_T node, const KEY_T &key, bool &found)
+{
+  SIZE_T ptr=node;
+  ERROR_T rc;
+  int c;
+
+  found=false;
+  for (;;) { 
+    rc=PushCopy(ptr);
+    if (rc) { return rc; }
+    rc=Release(depth-1);
+    if (rc) { return rc; }
+    if (mode==BTREE_LATCH_BLINK_LEAF && Leaf().b.info.nodetype==BTREE_LEAF_NODE) { 
+      Pop();
+      rc=Push(ptr,true);
+      if (rc) { return rc; }
+    }
+    BTreePathEntry &e=Leaf();
+
+    if (e.b.info.nodetype!=BTREE_ROOT_NODE &&
+	e.b.info.nodetype!=BTREE_INTERIOR_NODE &&
+	e.b.info.nodetype!=BTREE_LEAF_NODE) { 
+      c=-1;
+    } else {
+      c=e.b.CompareFences(key);
+    }
+    if (c>0) { 
+      rc=e.b.GetRightLink(ptr);
+      if (rc) { return rc; }
+      // a node with a bounded right has a right link, unless it was
+      // freed after being read
+      c = ptr==0 ? -1 : c;
+    }
+    if (c!=0) { 
+      Clear();
+      if (c<0) { 
+	ptr=node;
+      }
+      continue;
+    }
+
+    switch (e.b.info.nodetype) { 
+    case BTREE_ROOT_NODE:
+      if (e.b.info.numkeys==0) { 
+	return ERROR_NONEXISTENT;
+      }
+      // fall through
+    case BTREE_INTERIOR_NODE:
+      e.b.SearchKey(key,e.offset);
+      rc=e.b.GetPtr(e.offset,ptr);
+      if (rc) { return rc; }
+      break;
+    default:
+      found=e.b.SearchKey(key,e.offset);
+      return ERROR_NOERROR;
+    }
+  }
+}
+
+
+ERROR_T BTreePath::DescendLast(const SIZE_T node)
+{
+  SIZE_T ptr=node;
+  ERROR_T rc;
+
+  for (;;) { 
+    rc=Push(ptr);
+    if (rc) { return rc; }
+    BTreePathEntry &e=Leaf();
+
+    e.offset=e.b.info.numkeys;
+    switch (e.b.info.nodetype) { 
+    case BTREE_ROOT_NODE:
+    case BTREE_INTERIOR_NODE:
+      if (e.b.info.numkeys==0) { 
+	return ERROR_NONEXISTENT;
+      }
+      rc=e.b.GetPtr(e.offset,ptr);
+      if (rc) { return rc; }
+      break;
+    case BTREE_LEAF_NODE:
+      return ERROR_NOERROR;
+      break;
+    default:
+      return ERROR_INSANE;
+    }
+  }
+}
+
+
+ERROR_T BTreePath::NextLeaf()
+{
+  SIZE_T level=depth-1;
+  SIZE_T ptr;
+  ERROR_T rc;
+
+  // the nearest level above with a ptr further right
+  do { 
+    if (level<=top) { 
+      return ERROR_NONEXISTENT;
+    }
+    level--;
+  } while ((*this)[level].offset>=(*this)[level].b.info.numkeys);
+
+  rc=(*this)[level].b.GetPtr((*this)[level].offset+1,ptr);
+  if (rc) { return rc; }
+  while (depth>level+1) { 
+    Pop();
+  }
+  (*this)[level].offset++;
+
+  bool found;
+  return Descend(ptr,0,found);
+}
+
+
+ERROR_T BTreePath::PrevLeaf()
+{
+  SIZE_T level=depth-1;
+  SIZE_T ptr;
+  ERROR_T rc;
+
+  // the nearest level above with a ptr further left
+  do { 
+    if (level<=top) { 
+      return ERROR_NONEXISTENT;
+    }
+    level--;
+  } while ((*this)[level].offset==0);
+
+  rc=(*this)[level].b.GetPtr((*this)[level].offset-1,ptr);
+  if (rc) { return rc; }
+  while (depth>level+1) { 
+    Pop();
+  }
+  (*this)[level].offset--;
+
+  return DescendLast(ptr);
+}
+
+
+ERROR_T BTreePath::GetFences(const SIZE_T level, KEY_T &lokey, KEY_T &hikey,
+			     const KEY_T *&lo, const KEY_T *&hi) const
+{
+  ERROR_T rc;
+
+  lo=0;
+  hi=0;
+  // the nearest keys either side of the path, going up
+  for (SIZE_T l=level; l>top && (!lo || !hi); l--) { 
+    const BTreePathEntry &p=(*this)[l-1];
+    if (!lo && p.offset>0) { 
+      rc=p.b.GetKey(p.offset-1,lokey);
+      if (rc) { return rc; }
+      lo=&lokey;
+    }
+    if (!hi && p.offset<p.b.info.numkeys) { 
+      rc=p.b.GetKey(p.offset,hikey);
+      if (rc) { return rc; }
+      hi=&hikey;
+    }
+  }
+  // then those of the levels let go
+  if (!lo && hastoplo) { 
+    rc=CopyKey(lokey,toplo);
+    if (rc) { return rc; }
+    lo=&lokey;
+  }
+  if (!hi && hastophi) { 
+    rc=CopyKey(hikey,tophi);
+    if (rc) { return rc; }
+    hi=&hikey;
+  }
+  return ERROR_NOERROR;
+}
@@ -0,0 +1,136 @@
+#ifndef _btree_path
+#define _btree_path
+
+#include "global.h"
+#include "btree_ds.h"
+#include "buffercache.h"
+
+//
+// A path from a node down towards a leaf
+//
+// Each level holds its node pinned in the buffer cache (see
+// BTreeNode::Pin), so walking down and back up reads every node on
+// the path once and allocates nothing.  The offset of an interior
+// level is the ptr the path takes out of it; that of a leaf is the
+// key the path leads to, or where it would go.  Inserts and deletes
+// use the path to work their way back up, and cursors to move from
+// leaf to leaf in either direction.
+//
+// A path can also latch each node as it pins it (see SetLatching),
+// so that threads sharing a tree see each node whole.  It crabs
+// down: the latch on a node is taken before the one on its parent is
+// let go, and the levels above a node that the operation can't
+// change past are let go as soon as it is reached.  The path then
+// starts at GetTop rather than 0.
+//
+// In a B-link tree (BTREE_FLAG_BLINK) a path can instead go down
+// without latching anything but, at most, the leaf.  Every node
+// says which keys it holds and links to the one to its right, so a
+// thread that reads a node just as it is split still finds its way.
+//
+#define BTREE_MAX_DEPTH 32
+
+enum BTreeLatchMode {
+  BTREE_LATCH_NONE,   // single threaded
+  BTREE_LATCH_READ,   // shared latches, only the last level kept
+  BTREE_LATCH_LEAF,   // the same, but the leaf exclusive
+  BTREE_LATCH_WRITE,  // exclusive latches, kept up to the last safe level
+  BTREE_LATCH_BLINK,  // B-link trees only: no latches, each level a copy
+                      // (see BTreeNode::UnserializeUnlatched), only the
+                      // last level kept
+  BTREE_LATCH_BLINK_LEAF // the same, but the leaf latched exclusively and
+                         // pinned
+};
+
+// true if a change below b can't reach past it
+typedef bool (*BTreeSafeFn)(const BTreeNode &b);
+
+struct BTreePathEntry {
+  SIZE_T    node;
+  SIZE_T    offset;
+  bool      latched;
+  BTreeNode b;
+};
+
+
+class BTreePath {
+ private:
+  BufferCache    *cache;
+  // Levels are constructed in place as the path reaches them, so a
+  // path costs nothing for the ones it doesn't
+  union {
+    char          bytes[BTREE_MAX_DEPTH*sizeof(BTreePathEntry)];
+    void         *align;
+  } storage;
+  SIZE_T          depth;
+  SIZE_T          top;           // levels before it have been let go
+  BTreeLatchMode  mode;
+  BTreeSafeFn     safe;
+  // the fences of the node at top, from the levels let go
+  KEY_T           toplo, tophi;
+  bool            hastoplo, hastophi;
+
+  BTreePathEntry *Levels() { return (BTreePathEntry *) storage.bytes; }
+  const BTreePathEntry *Levels() const { return (const BTreePathEntry *) storage.bytes; }
+
+  ERROR_T Push(const SIZE_T node, const bool exclusive);
+  ERROR_T PushCopy(const SIZE_T node);
+  ERROR_T Release(const SIZE_T level);
+  ERROR_T DescendBlink(const SIZE_T node, const KEY_T &key, bool &found);
+
+ public:
+  BTreePath(BufferCache *cache);
+  BTreePath(const BTreePath &rhs) { throw GenericException(); }
+  BTreePath & operator=(const BTreePath &rhs) { throw GenericException(); return *this; }
+  ~BTreePath();
+
+  // Latch nodes from now on (the path must be empty).  In
+  // BTREE_LATCH_WRITE mode the levels above a node are let go when
+  // safe says the node is safe.
+  void   SetLatching(const BTreeLatchMode mode, BTreeSafeFn safe=0);
+  BTreeLatchMode GetLatching() const { return mode; }
+
+  SIZE_T GetDepth() const { return depth; }
+  // The first level still held
+  SIZE_T GetTop() const { return top; }
+  // 0 is where the path starts
+  BTreePathEntry & operator[](const SIZE_T level) { return Levels()[level]; }
+  const BTreePathEntry & operator[](const SIZE_T level) const { return Levels()[level]; }
+  BTreePathEntry & Leaf() { return Levels()[depth-1]; }
+  const BTreePathEntry & Leaf() const { return Levels()[depth-1]; }
+
+  // Latches and pins node as the next level down, with offset 0
+  // (in the B-link modes, copies it)
+  // return ERROR_INSANE if the path would be too deep
+  ERROR_T Push(const SIZE_T node);
+  // Unpins and unlatches the last level, or all of them
+  void    Pop();
+  void    Clear();
+
+  // Extends the path from node down to the leaf that holds key, or
+  // would hold it, and sets found if it is there.  A 0 key leads to
+  // the first key of the subtree (not in the B-link modes, where
+  // node must be the root).
+  // return ERROR_NONEXISTENT if node is an empty root
+  ERROR_T Descend(const SIZE_T node, const KEY_T *key, bool &found);
+  // Extends the path from node down to its last leaf, whose offset is
+  // left one past its last key
+  ERROR_T DescendLast(const SIZE_T node);
+
+  // Move the path to the next leaf (offset 0) or the previous leaf
+  // (offset one past its last key), going back up only as far as it
+  // takes.  return ERROR_NONEXISTENT, leaving the path as it was, if
+  // there is no such leaf under the top of the path
+  ERROR_T NextLeaf();
+  ERROR_T PrevLeaf();
+
+  // The keys that bound the node at level in its parent, from the
+  // levels above it: every key in it is > lo and <= hi.  lo and hi
+  // point to lokey and hikey, or are 0 if the path gives no bound.
+  // Levels let go in BTREE_LATCH_WRITE mode still count; in the
+  // read modes they don't.
+  ERROR_T GetFences(const SIZE_T level, KEY_T &lokey, KEY_T &hikey,
+		    const KEY_T *&lo, const KEY_T *&hi) const;
+};
+
+#endif
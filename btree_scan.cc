@@ -0,0 +1,106 @@
+#include <stdlib.h>
+#include <string.h>
+#include "btree.h"
+#include "btree_cursor.h"
+
+void usage()
+{
+  cerr << "usage: btree_scan filestem cachesize [lo [hi [reverse]]]\n";
+  cerr << "       (- for lo or hi means no bound)\n";
+}
+
+
+int main(int argc, char **argv)
+{
+  char *filestem;
+  SIZE_T cachesize;
+  SIZE_T superblocknum;
+  KEY_T lo, hi;
+  KEY_T *plo=0, *phi=0;
+  bool reverse=false;
+  SIZE_T count=0;
+
+  if (argc<3 || argc>6) {
+    usage();
+    return -1;
+  }
+
+  filestem=argv[1];
+  cachesize=atoi(argv[2]);
+  if (argc>3 && strcmp(argv[3],"-")) {
+    lo=KEY_T(argv[3]);
+    plo=&lo;
+  }
+  if (argc>4 && strcmp(argv[4],"-")) {
+    hi=KEY_T(argv[4]);
+    phi=&hi;
+  }
+  if (argc>5) {
+    if (strcmp(argv[5],"reverse")) {
+      usage();
+      return -1;
+    }
+    reverse=true;
+  }
+
+  DiskSystem disk(filestem);
+  BufferCache cache(&disk,cachesize);
+  BTreeIndex btree(0,0,&cache);
+
+  ERROR_T rc;
+
+
+  if ((rc=cache.Attach())!=ERROR_NOERROR) {
+    cerr << "Can't attach buffer cache due to error"<<rc<<endl;
+    return -1;
+  }
+
+  if ((rc=btree.Attach(0))!=ERROR_NOERROR) {
+    cerr << "Can't attach to index  due to error "<<rc<<endl;
+    return -1;
+  } else {
+    cerr << "Index attached!"<<endl;
+    BTreeCursor cursor(&btree,true);
+    KEY_T key;
+    VALUE_T val;
+    for (rc = reverse ? cursor.SeekLast(plo,phi) : cursor.Seek(plo,phi);
+	 rc==ERROR_NOERROR;
+	 rc = reverse ? cursor.Prev() : cursor.Next()) {
+      if ((rc=cursor.GetKey(key)) || (rc=cursor.GetVal(val))) {
+	break;
+      }
+      cout << "(";
+      cout.write((const char *)key.data,key.length);
+      cout << ",";
+      cout.write((const char *)val.data,val.length);
+      cout << ")\n";
+      count++;
+    }
+    if (rc!=ERROR_NONEXISTENT) {
+      cerr <<"Scan stopped due to error "<<rc<<endl;
+    } else {
+      cerr <<"Scan returned "<<count<<" pairs\n";
+    }
+    if ((rc=btree.Detach(superblocknum))!=ERROR_NOERROR) {
+      cerr <<"Can't detach from index due to error "<<rc<<endl;
+      return -1;
+    }
+    if ((rc=cache.Detach())!=ERROR_NOERROR) {
+      cerr <<"Can't detach from cache due to error "<<rc<<endl;
+      return -1;
+    }
+    cerr << "Performance statistics:\n";
+
+    cerr << "numallocs       = "<<cache.GetNumAllocs()<<endl;
+    cerr << "numdeallocs     = "<<cache.GetNumDeallocs()<<endl;
+    cerr << "numreads        = "<<cache.GetNumReads()<<endl;
+    cerr << "numdiskreads    = "<<cache.GetNumDiskReads()<<endl;
+    cerr << "numwrites       = "<<cache.GetNumWrites()<<endl;
+    cerr << "numdiskwrites   = "<<cache.GetNumDiskWrites()<<endl;
+    cerr << endl;
+
+    cerr << "total time      = "<<cache.GetCurrentTime()<<endl;
+
+    return 0;
+  }
+}
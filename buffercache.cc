@@ -1,6 +1,14 @@
+#include <string.h>
+#include <sched.h>
+#include <algorithm>
 #include "buffercache.h"
 
-ERROR_T BufferCache::CheckDeleteOldest()
+//
+// If writeback is false, a dirty oldest block is left alone and
+// ERROR_NOFETCH returned.  Pinned blocks are never chosen, so with
+// every block pinned the cache grows past cachesize for a while.
+//
+ERROR_T BufferCache::CheckDeleteOldest(const bool writeback)
 {
   // In a real buffer cache, we would use a priority queue to make this O(1)
 
@@ -17,7 +25,7 @@ ERROR_T BufferCache::CheckDeleteOldest()
   for (map<SIZE_T, Block, cache_compare_lessthan>::iterator i=blockmap.begin();
 	 i!=blockmap.end();
 	 ++i) {
-       if ((*i).second.lastaccessed<oldest) { 
+       if ((*i).second.pins==0 && (*i).second.lastaccessed<oldest) { 
 	 oldestptr=i;
 	 oldest=(*i).second.lastaccessed;
        }
@@ -27,12 +35,11 @@ ERROR_T BufferCache::CheckDeleteOldest()
  
   if (oldestptr!=blockmap.end()) { 
     if ((*oldestptr).second.dirty) {
-      double reqtime;
-      int rc=disk->Write((*oldestptr).first,
-			 (*oldestptr).second,
-			 reqtime);
-      curtime+=reqtime;
-      diskwrites++;
+      if (!writeback) { 
+	return ERROR_NOFETCH;
+      }
+      int rc=DiskWrite((*oldestptr).first,
+		       (*oldestptr).second);
       if (rc!=ERROR_NOERROR) { 
 	return rc;
       }
@@ -42,11 +49,73 @@ ERROR_T BufferCache::CheckDeleteOldest()
   return ERROR_NOERROR;
 }
 
+
+ERROR_T BufferCache::DiskRead(const SIZE_T blocknum, Block &block)
+{
+  double reqtime;
+  int rc = disk->Read(blocknum,
+		      block,
+		      reqtime);
+  curtime+=reqtime;
+  diskreads++;
+  TraceOp(TRACE_DISKREAD,blocknum,false);
+  return rc;
+}
+
+
+// One request for blocknum..blocknum+numblocks-1
+ERROR_T BufferCache::DiskRead(const SIZE_T blocknum, const SIZE_T numblocks, vector<Block> &blocks)
+{
+  double reqtime;
+  int rc = disk->Read(blocknum,
+		      numblocks,
+		      blocks,
+		      reqtime);
+  curtime+=reqtime;
+  for (SIZE_T i=0;i<numblocks;i++) { 
+    diskreads++;
+    TraceOp(TRACE_DISKREAD,blocknum+i,false);
+  }
+  return rc;
+}
+
+
+ERROR_T BufferCache::DiskWrite(const SIZE_T blocknum, const Block &block)
+{
+  double reqtime;
+  int rc = disk->Write(blocknum,
+		       block,
+		       reqtime);
+  curtime+=reqtime;
+  diskwrites++;
+  TraceOp(TRACE_DISKWRITE,blocknum,false);
+  return rc;
+}
+
+
+void BufferCache::TraceOp(const BlockTraceOp op, const SIZE_T blocknum, const bool hit)
+{
+  if (trace) { 
+    trace->Record(op,blocknum,hit,curtime);
+  }
+}
+
+
+// A block read in while someone holds its latch exclusively may be
+// changed at any moment
+SIZE_T BufferCache::StartVersion(const SIZE_T blocknum) const
+{
+  map<SIZE_T, BlockLatch *>::const_iterator i = latches.find(blocknum);
+
+  return (i!=latches.end() && (*i).second->exclusive) ? 1 : 0;
+}
+
+
 BufferCache::BufferCache(DiskSystem *d,
 			 SIZE_T cs) : 
    disk(d), cachesize(cs), curtime(0),
    allocs(0), deallocs(0), reads(0), writes(0),
-   diskreads(0), diskwrites(0)
+   diskreads(0), diskwrites(0), trace(0)
 {}
 
 
@@ -55,29 +124,30 @@ BufferCache::~BufferCache()
   if (disk) { 
     Detach();
   }
+  for (map<SIZE_T, BlockLatch *>::iterator i=latches.begin(); i!=latches.end(); ++i) { 
+    delete (*i).second;
+  }
   disk=0; cachesize=0; curtime=0;
 }
 
 ERROR_T BufferCache::Attach()
 {
+  RWLatchHolder hold(lock,true);
   blockmap.clear();
   return ERROR_NOERROR;
 }
 
 ERROR_T BufferCache::Detach()
 {
+  RWLatchHolder hold(lock,true);
   // write out all of our data and then throw it away
 
   for (map<SIZE_T, Block, cache_compare_lessthan>::iterator i=blockmap.begin();
 	 i!=blockmap.end();
 	 ++i) {
     if ((*i).second.dirty) { 
-      double reqtime;
-      int rc=disk->Write((*i).first,
-			 (*i).second,
-			 reqtime);
-      curtime+=reqtime;
-      diskwrites++;
+      int rc=DiskWrite((*i).first,
+		       (*i).second);
       if (rc!=ERROR_NOERROR) { 
 	return rc;
       }
@@ -111,12 +181,14 @@ double BufferCache::GetCurrentTime() const
 
 ERROR_T BufferCache::NotifyAllocateBlock(const SIZE_T outblocknum)
 {
+  RWLatchHolder hold(lock,true);
   allocs++;
   return disk->NotifyAllocateBlocks(outblocknum,1);
 }
 
 ERROR_T BufferCache::NotifyDeallocateBlock(const SIZE_T inblocknum)
 {
+  RWLatchHolder hold(lock,true);
   deallocs++;
   return disk->NotifyDeallocateBlocks(inblocknum,1);
 }
@@ -124,12 +196,14 @@ ERROR_T BufferCache::NotifyDeallocateBlock(const SIZE_T inblocknum)
 
 bool  BufferCache::IsBlockAllocated(const SIZE_T inblocknum)
 {
+  RWLatchHolder hold(lock,true);
   return disk->IsBlockAllocated(inblocknum);
 }
 
 
 ERROR_T BufferCache::ReadBlock(const SIZE_T inblocknum, Block &outblock) 
 {
+  RWLatchHolder hold(lock,true);
   map<SIZE_T, Block, cache_compare_lessthan>::iterator b;
 
   b = blockmap.find(inblocknum);
@@ -139,6 +213,7 @@ ERROR_T BufferCache::ReadBlock(const SIZE_T inblocknum, Block &outblock)
     outblock=(*b).second;
     (*b).second.lastaccessed=curtime;
     reads++;
+    TraceOp(TRACE_READ,inblocknum,true);
     return ERROR_NOERROR;
   } else {
     // It's not in cache, so time to allocate it
@@ -149,36 +224,108 @@ ERROR_T BufferCache::ReadBlock(const SIZE_T inblocknum, Block &outblock)
 	cerr << "BufferCache::ReadBlock: Attempt to read unallocated block " << inblocknum<<endl;
       }
     }
-    double reqtime;
-    int rc = disk->Read(inblocknum,
-			outblock,
-			reqtime);
-    curtime+=reqtime;
-    diskreads++;
+    int rc = DiskRead(inblocknum,outblock);
     if (rc!=ERROR_NOERROR) { 
       return rc;
     } else {
       outblock.lastaccessed=curtime;
       outblock.dirty=false;
       blockmap[inblocknum]=outblock;
+      blockmap[inblocknum].version=StartVersion(inblocknum);
       reads++;
+      TraceOp(TRACE_READ,inblocknum,false);
       return ERROR_NOERROR;
     }
   }
 } 
  
+//
+// The copy is made with the lock held shared, so nothing can evict
+// or write the block meanwhile, and only a holder of its exclusive
+// latch could be changing it, which its odd version shows.  That is
+// waited out with the lock let go.  A miss, or any read while
+// tracing, takes the lock exclusively.
+//
+ERROR_T BufferCache::ReadBlockUnlatched(const SIZE_T inblocknum, Block &outblock)
+{
+  map<SIZE_T, Block, cache_compare_lessthan>::iterator b;
+  bool loaded=false;
+  ERROR_T rc;
+
+  for (;;) { 
+    if (!trace) { 
+      RWLatchHolder hold(lock,false);
+
+      b = blockmap.find(inblocknum);
+      if (b!=blockmap.end() && !((*b).second.version & 1)) { 
+	if (outblock.length!=(*b).second.length &&
+	    (rc=outblock.Resize((*b).second.length,false))) { 
+	  return rc;
+	}
+	memcpy(outblock.data,(*b).second.data,outblock.length);
+	__atomic_store(&(*b).second.lastaccessed,&curtime,__ATOMIC_RELAXED);
+	__atomic_add_fetch(&reads,1,__ATOMIC_RELAXED);
+	return ERROR_NOERROR;
+      }
+    }
+    {
+      RWLatchHolder hold(lock,true);
+
+      b = blockmap.find(inblocknum);
+      if (b==blockmap.end()) { 
+	Block myblock;
+	CheckDeleteOldest();
+	rc = DiskRead(inblocknum,myblock);
+	if (rc!=ERROR_NOERROR) { 
+	  return rc;
+	}
+	myblock.dirty=false;
+	b = blockmap.insert(make_pair(inblocknum,myblock)).first;
+	(*b).second.version=StartVersion(inblocknum);
+	loaded=true;
+      }
+      if (!((*b).second.version & 1)) { 
+	if (outblock.length!=(*b).second.length &&
+	    (rc=outblock.Resize((*b).second.length,false))) { 
+	  return rc;
+	}
+	memcpy(outblock.data,(*b).second.data,outblock.length);
+	(*b).second.lastaccessed=curtime;
+	reads++;
+	TraceOp(TRACE_READ,inblocknum,!loaded);
+	return ERROR_NOERROR;
+      }
+    }
+    sched_yield();
+  }
+}
+
+ 
 ERROR_T BufferCache::WriteBlock(const SIZE_T inblocknum, const Block &inblock)
 {
+  RWLatchHolder hold(lock,true);
   map<SIZE_T, Block, cache_compare_lessthan>::iterator b;
   
   b = blockmap.find(inblocknum);
 
   if (b!=blockmap.end()) {
-    // It's in  cache, so just replace the block
-    (*b).second=inblock;
+    // It's in  cache, so just replace the block, in place since
+    // it may be pinned
+    if ((*b).second.length==inblock.length) { 
+      if ((*b).second.data!=inblock.data) { 
+	memcpy((*b).second.data,inblock.data,inblock.length);
+      }
+    } else {
+      SIZE_T pins=(*b).second.pins;
+      SIZE_T version=(*b).second.version;
+      (*b).second=inblock;
+      (*b).second.pins=pins;
+      (*b).second.version=version;
+    }
     (*b).second.lastaccessed=curtime;
     (*b).second.dirty=true;
     writes++;
+    TraceOp(TRACE_WRITE,inblocknum,true);
     return ERROR_NOERROR;
   } else {
     // It's not in cache, so time to allocate it
@@ -192,34 +339,189 @@ ERROR_T BufferCache::WriteBlock(const SIZE_T inblocknum, const Block &inblock)
     myblock.lastaccessed=curtime;
     myblock.dirty=true;
     blockmap[inblocknum]=myblock;
+    blockmap[inblocknum].version=StartVersion(inblocknum);
     writes++;
+    TraceOp(TRACE_WRITE,inblocknum,false);
     return ERROR_NOERROR;
   }
 }
   
+ERROR_T BufferCache::PinBlock(const SIZE_T blocknum, Block *&block)
+{
+  RWLatchHolder hold(lock,true);
+  map<SIZE_T, Block, cache_compare_lessthan>::iterator b;
+
+  b = blockmap.find(blocknum);
+
+  if (b==blockmap.end()) { 
+    Block myblock;
+    CheckDeleteOldest();
+    int rc = DiskRead(blocknum,myblock);
+    if (rc!=ERROR_NOERROR) { 
+      return rc;
+    }
+    myblock.dirty=false;
+    b = blockmap.insert(make_pair(blocknum,myblock)).first;
+    (*b).second.version=StartVersion(blocknum);
+    TraceOp(TRACE_READ,blocknum,false);
+  } else {
+    TraceOp(TRACE_READ,blocknum,true);
+  }
+  (*b).second.lastaccessed=curtime;
+  (*b).second.pins++;
+  reads++;
+  block=&(*b).second;
+  return ERROR_NOERROR;
+}
+
+
+// The block is the one PinBlock gave, so there's no need to look it up
+ERROR_T BufferCache::UnpinBlock(Block *block)
+{
+  RWLatchHolder hold(lock,true);
+  if (block->pins==0) { 
+    return ERROR_INSANE;
+  }
+  block->pins--;
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BufferCache::DirtyBlock(const SIZE_T blocknum, Block *block)
+{
+  RWLatchHolder hold(lock,true);
+  if (block->pins==0) { 
+    return ERROR_INSANE;
+  }
+  block->lastaccessed=curtime;
+  block->dirty=true;
+  writes++;
+  TraceOp(TRACE_WRITE,blocknum,true);
+  return ERROR_NOERROR;
+}
+
+
+// The wait for the latch itself happens outside the mutex
+ERROR_T BufferCache::LatchBlock(const SIZE_T blocknum, const bool exclusive)
+{
+  BlockLatch *l;
+
+  lock.Lock(true);
+  map<SIZE_T, BlockLatch *>::iterator i = latches.find(blocknum);
+  if (i==latches.end()) { 
+    i = latches.insert(make_pair(blocknum,new BlockLatch)).first;
+  }
+  l=(*i).second;
+  l->users++;
+  lock.Unlock();
+
+  l->latch.Lock(exclusive);
+
+  if (exclusive) { 
+    RWLatchHolder hold(lock,true);
+    map<SIZE_T, Block, cache_compare_lessthan>::iterator b = blockmap.find(blocknum);
+    l->exclusive=true;
+    if (b!=blockmap.end()) { 
+      (*b).second.version++;
+    }
+  }
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BufferCache::UnlatchBlock(const SIZE_T blocknum)
+{
+  RWLatchHolder hold(lock,true);
+  map<SIZE_T, BlockLatch *>::iterator i = latches.find(blocknum);
+
+  if (i==latches.end()) { 
+    return ERROR_INSANE;
+  }
+  if ((*i).second->exclusive) { 
+    map<SIZE_T, Block, cache_compare_lessthan>::iterator b = blockmap.find(blocknum);
+    (*i).second->exclusive=false;
+    if (b!=blockmap.end()) { 
+      (*b).second.version++;
+    }
+  }
+  (*i).second->latch.Unlock();
+  if (--(*i).second->users==0) { 
+    delete (*i).second;
+    latches.erase(i);
+  }
+  return ERROR_NOERROR;
+}
+
+  
 ERROR_T BufferCache::PrefetchBlock (const SIZE_T blocknum)
 {
-  // Not implemented yet
-  return ERROR_IMPLBUG;
+  vector<SIZE_T> one(1,blocknum);
+
+  return PrefetchBlocks(one);
+}
+
+
+ERROR_T BufferCache::PrefetchBlocks (const vector<SIZE_T> &blocknums)
+{
+  RWLatchHolder hold(lock,true);
+  vector<SIZE_T> want;
+  vector<Block> blocks;
+  ERROR_T ret=ERROR_NOERROR;
+  SIZE_T i, j, k;
+
+  for (i=0;i<blocknums.size();i++) { 
+    bool hit = blockmap.find(blocknums[i])!=blockmap.end();
+    TraceOp(TRACE_PREFETCH,blocknums[i],hit);
+    if (!hit) { 
+      want.push_back(blocknums[i]);
+    }
+  }
+  sort(want.begin(),want.end());
+  want.erase(unique(want.begin(),want.end()),want.end());
+  if (want.size()>cachesize) { 
+    // any more would push out the first ones
+    want.resize(cachesize);
+    ret=ERROR_NOFETCH;
+  }
+
+  for (i=0;i<want.size();i=j) { 
+    // want[i..j-1] are consecutive blocks
+    for (j=i+1;j<want.size() && want[j]==want[j-1]+1;j++) { 
+    }
+    blocks.clear();
+    int rc = DiskRead(want[i],j-i,blocks);
+    if (rc!=ERROR_NOERROR) { 
+      return rc;
+    }
+    for (k=0;k<blocks.size();k++) { 
+      if (CheckDeleteOldest(false)!=ERROR_NOERROR) { 
+	return ERROR_NOFETCH;
+      }
+      blocks[k].lastaccessed=curtime;
+      blocks[k].dirty=false;
+      blockmap[want[i+k]]=blocks[k];
+      blockmap[want[i+k]].version=StartVersion(want[i+k]);
+    }
+  }
+  return ret;
 }
   
 ERROR_T BufferCache::FlushBlock(const SIZE_T blocknum)
 {
+  RWLatchHolder hold(lock,true);
   map<SIZE_T, Block, cache_compare_lessthan>::iterator b;
   
   b = blockmap.find(blocknum);
 
+  TraceOp(TRACE_FLUSH,blocknum,b!=blockmap.end());
+
   if (b==blockmap.end()) { 
     return ERROR_NOERROR;
   } else {
     if ((*b).second.dirty) { 
-      double reqtime;
       int rc;
-      rc=disk->Write((*b).first,
-		     (*b).second,
-		     reqtime);
-      diskwrites++;
-      curtime+=reqtime;
+      rc=DiskWrite((*b).first,
+		   (*b).second);
       if (rc!=ERROR_NOERROR) { 
 	return rc;
       }
@@ -231,6 +533,7 @@ ERROR_T BufferCache::FlushBlock(const SIZE_T blocknum)
   
 ostream & BufferCache::Print(ostream &os) const
 {
+  RWLatchHolder hold(lock,true);
   os << "BufferCache(cachesize="<<cachesize
      << ", blocksize="<<GetBlockSize()
      << ", curtime="<<curtime
@@ -3,10 +3,13 @@
 
 #include <iostream>
 #include <map>
+#include <vector>
 
 #include "global.h"
 #include "block.h"
 #include "disksystem.h"
+#include "trace.h"
+#include "latch.h"
 
 using namespace std;
 
@@ -17,20 +20,50 @@ struct cache_compare_lessthan {
 };
 
 
+// A block's latch, made when it is first wanted and dropped when
+// nobody is waiting for it or holding it
+struct BlockLatch {
+  RWLatch latch;
+  SIZE_T  users;
+  bool    exclusive;  // held exclusively
+
+  BlockLatch() : users(0), exclusive(false) {}
+};
+
+
 //
 // LRU block cache with single step prefetch
 //
 // Write Back
 // Write Allocate
+//
+// Every operation holds the cache's lock, so any number of threads
+// can share a cache.  Blocks given out by PinBlock are read and
+// changed in place, outside the lock, so users that do that from
+// more than one thread order themselves with the block latches.
+//
+// Each cached block also has a version, which is odd while someone
+// holds the block's latch exclusively and so may be changing it in
+// place.  ReadBlockUnlatched uses it to read a block without a
+// latch, under the lock held shared, so readers that use it don't
+// wait for each other, only for blocks being changed.
 class BufferCache {
  private:
   DiskSystem *disk;
   SIZE_T cachesize;
   map<SIZE_T, Block, cache_compare_lessthan> blockmap;
+  map<SIZE_T, BlockLatch *> latches;
   double curtime;
   SIZE_T allocs, deallocs, reads, writes, diskreads, diskwrites;
+  BlockTrace *trace;
+  mutable RWLatch lock;
  protected:
-  ERROR_T CheckDeleteOldest();
+  ERROR_T CheckDeleteOldest(const bool writeback=true);
+  ERROR_T DiskRead(const SIZE_T blocknum, Block &block);
+  ERROR_T DiskRead(const SIZE_T blocknum, const SIZE_T numblocks, vector<Block> &blocks);
+  ERROR_T DiskWrite(const SIZE_T blocknum, const Block &block);
+  void    TraceOp(const BlockTraceOp op, const SIZE_T blocknum, const bool hit);
+  SIZE_T  StartVersion(const SIZE_T blocknum) const;
  public:
   // Cache size is in number of blocks
   BufferCache(DiskSystem *disk,
@@ -65,21 +98,58 @@ class BufferCache {
   // returns one of ERROR_NOERROR  (zero)
   // ERROR_NOSUCHBLOCK or other nonzero error codes
   ERROR_T ReadBlock(const SIZE_T inblocknum, Block &outblock);
+
+  // Like ReadBlock, for a caller that holds no latch on the block.
+  // Waits while someone holds the latch exclusively, so the copy is
+  // never of a block half way through being changed in place.  The
+  // caller can't tell what happens to the block after that.
+  ERROR_T ReadBlockUnlatched(const SIZE_T inblocknum, Block &outblock);
   
   // returns one of ERROR_NOERROR  (zero)
   // ERROR_NOSUCHBLOCK
   // ERROR_WRONGSIZEBLOCK or other nonzero error codes
   ERROR_T WriteBlock(const SIZE_T inblocknum, const Block &inblock);
   
+  // Pins a block in the cache, reading it in if need be, and gives
+  // the cached block itself.  A pinned block is never evicted, so
+  // block stays good until the matching UnpinBlock, and WriteBlock
+  // updates it in place.  Counts as a read.
+  ERROR_T PinBlock(const SIZE_T blocknum, Block *&block);
+  ERROR_T UnpinBlock(Block *block);
+  // Records that pinned block blocknum was changed in place.  Counts
+  // as a write.
+  ERROR_T DirtyBlock(const SIZE_T blocknum, Block *block);
+
+  // Waits for and takes the latch on blocknum, shared or exclusive.
+  // The cache never takes latches itself; they are there for its
+  // users to agree on who may look at or change a block.  A block
+  // need not be cached or pinned to be latched.  Taking or letting
+  // go of an exclusive latch moves the block to its next version.
+  ERROR_T LatchBlock(const SIZE_T blocknum, const bool exclusive);
+  ERROR_T UnlatchBlock(const SIZE_T blocknum);
+
   // Request that a block be read into the cache
   // This returns immediately.
   // ERROR_NOFETCH means that there is no room currently
   // to prefetch the block and it was not prefetched.
+  // (Making room never writes a block back, so there is no room
+  // when the least recently used block is dirty.)
   ERROR_T PrefetchBlock (const SIZE_T blocknum);
+
+  // Request that several blocks be read into the cache.  Runs of
+  // consecutive blocks are read with a single disk request each.
+  // At most a cache's worth are fetched; ERROR_NOFETCH means that
+  // some of them were not.
+  ERROR_T PrefetchBlocks (const vector<SIZE_T> &blocknums);
   
   // Request that a block be flushed to disk
   // Note that this blocks until the block is finished.
   ERROR_T FlushBlock(const SIZE_T blocknum);
+
+  // Record every cache and disk operation to the trace
+  // (0 turns tracing off).  The cache does not own the trace.
+  void SetTrace(BlockTrace *t) { trace=t; }
+  BlockTrace *GetTrace() const { return trace; }
   
  
   SIZE_T GetNumAllocs() const { return allocs; }
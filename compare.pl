@@ -73,6 +73,32 @@ while ($numerr<$maxerrs && !eof(CMD) && !eof(REF) && !eof(TEST)) {
       }
     }
     $numerr++ if $sawerror;
+  } elsif ($cmd =~ /^SCAN/) { 
+    # SCAN also spans multiple lines, but they must come in order
+    @refscan=();
+    while (defined($disp=<REF>) && $disp!~/END SCAN/) { 
+      chomp($disp);
+      push @refscan, $disp;
+    }
+    @testscan=();
+    while (defined($disp=<TEST>) && $disp!~/END SCAN/) { 
+      chomp($disp);
+      push @testscan, $disp;
+    }
+    for ($j=0; $j<=$#refscan || $j<=$#testscan; $j++) { 
+      $r = $j<=$#refscan ? $refscan[$j] : "(end of scan)";
+      $t = $j<=$#testscan ? $testscan[$j] : "(end of scan)";
+      if ($r ne $t) { 
+	print "----------------------------------------------------------------------------\n";
+	print "ERROR $numerr found on operation $i\n\n";
+	print "Operation is \"$cmd\"\n\n";
+	print "Reference implementation says: \"$r\"\n";
+	print "Test implementation says:      \"$t\"\n";
+	print "----------------------------------------------------------------------------\n";
+	$numerr++;
+	last;
+      }
+    }
   } else {
     if ($ref ne $test) { 
       print "----------------------------------------------------------------------------\n";
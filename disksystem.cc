@@ -516,6 +516,12 @@ SIZE_T DiskSystem::GetNumBlocks() const
 }
 
 
+double DiskSystem::EstimateAccess(const SIZE_T inoffblock, const SIZE_T numblock)
+{
+  return ModelAccess(inoffblock,numblock);
+}
+
+
 
 #define GETBIT(x) ((bitmap[(x)/8] >> (7-((x)%8))) & 0x1)
 #define SETBIT(x) do { bitmap[(x)/8] |= 0x1 << (7-((x)%8)); } while (0)
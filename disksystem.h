@@ -97,6 +97,10 @@ class DiskSystem {
   SIZE_T GetBlockSize() const;
   SIZE_T GetNumBlocks() const;
 
+  // Runs the access through the timing model only (the head
+  // moves, but no data is transfered).  Used to replay traces.
+  double EstimateAccess(const SIZE_T inoffblock, const SIZE_T numblock);
+
   //
   // These are notification functions that should be called when
   // a block is allocated or deallocated.  They keep the bitmap updated
@@ -0,0 +1,360 @@
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include "extsort.h"
+
+#define MIN(x,y) ((x)<(y) ? (x) : (y))
+
+
+// A record in the arena or a run file is a header followed by the
+// key bytes and then the value bytes
+struct SortRecordHeader {
+  SIZE_T keylength;
+  SIZE_T valuelength;
+};
+
+
+static int CompareKeys(const char *a, const SIZE_T alen, const char *b, const SIZE_T blen)
+{
+  int c=memcmp(a,b,MIN(alen,blen));
+
+  if (c) {
+    return c;
+  }
+  return (alen>blen)-(alen<blen);
+}
+
+
+struct SortRecordLess {
+  const char *arena;
+
+  SortRecordLess(const char *a) : arena(a) {}
+
+  bool operator()(const SIZE_T a, const SIZE_T b) const {
+    SortRecordHeader ha, hb;
+    memcpy(&ha,arena+a,sizeof(ha));
+    memcpy(&hb,arena+b,sizeof(hb));
+    return CompareKeys(arena+a+sizeof(ha),ha.keylength,arena+b+sizeof(hb),hb.keylength)<0;
+  }
+};
+
+
+// A run being merged, with the pair at its head
+struct SortRun {
+  FILE    *file;
+  string   name;
+  KEY_T    key;
+  VALUE_T  value;
+  bool     done;
+
+  SortRun(FILE *f, const string &n) : file(f), name(n), done(false) {}
+
+  ERROR_T Advance() {
+    SortRecordHeader h;
+    ERROR_T rc;
+
+    if (fread(&h,sizeof(h),1,file)!=1) {
+      done=true;
+      return ERROR_NOERROR;
+    }
+    if ((rc=key.Resize(h.keylength,false)) || (rc=value.Resize(h.valuelength,false))) {
+      return rc;
+    }
+    if (fread(key.data,1,h.keylength,file)!=h.keylength ||
+	fread(value.data,1,h.valuelength,file)!=h.valuelength) {
+      return ERROR_NOFILE;
+    }
+    return ERROR_NOERROR;
+  }
+};
+
+
+static ERROR_T WriteRecord(FILE *file,
+			   const char *key, const SIZE_T keylength,
+			   const char *value, const SIZE_T valuelength)
+{
+  SortRecordHeader h;
+
+  h.keylength=keylength;
+  h.valuelength=valuelength;
+  if (fwrite(&h,sizeof(h),1,file)!=1 ||
+      fwrite(key,1,keylength,file)!=keylength ||
+      fwrite(value,1,valuelength,file)!=valuelength) {
+    return ERROR_NOFILE;
+  }
+  return ERROR_NOERROR;
+}
+
+
+ExternalSorter::ExternalSorter(const string &t, const SIZE_T m, const SIZE_T f) :
+  tmpprefix(t), memory(m), fanin(f<2 ? 2 : f), nextrecord(0), nextrun(0),
+  numpairs(0), numruns(0), numpasses(0)
+{
+}
+
+
+ExternalSorter::~ExternalSorter()
+{
+  EndMerge();
+  for (SIZE_T i=0;i<runs.size();i++) {
+    remove(runs[i].c_str());
+  }
+}
+
+
+ERROR_T ExternalSorter::Add(const KEY_T &key, const VALUE_T &value)
+{
+  SIZE_T len=sizeof(SortRecordHeader)+key.length+value.length;
+  SortRecordHeader h;
+  ERROR_T rc;
+
+  // the arena and the record offsets must stay within memory
+  if (!records.empty() &&
+      arena.size()+len+(records.size()+1)*sizeof(SIZE_T)>memory) {
+    rc=WriteRun();
+    if (rc) { return rc; }
+  }
+
+  h.keylength=key.length;
+  h.valuelength=value.length;
+  records.push_back(arena.size());
+  arena.insert(arena.end(),(const char *)&h,(const char *)&h+sizeof(h));
+  arena.insert(arena.end(),(const char *)key.data,(const char *)key.data+key.length);
+  arena.insert(arena.end(),(const char *)value.data,(const char *)value.data+value.length);
+  numpairs++;
+  return ERROR_NOERROR;
+}
+
+
+//
+// Sorts the buffered pairs and writes them out as a new run
+//
+ERROR_T ExternalSorter::WriteRun()
+{
+  char name[32];
+  FILE *file;
+  SortRecordHeader h;
+  ERROR_T rc;
+
+  sort(records.begin(),records.end(),SortRecordLess(&arena[0]));
+
+  sprintf(name,".run%lu",(unsigned long)nextrun++);
+  string runname=tmpprefix+name;
+  if ((file=fopen(runname.c_str(),"w"))==0) {
+    return ERROR_NOFILE;
+  }
+  runs.push_back(runname);
+
+  for (SIZE_T i=0;i<records.size();i++) {
+    const char *p=&arena[records[i]];
+    memcpy(&h,p,sizeof(h));
+    rc=WriteRecord(file,p+sizeof(h),h.keylength,p+sizeof(h)+h.keylength,h.valuelength);
+    if (rc) {
+      fclose(file);
+      return rc;
+    }
+  }
+  if (fclose(file)) {
+    return ERROR_NOFILE;
+  }
+
+  numruns++;
+  arena.clear();
+  records.clear();
+  return ERROR_NOERROR;
+}
+
+
+//
+// Loser tree
+//
+// The inputs are the leaves k..2k-1 of a binary tree numbered from
+// 1, k the number of inputs.  Each interior node remembers the input
+// that lost the match played there and losers[0] the overall winner,
+// so after the winner advances only the matches on its path to the
+// root are replayed, log2(k) compares per pair.
+//
+bool ExternalSorter::Beats(const SIZE_T a, const SIZE_T b) const
+{
+  const SortRun *x=inputs[a], *y=inputs[b];
+
+  if (x->done || y->done) {
+    return !x->done;
+  }
+  int c=CompareKeys((const char *)x->key.data,x->key.length,
+		    (const char *)y->key.data,y->key.length);
+  // equal keys come out in run order
+  return c<0 || (c==0 && a<b);
+}
+
+
+SIZE_T ExternalSorter::Play(const SIZE_T node)
+{
+  SIZE_T k=inputs.size();
+
+  if (node>=k) {
+    return node-k;
+  }
+  SIZE_T a=Play(2*node), b=Play(2*node+1);
+  if (Beats(a,b)) {
+    losers[node]=b;
+    return a;
+  } else {
+    losers[node]=a;
+    return b;
+  }
+}
+
+
+void ExternalSorter::Replay(const SIZE_T input)
+{
+  SIZE_T winner=input;
+
+  for (SIZE_T node=(input+inputs.size())/2; node>=1; node/=2) {
+    if (Beats(losers[node],winner)) {
+      swap(losers[node],winner);
+    }
+  }
+  losers[0]=winner;
+}
+
+
+ERROR_T ExternalSorter::StartMerge(const SIZE_T first, const SIZE_T n)
+{
+  FILE *file;
+  ERROR_T rc;
+
+  for (SIZE_T i=first;i<first+n;i++) {
+    if ((file=fopen(runs[i].c_str(),"r"))==0) {
+      return ERROR_NOFILE;
+    }
+    inputs.push_back(new SortRun(file,runs[i]));
+    rc=inputs.back()->Advance();
+    if (rc) { return rc; }
+  }
+  losers.assign(inputs.size(),0);
+  losers[0]=Play(1);
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T ExternalSorter::NextMerged(KEY_T &key, VALUE_T &value)
+{
+  SortRun *w=inputs[losers[0]];
+  ERROR_T rc;
+
+  if (w->done) {
+    return ERROR_NONEXISTENT;
+  }
+  if ((rc=key.Resize(w->key.length,false)) || (rc=value.Resize(w->value.length,false))) {
+    return rc;
+  }
+  memcpy(key.data,w->key.data,w->key.length);
+  memcpy(value.data,w->value.data,w->value.length);
+
+  rc=w->Advance();
+  if (rc) { return rc; }
+  Replay(losers[0]);
+  return ERROR_NOERROR;
+}
+
+
+// Closes and removes the runs just merged
+void ExternalSorter::EndMerge()
+{
+  for (SIZE_T i=0;i<inputs.size();i++) {
+    fclose(inputs[i]->file);
+    remove(inputs[i]->name.c_str());
+    delete inputs[i];
+  }
+  inputs.clear();
+  losers.clear();
+}
+
+
+ERROR_T ExternalSorter::Finish()
+{
+  KEY_T key;
+  VALUE_T value;
+  char name[32];
+  FILE *file;
+  ERROR_T rc;
+
+  if (runs.empty()) {
+    // it all fit in memory
+    sort(records.begin(),records.end(),SortRecordLess(records.empty() ? 0 : &arena[0]));
+    nextrecord=0;
+    return ERROR_NOERROR;
+  }
+
+  if (!records.empty()) {
+    rc=WriteRun();
+    if (rc) { return rc; }
+  }
+  vector<char>().swap(arena);
+  vector<SIZE_T>().swap(records);
+
+  // merge fanin runs at a time until one more merge will do
+  while (runs.size()>fanin) {
+    vector<string> merged;
+    for (SIZE_T first=0; first<runs.size(); first+=fanin) {
+      SIZE_T n=MIN(fanin,runs.size()-first);
+      if (n==1) {
+	merged.push_back(runs[first]);
+	continue;
+      }
+      sprintf(name,".run%lu",(unsigned long)nextrun++);
+      string runname=tmpprefix+name;
+      if ((file=fopen(runname.c_str(),"w"))==0) {
+	rc=ERROR_NOFILE;
+      } else {
+	merged.push_back(runname);
+	rc=StartMerge(first,n);
+	while (rc==ERROR_NOERROR && (rc=NextMerged(key,value))==ERROR_NOERROR) {
+	  rc=WriteRecord(file,(const char *)key.data,key.length,(const char *)value.data,value.length);
+	}
+	if (fclose(file) && rc==ERROR_NONEXISTENT) {
+	  rc=ERROR_NOFILE;
+	}
+	EndMerge();
+      }
+      if (rc!=ERROR_NONEXISTENT) {
+	// leave everything not yet removed for the destructor
+	runs.insert(runs.end(),merged.begin(),merged.end());
+	return rc;
+      }
+    }
+    runs.swap(merged);
+    numpasses++;
+  }
+
+  // the last merge is read through GetNext
+  rc=StartMerge(0,runs.size());
+  if (rc) { return rc; }
+  runs.clear();
+  numpasses++;
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T ExternalSorter::GetNext(KEY_T &key, VALUE_T &value)
+{
+  SortRecordHeader h;
+  ERROR_T rc;
+
+  if (!inputs.empty()) {
+    return NextMerged(key,value);
+  }
+
+  if (nextrecord>=records.size()) {
+    return ERROR_NONEXISTENT;
+  }
+  const char *p=&arena[records[nextrecord++]];
+  memcpy(&h,p,sizeof(h));
+  if ((rc=key.Resize(h.keylength,false)) || (rc=value.Resize(h.valuelength,false))) {
+    return rc;
+  }
+  memcpy(key.data,p+sizeof(h),h.keylength);
+  memcpy(value.data,p+sizeof(h)+h.keylength,h.valuelength);
+  return ERROR_NOERROR;
+}
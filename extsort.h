@@ -0,0 +1,78 @@
+#ifndef _extsort
+#define _extsort
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#include "global.h"
+#include "btree.h"
+
+using namespace std;
+
+//
+// External merge sort of key/value pairs, for bulk loading input
+// that is not sorted or does not fit in memory
+//
+// Add collects pairs in a buffer of at most memory bytes.  Each
+// time the buffer fills it is sorted and written out as a run, a
+// file named tmpprefix.runN.  Finish then merges the runs fanin at a
+// time until at most fanin are left, and the sorter hands out the
+// merge of those through GetNext, so the last pass feeds straight
+// into BTreeIndex::BulkLoad.  Merges pick the next pair with a loser
+// tree.  Keys are ordered as the tree orders them: bytewise, with a
+// key that is a prefix of another first.  Runs are removed once they
+// have been merged.
+//
+struct SortRun;
+
+class ExternalSorter : public KeyValueSource {
+ private:
+  string            tmpprefix;
+  SIZE_T            memory;
+  SIZE_T            fanin;
+
+  // run generation: the pairs are packed into arena as
+  // (keylength, valuelength, key, value), found through records
+  vector<char>      arena;
+  vector<SIZE_T>    records;
+  SIZE_T            nextrecord;  // when nothing was written out, the next to hand out
+
+  vector<string>    runs;        // runs not yet merged
+  SIZE_T            nextrun;
+
+  // the merge being read through GetNext
+  vector<SortRun *> inputs;
+  vector<SIZE_T>    losers;      // losers[0] is the winner
+
+  SIZE_T            numpairs, numruns, numpasses;
+
+  ERROR_T WriteRun();
+  ERROR_T StartMerge(const SIZE_T first, const SIZE_T n);
+  ERROR_T NextMerged(KEY_T &key, VALUE_T &value);
+  void    EndMerge();
+  bool    Beats(const SIZE_T a, const SIZE_T b) const;
+  SIZE_T  Play(const SIZE_T node);
+  void    Replay(const SIZE_T input);
+
+ public:
+  ExternalSorter(const string &tmpprefix, const SIZE_T memory, const SIZE_T fanin=16);
+  ExternalSorter(const ExternalSorter &rhs) { throw GenericException(); }
+  ExternalSorter & operator=(const ExternalSorter &rhs) { throw GenericException(); return *this; }
+  ~ExternalSorter();
+
+  // returns ERROR_NOFILE if a run can't be written
+  ERROR_T Add(const KEY_T &key, const VALUE_T &value);
+  // Call after the last Add and before the first GetNext
+  ERROR_T Finish();
+  // The pairs in key order, ERROR_NONEXISTENT after the last
+  ERROR_T GetNext(KEY_T &key, VALUE_T &value);
+
+  SIZE_T  GetNumPairs() const { return numpairs; }
+  SIZE_T  GetNumRuns() const { return numruns; }
+  // merge passes, counting the one read through GetNext (0 if the
+  // pairs never left memory)
+  SIZE_T  GetNumPasses() const { return numpasses; }
+};
+
+#endif
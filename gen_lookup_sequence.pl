@@ -0,0 +1,55 @@
+#!/usr/bin/perl -w
+
+$#ARGV==4 or die "usage: gen_lookup_sequence.pl keysize valsize seed numkeys numlookups\n";
+
+($keysize,$valuesize,$seed,$numkeys,$numlookups)=@ARGV;
+
+srand $seed;
+
+$keybytes="abcdefghijklmnopqrstuvwxyz0123456789";
+$valuebytes="abcdefghijklmnopqrstuvwxyz0123456789";
+
+#
+# A lookup heavy sequence: load numkeys keys, then do numlookups
+# lookups, nine in ten of them for keys that exist
+#
+
+%content= ();
+@keys= ();
+
+print "INIT $keysize $valuesize\n";
+
+for ($i=0;$i<$numkeys;$i++) {
+  my ($key, $value) = (MakeNonExistentKey(), MakeValue());
+  $content{$key}=$value;
+  push @keys, $key;
+  print "INSERT $key $value  # should succeed\n";
+}
+
+for ($i=0;$i<$numlookups;$i++) {
+  if ($#keys>=0 && rand(10)>=1) {
+    my $key=$keys[int(rand($#keys+1))];
+    print "LOOKUP $key  # should succeed and return $content{$key}\n";
+  } else {
+    print "LOOKUP ".MakeNonExistentKey()."  # should fail\n";
+  }
+}
+
+print "DEINIT\n";
+
+
+sub MakeKey {
+  return join("", map { substr($keybytes,int(rand(length($keybytes))),1) } (1..$keysize));
+}
+
+sub MakeNonExistentKey {
+  my $key;
+  do {
+    $key=MakeKey();
+  } while (defined $content{$key});
+  return $key;
+}
+
+sub MakeValue {
+  return join("", map { substr($valuebytes,int(rand(length($valuebytes))),1) } (1..$valuesize));
+}
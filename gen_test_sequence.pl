@@ -1,8 +1,17 @@
 #!/usr/bin/perl -w
 
-$#ARGV==3 or die "usage: gen_test_sequence.pl keysize valsize seed num\n";
-
-($keysize,$valuesize,$seed,$num)=@ARGV;
+$#ARGV>=3 && $#ARGV<=6 or die "usage: gen_test_sequence.pl keysize valsize seed num [format [prefixlen [mixed|drain]]]\n";
+
+# With a format, the INIT asks sim for it (see README), and batches
+# of inserts and scans are mixed in.  Keys then each start with one of a few
+# prefixes of prefixlen characters, to try out prefix compression.
+# A drain sequence inserts for its first half and then mostly
+# deletes, so that nodes are merged.
+($keysize,$valuesize,$seed,$num,$format,$prefixlen,$shape)=@ARGV;
+$prefixlen=0 if !defined($prefixlen);
+$shape="mixed" if !defined($shape);
+$prefixlen<$keysize or die "prefixlen must be less than keysize\n";
+$shape eq "mixed" || $shape eq "drain" or die "unknown sequence shape $shape\n";
 
 srand $seed;
 
@@ -13,37 +22,61 @@ $valuebytes="abcdefghijklmnopqrstuvwxyz0123456789";
 	 INSERT_EXISTS => \&gen_insert_exists,
 	 UPDATE_NEW => \&gen_update_new,
 	 UPDATE_EXISTS => \&gen_update_exists,
-#
-# No deletes required this quarter
-# 
-#	 DELETE_NEW => \&gen_delete_new,
-#	 DELETE_EXISTS => \&gen_delete_new,
+	 UPSERT_NEW => \&gen_upsert_new,
+	 UPSERT_EXISTS => \&gen_upsert_exists,
+	 DELETE_NEW => \&gen_delete_new,
+	 DELETE_EXISTS => \&gen_delete_exists,
 	 LOOKUP_NEW => \&gen_lookup_new,
 	 LOOKUP_EXISTS => \&gen_lookup_exists,
 	 DISPLAY => \&gen_display
        );
 
-@opnames=keys %ops;
+if (defined($format)) { 
+  $ops{BATCH}=\&gen_batch;
+  $ops{SCAN}=\&gen_scan;
+}
+
+# sorted, so that a seed always gives the same sequence
+@opnames=sort keys %ops;
 
 
 %content= ();
 
-print "INIT $keysize $valuesize\n";
+@prefixes=map { join("", map { substr($keybytes,int(rand(length($keybytes))),1) } (1..$prefixlen)) } (1..3);
+
+print "INIT $keysize $valuesize", (defined($format) ? " $format" : ""), "\n";
 
 for ($i=1;$i<$num;$i++) { 
   # never try to do an existing key if no keys currently exist
   my $numkeys=keys %content;
-  do {
-    $op=$opnames[int(rand($#opnames + 1))];
-  } while ( $op =~ /EXISTS/ && $numkeys<1 );
+  if ($shape eq "drain") { 
+    $op=DrainOp($numkeys);
+  } else {
+    do {
+      $op=$opnames[int(rand($#opnames + 1))];
+    } while ( $op =~ /EXISTS/ && $numkeys<1 );
+  }
   print &{$ops{$op}}(), "\n";
 }
 
 print "DEINIT\n";
 
 
+# Filling up, then emptying out
+sub DrainOp {
+  my ($numkeys)=@_;
+  my $r=rand();
+
+  if ($i<$num/2) { 
+    return defined($ops{BATCH}) && $r<0.05 ? "BATCH" : "INSERT_NEW";
+  }
+  return "LOOKUP_NEW" if $numkeys<1;
+  return $r<0.8 ? "DELETE_EXISTS" : $r<0.9 ? "LOOKUP_EXISTS" : $r<0.99 ? "DELETE_NEW" : "DISPLAY";
+}
+
 sub MakeKey {
-  return join("", map { substr($keybytes,int(rand(length($keybytes))),1) } (1..$keysize));
+  my $prefix=$prefixlen>0 ? $prefixes[int(rand(3))] : "";
+  return $prefix.join("", map { substr($keybytes,int(rand(length($keybytes))),1) } (1..$keysize-$prefixlen));
 }
 
 sub MakeNonExistentKey {
@@ -84,6 +117,18 @@ sub gen_update_exists {
   return "UPDATE $key $value  # should succeed";
 }
 
+sub gen_upsert_new {
+  my ($key, $value) = (MakeNonExistentKey(), MakeValue());
+  $content{$key}=$value;
+  return "UPSERT $key $value  # should succeed";
+}
+
+sub gen_upsert_exists {
+  my ($key, $value) = (MakeExistentKey(), MakeValue());
+  $content{$key}=$value;
+  return "UPSERT $key $value  # should succeed";
+}
+
 sub gen_delete_new {
   return "DELETE ".MakeNonExistentKey()."  # should fail" ;
 }
@@ -103,6 +148,31 @@ sub gen_lookup_exists {
   return "LOOKUP $key  # should succeed and return $content{$key}";
 }
 
+# up to 100 inserts, mostly of new keys, to be done as one batch
+sub gen_batch {
+  my @lines=("BATCH");
+  my $n=1+int(rand(100));
+  for (my $j=0;$j<$n;$j++) { 
+    if (keys %content && rand()<0.1) { 
+      push @lines, gen_insert_exists();
+    } else {
+      push @lines, gen_insert_new();
+    }
+  }
+  push @lines, "END";
+  return join("\n",@lines);
+}
+
+# a range from and to keys that may or may not be there, either end
+# possibly open
+sub gen_scan {
+  my @ends=map { rand()<0.2 ? "-" : (keys %content && rand()<0.5) ? MakeExistentKey() : MakeKey() } (1..2);
+  if ($ends[0] ne "-" && $ends[1] ne "-" && $ends[0] gt $ends[1]) { 
+    @ends=reverse @ends;
+  }
+  return "SCAN $ends[0] $ends[1]  # should always succeed";
+}
+
 sub gen_display {
   return "DISPLAY  # should always succeed";
 }
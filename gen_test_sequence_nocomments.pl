@@ -13,10 +13,10 @@ $valuebytes="abcdefghijklmnopqrstuvwxyz0123456789";
 	 INSERT_EXISTS => \&gen_insert_exists,
 	 UPDATE_NEW => \&gen_update_new,
 	 UPDATE_EXISTS => \&gen_update_exists,
-#
-# No deletes required for this quarter
-#	 DELETE_NEW => \&gen_delete_new,
-#	 DELETE_EXISTS => \&gen_delete_new,
+	 UPSERT_NEW => \&gen_upsert_new,
+	 UPSERT_EXISTS => \&gen_upsert_exists,
+	 DELETE_NEW => \&gen_delete_new,
+	 DELETE_EXISTS => \&gen_delete_exists,
 	 LOOKUP_NEW => \&gen_lookup_new,
 	 LOOKUP_EXISTS => \&gen_lookup_exists,
 	 DISPLAY => \&gen_display
@@ -83,6 +83,18 @@ sub gen_update_exists {
   return "UPDATE $key $value";
 }
 
+sub gen_upsert_new {
+  my ($key, $value) = (MakeNonExistentKey(), MakeValue());
+  $content{$key}=$value;
+  return "UPSERT $key $value";
+}
+
+sub gen_upsert_exists {
+  my ($key, $value) = (MakeExistentKey(), MakeValue());
+  $content{$key}=$value;
+  return "UPSERT $key $value";
+}
+
 sub gen_delete_new {
   return "DELETE ".MakeNonExistentKey();
 }
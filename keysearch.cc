@@ -0,0 +1,347 @@
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "keysearch.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define KEYSEARCH_X86 1
+#include <immintrin.h>
+#else
+#define KEYSEARCH_X86 0
+#endif
+
+// Below this many keys the vector kernels stop bisecting and count
+#define KEYSEARCH_WINDOW 16
+
+
+//
+// Keys compare like memcmp, which is the same as comparing them
+// as big endian unsigned integers
+//
+static inline uint64_t LoadKey64(const BYTE_T *p)
+{
+  uint64_t x;
+  memcpy(&x,p,8);
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  x=__builtin_bswap64(x);
+#endif
+  return x;
+}
+
+static inline uint32_t LoadKey32(const BYTE_T *p)
+{
+  uint32_t x;
+  memcpy(&x,p,4);
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+  x=__builtin_bswap32(x);
+#endif
+  return x;
+}
+
+
+SIZE_T KeySearchGeneric(const BYTE_T *keys,
+			const SIZE_T stride,
+			const SIZE_T n,
+			const SIZE_T keysize,
+			const BYTE_T *key)
+{
+  SIZE_T lo=0, hi=n;
+
+  while (lo<hi) {
+    SIZE_T mid=lo+(hi-lo)/2;
+    if (memcmp(keys+mid*stride,key,keysize)<0) {
+      lo=mid+1;
+    } else {
+      hi=mid;
+    }
+  }
+  return lo;
+}
+
+
+static SIZE_T KeySearchScalar8(const BYTE_T *keys, const SIZE_T stride, const SIZE_T n, const BYTE_T *key)
+{
+  uint64_t k=LoadKey64(key);
+  SIZE_T lo=0, hi=n;
+
+  while (lo<hi) {
+    SIZE_T mid=lo+(hi-lo)/2;
+    if (LoadKey64(keys+mid*stride)<k) {
+      lo=mid+1;
+    } else {
+      hi=mid;
+    }
+  }
+  return lo;
+}
+
+
+static SIZE_T KeySearchScalar4(const BYTE_T *keys, const SIZE_T stride, const SIZE_T n, const BYTE_T *key)
+{
+  uint32_t k=LoadKey32(key);
+  SIZE_T lo=0, hi=n;
+
+  while (lo<hi) {
+    SIZE_T mid=lo+(hi-lo)/2;
+    if (LoadKey32(keys+mid*stride)<k) {
+      lo=mid+1;
+    } else {
+      hi=mid;
+    }
+  }
+  return lo;
+}
+
+
+#if KEYSEARCH_X86
+
+//
+// The vector kernels bisect down to a window of KEYSEARCH_WINDOW
+// keys and then count how many keys in the window are smaller than
+// the search key, several at a time.  The keys are sorted, so the
+// count stops at the first group that is not entirely smaller.
+// There is no unsigned compare, so both sides get their sign bit
+// flipped before the signed compare.
+//
+
+__attribute__((target("sse4.2")))
+static SIZE_T KeySearchSSE42_8(const BYTE_T *keys, const SIZE_T stride, const SIZE_T n, const BYTE_T *key)
+{
+  uint64_t k=LoadKey64(key);
+  SIZE_T lo=0, hi=n;
+
+  while (hi-lo>KEYSEARCH_WINDOW) {
+    SIZE_T mid=lo+(hi-lo)/2;
+    if (LoadKey64(keys+mid*stride)<k) {
+      lo=mid+1;
+    } else {
+      hi=mid;
+    }
+  }
+
+  const __m128i sign=_mm_set1_epi64x((long long)0x8000000000000000ULL);
+  const __m128i kv=_mm_xor_si128(_mm_set1_epi64x((long long)k),sign);
+
+  for (;lo+2<=hi;lo+=2) {
+    __m128i v=_mm_set_epi64x((long long)LoadKey64(keys+(lo+1)*stride),
+			     (long long)LoadKey64(keys+lo*stride));
+    v=_mm_xor_si128(v,sign);
+    int lt=_mm_movemask_pd(_mm_castsi128_pd(_mm_cmpgt_epi64(kv,v)));
+    if (lt!=0x3) {
+      return lo+__builtin_popcount(lt);
+    }
+  }
+  if (lo<hi && LoadKey64(keys+lo*stride)<k) {
+    lo++;
+  }
+  return lo;
+}
+
+
+__attribute__((target("sse4.2")))
+static SIZE_T KeySearchSSE42_4(const BYTE_T *keys, const SIZE_T stride, const SIZE_T n, const BYTE_T *key)
+{
+  uint32_t k=LoadKey32(key);
+  SIZE_T lo=0, hi=n;
+
+  while (hi-lo>KEYSEARCH_WINDOW) {
+    SIZE_T mid=lo+(hi-lo)/2;
+    if (LoadKey32(keys+mid*stride)<k) {
+      lo=mid+1;
+    } else {
+      hi=mid;
+    }
+  }
+
+  const __m128i sign=_mm_set1_epi32((int)0x80000000U);
+  const __m128i kv=_mm_xor_si128(_mm_set1_epi32((int)k),sign);
+
+  for (;lo+4<=hi;lo+=4) {
+    __m128i v=_mm_set_epi32((int)LoadKey32(keys+(lo+3)*stride),
+			    (int)LoadKey32(keys+(lo+2)*stride),
+			    (int)LoadKey32(keys+(lo+1)*stride),
+			    (int)LoadKey32(keys+lo*stride));
+    v=_mm_xor_si128(v,sign);
+    int lt=_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(kv,v)));
+    if (lt!=0xf) {
+      return lo+__builtin_popcount(lt);
+    }
+  }
+  while (lo<hi && LoadKey32(keys+lo*stride)<k) {
+    lo++;
+  }
+  return lo;
+}
+
+
+__attribute__((target("avx2")))
+static SIZE_T KeySearchAVX2_8(const BYTE_T *keys, const SIZE_T stride, const SIZE_T n, const BYTE_T *key)
+{
+  uint64_t k=LoadKey64(key);
+  SIZE_T lo=0, hi=n;
+
+  while (hi-lo>KEYSEARCH_WINDOW) {
+    SIZE_T mid=lo+(hi-lo)/2;
+    if (LoadKey64(keys+mid*stride)<k) {
+      lo=mid+1;
+    } else {
+      hi=mid;
+    }
+  }
+
+  const __m256i sign=_mm256_set1_epi64x((long long)0x8000000000000000ULL);
+  const __m256i kv=_mm256_xor_si256(_mm256_set1_epi64x((long long)k),sign);
+  const __m256i bswap=_mm256_setr_epi8(7,6,5,4,3,2,1,0,15,14,13,12,11,10,9,8,
+				       7,6,5,4,3,2,1,0,15,14,13,12,11,10,9,8);
+  const __m256i index=_mm256_setr_epi64x(0,stride,2*stride,3*stride);
+
+  for (;lo+4<=hi;lo+=4) {
+    __m256i v=_mm256_i64gather_epi64((const long long *)(keys+lo*stride),index,1);
+    v=_mm256_xor_si256(_mm256_shuffle_epi8(v,bswap),sign);
+    int lt=_mm256_movemask_pd(_mm256_castsi256_pd(_mm256_cmpgt_epi64(kv,v)));
+    if (lt!=0xf) {
+      return lo+__builtin_popcount(lt);
+    }
+  }
+  while (lo<hi && LoadKey64(keys+lo*stride)<k) {
+    lo++;
+  }
+  return lo;
+}
+
+
+__attribute__((target("avx2")))
+static SIZE_T KeySearchAVX2_4(const BYTE_T *keys, const SIZE_T stride, const SIZE_T n, const BYTE_T *key)
+{
+  uint32_t k=LoadKey32(key);
+  SIZE_T lo=0, hi=n;
+
+  while (hi-lo>KEYSEARCH_WINDOW) {
+    SIZE_T mid=lo+(hi-lo)/2;
+    if (LoadKey32(keys+mid*stride)<k) {
+      lo=mid+1;
+    } else {
+      hi=mid;
+    }
+  }
+
+  const __m256i sign=_mm256_set1_epi32((int)0x80000000U);
+  const __m256i kv=_mm256_xor_si256(_mm256_set1_epi32((int)k),sign);
+  const __m256i bswap=_mm256_setr_epi8(3,2,1,0,7,6,5,4,11,10,9,8,15,14,13,12,
+				       3,2,1,0,7,6,5,4,11,10,9,8,15,14,13,12);
+  const __m256i index=_mm256_setr_epi32(0,stride,2*stride,3*stride,
+					4*stride,5*stride,6*stride,7*stride);
+
+  for (;lo+8<=hi;lo+=8) {
+    __m256i v=_mm256_i32gather_epi32((const int *)(keys+lo*stride),index,1);
+    v=_mm256_xor_si256(_mm256_shuffle_epi8(v,bswap),sign);
+    int lt=_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(kv,v)));
+    if (lt!=0xff) {
+      return lo+__builtin_popcount(lt);
+    }
+  }
+  while (lo<hi && LoadKey32(keys+lo*stride)<k) {
+    lo++;
+  }
+  return lo;
+}
+
+#endif
+
+
+#if KEYSEARCH_X86
+
+// What the cpu has, found out once, whichever thread asks first
+static pthread_once_t cpuonce=PTHREAD_ONCE_INIT;
+static bool sse42, avx2;
+
+static void FindCpuSupport()
+{
+  __builtin_cpu_init();
+  sse42=__builtin_cpu_supports("sse4.2");
+  avx2=__builtin_cpu_supports("avx2");
+}
+
+#endif
+
+
+static bool CpuSupports(const KeySearchLevel level)
+{
+#if KEYSEARCH_X86
+  pthread_once(&cpuonce,FindCpuSupport);
+  switch (level) {
+  case KEYSEARCH_SCALAR:
+    return true;
+  case KEYSEARCH_SSE42:
+    return sse42;
+  case KEYSEARCH_AVX2:
+    return avx2;
+  default:
+    return false;
+  }
+#else
+  return level==KEYSEARCH_SCALAR;
+#endif
+}
+
+
+// The kernels KEYSEARCH_BEST gives, chosen once, since threads
+// searching nodes at the same time may all ask for them
+static pthread_once_t bestonce=PTHREAD_ONCE_INIT;
+static KeySearchFn best4, best8;
+
+static void ChooseBest()
+{
+  for (int l=KEYSEARCH_SCALAR; l<=KEYSEARCH_AVX2; l++) {
+    if (CpuSupports((KeySearchLevel)l)) {
+      best4=GetKeySearch(4,(KeySearchLevel)l);
+      // With the keys strided through the node, the four 64 bit
+      // gathers cost more than they save (see keysearch_bench)
+      if (l!=KEYSEARCH_AVX2) {
+	best8=GetKeySearch(8,(KeySearchLevel)l);
+      }
+    }
+  }
+}
+
+
+KeySearchFn GetKeySearch(const SIZE_T keysize, const KeySearchLevel level)
+{
+  if (level==KEYSEARCH_BEST) {
+    pthread_once(&bestonce,ChooseBest);
+    return keysize==4 ? best4 : keysize==8 ? best8 : 0;
+  }
+
+  if (!CpuSupports(level)) {
+    return 0;
+  }
+
+  switch (level) {
+  case KEYSEARCH_SCALAR:
+    return keysize==4 ? KeySearchScalar4 : keysize==8 ? KeySearchScalar8 : 0;
+#if KEYSEARCH_X86
+  case KEYSEARCH_SSE42:
+    return keysize==4 ? KeySearchSSE42_4 : keysize==8 ? KeySearchSSE42_8 : 0;
+  case KEYSEARCH_AVX2:
+    return keysize==4 ? KeySearchAVX2_4 : keysize==8 ? KeySearchAVX2_8 : 0;
+#endif
+  default:
+    return 0;
+  }
+}
+
+
+const char *KeySearchLevelName(const KeySearchLevel level)
+{
+  switch (level) {
+  case KEYSEARCH_SCALAR:
+    return "scalar";
+  case KEYSEARCH_SSE42:
+    return "sse4.2";
+  case KEYSEARCH_AVX2:
+    return "avx2";
+  default:
+    return "best";
+  }
+}
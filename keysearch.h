@@ -0,0 +1,36 @@
+#ifndef _keysearch
+#define _keysearch
+
+#include "global.h"
+
+//
+// Search kernels for nodes with small fixed size keys
+//
+// A kernel is given n sorted keys of keysize bytes each, laid out
+// stride bytes apart (so it works on the interleaved node layouts),
+// and returns the index of the first key >= key, or n if there is
+// none.  Keys are ordered as memcmp orders them.
+//
+typedef SIZE_T (*KeySearchFn)(const BYTE_T *keys,
+			      const SIZE_T stride,
+			      const SIZE_T n,
+			      const BYTE_T *key);
+
+enum KeySearchLevel {KEYSEARCH_SCALAR, KEYSEARCH_SSE42, KEYSEARCH_AVX2, KEYSEARCH_BEST};
+
+// Returns the kernel for this keysize at the given level, or 0 if
+// there is no special kernel for it (or the cpu lacks the level).
+// KEYSEARCH_BEST picks the best level the cpu supports; the check
+// is done once.
+KeySearchFn GetKeySearch(const SIZE_T keysize, const KeySearchLevel level=KEYSEARCH_BEST);
+
+const char *KeySearchLevelName(const KeySearchLevel level);
+
+// Plain binary search with memcmp, for any keysize
+SIZE_T KeySearchGeneric(const BYTE_T *keys,
+			const SIZE_T stride,
+			const SIZE_T n,
+			const SIZE_T keysize,
+			const BYTE_T *key);
+
+#endif
@@ -0,0 +1,129 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <vector>
+#include <algorithm>
+
+#include "btree_ds.h"
+#include "keysearch.h"
+
+void usage()
+{
+  cerr << "usage: keysearch_bench keysize valuesize blocksize numprobes\n";
+}
+
+
+static double Now()
+{
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC,&t);
+  return t.tv_sec*1e9+t.tv_nsec;
+}
+
+
+static void MakeKey(BYTE_T *k, const SIZE_T keysize)
+{
+  static const char keybytes[]="abcdefghijklmnopqrstuvwxyz0123456789";
+  for (SIZE_T i=0;i<keysize;i++) {
+    k[i]=keybytes[rand()%36];
+  }
+}
+
+
+static bool KeyLess(const vector<BYTE_T> &a, const vector<BYTE_T> &b)
+{
+  return memcmp(&a[0],&b[0],a.size())<0;
+}
+
+
+int main(int argc, char *argv[])
+{
+  if (argc!=5) {
+    usage();
+    return -1;
+  }
+
+  SIZE_T keysize=atoi(argv[1]);
+  SIZE_T valuesize=atoi(argv[2]);
+  SIZE_T blocksize=atoi(argv[3]);
+  SIZE_T numprobes=atoi(argv[4]);
+
+  // Size the keys just like a leaf of the btree would
+  NodeMetadata leaf;
+  leaf.nodetype=BTREE_LEAF_NODE;
+  leaf.keysize=keysize;
+  leaf.valuesize=valuesize;
+  leaf.blocksize=blocksize;
+  SIZE_T slots=leaf.GetNumSlotsAsLeaf();
+  SIZE_T stride=keysize+valuesize;
+
+  srand(339);
+
+  cout << "keysize="<<keysize<<" valuesize="<<valuesize<<" blocksize="<<blocksize
+       << " slots="<<slots<<" probes="<<numprobes<<endl;
+  cout << "fill numkeys memcmp(ns)";
+  for (int l=KEYSEARCH_SCALAR; l<=KEYSEARCH_AVX2; l++) {
+    cout << " " << KeySearchLevelName((KeySearchLevel)l) << "(ns)";
+  }
+  cout << endl;
+
+  int fills[]={10,25,50,75,100};
+
+  for (unsigned f=0;f<sizeof(fills)/sizeof(fills[0]);f++) {
+    SIZE_T n=slots*fills[f]/100;
+    if (n==0) {
+      n=1;
+    }
+
+    vector<vector<BYTE_T> > keys(n, vector<BYTE_T>(keysize));
+    for (SIZE_T i=0;i<n;i++) {
+      MakeKey(&keys[i][0],keysize);
+    }
+    sort(keys.begin(),keys.end(),KeyLess);
+
+    vector<BYTE_T> node(n*stride+8,0);
+    for (SIZE_T i=0;i<n;i++) {
+      memcpy(&node[i*stride],&keys[i][0],keysize);
+    }
+
+    // half of the probes hit, half (most likely) miss
+    vector<BYTE_T> probes(numprobes*keysize);
+    for (SIZE_T i=0;i<numprobes;i++) {
+      if (i%2) {
+	memcpy(&probes[i*keysize],&keys[rand()%n][0],keysize);
+      } else {
+	MakeKey(&probes[i*keysize],keysize);
+      }
+    }
+
+    vector<SIZE_T> expect(numprobes);
+    double start=Now();
+    for (SIZE_T i=0;i<numprobes;i++) {
+      expect[i]=KeySearchGeneric(&node[0],stride,n,keysize,&probes[i*keysize]);
+    }
+    double generic=(Now()-start)/numprobes;
+
+    cout << fills[f] << "% " << n << " " << generic;
+
+    for (int l=KEYSEARCH_SCALAR; l<=KEYSEARCH_AVX2; l++) {
+      KeySearchFn kernel=GetKeySearch(keysize,(KeySearchLevel)l);
+      if (!kernel) {
+	cout << " -";
+	continue;
+      }
+      start=Now();
+      for (SIZE_T i=0;i<numprobes;i++) {
+	SIZE_T r=kernel(&node[0],stride,n,&probes[i*keysize]);
+	if (r!=expect[i]) {
+	  cerr << KeySearchLevelName((KeySearchLevel)l) << " kernel returned "<<r
+	       << " instead of "<<expect[i]<<endl;
+	  return -1;
+	}
+      }
+      cout << " " << (Now()-start)/numprobes;
+    }
+    cout << endl;
+  }
+
+  return 0;
+}
@@ -0,0 +1,79 @@
+#ifndef _latch
+#define _latch
+
+#include <pthread.h>
+
+#include "global.h"
+
+//
+// Thin wrappers over the pthreads locks, for the buffer cache and
+// the tree to share between threads
+//
+
+class Mutex {
+ private:
+  pthread_mutex_t m;
+ public:
+  Mutex() { pthread_mutex_init(&m,0); }
+  Mutex(const Mutex &rhs) { throw GenericException(); }
+  Mutex & operator=(const Mutex &rhs) { throw GenericException(); return *this; }
+  ~Mutex() { pthread_mutex_destroy(&m); }
+
+  void Lock() { pthread_mutex_lock(&m); }
+  void Unlock() { pthread_mutex_unlock(&m); }
+};
+
+
+// Holds a mutex for as long as it is in scope
+class MutexHolder {
+ private:
+  Mutex &m;
+ public:
+  MutexHolder(Mutex &x) : m(x) { m.Lock(); }
+  ~MutexHolder() { m.Unlock(); }
+};
+
+
+//
+// Reader/writer latch.  Writers go first: once one is waiting, new
+// readers wait behind it, so a stream of lookups can't keep an
+// insert out of a node for good.
+//
+class RWLatch {
+ private:
+  pthread_rwlock_t l;
+ public:
+  RWLatch() {
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+#ifdef __GLIBC__
+    pthread_rwlockattr_setkind_np(&attr,PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+#endif
+    pthread_rwlock_init(&l,&attr);
+    pthread_rwlockattr_destroy(&attr);
+  }
+  RWLatch(const RWLatch &rhs) { throw GenericException(); }
+  RWLatch & operator=(const RWLatch &rhs) { throw GenericException(); return *this; }
+  ~RWLatch() { pthread_rwlock_destroy(&l); }
+
+  void Lock(const bool exclusive) {
+    if (exclusive) {
+      pthread_rwlock_wrlock(&l);
+    } else {
+      pthread_rwlock_rdlock(&l);
+    }
+  }
+  void Unlock() { pthread_rwlock_unlock(&l); }
+};
+
+
+// Holds a reader/writer latch for as long as it is in scope
+class RWLatchHolder {
+ private:
+  RWLatch &l;
+ public:
+  RWLatchHolder(RWLatch &x, const bool exclusive) : l(x) { l.Lock(exclusive); }
+  ~RWLatchHolder() { l.Unlock(); }
+};
+
+#endif
@@ -19,11 +19,25 @@ if (!($op eq "INIT")) {
 }
 
 %content=();
+$inbatch=0;
 
 while ($line=<STDIN>) { 
   $line=~/^(\S+)\s+(.*)$/;
   $op=$1; $rest=$2; 
-  if ($op eq "INSERT") {
+  if ($inbatch && !($op eq "INSERT" || $op eq "END")) { 
+    # only inserts can be batched, and they do just what they would
+    # have done one at a time
+    print STDERR "Can't $op inside a batch\n" if $debug;
+    print "FAIL\n";
+  } elsif ($op eq "BATCH") { 
+    print STDERR "Starting a batch\n" if $debug;
+    print "OK\n";
+    $inbatch=1;
+  } elsif ($op eq "END" && $inbatch) { 
+    print STDERR "Ending a batch\n" if $debug;
+    print "OK\n";
+    $inbatch=0;
+  } elsif ($op eq "INSERT") {
     ($key, $value) = split(/\s+/,$rest);
     if (defined $content{$key} || Bug()) { 
       print STDERR "Inserting ($key, $value) failed because $key already exists\n" if $debug;
@@ -43,6 +57,11 @@ while ($line=<STDIN>) {
       print STDERR "Updated ($key, $value)\n" if $debug;
       print "OK\n";
     }
+  } elsif ($op eq "UPSERT") { 
+    ($key, $value) = split(/\s+/,$rest);
+    $content{$key}=$value;
+    print STDERR "Upserted ($key, $value)\n" if $debug;
+    print "OK\n";
   } elsif ($op eq "DELETE") { 
     ($key)=split(/\s+/,$rest);
     if (!(defined $content{$key}) || Bug() ) { 
@@ -70,6 +89,16 @@ while ($line=<STDIN>) {
       print "($key, $content{$key})\n";
     }
     print "OK END DISPLAY\n";
+  } elsif ($op eq "SCAN") { 
+    ($lo, $hi)=split(/\s+/,$rest);
+    print STDERR "Scanning from $lo to $hi\n" if $debug;
+    print "OK BEGIN SCAN\n";
+    foreach $key (sort keys %content) {
+      next if ($lo ne "-" && $key lt $lo);
+      last if ($hi ne "-" && $key gt $hi);
+      print "($key,$content{$key})\n";
+    }
+    print "OK END SCAN\n";
   } elsif ($op eq "DEINIT") {
     print STDERR "Got a deinit.  Finishing up now\n" if $debug;
     print "OK\n";
@@ -0,0 +1,349 @@
+#include <string>
+#include <vector>
+#include <list>
+#include <map>
+#include <set>
+#include <stdlib.h>
+#include <string.h>
+
+#include "trace.h"
+#include "disksystem.h"
+
+
+void usage()
+{
+  cerr << "usage: replaytrace tracefile lru|fifo|clock|opt cachesize[,cachesize...] [filestem]\n";
+  cerr << "       replaytrace tracefile disk filestem\n";
+  cerr << "       replaytrace tracefile dump\n";
+}
+
+
+//
+// Offline models of a write back, write allocate block cache.
+// They only track which blocks are resident; the driver below
+// keeps track of dirtiness and counts the disk traffic.
+//
+class CacheModel {
+ public:
+  virtual ~CacheModel() {}
+  virtual bool Contains(const SIZE_T block) const = 0;
+  // Reference a block.  If it is not resident and the cache is full,
+  // a victim is chosen, removed, and returned in victim.
+  // index is the position of the reference in the request stream.
+  virtual bool Access(const SIZE_T block, const SIZE_T index, bool &evicted, SIZE_T &victim) = 0;
+  virtual void Remove(const SIZE_T block) = 0;
+};
+
+
+// LRU (what BufferCache implements) and FIFO
+class ListCacheModel : public CacheModel {
+ private:
+  SIZE_T size;
+  bool   promote;
+  list<SIZE_T> order;
+  map<SIZE_T, list<SIZE_T>::iterator> where;
+ public:
+  ListCacheModel(const SIZE_T s, const bool lru) : size(s), promote(lru) {}
+
+  bool Contains(const SIZE_T block) const { return where.find(block)!=where.end(); }
+
+  bool Access(const SIZE_T block, const SIZE_T index, bool &evicted, SIZE_T &victim) {
+    map<SIZE_T, list<SIZE_T>::iterator>::iterator i=where.find(block);
+    evicted=false;
+    if (i!=where.end()) {
+      if (promote) {
+	order.splice(order.begin(),order,(*i).second);
+      }
+      return true;
+    }
+    if (order.size()>=size) {
+      victim=order.back();
+      evicted=true;
+      where.erase(victim);
+      order.pop_back();
+    }
+    order.push_front(block);
+    where[block]=order.begin();
+    return false;
+  }
+
+  void Remove(const SIZE_T block) {
+    map<SIZE_T, list<SIZE_T>::iterator>::iterator i=where.find(block);
+    if (i!=where.end()) {
+      order.erase((*i).second);
+      where.erase(i);
+    }
+  }
+};
+
+
+// CLOCK (second chance)
+class ClockCacheModel : public CacheModel {
+ private:
+  SIZE_T size;
+  SIZE_T hand;
+  vector<SIZE_T> frames;
+  vector<bool>   referenced;
+  vector<bool>   used;
+  map<SIZE_T, SIZE_T> where;
+ public:
+  ClockCacheModel(const SIZE_T s) : size(s), hand(0), frames(s), referenced(s,false), used(s,false) {}
+
+  bool Contains(const SIZE_T block) const { return where.find(block)!=where.end(); }
+
+  bool Access(const SIZE_T block, const SIZE_T index, bool &evicted, SIZE_T &victim) {
+    map<SIZE_T, SIZE_T>::iterator i=where.find(block);
+    evicted=false;
+    if (i!=where.end()) {
+      referenced[(*i).second]=true;
+      return true;
+    }
+    while (used[hand] && referenced[hand]) {
+      referenced[hand]=false;
+      hand=(hand+1)%size;
+    }
+    if (used[hand]) {
+      victim=frames[hand];
+      evicted=true;
+      where.erase(victim);
+    }
+    frames[hand]=block;
+    used[hand]=true;
+    referenced[hand]=true;
+    where[block]=hand;
+    hand=(hand+1)%size;
+    return false;
+  }
+
+  void Remove(const SIZE_T block) {
+    map<SIZE_T, SIZE_T>::iterator i=where.find(block);
+    if (i!=where.end()) {
+      used[(*i).second]=false;
+      referenced[(*i).second]=false;
+      where.erase(i);
+    }
+  }
+};
+
+
+// Belady's OPT: evict the block whose next reference is furthest away
+class OptCacheModel : public CacheModel {
+ private:
+  SIZE_T size;
+  const vector<SIZE_T> &nextuse;
+  set<pair<SIZE_T,SIZE_T> > bynext;
+  map<SIZE_T, SIZE_T> where;
+ public:
+  OptCacheModel(const SIZE_T s, const vector<SIZE_T> &next) : size(s), nextuse(next) {}
+
+  bool Contains(const SIZE_T block) const { return where.find(block)!=where.end(); }
+
+  bool Access(const SIZE_T block, const SIZE_T index, bool &evicted, SIZE_T &victim) {
+    map<SIZE_T, SIZE_T>::iterator i=where.find(block);
+    evicted=false;
+    if (i!=where.end()) {
+      bynext.erase(make_pair((*i).second,block));
+      (*i).second=nextuse[index];
+      bynext.insert(make_pair(nextuse[index],block));
+      return true;
+    }
+    if (where.size()>=size) {
+      set<pair<SIZE_T,SIZE_T> >::iterator last=bynext.end();
+      --last;
+      victim=(*last).second;
+      evicted=true;
+      where.erase(victim);
+      bynext.erase(last);
+    }
+    where[block]=nextuse[index];
+    bynext.insert(make_pair(nextuse[index],block));
+    return false;
+  }
+
+  void Remove(const SIZE_T block) {
+    map<SIZE_T, SIZE_T>::iterator i=where.find(block);
+    if (i!=where.end()) {
+      bynext.erase(make_pair((*i).second,block));
+      where.erase(i);
+    }
+  }
+};
+
+
+struct ReplayStats {
+  SIZE_T reads, writes, flushes, hits, misses, diskreads, diskwrites;
+  double time;
+};
+
+
+static void Charge(DiskSystem *disk, const SIZE_T block, double &time)
+{
+  if (disk) {
+    time+=disk->EstimateAccess(block,1);
+  }
+}
+
+
+static void Replay(const vector<BlockTraceRecord> &reqs,
+		   CacheModel &cache,
+		   DiskSystem *disk,
+		   ReplayStats &s)
+{
+  set<SIZE_T> dirty;
+  bool evicted;
+  SIZE_T victim;
+
+  memset(&s,0,sizeof(s));
+
+  for (SIZE_T i=0;i<reqs.size();i++) {
+    const BlockTraceRecord &r=reqs[i];
+    if (r.op==TRACE_FLUSH) {
+      s.flushes++;
+      if (dirty.erase(r.block)) {
+	s.diskwrites++;
+	Charge(disk,r.block,s.time);
+      }
+      cache.Remove(r.block);
+      continue;
+    }
+    if (r.op==TRACE_READ) {
+      s.reads++;
+    } else {
+      s.writes++;
+    }
+    if (cache.Access(r.block,i,evicted,victim)) {
+      s.hits++;
+    } else {
+      s.misses++;
+      if (evicted && dirty.erase(victim)) {
+	s.diskwrites++;
+	Charge(disk,victim,s.time);
+      }
+      // write allocate does not fetch the old contents
+      if (r.op==TRACE_READ) {
+	s.diskreads++;
+	Charge(disk,r.block,s.time);
+      }
+    }
+    if (r.op==TRACE_WRITE) {
+      dirty.insert(r.block);
+    }
+  }
+  // and finally the write back at detach
+  for (set<SIZE_T>::const_iterator d=dirty.begin(); d!=dirty.end(); ++d) {
+    s.diskwrites++;
+    Charge(disk,*d,s.time);
+  }
+}
+
+
+int main(int argc, char *argv[])
+{
+  if (argc<3) {
+    usage();
+    exit(-1);
+  }
+
+  string policy=argv[2];
+  BlockTrace trace;
+  BlockTraceRecord rec;
+  vector<BlockTraceRecord> reqs;
+  ERROR_T rc;
+
+  if ((rc=trace.Open(argv[1],false))!=ERROR_NOERROR) {
+    cerr << "Can't open trace "<<argv[1]<<" due to error "<<rc<<endl;
+    return -1;
+  }
+
+  if (policy=="dump") {
+    while (trace.Next(rec)==ERROR_NOERROR) {
+      cout << rec << endl;
+    }
+    return 0;
+  }
+
+  if (policy=="disk") {
+    // Replay the disk requests the original run made
+    // against (possibly) a different disk model
+    if (argc<4) {
+      usage();
+      exit(-1);
+    }
+    DiskSystem disk(argv[3]);
+    SIZE_T n=0;
+    double time=0, recorded=0;
+    while (trace.Next(rec)==ERROR_NOERROR) {
+      if (rec.op==TRACE_DISKREAD || rec.op==TRACE_DISKWRITE) {
+	time+=disk.EstimateAccess(rec.block,1);
+	n++;
+      }
+      recorded=rec.time;
+    }
+    cout << "numdiskops      = "<<n<<endl;
+    cout << "recorded time   = "<<recorded<<endl;
+    cout << "replayed time   = "<<time<<endl;
+    return 0;
+  }
+
+  if (argc<4 ||
+      (policy!="lru" && policy!="fifo" && policy!="clock" && policy!="opt")) {
+    usage();
+    exit(-1);
+  }
+
+  // The cache policy sees only the requests made to the cache
+  while (trace.Next(rec)==ERROR_NOERROR) {
+    if (rec.op==TRACE_READ || rec.op==TRACE_WRITE || rec.op==TRACE_FLUSH) {
+      reqs.push_back(rec);
+    }
+  }
+
+  vector<SIZE_T> nextuse(reqs.size());
+  if (policy=="opt") {
+    map<SIZE_T, SIZE_T> seen;
+    for (SIZE_T i=reqs.size();i>0;i--) {
+      map<SIZE_T, SIZE_T>::iterator j=seen.find(reqs[i-1].block);
+      nextuse[i-1] = (j==seen.end()) ? reqs.size() : (*j).second;
+      seen[reqs[i-1].block]=i-1;
+    }
+  }
+
+  cout << "policy cachesize requests hits misses hitrate diskreads diskwrites time\n";
+
+  char *sizes=argv[3];
+  for (char *tok=strtok(sizes,","); tok; tok=strtok(0,",")) {
+    SIZE_T cachesize=atoi(tok);
+    if (cachesize==0) {
+      cerr << "Ignoring cache size "<<tok<<endl;
+      continue;
+    }
+    CacheModel *cache;
+    if (policy=="lru") {
+      cache = new ListCacheModel(cachesize,true);
+    } else if (policy=="fifo") {
+      cache = new ListCacheModel(cachesize,false);
+    } else if (policy=="clock") {
+      cache = new ClockCacheModel(cachesize);
+    } else {
+      cache = new OptCacheModel(cachesize,nextuse);
+    }
+    DiskSystem *disk = argc>4 ? new DiskSystem(argv[4]) : 0;
+    ReplayStats s;
+
+    Replay(reqs,*cache,disk,s);
+
+    cout << policy << " " << cachesize << " " << (s.reads+s.writes) << " "
+	 << s.hits << " " << s.misses << " "
+	 << (s.reads+s.writes ? (double)s.hits/(double)(s.reads+s.writes) : 0.0) << " "
+	 << s.diskreads << " " << s.diskwrites << " ";
+    if (disk) {
+      cout << s.time << endl;
+    } else {
+      cout << "-" << endl;
+    }
+    delete cache;
+    delete disk;
+  }
+
+  return 0;
+}
@@ -5,13 +5,15 @@
 #include <strstream>
 #include <fstream>
 #include "btree.h"
+#include "btree_cursor.h"
+#include "btree_memtable.h"
 
 
 using namespace std;
 
 void usage()
 {
-  cerr << "usage: sim filestem cachesize < specfile \n";
+  cerr << "usage: sim filestem cachesize [tracefile] < specfile \n";
 }
 
 
@@ -20,7 +22,7 @@ int main(int argc, char *argv[])
 
   // CONFORMS to the interface of ref_impl.pl
 
-  if (argc != 3){
+  if (argc != 3 && argc != 4){
     usage();
     return 1;
   }
@@ -39,8 +41,22 @@ int main(int argc, char *argv[])
   // so we need to do this outside the loop
   DiskSystem disk(filestem);
   BufferCache cache(&disk,cachesize);
-  // will be set on init
-  BTreeIndex *btree;
+  BlockTrace trace;
+  // will be set on init, 0 while there's none
+  BTreeIndex *btree=0;
+  // and, if INIT asks for one, a write buffer in front of it
+  BTreeMemtable *memtable=0;
+  // pairs inserted since BATCH, which go in together at END
+  bool inbatch=false;
+  vector<KeyValuePair> batch;
+
+  if (argc == 4) {
+    if ((rc=trace.Open(argv[3],true))!=ERROR_NOERROR) {
+      cerr << "Can't open trace file "<<argv[3]<<" due to error "<<rc<<"\n";
+      return -1;
+    }
+    cache.SetTrace(&trace);
+  }
 
 
   if ((rc=cache.Attach())!=ERROR_NOERROR) {
@@ -53,43 +69,162 @@ int main(int argc, char *argv[])
   //Now simply read each line and call btree functions corresponding to the same
   while (fgets(line, max, file) != NULL){
     // foreach line read we will refer to a case switch statement
-    string line2, action, key, value;
+    string line2, action, key, value, format, memtablebytes, filterkeys, cachekeys;
     line2 = line;
     istrstream is(line2.c_str(),line2.size());
-    is >> action >> key >> value;
+    is >> action >> key >> value >> format >> memtablebytes >> filterkeys >> cachekeys;
+
+    // everything else needs a tree
+    if (!action.empty() && action != "INIT" && !btree) {
+      cerr << "No btree to "<<action<<"\n";
+      cout << "FAIL\n";
+      continue;
+    }
+
+    // what the btree shows must include what is still buffered, so
+    // if it can't all be drained the command fails.  DEINIT goes on
+    // to detach, but fails, and says how many changes were lost.
+    if (memtable && (action == "BATCH" || action == "DISPLAY" ||
+		     action == "SCAN" || action == "DEINIT")) {
+      if ((rc=memtable->Drain())!=ERROR_NOERROR) {
+	cerr << "Can't drain memtable due to error "<<rc<<"\n";
+	if (action != "DEINIT") { 
+	  cout << "FAIL\n";
+	  continue;
+	}
+      }
+    }
 
     if (action == "INIT") {
-      btree = new BTreeIndex(atoi(key.c_str()),atoi(value.c_str()),&cache);
+      // INIT keysize valuesize [format [memtablebytes [filterkeys [cachekeys]]]]
+      // (a memtablebytes of 0 means no memtable)
+      int f = (format.empty() || format[0]=='#') ? BTREE_FORMAT_FIXED : NodeFormatFromName(format.c_str());
+      if (f<0) { 
+	cerr << "Unknown node format "<<format<<"\n";
+	cout << "FAIL\n";
+	continue;
+      }
+      btree = new BTreeIndex(atoi(key.c_str()),atoi(value.c_str()),&cache,true,f);
+      if (!filterkeys.empty() && filterkeys[0]!='#') {
+	btree->SetFilterKeys(atoi(filterkeys.c_str()));
+      }
       if ((rc=btree->Attach(0, true))!=ERROR_NOERROR) {
 	cerr << "Can't attach btree with initialization due to error "<<rc<<"\n";
 	cout << "FAIL\n";
+	// an unattached tree can't be used, so later operations fail too
+	delete btree;
+	btree=0;
       } else {
+	if (!cachekeys.empty() && cachekeys[0]!='#') {
+	  btree->SetKeyCache(atoi(cachekeys.c_str()));
+	}
+	if (!memtablebytes.empty() && memtablebytes[0]!='#' && atoi(memtablebytes.c_str())>0) {
+	  if (!btree->IsUnique()) { 
+	    // the tree goes on without one
+	    cerr << "Can't put a memtable in front of a non-unique index\n";
+	    cout << "FAIL\n";
+	    continue;
+	  }
+	  memtable = new BTreeMemtable(btree,atoi(memtablebytes.c_str()));
+	}
+	cout << "OK\n";
+      }
+    } else if (action == "BATCH"){
+      if (inbatch) { 
+	cout << "FAIL\n";
+	cerr << "Already in a batch\n";
+      } else {
+	inbatch=true;
+	batch.clear();
 	cout << "OK\n";
       }
+    } else if (inbatch && action == "INSERT"){
+      // the result is printed at END
+      batch.push_back(KeyValuePair(KEY_T(key.c_str()),VALUE_T(value.c_str())));
+    } else if (inbatch && action == "END"){
+      vector<ERROR_T> results;
+      rc=btree->InsertBatch(batch,results);
+      for (unsigned int i=0; i<batch.size(); i++) { 
+	if (results[i] || (rc && rc!=ERROR_CONFLICT)) { 
+	  cout <<"FAIL\n";
+	  cerr <<"Can't insert due to error "<<(results[i] ? results[i] : rc)<<"\n";
+	} else {
+	  cout <<"OK\n";
+	}
+      }
+      inbatch=false;
+      cout << "OK\n";
+    } else if (inbatch){
+      // only inserts can be batched
+      cout <<"FAIL\n";
+      cerr <<"Can't "<<action<<" inside a batch\n";
     } else if (action == "INSERT"){
-      if ((rc=btree->Insert(KEY_T(key.c_str()),VALUE_T(value.c_str())))!=ERROR_NOERROR) { 
+      if ((rc=memtable ? memtable->Insert(KEY_T(key.c_str()),VALUE_T(value.c_str()))
+	          : btree->Insert(KEY_T(key.c_str()),VALUE_T(value.c_str())))!=ERROR_NOERROR) { 
         cout <<"FAIL"<<endl;
 	cerr <<"Can't insert due to error "<<rc<<"\n";
       } else {
         cout <<"OK\n";
       }
     } else if (action == "UPDATE"){
-      if ((rc=btree->Update(KEY_T(key.c_str()),VALUE_T(value.c_str())))!=ERROR_NOERROR) { 
+      if ((rc=memtable ? memtable->Update(KEY_T(key.c_str()),VALUE_T(value.c_str()))
+	          : btree->Update(KEY_T(key.c_str()),VALUE_T(value.c_str())))!=ERROR_NOERROR) { 
         cout <<"FAIL" <<endl;
 	cerr <<"Can't update due to error "<<rc<<"\n";
       } else {
         cout <<"OK\n";
       }
+    } else if (action == "UPSERT"){
+      if ((rc=memtable ? memtable->Upsert(KEY_T(key.c_str()),VALUE_T(value.c_str()))
+	          : btree->Upsert(KEY_T(key.c_str()),VALUE_T(value.c_str())))!=ERROR_NOERROR) { 
+        cout <<"FAIL" <<endl;
+	cerr <<"Can't upsert due to error "<<rc<<"\n";
+      } else {
+        cout <<"OK\n";
+      }
+    } else if (action == "DELETE" && !btree->IsUnique() && !value.empty() && value[0]!='#'){
+      // DELETE key value takes just the one value of a non-unique index
+      if ((rc=btree->Delete(KEY_T(key.c_str()),VALUE_T(value.c_str())))!=ERROR_NOERROR) { 
+        cout <<"FAIL"<<endl;
+	cerr <<"Can't delete due to error "<<rc<<endl;
+      } else {
+        cout <<"OK\n";
+      }
     } else if (action == "DELETE"){
-      if ((rc=btree->Delete(KEY_T(key.c_str())))!=ERROR_NOERROR) { 
+      if ((rc=memtable ? memtable->Delete(KEY_T(key.c_str()))
+	          : btree->Delete(KEY_T(key.c_str())))!=ERROR_NOERROR) { 
         cout <<"FAIL"<<endl;
 	cerr <<"Can't delete due to error "<<rc<<endl;
       } else {
         cout <<"OK\n";
       }
+    } else if (action == "LOOKUP" && !btree->IsUnique()){
+      // all of the key's values
+      BTreePostingCursor values(btree);
+      VALUE_T v;
+      if ((rc=values.Seek(KEY_T(key.c_str())))!=ERROR_NOERROR) { 
+        cout <<"FAIL"<< endl;
+	cerr <<"Can't lookup due to error "<<rc<<endl;
+      } else {
+        cout <<"OK";
+	for (; rc==ERROR_NOERROR; rc=values.Next()) { 
+	  if ((rc=values.GetVal(v))!=ERROR_NOERROR) { 
+	    break;
+	  }
+	  cout << " ";
+	  for (unsigned int k=0; k<v.length; k++) {
+	    cout << v.data[k];
+	  }
+	}
+ 	cout << endl;
+	if (rc!=ERROR_NONEXISTENT) {
+	  cerr <<"Lookup stopped due to error "<<rc<<endl;
+	}
+      }
     } else if (action == "LOOKUP"){
       VALUE_T lookup_value;
-      if ((rc=btree->Lookup(KEY_T(key.c_str()),lookup_value))!=ERROR_NOERROR) { 
+      if ((rc=memtable ? memtable->Lookup(KEY_T(key.c_str()),lookup_value)
+	          : btree->Lookup(KEY_T(key.c_str()),lookup_value))!=ERROR_NOERROR) { 
         cout <<"FAIL"<< endl;
 	cerr <<"Can't lookup due to error "<<rc<<endl;
       } else {
@@ -104,7 +239,46 @@ int main(int argc, char *argv[])
       cout <<"OK BEGIN DISPLAY\n";
       btree->Display(cout,BTREE_SORTED_KEYVAL);
       cout <<"OK END DISPLAY\n";
+    } else if (action == "SCAN") {
+      // SCAN lo hi, either of which may be - for no bound
+      BTreeCursor cursor(btree,true);
+      KEY_T lo(key.c_str()), hi(value.c_str());
+      KEY_T k;
+      VALUE_T v;
+      cout <<"OK BEGIN SCAN\n";
+      for (rc=cursor.Seek(key=="-" ? 0 : &lo, value=="-" ? 0 : &hi);
+	   rc==ERROR_NOERROR;
+	   rc=cursor.Next()) {
+	if ((rc=cursor.GetKey(k)) || (rc=cursor.GetVal(v))) {
+	  break;
+	}
+	cout << "(";
+	for (unsigned int i=0; i<k.length; i++) {
+	  cout << k.data[i];
+	}
+	cout << ",";
+	for (unsigned int i=0; i<v.length; i++) {
+	  cout << v.data[i];
+	}
+	cout << ")\n";
+      }
+      if (rc!=ERROR_NONEXISTENT) {
+	cerr <<"Scan stopped due to error "<<rc<<endl;
+      }
+      cout <<"OK END SCAN\n";
     } else if (action == "DEINIT"){
+      const BTreeFilter &filter=btree->GetFilter();
+      if (filter.IsOn()) {
+	cerr << "Filter: probes="<<filter.GetNumProbes()<<" skipped="<<filter.GetNumSkipped()
+	     << " falsepositives="<<filter.GetNumFalsePositives()
+	     << " falsepositiverate="<<filter.GetFalsePositiveRate()<<"\n";
+      }
+      const BTreeKeyCache &keycache=btree->GetKeyCache();
+      if (keycache.IsOn()) {
+	cerr << "Keycache: lookups="<<keycache.GetNumLookups()<<" hits="<<keycache.GetNumHits()
+	     << " hitrate="<<keycache.GetHitRate()<<" admitted="<<keycache.GetNumAdmitted()
+	     << " rejected="<<keycache.GetNumRejected()<<"\n";
+      }
       if ((rc=btree->Detach(superblocknum))!=ERROR_NOERROR) { 
 	cout << "FAIL"<<endl;
 	cerr << "Can't detach btree due to error "<<rc<<endl;
@@ -113,11 +287,25 @@ int main(int argc, char *argv[])
 	  cout <<"FAIL"<<endl;
 	  cerr <<"Can't detach cache due to error "<<rc<<endl;
 	} else {
+	  bool lost = memtable && memtable->GetNumEntries()>0;
+	  if (lost) { 
+	    cerr << "Lost "<<memtable->GetNumEntries()<<" changes still in the memtable\n";
+	  }
+	  delete memtable;
+	  memtable=0;
 	  delete btree;
-	  cout << "OK\n";
+	  btree=0;
+	  cout << (lost ? "FAIL\n" : "OK\n");
 	}
       }
     }
+
+    // a change the memtable holds is done, even if the drain it set
+    // off failed, but that failure is worth knowing about
+    if (memtable && !inbatch && rc==ERROR_NOERROR && memtable->GetDrainError() &&
+	(action == "INSERT" || action == "UPDATE" || action == "UPSERT" || action == "DELETE")) {
+      cerr << "Can't drain memtable due to error "<<memtable->GetDrainError()<<"\n";
+    }
   }
     
   fclose(file);
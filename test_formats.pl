@@ -0,0 +1,58 @@
+#!/usr/bin/perl -w
+
+# Runs generated sequences, with batches, upserts and scans, through
+# sim in every node format, alone and with each flag but +multi
+# (ref_impl.pl keeps one value per key), and checks each against the
+# reference implementation.  The keys share long prefixes, on small
+# blocks, so that nodes split often, and prefix compressed nodes
+# change their prefixes.  A mixed sequence and
+# one that fills the tree and then deletes most of it, so that nodes
+# merge too, are run in each format.
+
+$diskstem="__test";
+$numblocks=8192;
+$blocksize=512;
+$heads=1;
+$blockspertrack=1024;
+$tracks=8;
+$avgseek=10;
+$trackseek=1;
+$rotlat=10;
+$cachesize=64;
+
+$keysize=32;
+$valuesize=8;
+$prefixlen=24;
+
+$maxerr=10;
+
+@formats=();
+foreach $f ("fixed", "prefix", "slotted", "soa") {
+  push @formats, map { "$f$_" } ("", "+blink", "+cow", "+buffered");
+}
+
+$#ARGV==1 or die "usage: test_formats.pl seed numops\n";
+
+($seed,$numops)=@ARGV;
+
+$ENV{PATH}.=":.";
+
+$failed=0;
+foreach $format (@formats) {
+  foreach $shape ("mixed", "drain") {
+    system "deletedisk $diskstem >/dev/null 2>&1";
+    system "makedisk $diskstem $numblocks $blocksize $heads $blockspertrack $tracks $avgseek $trackseek $rotlat >/dev/null 2>&1";
+
+    system "gen_test_sequence.pl $keysize $valuesize $seed $numops $format $prefixlen $shape > $diskstem.input";
+    system "ref_impl.pl nodebug 0 < $diskstem.input > $diskstem.refout";
+    system "sim $diskstem $cachesize < $diskstem.input > $diskstem.yourout 2>/dev/null";
+
+    $summary=`compare.pl $diskstem.input $diskstem.refout $diskstem.yourout $maxerr | grep Summary`;
+    print "$format $shape: $summary";
+    $failed++ if $summary!~/ 0 errors/;
+  }
+}
+
+unlink "$diskstem.input", "$diskstem.refout", "$diskstem.yourout";
+
+exit($failed ? 1 : 0);
@@ -0,0 +1,62 @@
+#!/usr/bin/perl -w
+
+# Checks that sim won't put a memtable in front of a non-unique
+# (+multi) tree, whose changes a drain couldn't apply, and that the
+# tree works on without one.
+
+$diskstem="__test";
+$numblocks=1024;
+$blocksize=1024;
+$heads=1;
+$blockspertrack=1024;
+$tracks=1;
+$avgseek=10;
+$trackseek=1;
+$rotlat=10;
+$cachesize=64;
+
+$ENV{PATH}.=":.";
+
+@ops=("INIT 8 8 fixed+multi 200",
+      "INSERT aaaaaaaa 11111111",
+      "INSERT aaaaaaaa 22222222",
+      "LOOKUP aaaaaaaa",
+      "DELETE aaaaaaaa 11111111",
+      "LOOKUP aaaaaaaa",
+      "DISPLAY",
+      "DEINIT");
+
+@expected=("FAIL",
+	   "OK",
+	   "OK",
+	   "OK 11111111 22222222",
+	   "OK",
+	   "OK 22222222",
+	   "OK BEGIN DISPLAY",
+	   "(aaaaaaaa,22222222)",
+	   "OK END DISPLAY",
+	   "OK");
+
+system "deletedisk $diskstem";
+system "makedisk $diskstem $numblocks $blocksize $heads $blockspertrack $tracks $avgseek $trackseek $rotlat";
+
+open(IN,">$diskstem.in") or die "can't write $diskstem.in\n";
+print IN map {"$_\n"} @ops;
+close(IN);
+
+@got=`sim $diskstem $cachesize < $diskstem.in 2>/dev/null`;
+chomp @got;
+unlink "$diskstem.in";
+
+$errors=0;
+for ($i=0;$i<=$#expected || $i<=$#got;$i++) {
+  $e = $i<=$#expected ? $expected[$i] : "(nothing)";
+  $g = $i<=$#got ? $got[$i] : "(nothing)";
+  if ($e ne $g) {
+    print "line ",$i+1,": expected \"$e\" but got \"$g\"\n";
+    $errors++;
+  }
+}
+
+print "Summary: $errors errors found\n";
+exit($errors ? 1 : 0);
@@ -0,0 +1,154 @@
+#include <string.h>
+
+#include "trace.h"
+
+struct BlockTraceHeader {
+  SIZE_T magic;
+  SIZE_T version;
+  SIZE_T recordsize;
+};
+
+
+const char *BlockTraceOpName(const SIZE_T op)
+{
+  switch (op) {
+  case TRACE_READ:
+    return "READ";
+  case TRACE_WRITE:
+    return "WRITE";
+  case TRACE_FLUSH:
+    return "FLUSH";
+  case TRACE_PREFETCH:
+    return "PREFETCH";
+  case TRACE_DISKREAD:
+    return "DISKREAD";
+  case TRACE_DISKWRITE:
+    return "DISKWRITE";
+  default:
+    return "UNKNOWN";
+  }
+}
+
+
+ostream & BlockTraceRecord::Print(ostream &os) const
+{
+  os << time << " " << BlockTraceOpName(op) << " " << block;
+  if (op==TRACE_READ || op==TRACE_WRITE || op==TRACE_FLUSH || op==TRACE_PREFETCH) {
+    os << (hit ? " hit" : " miss");
+  }
+  return os;
+}
+
+
+BlockTrace::BlockTrace() : file(0), writing(false), numrecords(0)
+{}
+
+
+BlockTrace::~BlockTrace()
+{
+  Close();
+}
+
+
+ERROR_T BlockTrace::Open(const string &filename, const bool write)
+{
+  BlockTraceHeader h;
+
+  Close();
+
+  if ((file=fopen(filename.c_str(), write ? "w" : "r"))==0) {
+    return ERROR_NOFILE;
+  }
+
+  writing=write;
+  numrecords=0;
+
+  if (writing) {
+    h.magic=BLOCKTRACE_MAGIC;
+    h.version=BLOCKTRACE_VERSION;
+    h.recordsize=sizeof(BlockTraceRecord);
+    if (fwrite(&h,sizeof(h),1,file)!=1) {
+      Close();
+      return ERROR_NOFILE;
+    }
+  } else {
+    if (fread(&h,sizeof(h),1,file)!=1 ||
+	h.magic!=BLOCKTRACE_MAGIC ||
+	h.version!=BLOCKTRACE_VERSION ||
+	h.recordsize!=sizeof(BlockTraceRecord)) {
+      Close();
+      return ERROR_BADCONFIG;
+    }
+  }
+
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BlockTrace::Close()
+{
+  if (file) {
+    fclose(file);
+    file=0;
+  }
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BlockTrace::Record(const BlockTraceOp op,
+			   const SIZE_T block,
+			   const bool hit,
+			   const double time)
+{
+  BlockTraceRecord rec;
+
+  if (!file || !writing) {
+    return ERROR_NOFILE;
+  }
+
+  memset(&rec,0,sizeof(rec));
+  rec.time=time;
+  rec.block=block;
+  rec.op=op;
+  rec.hit=hit;
+
+  if (fwrite(&rec,sizeof(rec),1,file)!=1) {
+    return ERROR_GENERAL;
+  }
+
+  numrecords++;
+
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BlockTrace::Next(BlockTraceRecord &rec)
+{
+  if (!file || writing) {
+    return ERROR_NOFILE;
+  }
+
+  if (fread(&rec,sizeof(rec),1,file)!=1) {
+    return ERROR_NONEXISTENT;
+  }
+
+  numrecords++;
+
+  return ERROR_NOERROR;
+}
+
+
+ERROR_T BlockTrace::Rewind()
+{
+  if (!file || writing) {
+    return ERROR_NOFILE;
+  }
+
+  if (fseek(file,sizeof(BlockTraceHeader),SEEK_SET)) {
+    return ERROR_GENERAL;
+  }
+
+  numrecords=0;
+
+  return ERROR_NOERROR;
+}
@@ -0,0 +1,77 @@
+#ifndef _trace
+#define _trace
+
+#include <stdio.h>
+#include <iostream>
+#include <string>
+
+#include "global.h"
+
+using namespace std;
+
+//
+// Block I/O trace
+//
+// A trace file is a small header followed by a sequence of fixed
+// size records, one per block operation seen by the buffer cache
+// or issued by it to the disk system.  Records are written in
+// host byte order, just like the btree nodes on the virtual disk.
+//
+enum BlockTraceOp {TRACE_READ,        // BufferCache::ReadBlock
+		   TRACE_WRITE,       // BufferCache::WriteBlock
+		   TRACE_FLUSH,       // BufferCache::FlushBlock
+		   TRACE_PREFETCH,    // BufferCache::PrefetchBlock
+		   TRACE_DISKREAD,    // DiskSystem::Read issued by the cache
+		   TRACE_DISKWRITE};  // DiskSystem::Write issued by the cache
+
+#define BLOCKTRACE_MAGIC   0x43525442  // "BTRC"
+#define BLOCKTRACE_VERSION 1
+
+struct BlockTraceRecord {
+  double time;     // simulated time (ms) after the operation completed
+  SIZE_T block;    // block number
+  SIZE_T op;       // a BlockTraceOp
+  SIZE_T hit;      // 1 if served from the cache (cache ops only)
+  SIZE_T reserved;
+
+  ostream &Print(ostream &os) const;
+};
+
+inline ostream & operator<<(ostream &os, const BlockTraceRecord &r) { return r.Print(os); }
+
+const char *BlockTraceOpName(const SIZE_T op);
+
+
+class BlockTrace {
+ private:
+  FILE   *file;
+  bool    writing;
+  SIZE_T  numrecords;
+
+ public:
+  BlockTrace();
+  BlockTrace(const BlockTrace &rhs) { throw GenericException(); }
+  BlockTrace & operator=(const BlockTrace &rhs) { throw GenericException(); return *this; }
+  ~BlockTrace();
+
+  // Open a trace for recording (write=true, truncates) or replay
+  // returns ERROR_NOFILE if the file can't be opened and
+  // ERROR_BADCONFIG if it is not a trace file
+  ERROR_T Open(const string &filename, const bool write);
+  ERROR_T Close();
+
+  ERROR_T Record(const BlockTraceOp op,
+		 const SIZE_T block,
+		 const bool hit,
+		 const double time);
+
+  // returns ERROR_NONEXISTENT at the end of the trace
+  ERROR_T Next(BlockTraceRecord &rec);
+
+  // Go back to the first record of a trace opened for replay
+  ERROR_T Rewind();
+
+  SIZE_T GetNumRecords() const { return numrecords; }
+};
+
+#endif